@@ -0,0 +1 @@
+../../../core/ga-memory.cpp
\ No newline at end of file
@@ -0,0 +1 @@
+../../../core/ga-memory.h
\ No newline at end of file
@@ -463,6 +463,15 @@ create_overlay(int ch, int w, int h, PixelFormat format) {
 	return 0;
 }
 
+void
+destroy_overlay_pipe(dpipe_t *pipe, int w, int h) {
+	for(int i = 0; i < pipe->nframe; i++) {
+		avpicture_free((AVPicture*) pipe->buffers[i]->pointer);
+	}
+	dpipe_destroy(pipe);
+	return;
+}
+
 static void
 initConfig() {
 	int i;
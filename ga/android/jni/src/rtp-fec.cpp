@@ -0,0 +1 @@
+../../../core/rtp-fec.cpp
\ No newline at end of file
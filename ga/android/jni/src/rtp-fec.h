@@ -0,0 +1 @@
+../../../core/rtp-fec.h
\ No newline at end of file
@@ -0,0 +1,209 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * dpipe microbenchmark: linked-list pools vs. lock-free rings.
+ *
+ * Frames go through two pipes and three threads, the same as
+ * vsource -> filter -> encoder.  Each mode is run twice: with the source
+ * pushing frames as fast as it can, and paced at a given frame rate.
+ * For each run, the frames delivered to the sink per second, the
+ * source-to-sink latency, the frames dropped (overwritten) on the way,
+ * and the CPU time and context switches per source frame are reported.
+ *
+ * Usage: dpipe-bench [frames [fps [poolsize [framesize]]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "ga-common.h"
+#include "dpipe.h"
+
+#define	BENCH_LAST	-1LL	// sequence number of the last frame
+
+typedef struct bench_frame_s {
+	long long seq;
+	long long stored_ns;
+}	bench_frame_t;
+
+typedef struct bench_s {
+	dpipe_t *pipe[2];
+	int frames;
+	int fps;		// 0: as fast as possible
+	// sink results
+	long long received;
+	long long latency_sum;
+	long long latency_max;
+}	bench_t;
+
+static long long
+bench_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void *
+bench_source(void *arg) {
+	bench_t *b = (bench_t*) arg;
+	long long i, start = bench_now_ns();
+	dpipe_buffer_t *data;
+	bench_frame_t *frame;
+	for(i = 0; i <= b->frames; i++) {
+		if(b->fps > 0) {
+			long long due = start + i * 1000000000LL / b->fps;
+			long long now = bench_now_ns();
+			if(due > now)
+				usleep((due - now) / 1000);
+		}
+		// dpipe_get() waits for a buffer: the last frame is never lost
+		data = dpipe_get(b->pipe[0]);
+		frame = (bench_frame_t*) data->pointer;
+		frame->seq = i < b->frames ? i : BENCH_LAST;
+		frame->stored_ns = bench_now_ns();
+		dpipe_store(b->pipe[0], data);
+	}
+	return NULL;
+}
+
+static void *
+bench_relay(void *arg) {
+	bench_t *b = (bench_t*) arg;
+	dpipe_buffer_t *srcdata, *dstdata;
+	bench_frame_t *src, *dst;
+	long long seq;
+	do {
+		srcdata = dpipe_load(b->pipe[0], NULL);
+		src = (bench_frame_t*) srcdata->pointer;
+		seq = src->seq;
+		dstdata = dpipe_get(b->pipe[1]);
+		dst = (bench_frame_t*) dstdata->pointer;
+		bcopy(src, dst, sizeof(bench_frame_t));
+		dpipe_store(b->pipe[1], dstdata);
+		dpipe_put(b->pipe[0], srcdata);
+	} while(seq != BENCH_LAST);
+	return NULL;
+}
+
+static void *
+bench_sink(void *arg) {
+	bench_t *b = (bench_t*) arg;
+	dpipe_buffer_t *data;
+	bench_frame_t *frame;
+	long long seq, latency;
+	do {
+		data = dpipe_load(b->pipe[1], NULL);
+		frame = (bench_frame_t*) data->pointer;
+		seq = frame->seq;
+		latency = bench_now_ns() - frame->stored_ns;
+		dpipe_put(b->pipe[1], data);
+		if(seq == BENCH_LAST)
+			break;
+		b->received++;
+		b->latency_sum += latency;
+		if(latency > b->latency_max)
+			b->latency_max = latency;
+	} while(1);
+	return NULL;
+}
+
+static long long
+bench_cpu_us(struct rusage *ru) {
+	return ru->ru_utime.tv_sec * 1000000LL + ru->ru_utime.tv_usec
+		+ ru->ru_stime.tv_sec * 1000000LL + ru->ru_stime.tv_usec;
+}
+
+static int
+bench_run(const char *mode, int flags, int frames, int fps, int poolsize, int framesize) {
+	bench_t b;
+	pthread_t t[3];
+	struct rusage ru0, ru1;
+	long long t0, t1, cpu, csw;
+	char name[64];
+	int i;
+	//
+	bzero(&b, sizeof(b));
+	b.frames = frames;
+	b.fps = fps;
+	for(i = 0; i < 2; i++) {
+		snprintf(name, sizeof(name), "bench-%s-%d-%d", mode, fps, i);
+		if((b.pipe[i] = dpipe_create_ex(0, name, poolsize, framesize, flags)) == NULL) {
+			fprintf(stderr, "cannot create pipe '%s'\n", name);
+			return -1;
+		}
+	}
+	getrusage(RUSAGE_SELF, &ru0);
+	t0 = bench_now_ns();
+	pthread_create(&t[2], NULL, bench_sink, &b);
+	pthread_create(&t[1], NULL, bench_relay, &b);
+	pthread_create(&t[0], NULL, bench_source, &b);
+	for(i = 0; i < 3; i++)
+		pthread_join(t[i], NULL);
+	t1 = bench_now_ns();
+	getrusage(RUSAGE_SELF, &ru1);
+	//
+	cpu = bench_cpu_us(&ru1) - bench_cpu_us(&ru0);
+	csw = (ru1.ru_nvcsw - ru0.ru_nvcsw) + (ru1.ru_nivcsw - ru0.ru_nivcsw);
+	printf("%-9s %5s %10.0f %8.2f %9.2f %8.2f%% %9.3f %8.3f\n",
+		mode, fps > 0 ? "paced" : "burst",
+		b.received * 1e9 / (t1 - t0),
+		b.received > 0 ? b.latency_sum / 1000.0 / b.received : 0.0,
+		b.latency_max / 1000.0,
+		100.0 * (frames - b.received) / frames,
+		1.0 * cpu / frames,
+		1.0 * csw / frames);
+	for(i = 0; i < 2; i++)
+		dpipe_destroy(b.pipe[i]);
+	return 0;
+}
+
+int
+main(int argc, char *argv[]) {
+	int frames = 200000;
+	int fps = 240;
+	int poolsize = 8;
+	int framesize = 4096;
+	//
+	if(argc > 1)	frames = strtol(argv[1], NULL, 0);
+	if(argc > 2)	fps = strtol(argv[2], NULL, 0);
+	if(argc > 3)	poolsize = strtol(argv[3], NULL, 0);
+	if(argc > 4)	framesize = strtol(argv[4], NULL, 0);
+	if(frames <= 0 || fps <= 0 || poolsize < 2 || framesize < (int) sizeof(bench_frame_t)) {
+		fprintf(stderr, "usage: %s [frames [fps [poolsize [framesize]]]]\n", argv[0]);
+		return -1;
+	}
+	printf("%d frames, %d-frame pools of %d bytes; paced runs at %d fps\n",
+		frames, poolsize, framesize, fps);
+	printf("%-9s %5s %10s %8s %9s %9s %9s %8s\n",
+		"mode", "run", "sink f/s", "lat(us)", "max(us)", "dropped", "cpu/f(us)", "csw/f");
+	// paced runs are bounded to ~5 seconds
+	if(bench_run("list", DPIPE_FLAG_NONE, frames, 0, poolsize, framesize) < 0
+	|| bench_run("lockfree", DPIPE_FLAG_LOCKFREE, frames, 0, poolsize, framesize) < 0
+	|| bench_run("list", DPIPE_FLAG_NONE, fps * 5, fps, poolsize, framesize) < 0
+	|| bench_run("lockfree", DPIPE_FLAG_LOCKFREE, fps * 5, fps, poolsize, framesize) < 0)
+		return -1;
+	return 0;
+}
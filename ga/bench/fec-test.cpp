@@ -0,0 +1,369 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * RTP FEC loss-injection test over the loopback interface.
+ *
+ * A sender paces frames of RTP packets (a large key frame every second,
+ * smaller frames in between) to a local receiver, protects them with
+ * rtp_fec_encode(), and drops packets at random before sending.  The
+ * receiver rebuilds lost packets with rtp_fec_decoder_recover() and checks
+ * them byte by byte.  For each loss rate, a run without FEC and a run with
+ * FEC drop the same media packets; the frames completed, the frames that
+ * are complete only because of recovered packets, the parity overhead,
+ * and the frame latency (first packet sent to frame complete) are
+ * reported.  It fails if a recovered packet differs from the sent one, or if
+ * the parity packets exceed the configured ratio by more than a margin.
+ *
+ * Usage: fec-test [frames [fps [blocksize [ratio]]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ga-common.h"
+#include "rtp-fec.h"
+
+#define	TEST_PAYLOAD	1200	// RTP payload size
+#define	TEST_KEY_PACKETS 96	// packets of a key frame
+#define	TEST_TS_STEP	1500	// RTP timestamp step per frame
+#define	TEST_SEED_MEDIA	0x12345678
+#define	TEST_SEED_FEC	0x9abcdef0
+#define	TEST_PARITY_MARGIN 0.01	// allowed parity overhead above the ratio
+
+typedef struct test_frame_s {
+	unsigned short firstseq;
+	int npkt;
+	long long sent_ns;	// first packet sent
+	// receiver side
+	int received;		// media packets received or recovered
+	int recovered;		// packets recovered of this frame
+	long long done_ns;	// frame complete
+}	test_frame_t;
+
+typedef struct test_s {
+	int s, r;
+	struct sockaddr_in sin;
+	int frames;
+	int fps;
+	int blocksize;
+	double ratio;		// 0: no FEC
+	double loss;		// drop rate, in (0, 1)
+	test_frame_t *frame;
+	volatile int published;	// frames with a valid firstseq and npkt
+	volatile int running;
+	// results
+	unsigned long long media;
+	unsigned long long parity;
+	unsigned long long dropped;
+	unsigned long long mismatched;
+}	test_t;
+
+static long long
+test_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* xorshift32: runs with the same seed drop the same media packets */
+static double
+test_random(unsigned int *state) {
+	unsigned int x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*state = x;
+	return x / 4294967296.0;
+}
+
+static int
+test_frame_packets(int i, int fps) {
+	if(i % fps == 0)
+		return TEST_KEY_PACKETS;
+	return 4 + (i * 7) % 13;
+}
+
+/* the payload is a function of the sequence number: any packet can be checked */
+static void
+test_payload(unsigned char *payload, unsigned short seq, int len) {
+	int i;
+	for(i = 0; i < len; i++)
+		payload[i] = (seq * 31 + i) & 0xff;
+	return;
+}
+
+/* build a frame of length-prefixed RTP packets, as rtp_write_bindata() gets */
+static int
+test_build(unsigned char *buf, unsigned short seq, unsigned int ts, int npkt) {
+	unsigned char *p;
+	int i, len = 0, plen = RTP_FEC_RTP_HEADER + TEST_PAYLOAD;
+	for(i = 0; i < npkt; i++, seq++) {
+		buf[len+0] = 0;
+		buf[len+1] = 0;
+		buf[len+2] = plen >> 8;
+		buf[len+3] = plen & 0xff;
+		p = buf + len + 4;
+		p[0] = 0x80;
+		p[1] = 96 | (i == npkt - 1 ? 0x80 : 0);
+		p[2] = seq >> 8;
+		p[3] = seq & 0xff;
+		p[4] = ts >> 24;
+		p[5] = ts >> 16;
+		p[6] = ts >> 8;
+		p[7] = ts;
+		p[8] = p[9] = p[10] = 0;
+		p[11] = 0x10;
+		test_payload(p + RTP_FEC_RTP_HEADER, seq, TEST_PAYLOAD);
+		len += 4 + plen;
+	}
+	return len;
+}
+
+static void
+test_send(test_t *t, unsigned char *buf, int buflen, unsigned int *state, unsigned long long *count) {
+	int i = 0, pktlen;
+	while(i + 4 <= buflen) {
+		pktlen = (buf[i] << 24) | (buf[i+1] << 16) | (buf[i+2] << 8) | buf[i+3];
+		(*count)++;
+		if(test_random(state) < t->loss)
+			t->dropped++;
+		else
+			sendto(t->s, buf + i + 4, pktlen, 0, (struct sockaddr*) &t->sin, sizeof(t->sin));
+		i += 4 + pktlen;
+	}
+	return;
+}
+
+static void *
+test_sender(void *arg) {
+	test_t *t = (test_t*) arg;
+	rtp_fec_encoder_t enc;
+	unsigned char *buf, *parity;
+	unsigned int mstate = TEST_SEED_MEDIA, pstate = TEST_SEED_FEC;
+	unsigned short seq = 0;
+	long long start = test_now_ns();
+	int i, len, plen;
+	//
+	buf = (unsigned char*) malloc(TEST_KEY_PACKETS * (4 + RTP_FEC_RTP_HEADER + TEST_PAYLOAD));
+	if(t->ratio > 0 && rtp_fec_encoder_init(&enc, t->blocksize, t->ratio) < 0) {
+		fprintf(stderr, "invalid FEC parameters: block %d, ratio %.2f\n",
+			t->blocksize, t->ratio);
+		t->running = 0;
+		free(buf);
+		return NULL;
+	}
+	for(i = 0; i < t->frames; i++) {
+		long long due = start + i * 1000000000LL / t->fps;
+		long long now = test_now_ns();
+		test_frame_t *f = &t->frame[i];
+		if(due > now)
+			usleep((due - now) / 1000);
+		f->firstseq = seq;
+		f->npkt = test_frame_packets(i, t->fps);
+		len = test_build(buf, seq, i * TEST_TS_STEP, f->npkt);
+		seq += f->npkt;
+		f->sent_ns = test_now_ns();
+		__sync_synchronize();
+		t->published = i + 1;
+		test_send(t, buf, len, &mstate, &t->media);
+		if(t->ratio > 0 && (plen = rtp_fec_encode(&enc, buf, len, &parity)) > 0)
+			test_send(t, parity, plen, &pstate, &t->parity);
+	}
+	if(t->ratio > 0)
+		rtp_fec_encoder_deinit(&enc);
+	free(buf);
+	usleep(200000);
+	t->running = 0;
+	return NULL;
+}
+
+/* count a received or recovered media packet into its frame */
+static void
+test_account(test_t *t, const unsigned char *pkt, int len, int recovered) {
+	unsigned char payload[TEST_PAYLOAD];
+	unsigned short seq = (pkt[2] << 8) | pkt[3];
+	unsigned int ts = (pkt[4] << 24) | (pkt[5] << 16) | (pkt[6] << 8) | pkt[7];
+	unsigned int i = ts / TEST_TS_STEP;
+	test_frame_t *f;
+	//
+	if(i >= (unsigned int) t->published)
+		return;
+	f = &t->frame[i];
+	__sync_synchronize();
+	if(((unsigned short) (seq - f->firstseq)) >= f->npkt)
+		return;
+	if(recovered) {
+		test_payload(payload, seq, TEST_PAYLOAD);
+		if(len != RTP_FEC_RTP_HEADER + TEST_PAYLOAD
+		|| memcmp(pkt + RTP_FEC_RTP_HEADER, payload, TEST_PAYLOAD) != 0) {
+			t->mismatched++;
+			return;
+		}
+		f->recovered++;
+	}
+	if(++f->received == f->npkt)
+		f->done_ns = test_now_ns();
+	return;
+}
+
+static void *
+test_receiver(void *arg) {
+	test_t *t = (test_t*) arg;
+	rtp_fec_decoder_t *dec = rtp_fec_decoder_create();
+	unsigned char pkt[RTP_FEC_MAX_PACKET];
+	const unsigned char *data;
+	unsigned short seq;
+	int n, len, recovered;
+	//
+	while(t->running) {
+		if((n = recv(t->r, pkt, sizeof(pkt), 0)) < RTP_FEC_RTP_HEADER)
+			continue;
+		if(rtp_fec_is_parity(pkt, n)) {
+			if(rtp_fec_decoder_recover(dec, pkt, n, &seq) <= 0)
+				continue;
+			if((data = rtp_fec_decoder_get(dec, seq, &len, &recovered)) != NULL)
+				test_account(t, data, len, 1);
+			continue;
+		}
+		rtp_fec_decoder_add(dec, pkt, n);
+		test_account(t, pkt, n, 0);
+	}
+	rtp_fec_decoder_destroy(dec);
+	return NULL;
+}
+
+/* returns the average latency of complete frames, in us, or -1 on failure */
+static double
+test_run(test_t *t, double loss, double ratio) {
+	pthread_t tid[2];
+	long long latency_sum = 0, latency_max = 0, latency;
+	int i, lossy = 0, complete = 0, saved = 0;
+	//
+	t->loss = loss;
+	t->ratio = ratio;
+	t->published = 0;
+	t->running = 1;
+	t->media = t->parity = t->dropped = t->mismatched = 0;
+	bzero(t->frame, t->frames * sizeof(test_frame_t));
+	pthread_create(&tid[1], NULL, test_receiver, t);
+	pthread_create(&tid[0], NULL, test_sender, t);
+	for(i = 0; i < 2; i++)
+		pthread_join(tid[i], NULL);
+	//
+	for(i = 0; i < t->frames; i++) {
+		test_frame_t *f = &t->frame[i];
+		if(f->received - f->recovered < f->npkt)
+			lossy++;
+		if(f->received < f->npkt)
+			continue;
+		complete++;
+		if(f->recovered > 0)
+			saved++;
+		latency = f->done_ns - f->sent_ns;
+		latency_sum += latency;
+		if(latency > latency_max)
+			latency_max = latency;
+	}
+	printf("%5.1f%% %-4s %7d %7d %9d %10d %8.1f%% %8.1f%% %9.1f %9.1f\n",
+		100.0 * loss, ratio > 0 ? "on" : "off",
+		t->frames, lossy, complete, saved,
+		lossy > 0 ? 100.0 * saved / lossy : 100.0,
+		t->media > 0 ? 100.0 * t->parity / t->media : 0.0,
+		complete > 0 ? latency_sum / 1000.0 / complete : 0.0,
+		latency_max / 1000.0);
+	if(t->mismatched > 0) {
+		fprintf(stderr, "%llu recovered packet(s) mismatched\n", t->mismatched);
+		return -1;
+	}
+	if(t->media > 0 && 1.0 * t->parity / t->media > ratio + TEST_PARITY_MARGIN) {
+		fprintf(stderr, "parity overhead %.1f%% exceeds ratio %.1f%%\n",
+			100.0 * t->parity / t->media, 100.0 * ratio);
+		return -1;
+	}
+	return complete > 0 ? latency_sum / 1000.0 / complete : 0.0;
+}
+
+int
+main(int argc, char *argv[]) {
+	static const double loss[] = { 0.005, 0.01, 0.02, 0.05 };
+	test_t t;
+	int rbuf = 1<<22, failed = 0;
+	unsigned int k;
+	struct timeval timeout = { 0, 100000 };
+	socklen_t sinlen = sizeof(t.sin);
+	double ratio = 0.1, off, on;
+	//
+	bzero(&t, sizeof(t));
+	t.frames = 600;
+	t.fps = 60;
+	t.blocksize = 20;
+	if(argc > 1)	t.frames = strtol(argv[1], NULL, 0);
+	if(argc > 2)	t.fps = strtol(argv[2], NULL, 0);
+	if(argc > 3)	t.blocksize = strtol(argv[3], NULL, 0);
+	if(argc > 4)	ratio = strtod(argv[4], NULL);
+	if(t.frames <= 0 || t.fps <= 0
+	|| t.blocksize < 1 || t.blocksize > RTP_FEC_MAX_BLOCK
+	|| ratio <= 0 || ratio > 1) {
+		fprintf(stderr, "usage: %s [frames [fps [blocksize [ratio]]]]\n", argv[0]);
+		return -1;
+	}
+	if((t.s = socket(AF_INET, SOCK_DGRAM, 0)) < 0
+	|| (t.r = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	bzero(&t.sin, sizeof(t.sin));
+	t.sin.sin_family = AF_INET;
+	t.sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(t.r, (struct sockaddr*) &t.sin, sizeof(t.sin)) < 0
+	|| getsockname(t.r, (struct sockaddr*) &t.sin, &sinlen) < 0) {
+		perror("bind");
+		return -1;
+	}
+	setsockopt(t.r, SOL_SOCKET, SO_RCVBUF, &rbuf, sizeof(rbuf));
+	setsockopt(t.r, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	t.frame = (test_frame_t*) malloc(t.frames * sizeof(test_frame_t));
+	//
+	printf("%d frames at %d fps, %d-byte payloads; FEC block %d, ratio %.2f\n",
+		t.frames, t.fps, TEST_PAYLOAD, t.blocksize, ratio);
+	printf("%6s %-4s %7s %7s %9s %10s %9s %9s %9s %9s\n",
+		"loss", "fec", "frames", "lossy", "complete", "recovered",
+		"rec-rate", "parity", "lat(us)", "max(us)");
+	for(k = 0; k < sizeof(loss) / sizeof(loss[0]); k++) {
+		if((off = test_run(&t, loss[k], 0)) < 0
+		|| (on = test_run(&t, loss[k], ratio)) < 0) {
+			failed = 1;
+			continue;
+		}
+		printf("%6s latency overhead: %+.1f us per complete frame\n", "", on - off);
+	}
+	free(t.frame);
+	close(t.s);
+	close(t.r);
+	return failed ? -1 : 0;
+}
@@ -0,0 +1,249 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * rgb2yuv benchmark: conversion kernels vs. swscale.
+ *
+ * BGRA frames are converted to YUV420P by swscale (SWS_BICUBIC, as used
+ * by filter-rgb2yuv) and by each rgb2yuv kernel available on the running
+ * CPU, at 1920x1080 and 2560x1440.  For each conversion, the time per
+ * frame, the speedup over swscale, and the largest difference from the
+ * swscale output in the Y and U/V planes are reported.  The best kernel
+ * is also run band-parallel with a given number of threads.
+ *
+ * All the kernels must produce identical output: the benchmark fails
+ * if the output of a kernel differs from the scalar kernel.
+ *
+ * Usage: rgb2yuv-bench [frames [threads]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ga-common.h"
+#include "ga-avcodec.h"
+#include "rgb2yuv.h"
+
+typedef struct bench_image_s {
+	int width, height;
+	unsigned char *src;		// BGRA
+	int srcstride;
+	unsigned char *plane[3];	// YUV420P
+	int stride[3];
+}	bench_image_t;
+
+static long long
+bench_now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int
+bench_alloc(bench_image_t *img, int width, int height) {
+	int i;
+	bzero(img, sizeof(bench_image_t));
+	img->width = width;
+	img->height = height;
+	img->srcstride = width * 4;
+	img->stride[0] = width;
+	img->stride[1] = img->stride[2] = (width + 1) / 2;
+	if((img->src = (unsigned char*) malloc(img->srcstride * height)) == NULL)
+		return -1;
+	for(i = 0; i < 3; i++) {
+		int h = i == 0 ? height : (height + 1) / 2;
+		if((img->plane[i] = (unsigned char*) malloc(img->stride[i] * h)) == NULL)
+			return -1;
+	}
+	return 0;
+}
+
+static void
+bench_free(bench_image_t *img) {
+	int i;
+	free(img->src);
+	for(i = 0; i < 3; i++)
+		free(img->plane[i]);
+	return;
+}
+
+/* gradients with some noise, so that 2x2 blocks are not flat */
+static void
+bench_fill(bench_image_t *img) {
+	unsigned int seed = 12345;
+	int x, y;
+	for(y = 0; y < img->height; y++) {
+		unsigned char *p = img->src + y * img->srcstride;
+		for(x = 0; x < img->width; x++, p += 4) {
+			seed = seed * 1103515245 + 12345;
+			p[0] = (x + (seed >> 16)) & 0xff;
+			p[1] = (y + (seed >> 20)) & 0xff;
+			p[2] = ((x + y) >> 1) & 0xff;
+			p[3] = 0xff;
+		}
+	}
+	return;
+}
+
+/* largest difference of plane i between two images */
+static int
+bench_maxdiff(bench_image_t *a, bench_image_t *b, int i) {
+	int x, y, d, maxd = 0;
+	int w = i == 0 ? a->width : (a->width + 1) / 2;
+	int h = i == 0 ? a->height : (a->height + 1) / 2;
+	for(y = 0; y < h; y++) {
+		unsigned char *pa = a->plane[i] + y * a->stride[i];
+		unsigned char *pb = b->plane[i] + y * b->stride[i];
+		for(x = 0; x < w; x++) {
+			d = pa[x] > pb[x] ? pa[x] - pb[x] : pb[x] - pa[x];
+			if(d > maxd)
+				maxd = d;
+		}
+	}
+	return maxd;
+}
+
+static int
+bench_identical(bench_image_t *a, bench_image_t *b) {
+	return bench_maxdiff(a, b, 0) == 0
+		&& bench_maxdiff(a, b, 1) == 0
+		&& bench_maxdiff(a, b, 2) == 0;
+}
+
+static void
+bench_report(const char *name, long long ns, int frames, long long refns,
+		bench_image_t *img, bench_image_t *ref) {
+	double ms = ns / 1000000.0 / frames;
+	printf("%-12s %9.3f %9.1f %8.2fx %6d %6d\n",
+		name, ms, 1000.0 / ms, 1.0 * refns / ns,
+		bench_maxdiff(img, ref, 0),
+		bench_maxdiff(img, ref, 1) > bench_maxdiff(img, ref, 2)
+			? bench_maxdiff(img, ref, 1) : bench_maxdiff(img, ref, 2));
+	return;
+}
+
+static int
+bench_run(int width, int height, int frames, int threads) {
+	static const char *names[] = { "c", "sse2", "avx2", "neon", NULL };
+	bench_image_t ref, out, c;
+	struct SwsContext *swsctx;
+	rgb2yuv_pool_t *pool;
+	const char *best = NULL;
+	long long t0, refns;
+	char label[32];
+	int i, f, err = -1;
+	//
+	bzero(&ref, sizeof(ref));
+	bzero(&out, sizeof(out));
+	bzero(&c, sizeof(c));
+	if(bench_alloc(&ref, width, height) < 0
+	|| bench_alloc(&out, width, height) < 0
+	|| bench_alloc(&c, width, height) < 0) {
+		fprintf(stderr, "cannot allocate %dx%d frames\n", width, height);
+		goto quit;
+	}
+	bench_fill(&ref);
+	memcpy(out.src, ref.src, ref.srcstride * height);
+	memcpy(c.src, ref.src, ref.srcstride * height);
+	// swscale reference
+	if((swsctx = sws_getContext(width, height, AV_PIX_FMT_BGRA,
+			width, height, AV_PIX_FMT_YUV420P,
+			SWS_BICUBIC, NULL, NULL, NULL)) == NULL) {
+		fprintf(stderr, "cannot create swscale context\n");
+		goto quit;
+	}
+	t0 = bench_now_ns();
+	for(f = 0; f < frames; f++) {
+		const unsigned char *src[1] = { ref.src };
+		int srcstride[1] = { ref.srcstride };
+		sws_scale(swsctx, src, srcstride, 0, height, ref.plane, ref.stride);
+	}
+	refns = bench_now_ns() - t0;
+	sws_freeContext(swsctx);
+	//
+	printf("\n%dx%d, %d frames\n", width, height, frames);
+	printf("%-12s %9s %9s %9s %6s %6s\n",
+		"kernel", "ms/frame", "frames/s", "speedup", "dY", "dUV");
+	bench_report("swscale", refns, frames, refns, &ref, &ref);
+	// kernels available on this CPU
+	for(i = 0; names[i] != NULL; i++) {
+		bench_image_t *img = (i == 0) ? &c : &out;
+		const char *k = rgb2yuv_init(names[i]);
+		long long ns;
+		if(k == NULL || strcmp(k, names[i]) != 0)
+			continue;
+		best = names[i];
+		t0 = bench_now_ns();
+		for(f = 0; f < frames; f++) {
+			rgb2yuv_convert(RGB2YUV_ORDER_BGRA, img->src, img->srcstride,
+				width, height, img->plane, img->stride);
+		}
+		ns = bench_now_ns() - t0;
+		bench_report(names[i], ns, frames, refns, img, &ref);
+		if(i > 0 && !bench_identical(img, &c)) {
+			fprintf(stderr, "kernel '%s' output differs from the scalar kernel\n", names[i]);
+			goto quit;
+		}
+	}
+	// the last available kernel is the fastest one
+	if(best != NULL && threads > 1
+	&& (pool = rgb2yuv_pool_create(threads, -1)) != NULL) {
+		long long ns;
+		rgb2yuv_init(best);
+		t0 = bench_now_ns();
+		for(f = 0; f < frames; f++) {
+			rgb2yuv_convert_parallel(pool, RGB2YUV_ORDER_BGRA, out.src, out.srcstride,
+				width, height, out.plane, out.stride);
+		}
+		ns = bench_now_ns() - t0;
+		rgb2yuv_pool_destroy(pool);
+		snprintf(label, sizeof(label), "%s x%d", best, threads);
+		bench_report(label, ns, frames, refns, &out, &ref);
+		if(!bench_identical(&out, &c)) {
+			fprintf(stderr, "parallel '%s' output differs from the scalar kernel\n", best);
+			goto quit;
+		}
+	}
+	err = 0;
+quit:
+	bench_free(&ref);
+	bench_free(&out);
+	bench_free(&c);
+	return err;
+}
+
+int
+main(int argc, char *argv[]) {
+	int frames = 100;
+	int threads = 4;
+	//
+	if(argc > 1)	frames = strtol(argv[1], NULL, 0);
+	if(argc > 2)	threads = strtol(argv[2], NULL, 0);
+	if(frames <= 0 || threads <= 0) {
+		fprintf(stderr, "usage: %s [frames [threads]]\n", argv[0]);
+		return -1;
+	}
+	printf("BGRA to YUV420P; dY and dUV are the largest differences from swscale\n");
+	if(bench_run(1920, 1080, frames, threads) < 0
+	|| bench_run(2560, 1440, frames, threads) < 0)
+		return -1;
+	return 0;
+}
@@ -0,0 +1,263 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * RTP/UDP egress benchmark over the loopback interface (Linux only).
+ *
+ * Frames of RTP-sized packets, in the format of rtp_write_bindata(), are
+ * sent to a local receiver with one sendto() per packet, with sendmmsg(),
+ * and with sendmmsg() and UDP GSO, using rtp_batch_send() of the
+ * ffmpeg-rtsp-server.  Before measuring, it checks that the receiver gets
+ * every packet of a frame with the right size and content.  For each mode,
+ * the packets/s and Gbit/s sent, the packets received, and the CPU time
+ * of the sending thread per Gbit are reported.
+ *
+ * Usage: udp-bench [seconds [packets-per-frame [packet-size]]]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ga-common.h"
+#include "rtpbatch.h"
+
+#define	BENCH_RECV_BATCH	64
+#define	BENCH_CHECK_PACKETS	64	// packets of the frame that is checked
+#define	BENCH_MODE_SENDTO	0
+#define	BENCH_MODE_SENDMMSG	1
+#define	BENCH_MODE_GSO		2
+
+typedef struct bench_recv_s {
+	int s;
+	volatile int running;
+	unsigned long long packets;
+	unsigned long long bytes;
+}	bench_recv_t;
+
+static const char *bench_mode_name[] = { "sendto", "sendmmsg", "sendmmsg+gso" };
+
+static void *
+bench_receiver(void *arg) {
+	bench_recv_t *r = (bench_recv_t*) arg;
+	static unsigned char buf[BENCH_RECV_BATCH][2048];
+	struct mmsghdr msg[BENCH_RECV_BATCH];
+	struct iovec iov[BENCH_RECV_BATCH];
+	struct timespec timeout;
+	int i, n;
+	//
+	for(i = 0; i < BENCH_RECV_BATCH; i++) {
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = sizeof(buf[i]);
+	}
+	while(r->running) {
+		bzero(msg, sizeof(msg));
+		for(i = 0; i < BENCH_RECV_BATCH; i++) {
+			msg[i].msg_hdr.msg_iov = &iov[i];
+			msg[i].msg_hdr.msg_iovlen = 1;
+		}
+		timeout.tv_sec = 0;
+		timeout.tv_nsec = 100000000;
+		if((n = recvmmsg(r->s, msg, BENCH_RECV_BATCH, MSG_WAITFORONE, &timeout)) <= 0)
+			continue;
+		r->packets += n;
+		for(i = 0; i < n; i++)
+			r->bytes += msg[i].msg_len;
+	}
+	return NULL;
+}
+
+/* build a frame: npkt packets of pktsize bytes, the last one is shorter */
+static int
+bench_frame(unsigned char *buf, int npkt, int pktsize, int *sizes) {
+	int i, len = 0, p;
+	for(i = 0; i < npkt; i++) {
+		p = i < npkt - 1 ? pktsize : pktsize / 2 + 1;
+		buf[len+0] = 0;
+		buf[len+1] = 0;
+		buf[len+2] = p >> 8;
+		buf[len+3] = p & 0xff;
+		memset(buf + len + 4, i & 0xff, p);
+		if(sizes != NULL)
+			sizes[i] = p;
+		len += 4 + p;
+	}
+	return len;
+}
+
+/* the non-batched path of rtp_write_bindata() */
+static int
+bench_sendto(int s, struct sockaddr_in *sin, unsigned char *buf, int buflen) {
+	int i = 0, pktlen;
+	while(i + 4 <= buflen) {
+		pktlen = (buf[i] << 24) | (buf[i+1] << 16) | (buf[i+2] << 8) | buf[i+3];
+		sendto(s, buf + i + 4, pktlen, 0, (struct sockaddr*) sin, sizeof(*sin));
+		i += 4 + pktlen;
+	}
+	return i;
+}
+
+static int
+bench_send(int mode, int s, struct sockaddr_in *sin, unsigned char *buf, int buflen) {
+	if(mode == BENCH_MODE_SENDTO)
+		return bench_sendto(s, sin, buf, buflen);
+	return rtp_batch_send(s, sin, buf, buflen);
+}
+
+static void
+bench_setmode(int mode) {
+	if(mode != BENCH_MODE_SENDTO)
+		rtp_batch_config(1, mode == BENCH_MODE_GSO);
+	return;
+}
+
+/*
+ * send a frame and check that the receiver gets the same packets;
+ * the frame is small enough for the default socket receive buffer
+ */
+static int
+bench_check(int mode, int s, int r, struct sockaddr_in *sin, int npkt, int pktsize) {
+	unsigned char *buf, rbuf[2048];
+	int *sizes, len, i, n, bad = 0;
+	//
+	if(npkt > BENCH_CHECK_PACKETS)
+		npkt = BENCH_CHECK_PACKETS;
+	buf = (unsigned char*) malloc(npkt * (pktsize + 4));
+	sizes = (int*) malloc(npkt * sizeof(int));
+	len = bench_frame(buf, npkt, pktsize, sizes);
+	bench_setmode(mode);
+	bench_send(mode, s, sin, buf, len);
+	for(i = 0; i < npkt; i++) {
+		if((n = recv(r, rbuf, sizeof(rbuf), 0)) < 0)
+			break;
+		if(n != sizes[i] || rbuf[0] != (i & 0xff) || rbuf[n-1] != (i & 0xff))
+			bad++;
+	}
+	free(sizes);
+	free(buf);
+	printf("check %-12s: %d/%d packets received, %d mismatched\n",
+		bench_mode_name[mode], i, npkt, bad);
+	return (i == npkt && bad == 0) ? 0 : -1;
+}
+
+static long long
+bench_cpu_us() {
+	struct rusage ru;
+	getrusage(RUSAGE_THREAD, &ru);
+	return ru.ru_utime.tv_sec * 1000000LL + ru.ru_utime.tv_usec
+		+ ru.ru_stime.tv_sec * 1000000LL + ru.ru_stime.tv_usec;
+}
+
+static void
+bench_run(int mode, int s, int r, struct sockaddr_in *sin, int seconds, int npkt, int pktsize) {
+	bench_recv_t rx;
+	pthread_t tid;
+	unsigned char *buf;
+	unsigned long long frames = 0, packets, bytes;
+	struct timeval t0, t1;
+	long long cpu, elapsed;
+	int len;
+	double gbits;
+	//
+	buf = (unsigned char*) malloc(npkt * (pktsize + 4));
+	len = bench_frame(buf, npkt, pktsize, NULL);
+	bench_setmode(mode);
+	bzero(&rx, sizeof(rx));
+	rx.s = r;
+	rx.running = 1;
+	pthread_create(&tid, NULL, bench_receiver, &rx);
+	cpu = bench_cpu_us();
+	gettimeofday(&t0, NULL);
+	do {
+		bench_send(mode, s, sin, buf, len);
+		frames++;
+		gettimeofday(&t1, NULL);
+	} while(tvdiff_us(&t1, &t0) < seconds * 1000000LL);
+	cpu = bench_cpu_us() - cpu;
+	elapsed = tvdiff_us(&t1, &t0);
+	usleep(200000);
+	rx.running = 0;
+	pthread_join(tid, NULL);
+	free(buf);
+	//
+	packets = frames * npkt;
+	bytes = frames * (len - 4 * npkt);
+	gbits = bytes * 8 / 1e9;
+	printf("%-12s %12.0f %8.3f %8.2f%% %12.3f\n",
+		bench_mode_name[mode],
+		packets * 1e6 / elapsed,
+		gbits * 1e6 / elapsed,
+		100.0 * rx.packets / packets,
+		cpu / 1e6 / gbits);
+	return;
+}
+
+int
+main(int argc, char *argv[]) {
+	int seconds = 3, npkt = 200, pktsize = 1200;
+	int s, r, rbuf = 1<<24, mode, failed = 0;
+	struct timeval timeout = { 1, 0 };
+	struct sockaddr_in sin;
+	socklen_t sinlen = sizeof(sin);
+	//
+	if(argc > 1)	seconds = strtol(argv[1], NULL, 0);
+	if(argc > 2)	npkt = strtol(argv[2], NULL, 0);
+	if(argc > 3)	pktsize = strtol(argv[3], NULL, 0);
+	if(seconds <= 0 || npkt <= 0 || pktsize < 16 || pktsize > 1472) {
+		fprintf(stderr, "usage: %s [seconds [packets-per-frame [packet-size]]]\n", argv[0]);
+		return -1;
+	}
+	if((s = socket(AF_INET, SOCK_DGRAM, 0)) < 0
+	|| (r = socket(AF_INET, SOCK_DGRAM, 0)) < 0) {
+		perror("socket");
+		return -1;
+	}
+	bzero(&sin, sizeof(sin));
+	sin.sin_family = AF_INET;
+	sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if(bind(r, (struct sockaddr*) &sin, sizeof(sin)) < 0
+	|| getsockname(r, (struct sockaddr*) &sin, &sinlen) < 0) {
+		perror("bind");
+		return -1;
+	}
+	setsockopt(r, SOL_SOCKET, SO_RCVBUF, &rbuf, sizeof(rbuf));
+	setsockopt(r, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+	//
+	for(mode = BENCH_MODE_SENDTO; mode <= BENCH_MODE_GSO; mode++) {
+		if(bench_check(mode, s, r, &sin, npkt, pktsize) < 0)
+			failed = 1;
+	}
+	if(failed)
+		return -1;
+	printf("%d packets of %d bytes per frame, %d second(s) per mode\n",
+		npkt, pktsize, seconds);
+	printf("%-12s %12s %8s %9s %12s\n",
+		"mode", "packets/s", "Gbit/s", "received", "cpu-s/Gbit");
+	for(mode = BENCH_MODE_SENDTO; mode <= BENCH_MODE_GSO; mode++)
+		bench_run(mode, s, r, &sin, seconds, npkt, pktsize);
+	return 0;
+}
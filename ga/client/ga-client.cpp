@@ -50,6 +50,7 @@ extern "C" {
 
 #include "ga-common.h"
 #include "ga-conf.h"
+#include "ga-memory.h"
 #include "ga-avcodec.h"
 #include "vconverter.h"
 
@@ -173,8 +174,11 @@ create_overlay(struct RTSPThreadParam *rtspParam, int ch) {
 		exit(-1);
 	}
 	for(data = pipe->in; data != NULL; data = data->next) {
+		int picsize = avpicture_get_size(AV_PIX_FMT_YUV420P, w, h);
+		uint8_t *picbuf;
 		bzero(data->pointer, sizeof(AVPicture));
-		if(avpicture_alloc((AVPicture*) data->pointer, AV_PIX_FMT_YUV420P, w, h) != 0) {
+		if((picbuf = (uint8_t*) ga_mem_alloc(picsize, pipe->memflags)) == NULL
+		|| avpicture_fill((AVPicture*) data->pointer, picbuf, AV_PIX_FMT_YUV420P, w, h) < 0) {
 			rtsperror("ga-client: per frame initialization failed.\n");
 			exit(-1);
 		}
@@ -292,6 +296,25 @@ create_overlay(struct RTSPThreadParam *rtspParam, int ch) {
 	return;
 }
 
+/**
+ * Release a pipeline created by create_overlay(), including its pictures.
+ *
+ * @param pipe [in] The pipeline.
+ * @param w [in] Picture width passed to create_overlay().
+ * @param h [in] Picture height passed to create_overlay().
+ */
+void
+destroy_overlay_pipe(dpipe_t *pipe, int w, int h) {
+	int picsize = avpicture_get_size(AV_PIX_FMT_YUV420P, w, h);
+	for(int i = 0; i < pipe->nframe; i++) {
+		AVPicture *pict = (AVPicture*) pipe->buffers[i]->pointer;
+		if(pict->data[0] != NULL)
+			ga_mem_free(pict->data[0], picsize, pipe->memflags);
+	}
+	dpipe_destroy(pipe);
+	return;
+}
+
 static void
 open_audio(struct RTSPThreadParam *rtspParam, AVCodecContext *adecoder) {
 	SDL_AudioSpec wanted, spec;
@@ -34,8 +34,10 @@ unsigned increaseReceiveBufferTo(UsageEnvironment& env,
 
 #include "ga-common.h"
 #include "ga-conf.h"
+#include "ga-memory.h"
 #include "ga-avcodec.h"
 #include "controller.h"
+#include "rtp-fec.h"
 #include "minih264.h"
 #include "qosreport.h"
 #ifdef ANDROID
@@ -83,6 +85,7 @@ static enum AVCodecID audio_codec_id = AV_CODEC_ID_NONE;
 static int video_framing = 0;
 static int audio_framing = 0;
 static int log_rtp = 0;
+static int request_idr_on_loss = 0;
 
 #ifdef COUNT_FRAME_RATE
 static int cf_frame[VIDEO_SOURCE_CHANNEL_MAX];
@@ -624,6 +627,33 @@ bandwidth_estimator_update(unsigned int ssrc, unsigned short seq, struct timeval
 	return;
 }
 
+//// keyframe requests
+
+/** Minimum interval between two keyframe requests of a channel: the server also limits the rate */
+#define	REQUEST_IDR_INTERVAL_US	500000
+
+static struct timeval idr_requested[VIDEO_SOURCE_CHANNEL_MAX];
+
+/**
+ * Ask the server for a keyframe, instead of waiting for the next one,
+ * after a video frame is corrupted by packet loss.
+ */
+static void
+request_idr(int channel) {
+	ctrlmsg_t m;
+	struct timeval tv;
+	if(channel < 0 || channel >= VIDEO_SOURCE_CHANNEL_MAX)
+		return;
+	gettimeofday(&tv, NULL);
+	if(idr_requested[channel].tv_sec != 0
+	&& tvdiff_us(&tv, &idr_requested[channel]) < REQUEST_IDR_INTERVAL_US)
+		return;
+	idr_requested[channel] = tv;
+	ctrlsys_request_idr(&m, channel);
+	ctrl_client_sendmsg(&m, sizeof(ctrlmsg_system_requestidr_t));
+	return;
+}
+
 ////
 
 #ifdef WIN32
@@ -644,6 +674,8 @@ __attribute__((__packed__))
 
 typedef struct rtp_pkt_minimum_s rtp_pkt_minimum_t;
 
+static int fec_packet_handler(MediaSubsession *subsession, unsigned char *packet, unsigned &packetSize);
+
 void
 rtp_packet_handler(void *clientData, unsigned char *packet, unsigned &packetSize) {
 	rtp_pkt_minimum_t *rtp = (rtp_pkt_minimum_t*) packet;
@@ -659,6 +691,10 @@ rtp_packet_handler(void *clientData, unsigned char *packet, unsigned &packetSize
 	seqnum = ntohs(rtp->seqnum);
 	flags = ntohs(rtp->flags);
 	timestamp = ntohl(rtp->timestamp);
+	// parity packets are not media packets, and test losses are losses
+	if(clientData != NULL
+	&& fec_packet_handler((MediaSubsession*) clientData, packet, packetSize) != 0)
+		return;
 	//
 	if(log_rtp > 0) {
 #ifdef ANDROID
@@ -1067,6 +1103,450 @@ play_video(int channel, unsigned char *buffer, int bufsize, struct timeval pts,
 	return;
 }
 
+//// forward error correction: recover lost video packets with parity packets
+
+/** Default time to wait for parity packets of an incomplete frame, in ms */
+#define	FEC_DEF_WAIT_MS		30
+/** Number of recent frame ends (marker packets) kept per channel */
+#define	FEC_FRAME_ENDS		8
+
+/**
+ * Frame assembly with packet recovery of a video channel.
+ *
+ * Once the server sends parity packets, the NAL units of a frame are held
+ * until the frame is complete.  live555 drops what it cannot reassemble,
+ * and it waits for a lost packet up to the reordering threshold, so a
+ * frame with recovered packets is rebuilt from its RTP packets and passed
+ * to the decoder at once; live555's late delivery of the frame is dropped.
+ */
+typedef struct fec_channel_s {
+	int channel;
+	rtp_fec_decoder_t *dec;		/* created on the first parity packet */
+	int startvalid;
+	unsigned short startseq;	/* the first kept packet: it starts a frame */
+	TaskScheduler *scheduler;
+	TaskToken timer;		/* wait for parity packets */
+	struct {
+		int valid;
+		unsigned int ts;
+		unsigned short seq;
+		struct timeval tv;	/* arrival (or recovery) time */
+	}	ends[FEC_FRAME_ENDS];
+	int nextend;
+	// the held frame
+	int held;			/* number of held NAL units */
+	bool marker;			/* the last NAL unit is held */
+	unsigned int ts;		/* RTP timestamp */
+	struct timeval pts;		/* presentation time */
+	unsigned char *buf;		/* held NAL units */
+	int buflen, bufsize;
+	unsigned char *rbuf;		/* rebuilt frame */
+	int rbuflen, rbufsize;
+	// the last frame passed to the decoder
+	int donevalid;
+	unsigned int donets;
+	struct timeval donepts;
+	// statistics
+	unsigned int frames, recovered, unrecovered;
+	long long delayus;		/* recovered frames: from the frame end to the decoder */
+	struct timeval stattv;
+}	fec_channel_t;
+
+static int fec_wait_ms = FEC_DEF_WAIT_MS;
+static int fec_test_loss = 0;		/* drop this percentage of video packets, for testing */
+static int fec_stats = 0;		/* report interval, in seconds */
+static fec_channel_t fec_ctx[VIDEO_SOURCE_CHANNEL_MAX];
+
+static inline unsigned short
+fec_rb16(const unsigned char *p) {
+	return (p[0] << 8) | p[1];
+}
+
+static inline unsigned int
+fec_rb32(const unsigned char *p) {
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void
+fec_init() {
+	int i;
+	for(i = 0; i < VIDEO_SOURCE_CHANNEL_MAX; i++) {
+		bzero(&fec_ctx[i], sizeof(fec_channel_t));
+		fec_ctx[i].channel = i;
+	}
+	return;
+}
+
+static void
+fec_deinit() {
+	int i;
+	for(i = 0; i < VIDEO_SOURCE_CHANNEL_MAX; i++) {
+		fec_channel_t *fc = &fec_ctx[i];
+		if(fc->timer != NULL)
+			fc->scheduler->unscheduleDelayedTask(fc->timer);
+		if(fc->dec != NULL)
+			rtp_fec_decoder_destroy(fc->dec);
+		if(fc->buf != NULL)
+			free(fc->buf);
+		if(fc->rbuf != NULL)
+			free(fc->rbuf);
+	}
+	fec_init();
+	return;
+}
+
+static int
+fec_append(unsigned char **buf, int *buflen, int *bufsize, const unsigned char *data, int len) {
+	if(*buflen + len > *bufsize) {
+		int size = *bufsize * 2 > *buflen + len ? *bufsize * 2 : *buflen + len + 65536;
+		unsigned char *p;
+		if((p = (unsigned char*) realloc(*buf, size)) == NULL)
+			return -1;
+		*buf = p;
+		*bufsize = size;
+	}
+	bcopy(data, *buf + *buflen, len);
+	*buflen += len;
+	return 0;
+}
+
+/* append a NAL unit, or a part of it, to the rebuilt frame */
+static int
+fec_append_nal(fec_channel_t *fc, const unsigned char *data, int len, int startcode) {
+	static const unsigned char sc[4] = { 0, 0, 0, 1 };
+	if(startcode && fec_append(&fc->rbuf, &fc->rbuflen, &fc->rbufsize, sc, 4) < 0)
+		return -1;
+	return fec_append(&fc->rbuf, &fc->rbuflen, &fc->rbufsize, data, len);
+}
+
+/* append the NAL units of an RTP packet (RFC 6184 or RFC 7798) to the rebuilt frame */
+static int
+fec_depacketize(fec_channel_t *fc, const unsigned char *pkt, int len) {
+	const unsigned char *pl;
+	unsigned char hdr[2];
+	int off, plen, type, i, n;
+	//
+	off = 12 + (pkt[0] & 0x0f) * 4;
+	if(pkt[0] & 0x10) {	// header extension
+		if(off + 4 > len)
+			return -1;
+		off += 4 + fec_rb16(pkt+off+2) * 4;
+	}
+	if(pkt[0] & 0x20)	// padding
+		len -= pkt[len-1];
+	if(off + 2 > len)
+		return -1;
+	pl = pkt + off;
+	plen = len - off;
+	if(video_codec_id == AV_CODEC_ID_H264) {
+		type = pl[0] & 0x1f;
+		if(type >= 1 && type <= 23)
+			return fec_append_nal(fc, pl, plen, 1);
+		if(type == 24) {	// STAP-A
+			for(i = 1; i + 2 <= plen; i += 2 + n) {
+				n = fec_rb16(pl+i);
+				if(i + 2 + n > plen || fec_append_nal(fc, pl+i+2, n, 1) < 0)
+					return -1;
+			}
+			return 0;
+		}
+		if(type == 28) {	// FU-A
+			if(pl[1] & 0x80) {
+				hdr[0] = (pl[0] & 0xe0) | (pl[1] & 0x1f);
+				if(fec_append_nal(fc, hdr, 1, 1) < 0)
+					return -1;
+			}
+			return fec_append_nal(fc, pl+2, plen-2, 0);
+		}
+	} else if(video_codec_id == AV_CODEC_ID_H265) {
+		type = (pl[0] >> 1) & 0x3f;
+		if(type < 48)
+			return fec_append_nal(fc, pl, plen, 1);
+		if(type == 48) {	// AP
+			for(i = 2; i + 2 <= plen; i += 2 + n) {
+				n = fec_rb16(pl+i);
+				if(i + 2 + n > plen || fec_append_nal(fc, pl+i+2, n, 1) < 0)
+					return -1;
+			}
+			return 0;
+		}
+		if(type == 49 && plen >= 3) {	// FU
+			if(pl[2] & 0x80) {
+				hdr[0] = (pl[0] & 0x81) | ((pl[2] & 0x3f) << 1);
+				hdr[1] = pl[1];
+				if(fec_append_nal(fc, hdr, 2, 1) < 0)
+					return -1;
+			}
+			return fec_append_nal(fc, pl+3, plen-3, 0);
+		}
+	}
+	return -1;
+}
+
+/* remember the last packet of a frame */
+static void
+fec_note_packet(fec_channel_t *fc, const unsigned char *pkt, int len) {
+	if(len < 12 || (pkt[1] & 0x80) == 0)
+		return;
+	fc->ends[fc->nextend].valid = 1;
+	fc->ends[fc->nextend].ts = fec_rb32(pkt+4);
+	fc->ends[fc->nextend].seq = fec_rb16(pkt+2);
+	gettimeofday(&fc->ends[fc->nextend].tv, NULL);
+	fc->nextend = (fc->nextend + 1) % FEC_FRAME_ENDS;
+	return;
+}
+
+/*
+ * Check if all the packets of a frame are available: the frame ends with
+ * its marker packet, and starts after a packet of another frame (or with
+ * the first kept packet, which follows the parity packets of a frame).
+ * Returns the index of the frame end, or -1.
+ */
+static int
+fec_frame_complete(fec_channel_t *fc, unsigned int ts, unsigned short *first, int *recovered) {
+	const unsigned char *pkt;
+	unsigned short seq;
+	int i, n, len, r;
+	for(i = 0; i < FEC_FRAME_ENDS; i++) {
+		if(fc->ends[i].valid && fc->ends[i].ts == ts)
+			break;
+	}
+	if(i == FEC_FRAME_ENDS)
+		return -1;
+	*recovered = 0;
+	for(seq = fc->ends[i].seq, n = 0; n < RTP_FEC_WINDOW; seq--, n++) {
+		if((pkt = rtp_fec_decoder_get(fc->dec, seq, &len, &r)) == NULL)
+			return -1;
+		if(fec_rb32(pkt+4) != ts) {
+			*first = seq + 1;
+			return i;
+		}
+		*recovered += r;
+		if(fc->startvalid && seq == fc->startseq) {
+			*first = seq;
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void
+fec_report(fec_channel_t *fc) {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	if(fc->stattv.tv_sec == 0) {
+		fc->stattv = tv;
+		return;
+	}
+	if(tvdiff_us(&tv, &fc->stattv) < fec_stats * 1000000LL)
+		return;
+	ga_error("rtspclient: FEC channel %d: %u frames, %u recovered, %u unrecovered (%.2f%% of lossy frames recovered), recovery delay %.2f ms; %llu/%llu packets recovered\n",
+		fc->channel, fc->frames, fc->recovered, fc->unrecovered,
+		fc->recovered + fc->unrecovered == 0 ? 100.0 :
+			100.0 * fc->recovered / (fc->recovered + fc->unrecovered),
+		fc->recovered == 0 ? 0.0 : fc->delayus / 1000.0 / fc->recovered,
+		fc->dec->recovered, fc->dec->parity);
+	fc->frames = fc->recovered = fc->unrecovered = 0;
+	fc->delayus = 0;
+	fc->stattv = tv;
+	return;
+}
+
+/* pass a frame to the decoder */
+static void
+fec_frame_done(fec_channel_t *fc, unsigned char *buffer, int bufsize, unsigned int ts, struct timeval pts, bool marker) {
+	if(bufsize > 0)
+		play_video(fc->channel, buffer, bufsize, pts, marker);
+	if(fc->held > 0 && fc->ts == ts) {
+		fc->held = 0;
+		fc->buflen = 0;
+		fc->marker = false;
+		if(fc->timer != NULL) {
+			fc->scheduler->unscheduleDelayedTask(fc->timer);
+			fc->timer = NULL;
+		}
+	}
+	fc->donevalid = 1;
+	fc->donets = ts;
+	fc->donepts = pts;
+	fc->frames++;
+	if(fec_stats > 0)
+		fec_report(fc);
+	return;
+}
+
+/* presentation time of a frame that live555 has not delivered yet: 90KHz clock */
+static struct timeval
+fec_frame_pts(fec_channel_t *fc, unsigned int ts) {
+	struct timeval pts;
+	long long us;
+	if(fc->held > 0 && fc->ts == ts)
+		return fc->pts;
+	if(fc->donevalid == 0) {
+		gettimeofday(&pts, NULL);
+		return pts;
+	}
+	us = fc->donepts.tv_sec * 1000000LL + fc->donepts.tv_usec
+		+ ((int) (ts - fc->donets)) * 100LL / 9;
+	pts.tv_sec = us / 1000000LL;
+	pts.tv_usec = us % 1000000LL;
+	return pts;
+}
+
+/*
+ * Pass a frame with recovered packets to the decoder, if it is complete.
+ * An older held frame is passed first, as it is.
+ * Returns 1 if the frame is passed, or 0 if not, or -1 if it cannot be rebuilt.
+ */
+static int
+fec_frame_recover(fec_channel_t *fc, unsigned int ts) {
+	unsigned short seq, first;
+	const unsigned char *pkt;
+	struct timeval tv;
+	int end, len, recovered;
+	//
+	if(fc->donevalid && (int) (ts - fc->donets) <= 0)
+		return 0;
+	if((end = fec_frame_complete(fc, ts, &first, &recovered)) < 0 || recovered == 0)
+		return 0;
+	fc->rbuflen = 0;
+	for(seq = first; ; seq++) {
+		if((pkt = rtp_fec_decoder_get(fc->dec, seq, &len, NULL)) == NULL
+		|| fec_depacketize(fc, pkt, len) < 0) {
+			// unsupported packetization: leave it to live555
+			return -1;
+		}
+		if(seq == fc->ends[end].seq)
+			break;
+	}
+	if(fc->held > 0 && (int) (fc->ts - ts) < 0) {
+		fc->unrecovered++;
+		fec_frame_done(fc, fc->buf, fc->buflen, fc->ts, fc->pts, fc->marker);
+		if(request_idr_on_loss != 0)
+			request_idr(fc->channel);
+	}
+	gettimeofday(&tv, NULL);
+	fc->recovered++;
+	fc->delayus += tvdiff_us(&tv, &fc->ends[end].tv);
+	fec_frame_done(fc, fc->rbuf, fc->rbuflen, ts, fec_frame_pts(fc, ts), true);
+	return 1;
+}
+
+/* pass the held frame to the decoder: rebuilt if possible, or as it is */
+static void
+fec_frame_release(fec_channel_t *fc) {
+	unsigned short first;
+	int recovered;
+	if(fc->held == 0)
+		return;
+	if(fec_frame_complete(fc, fc->ts, &first, &recovered) >= 0) {
+		if(recovered == 0) {
+			fec_frame_done(fc, fc->buf, fc->buflen, fc->ts, fc->pts, fc->marker);
+			return;
+		}
+		if(fec_frame_recover(fc, fc->ts) > 0)
+			return;
+	}
+	fc->unrecovered++;
+	fec_frame_done(fc, fc->buf, fc->buflen, fc->ts, fc->pts, fc->marker);
+	if(request_idr_on_loss != 0)
+		request_idr(fc->channel);
+	return;
+}
+
+static void
+fec_wait_timeout(void *clientData) {
+	fec_channel_t *fc = (fec_channel_t*) clientData;
+	fc->timer = NULL;
+	fec_frame_release(fc);
+	return;
+}
+
+/*
+ * Video RTP packets before live555.  Returns non-zero if live555 should
+ * not see the packet: parity packets, and packets dropped for testing.
+ */
+static int
+fec_packet_handler(MediaSubsession *subsession, unsigned char *packet, unsigned &packetSize) {
+	map<unsigned short,int>::iterator mi;
+	fec_channel_t *fc;
+	unsigned short seq;
+	const unsigned char *pkt;
+	int len;
+	//
+	if(fec_test_loss > 0 && rand() % 100 < fec_test_loss) {
+		packetSize = 0;
+		return 1;
+	}
+	if((mi = port2channel.find(subsession->clientPortNum())) == port2channel.end())
+		return rtp_fec_is_parity(packet, packetSize);
+	fc = &fec_ctx[mi->second];
+	if(rtp_fec_is_parity(packet, packetSize)) {
+		if(video_codec_id != AV_CODEC_ID_H264 && video_codec_id != AV_CODEC_ID_H265)
+			return 1;
+		if(fc->dec == NULL) {
+			if((fc->dec = rtp_fec_decoder_create()) == NULL)
+				return 1;
+			rtsperror("FEC: recover video packets of channel %d\n", fc->channel);
+		}
+		if(rtp_fec_decoder_recover(fc->dec, packet, packetSize, &seq) > 0
+		&& (pkt = rtp_fec_decoder_get(fc->dec, seq, &len, NULL)) != NULL) {
+			fec_note_packet(fc, pkt, len);
+			fec_frame_recover(fc, fec_rb32(pkt+4));
+		}
+		return 1;
+	}
+	if(fc->dec != NULL) {
+		if(fc->startvalid == 0) {
+			fc->startvalid = 1;
+			fc->startseq = fec_rb16(packet+2);
+		}
+		rtp_fec_decoder_add(fc->dec, packet, packetSize);
+		fec_note_packet(fc, packet, packetSize);
+		if(packet[1] & 0x80)
+			fec_frame_recover(fc, fec_rb32(packet+4));
+	}
+	return 0;
+}
+
+/*
+ * A NAL unit from live555: hold it until the frame is complete.
+ * Returns 0 if packet recovery is not used.
+ */
+static int
+fec_frame_hold(fec_channel_t *fc, TaskScheduler *scheduler, unsigned int ts,
+		unsigned char *buffer, int bufsize, struct timeval pts, bool marker) {
+	unsigned short first;
+	int recovered;
+	if(fc->dec == NULL)
+		return 0;
+	// late delivery of a recovered frame
+	if(fc->donevalid && (int) (ts - fc->donets) <= 0)
+		return 1;
+	if(fc->held > 0 && fc->ts != ts)
+		fec_frame_release(fc);
+	if(fc->held == 0) {
+		fc->ts = ts;
+		fc->pts = pts;
+		fc->buflen = 0;
+	}
+	if(fec_append(&fc->buf, &fc->buflen, &fc->bufsize, buffer, bufsize) < 0) {
+		rtsperror("FEC: cannot hold frame data.\n");
+		return 0;
+	}
+	fc->held++;
+	if(marker == false)
+		return 1;
+	fc->marker = true;
+	if(fec_frame_complete(fc, ts, &first, &recovered) >= 0) {
+		fec_frame_release(fc);
+		return 1;
+	}
+	fc->scheduler = scheduler;
+	fc->timer = scheduler->scheduleDelayedTask(fec_wait_ms * 1000, fec_wait_timeout, fc);
+	return 1;
+}
+
 static const int abmaxsize = AVCODEC_MAX_AUDIO_FRAME_SIZE*4;
 static unsigned char *audiobuf = NULL;
 static unsigned int absize = 0;
@@ -1341,6 +1821,13 @@ rtsp_thread(void *param) {
 	//
 	if(ga_conf_readbool("log-rtp-packet", 0) != 0)
 		log_rtp = 1;
+	request_idr_on_loss = ga_conf_readbool("request-idr-on-loss", 0);
+	if(ga_conf_readint("fec-wait") > 0)
+		fec_wait_ms = ga_conf_readint("fec-wait");
+	fec_test_loss = ga_conf_readint("fec-test-loss");
+	fec_stats = ga_conf_readint("fec-stats");
+	if(fec_test_loss > 0)
+		rtsperror("*** TEST: drop %d%% of the video packets.\n", fec_test_loss);
 	if(ga_conf_readv("save-yuv-image", savefile_yuv, sizeof(savefile_yuv)) != NULL)
 		savefp_yuv = ga_save_init(savefile_yuv);
 	if(savefp_yuv != NULL
@@ -1356,6 +1843,7 @@ rtsp_thread(void *param) {
 	rtsperror("RTP reordering threshold = %d\n", rtp_packet_reordering_threshold);
 	//
 	pktloss_monitor_init();
+	fec_init();
 	port2channel.clear();
 	video_sess_fmt = -1;
 	audio_sess_fmt = -1;
@@ -1402,11 +1890,14 @@ rtsp_thread(void *param) {
 	}
 	//
 	shutdownStream(client);
+	fec_deinit();
 	deinit_decoder_buffer();
 	// release resources in rtspThreadParam
 	for(int i = 0; i < VIDEO_SOURCE_CHANNEL_MAX; i++) {
 		if(rtspParam->pipe[i] != NULL) {
-			dpipe_destroy(rtspParam->pipe[i]);
+			// pictures are owned by the one that calls create_overlay()
+			destroy_overlay_pipe(rtspParam->pipe[i],
+				rtspParam->width[i], rtspParam->height[i]);
 			rtspParam->pipe[i] = NULL;
 		}
 	}
@@ -1564,7 +2055,7 @@ setupNextSubsession(RTSPClient* rtspClient) {
 				video_sess_fmt = scs.subsession->rtpPayloadFormat();
 				video_codec_name = strdup(scs.subsession->codecName());
 				qos_add_source(video_codec_name, scs.subsession->rtpSource());
-				scs.subsession->rtpSource()->setAuxilliaryReadHandler(rtp_packet_handler, NULL);
+				scs.subsession->rtpSource()->setAuxilliaryReadHandler(rtp_packet_handler, scs.subsession);
 				if(rtp_packet_reordering_threshold > 0)
 					scs.subsession->rtpSource()->setPacketReorderingThresholdTime(rtp_packet_reordering_threshold);
 				if(port2channel.find(scs.subsession->clientPortNum()) == port2channel.end()) {
@@ -1987,11 +2478,21 @@ DummySink::afterGettingFrame(unsigned frameSize, unsigned numTruncatedBytes,
 			}
 #endif
 		}
+		// with parity packets, only frames that are not recovered count
+		if(lost > 0 && request_idr_on_loss != 0 && fec_ctx[channel].dec == NULL)
+			request_idr(channel);
 		//
-		play_video(channel,
+		if(rtpsrc == NULL
+		|| fec_frame_hold(&fec_ctx[channel], &envir().taskScheduler(),
+			rtpsrc->curPacketRTPTimestamp(),
 			fReceiveBuffer+MAX_FRAMING_SIZE-video_framing,
 			frameSize+video_framing, presentationTime,
-			marker);
+			marker) == 0) {
+			play_video(channel,
+				fReceiveBuffer+MAX_FRAMING_SIZE-video_framing,
+				frameSize+video_framing, presentationTime,
+				marker);
+		}
 #ifdef ANDROID
 		if(rtspconf->builtin_video_decoder==0
 		&& rtspconf->builtin_audio_decoder==0)
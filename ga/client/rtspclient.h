@@ -83,6 +83,7 @@ void * rtsp_thread(void *param);
 /* internal use only */
 int audio_buffer_fill(void *userdata, unsigned char *stream, int ssize);
 void audio_buffer_fill_sdl(void *userdata, unsigned char *stream, int ssize);
+void destroy_overlay_pipe(dpipe_t *pipe, int w, int h);
 #ifdef ANDROID
 void setRTSPThreadParam(struct RTSPThreadParam *param);
 struct RTSPThreadParam * getRTSPThreadParam();
@@ -48,6 +48,8 @@ static int qhead, qtail, qsize, qunit;
 static unsigned char *qbuffer = NULL;
 
 static msgfunc replay = NULL;
+// sender of the message being handled by the server thread
+static struct sockaddr_in ctrlpeer;
 
 #ifdef WIN32
 static unsigned long
@@ -486,6 +488,7 @@ tcp_again:
 			}
 		}
 		// handle message
+		bcopy(&csin, &ctrlpeer, sizeof(ctrlpeer));
 		if(ctrlsys_handle_message(buf+bufhead, msglen) != 0) {
 			// message has been handeled, do nothing
 		} else if(replay != NULL) {
@@ -511,6 +514,19 @@ tcp_again:
 	return NULL;
 }
 
+/**
+ * Get the client that sent the message being handled.
+ *
+ * @param sin [out] Address of the client.
+ *
+ * This function is valid only in a system message handler or a replay callback.
+ */
+void
+ctrl_server_get_peer(struct sockaddr_in *sin) {
+	bcopy(&ctrlpeer, sin, sizeof(ctrlpeer));
+	return;
+}
+
 int
 ctrl_server_readnext(void *msg, int msglen) {
 	int ret;
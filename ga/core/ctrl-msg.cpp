@@ -32,7 +32,8 @@
 static ctrlsys_handler_t ctrlsys_handler_list[] = {
 	NULL,	/* 0 = CTRL_MSGSYS_SUBTYPE_NULL */
 	NULL,	/* 1 = CTRL_MSGSYS_SUBTYPE_SHUTDOWN */
-	NULL	/* 2 = CTRL_MSGSYS_SUBTYPE_NETREPORT */
+	NULL,	/* 2 = CTRL_MSGSYS_SUBTYPE_NETREPORT */
+	NULL	/* 3 = CTRL_MSGSYS_SUBTYPE_REQUEST_IDR */
 };
 
 ctrlsys_handler_t
@@ -58,6 +59,7 @@ ctrlsys_set_handler(unsigned char subtype, ctrlsys_handler_t handler) {
 static int 
 ctrlsys_ntoh(ctrlmsg_system_t *msg) {
 	ctrlmsg_system_netreport_t *netreport;
+	ctrlmsg_system_requestidr_t *requestidr;
 	msg->msgsize = ntohs(msg->msgsize);
 	switch(msg->subtype) {
 	/* no conversion needed, and no size checking */
@@ -75,6 +77,12 @@ ctrlsys_ntoh(ctrlmsg_system_t *msg) {
 		netreport->bytecount = htonl(netreport->bytecount);
 		netreport->capacity = htonl(netreport->capacity);
 		break;
+	case CTRL_MSGSYS_SUBTYPE_REQUEST_IDR:
+		if(msg->msgsize != sizeof(ctrlmsg_system_requestidr_t))
+			return -1;
+		requestidr = (ctrlmsg_system_requestidr_t*) msg;
+		requestidr->channel = ntohl(requestidr->channel);
+		break;
 	default:
 		return -1;
 	}
@@ -140,3 +148,24 @@ ctrlsys_netreport(ctrlmsg_t *msg, unsigned int duration,
 	return msg;
 }
 
+/**
+ * Build a keyframe request message, which is sent from a client to a server
+ * when the client cannot decode a video channel due to packet loss.
+ *
+ * @param msg [in]	The structure to store the built message.
+ *			The size of the structure must be at least \a sizeof(ctrlmsg_system_requestidr_t)
+ * @param channel [in]	The video channel id.
+ *
+ * The server limits the rate of forced keyframes, so requests can be repeated.
+ */
+ctrlmsg_t *
+ctrlsys_request_idr(ctrlmsg_t *msg, unsigned int channel) {
+	ctrlmsg_system_requestidr_t *msgr = (ctrlmsg_system_requestidr_t*) msg;
+	bzero(msg, sizeof(ctrlmsg_system_requestidr_t));
+	msgr->msgsize = htons(sizeof(ctrlmsg_system_requestidr_t));
+	msgr->msgtype = CTRL_MSGTYPE_SYSTEM;
+	msgr->subtype = CTRL_MSGSYS_SUBTYPE_REQUEST_IDR;
+	msgr->channel = htonl(channel);
+	return msg;
+}
+
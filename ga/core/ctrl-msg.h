@@ -32,7 +32,8 @@
 #define	CTRL_MSGSYS_SUBTYPE_NULL	0	/* system control message: NULL */
 #define	CTRL_MSGSYS_SUBTYPE_SHUTDOWN	1	/* system control message: shutdown */
 #define	CTRL_MSGSYS_SUBTYPE_NETREPORT	2	/* system control message: report networking */
-#define	CTRL_MSGSYS_SUBTYPE_MAX		2	/* must equal to the last sub message type */
+#define	CTRL_MSGSYS_SUBTYPE_REQUEST_IDR	3	/* system control message: request a keyframe */
+#define	CTRL_MSGSYS_SUBTYPE_MAX		3	/* must equal to the last sub message type */
 
 #ifdef WIN32
 #define	BEGIN_CTRL_MESSAGE_STRUCT	__pragma(pack(push, 1))	/* equal to #pragma pack(push, 1) */
@@ -87,6 +88,19 @@ struct ctrlmsg_system_netreport_s {
 END_CTRL_MESSAGE_STRUCT
 typedef struct ctrlmsg_system_netreport_s ctrlmsg_system_netreport_t;
 
+BEGIN_CTRL_MESSAGE_STRUCT
+/**
+ * System control message: request a keyframe to recover from packet loss.
+ */
+struct ctrlmsg_system_requestidr_s {
+	unsigned short msgsize;		/*< size of this message, including this field */
+	unsigned char msgtype;		/*< must be CTRL_MSGTYPE_SYSTEM */
+	unsigned char subtype;		/*< must be CTRL_MSGSYS_SUBTYPE_REQUEST_IDR */
+	unsigned int channel;		/*< video channel id */
+}
+END_CTRL_MESSAGE_STRUCT
+typedef struct ctrlmsg_system_requestidr_s ctrlmsg_system_requestidr_t;
+
 ////////////////////////////////////////////////////////////////////////////
 
 typedef void (*ctrlsys_handler_t)(ctrlmsg_system_t *);
@@ -96,5 +110,6 @@ EXPORT	ctrlsys_handler_t ctrlsys_set_handler(unsigned char subtype, ctrlsys_hand
 
 // functions for building message data structure
 EXPORT ctrlmsg_t * ctrlsys_netreport(ctrlmsg_t *msg, unsigned int duration, unsigned int framecount, unsigned int pktcount, unsigned int pktloss, unsigned int bytecount, unsigned int capacity);
+EXPORT ctrlmsg_t * ctrlsys_request_idr(ctrlmsg_t *msg, unsigned int channel);
 
 #endif	/* __CTRL_MSG_H__ */
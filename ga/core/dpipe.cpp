@@ -21,15 +21,385 @@
  * dpipe implementation: pipe for delivering discrete frames
  */
 #include "dpipe.h"
+#include "ga-conf.h"
+#include "ga-memory.h"
 
 #include <map>
 #include <string>
+#include <atomic>
+#include <errno.h>
+#ifdef __linux__
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#endif
 using namespace std;
 
 /** Store the mapping between pipe-name and pipe structure */
 static pthread_mutex_t dpipemap_mutex = PTHREAD_MUTEX_INITIALIZER;
 static map<string,dpipe_t*> dpipemap;
 
+/** Cache line size used to separate producer and consumer indexes */
+#define	DPIPE_CACHELINE		64
+/** Number of busy retries in dpipe_get() before yielding the processor */
+#define	DPIPE_GET_RETRY		64
+
+/**
+ * A slot in the lock-free ring.
+ */
+typedef struct dpipe_ring_cell_s {
+	atomic<size_t> seq;		/**< slot sequence number */
+	dpipe_buffer_t *buffer;		/**< stored frame buffer */
+}	dpipe_ring_cell_t;
+
+/**
+ * Bounded lock-free ring of frame buffers.
+ *
+ * This is a sequence-numbered array queue: it works for SPSC and MPSC
+ * use and also allows dpipe_get() to steal the eldest frame from the
+ * output ring while the consumer is loading from it.
+ */
+typedef struct dpipe_ring_s {
+	dpipe_ring_cell_t *cell;	/**< ring slots */
+	size_t mask;			/**< number of slots - 1 (slots is 2^n) */
+	char pad0[DPIPE_CACHELINE];
+	atomic<size_t> head;		/**< dequeue position */
+	char pad1[DPIPE_CACHELINE];
+	atomic<size_t> tail;		/**< enqueue position */
+	char pad2[DPIPE_CACHELINE];
+}	dpipe_ring_t;
+
+/**
+ * Lock-free pools of a dpipe: used with DPIPE_FLAG_LOCKFREE.
+ */
+struct dpipe_lockfree_s {
+	dpipe_ring_t in;		/**< free frame buffers */
+	dpipe_ring_t out;		/**< occupied frame buffers */
+	atomic<int> stored;		/**< number of stored frames: also the futex word */
+	atomic<int> waiters;		/**< number of blocked loaders */
+};
+
+static int
+dpipe_ring_init(dpipe_ring_t *ring, int nframe) {
+	size_t i, slots = 1;
+	while(slots < (size_t) nframe)
+		slots <<= 1;
+	if((ring->cell = new (nothrow) dpipe_ring_cell_t[slots]) == NULL)
+		return -1;
+	for(i = 0; i < slots; i++) {
+		ring->cell[i].seq.store(i, memory_order_relaxed);
+		ring->cell[i].buffer = NULL;
+	}
+	ring->mask = slots - 1;
+	ring->head.store(0, memory_order_relaxed);
+	ring->tail.store(0, memory_order_relaxed);
+	return 0;
+}
+
+static bool
+dpipe_ring_push(dpipe_ring_t *ring, dpipe_buffer_t *buffer) {
+	dpipe_ring_cell_t *cell;
+	size_t pos = ring->tail.load(memory_order_relaxed);
+	for(;;) {
+		cell = &ring->cell[pos & ring->mask];
+		size_t seq = cell->seq.load(memory_order_acquire);
+		long diff = (long) seq - (long) pos;
+		if(diff == 0) {
+			if(ring->tail.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+				break;
+		} else if(diff < 0) {
+			return false;	// full: should not happen, rings have >= nframe slots
+		} else {
+			pos = ring->tail.load(memory_order_relaxed);
+		}
+	}
+	cell->buffer = buffer;
+	cell->seq.store(pos + 1, memory_order_release);
+	return true;
+}
+
+static dpipe_buffer_t *
+dpipe_ring_pop(dpipe_ring_t *ring) {
+	dpipe_ring_cell_t *cell;
+	dpipe_buffer_t *buffer;
+	size_t pos = ring->head.load(memory_order_relaxed);
+	for(;;) {
+		cell = &ring->cell[pos & ring->mask];
+		size_t seq = cell->seq.load(memory_order_acquire);
+		long diff = (long) seq - (long) (pos + 1);
+		if(diff == 0) {
+			if(ring->head.compare_exchange_weak(pos, pos + 1, memory_order_relaxed))
+				break;
+		} else if(diff < 0) {
+			return NULL;	// empty
+		} else {
+			pos = ring->head.load(memory_order_relaxed);
+		}
+	}
+	buffer = cell->buffer;
+	cell->seq.store(pos + ring->mask + 1, memory_order_release);
+	return buffer;
+}
+
+/**
+ * Block a loader until the number of stored frames differs from \a stored.
+ *
+ * @return 0 if woken up (possibly spuriously), or -1 on timed out.
+ */
+static int
+dpipe_lockfree_wait(dpipe_t *dpipe, int stored, const struct timespec *abstime) {
+	struct dpipe_lockfree_s *lf = dpipe->lockfree;
+#ifdef __linux__
+	// absolute CLOCK_REALTIME timeout, the same as pthread_cond_timedwait()
+	if(syscall(SYS_futex, (int*) &lf->stored,
+			FUTEX_WAIT_BITSET_PRIVATE | FUTEX_CLOCK_REALTIME,
+			stored, abstime, NULL, FUTEX_BITSET_MATCH_ANY) < 0
+	&& errno == ETIMEDOUT)
+		return -1;
+	return 0;
+#else
+	int ret = 0;
+	pthread_mutex_lock(&dpipe->cond_mutex);
+	if(lf->stored.load() == stored) {
+		if(abstime == NULL) {
+			pthread_cond_wait(&dpipe->cond, &dpipe->cond_mutex);
+		} else if(pthread_cond_timedwait(&dpipe->cond, &dpipe->cond_mutex, abstime) != 0) {
+			ret = -1;
+		}
+	}
+	pthread_mutex_unlock(&dpipe->cond_mutex);
+	return ret;
+#endif
+}
+
+/**
+ * Wake up a blocked loader, if any.
+ * No system call is made when nobody is waiting.
+ */
+static void
+dpipe_lockfree_wake(dpipe_t *dpipe) {
+	struct dpipe_lockfree_s *lf = dpipe->lockfree;
+	lf->stored.fetch_add(1);
+	if(lf->waiters.load() == 0)
+		return;
+#ifdef __linux__
+	syscall(SYS_futex, (int*) &lf->stored, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#else
+	pthread_mutex_lock(&dpipe->cond_mutex);
+	pthread_cond_signal(&dpipe->cond);
+	pthread_mutex_unlock(&dpipe->cond_mutex);
+#endif
+	return;
+}
+
+static void
+dpipe_lockfree_free(struct dpipe_lockfree_s *lf) {
+	if(lf == NULL)
+		return;
+	delete[] lf->in.cell;
+	delete[] lf->out.cell;
+	delete lf;
+	return;
+}
+
+static int
+dpipe_lockfree_init(dpipe_t *dpipe, int nframe) {
+	struct dpipe_lockfree_s *lf;
+	dpipe_buffer_t *vbuf;
+	if((lf = new (nothrow) struct dpipe_lockfree_s) == NULL)
+		return -1;
+	lf->in.cell = lf->out.cell = NULL;
+	lf->stored.store(0);
+	lf->waiters.store(0);
+	dpipe->lockfree = lf;
+	if(dpipe_ring_init(&lf->in, nframe) < 0
+	|| dpipe_ring_init(&lf->out, nframe) < 0)
+		return -1;
+	for(vbuf = dpipe->in; vbuf != NULL; vbuf = vbuf->next) {
+		dpipe_ring_push(&lf->in, vbuf);
+	}
+	return 0;
+}
+
+/**
+ * Statistics of a dpipe: used with DPIPE_FLAG_STATS.
+ *
+ * Producer-side and consumer-side counters are kept in separate
+ * cache lines, so the two sides do not contend for them.
+ */
+struct dpipe_counter_s {
+	long long created_us;			/**< creation time */
+	long long interval_us;			/**< periodic dump interval, or 0 */
+	char pad0[DPIPE_CACHELINE];
+	// producer side
+	atomic<unsigned long long> stored;
+	atomic<unsigned long long> dropped;
+	atomic<unsigned long long> occupancy_sum;
+	atomic<int> occupancy_max;
+	atomic<long long> last_store_us;
+	char pad1[DPIPE_CACHELINE];
+	// consumer side
+	atomic<unsigned long long> loaded;
+	atomic<unsigned long long> wait_total_us;
+	atomic<long long> wait_max_us;
+	atomic<long long> last_load_us;
+	atomic<unsigned long long> wait_hist[DPIPE_STATS_HISTSIZE];
+	char pad2[DPIPE_CACHELINE];
+	// interval baseline for dpipe_stats_dump()
+	pthread_mutex_t dump_mutex;
+	long long dump_us;
+	unsigned long long dump_stored;
+	unsigned long long dump_loaded;
+};
+
+static long long
+dpipe_now_us() {
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000LL + tv.tv_usec;
+}
+
+static void *
+dpipe_dump_threadproc(void *arg) {
+	long long interval_us = *(long long*) arg;
+	while(1) {
+		ga_usleep(interval_us, NULL);
+		dpipe_stats_dump_all();
+	}
+	return NULL;
+}
+
+/**
+ * Start the periodic dump thread if it is not running.
+ *
+ * Pipes are dumped from their own thread, so formatted output
+ * never runs on the producer or consumer threads.
+ */
+static void
+dpipe_dump_start(long long interval_us) {
+	static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+	static long long interval = 0;
+	pthread_t t;
+	pthread_mutex_lock(&mutex);
+	if(interval == 0) {
+		interval = interval_us;
+		if(pthread_create(&t, NULL, dpipe_dump_threadproc, &interval) != 0) {
+			ga_error("dpipe: cannot create the stats dump thread.\n");
+			interval = 0;
+		} else {
+			pthread_detach(t);
+		}
+	}
+	pthread_mutex_unlock(&mutex);
+	return;
+}
+
+static int
+dpipe_counter_init(dpipe_t *dpipe) {
+	struct dpipe_counter_s *c;
+	int i, interval;
+	if((c = new (nothrow) struct dpipe_counter_s) == NULL)
+		return -1;
+	c->created_us = c->dump_us = dpipe_now_us();
+	interval = ga_conf_readint("dpipe-stats-interval");
+	c->interval_us = interval > 0 ? interval * 1000000LL : 0;
+	c->stored.store(0);
+	c->dropped.store(0);
+	c->occupancy_sum.store(0);
+	c->occupancy_max.store(0);
+	c->last_store_us.store(0);
+	c->loaded.store(0);
+	c->wait_total_us.store(0);
+	c->wait_max_us.store(0);
+	c->last_load_us.store(0);
+	for(i = 0; i < DPIPE_STATS_HISTSIZE; i++)
+		c->wait_hist[i].store(0);
+	pthread_mutex_init(&c->dump_mutex, NULL);
+	c->dump_stored = c->dump_loaded = 0;
+	dpipe->counter = c;
+	if(c->interval_us > 0)
+		dpipe_dump_start(c->interval_us);
+	return 0;
+}
+
+static void
+dpipe_counter_free(struct dpipe_counter_s *c) {
+	if(c == NULL)
+		return;
+	pthread_mutex_destroy(&c->dump_mutex);
+	delete c;
+	return;
+}
+
+/** Update statistics on dpipe_store(): \a now is the stored time and \a occupancy is the number of stored frames */
+static void
+dpipe_counter_store(dpipe_t *dpipe, long long now, int occupancy) {
+	struct dpipe_counter_s *c = dpipe->counter;
+	if(c == NULL)
+		return;
+	c->stored.fetch_add(1, memory_order_relaxed);
+	c->occupancy_sum.fetch_add(occupancy, memory_order_relaxed);
+	if(occupancy > c->occupancy_max.load(memory_order_relaxed))
+		c->occupancy_max.store(occupancy, memory_order_relaxed);
+	c->last_store_us.store(now, memory_order_relaxed);
+	return;
+}
+
+/** Update statistics on a successful load */
+static void
+dpipe_counter_load(dpipe_t *dpipe, dpipe_buffer_t *vbuf) {
+	struct dpipe_counter_s *c = dpipe->counter;
+	long long now, wait;
+	int bucket = 0;
+	if(c == NULL || vbuf == NULL)
+		return;
+	now = dpipe_now_us();
+	wait = now - vbuf->stored_us;
+	if(wait < 0)
+		wait = 0;
+	while(wait >> bucket && bucket < DPIPE_STATS_HISTSIZE - 1)
+		bucket++;
+	c->loaded.fetch_add(1, memory_order_relaxed);
+	c->wait_total_us.fetch_add(wait, memory_order_relaxed);
+	if(wait > c->wait_max_us.load(memory_order_relaxed))
+		c->wait_max_us.store(wait, memory_order_relaxed);
+	c->wait_hist[bucket].fetch_add(1, memory_order_relaxed);
+	c->last_load_us.store(now, memory_order_relaxed);
+	return;
+}
+
+/** Update statistics when dpipe_get() recycles a stored frame */
+static void
+dpipe_counter_drop(dpipe_t *dpipe) {
+	if(dpipe->counter == NULL)
+		return;
+	dpipe->counter->dropped.fetch_add(1, memory_order_relaxed);
+	return;
+}
+
+/**
+ * Drop a reference of a frame buffer. This is an internal function.
+ *
+ * @param vbuf [in] The frame buffer.
+ * @return \a vbuf if it is no longer referenced and can be reused,
+ *	or NULL if it is still held by others.
+ *
+ * The referenced source buffer (see dpipe_store_ref()) is released as well.
+ */
+static dpipe_buffer_t *
+dpipe_buffer_release(dpipe_buffer_t *vbuf) {
+	dpipe_buffer_t *source;
+	if(vbuf->refcount.fetch_sub(1) > 1)
+		return NULL;
+	if((source = vbuf->source) != NULL) {
+		vbuf->source = NULL;
+		vbuf->pointer = (void*) (((char*) vbuf->internal) + vbuf->offset);
+		dpipe_put(source->owner, source);
+	}
+	return vbuf;
+}
+
 /**
  * Create and register a new video pipe.
  *
@@ -40,9 +410,39 @@ static map<string,dpipe_t*> dpipemap;
  * @return Pointer to a created dpipe, or NULL on failure
  *
  * Note: dpipe_create() also returns NULL if the requesting name is existed.
+ * The pipe uses lock-free pools if \em dpipe-lockfree is enabled,
+ * and collects statistics if \em dpipe-stats is enabled in the configuration.
  */
 dpipe_t *
 dpipe_create(int id, const char *name, int nframe, int maxframesize) {
+	int flags = DPIPE_FLAG_NONE;
+	if(ga_conf_readbool("dpipe-lockfree", 0) != 0)
+		flags |= DPIPE_FLAG_LOCKFREE;
+	if(ga_conf_readbool("dpipe-stats", 0) != 0)
+		flags |= DPIPE_FLAG_STATS;
+	return dpipe_create_ex(id, name, nframe, maxframesize, flags);
+}
+
+/**
+ * Create and register a new video pipe with creation flags.
+ *
+ * @param id [in] The video channel id
+ * @param name [in] The name of the dpipe, must be unique
+ * @param nframe [in] Number of frame buffers in the pipe
+ * @param maxframesize [in] The maximum frame buffer size
+ * @param flags [in] DPIPE_FLAG_* values
+ * @return Pointer to a created dpipe, or NULL on failure
+ *
+ * With DPIPE_FLAG_LOCKFREE, the input and output pools are lock-free rings
+ * and a blocked dpipe_load() is woken up via futex (Linux) or a condition
+ * variable (others) only when there is a waiter.
+ * The API and the drop-the-eldest-frame behavior of dpipe_get() are the same.
+ *
+ * With DPIPE_FLAG_STATS, the pipe records throughput, occupancy,
+ * dropped frames, and queue-wait times, see dpipe_stats().
+ */
+dpipe_t *
+dpipe_create_ex(int id, const char *name, int nframe, int maxframesize, int flags) {
 	int i;
 	dpipe_t *dpipe;
 	// sanity checks
@@ -57,31 +457,49 @@ dpipe_create(int id, const char *name, int nframe, int maxframesize) {
 	//
 	bzero(dpipe, sizeof(dpipe_t));
 	dpipe->channel_id = id;
+	dpipe->flags = flags;
 	if((dpipe->name = strdup(name)) == NULL)
 		goto err_create;
 	pthread_mutex_init(&dpipe->cond_mutex, NULL);
 	pthread_cond_init(&dpipe->cond, NULL);
 	pthread_mutex_init(&dpipe->io_mutex, NULL);
 	// alloc and init frame buffers
+	dpipe->framesize.store(maxframesize);
+	dpipe->memflags = ga_mem_conf_flags();
+	dpipe->numa_bound.store(0);
+	if((dpipe->buffers = (dpipe_buffer_t**) calloc(nframe, sizeof(dpipe_buffer_t*))) == NULL)
+		goto err_create;
 	for(i = 0; i < nframe; i++) {
 		dpipe_buffer_t* dbuffer;
 		if((dbuffer = (dpipe_buffer_t*) malloc(sizeof(dpipe_buffer_t))) == NULL)
 			goto err_create;
-		if(ga_malloc(maxframesize, &dbuffer->internal, &dbuffer->offset) < 0) {
+		bzero(dbuffer, sizeof(dpipe_buffer_t));
+		dbuffer->owner = dpipe;
+		dbuffer->refcount.store(0);
+		if((dbuffer->internal = ga_mem_alloc(maxframesize, dpipe->memflags)) == NULL) {
 			free(dbuffer);
 			goto err_create;
 		}
-		dbuffer->pointer = (void*) (((char*) dbuffer->internal) + dbuffer->offset);
+		dbuffer->offset = 0;
+		dbuffer->size = maxframesize;
+		dbuffer->pointer = dbuffer->internal;
 		dbuffer->next = dpipe->in;
 		dpipe->in = dbuffer;
 		dpipe->in_count++;
+		dpipe->buffers[dpipe->nframe++] = dbuffer;
 	}
+	if((flags & DPIPE_FLAG_LOCKFREE) && dpipe_lockfree_init(dpipe, nframe) < 0)
+		goto err_create;
+	if((flags & DPIPE_FLAG_STATS) && dpipe_counter_init(dpipe) < 0)
+		goto err_create;
 	//
 	pthread_mutex_lock(&dpipemap_mutex);
 	dpipemap[dpipe->name] = dpipe;
 	pthread_mutex_unlock(&dpipemap_mutex);
-	ga_error("dpipe: '%s' initialized, %d frames, framesize = %d\n",
-		dpipe->name, dpipe->in_count, maxframesize);
+	ga_error("dpipe: '%s' initialized, %d frames, framesize = %d%s%s\n",
+		dpipe->name, dpipe->nframe, maxframesize,
+		dpipe->lockfree ? " (lock-free)" : "",
+		(dpipe->memflags & GA_MEM_HUGEPAGE) ? " (hugepage)" : "");
 	return dpipe;
 	// failure cases
 err_create:
@@ -115,7 +533,7 @@ dpipe_lookup(const char *name) {
  */
 int
 dpipe_destroy(dpipe_t *dpipe) {
-	dpipe_buffer_t *vbuf, *next;
+	int i;
 	if(dpipe == NULL)
 		return 0;
 	if(dpipe->name) {
@@ -127,22 +545,80 @@ dpipe_destroy(dpipe_t *dpipe) {
 	pthread_mutex_destroy(&dpipe->cond_mutex);
 	pthread_cond_destroy(&dpipe->cond);
 	pthread_mutex_destroy(&dpipe->io_mutex);
+	dpipe_lockfree_free(dpipe->lockfree);
+	dpipe_counter_free(dpipe->counter);
 	//
-	for(vbuf = dpipe->in; vbuf != NULL; vbuf = next) {
-		next = vbuf->next;
-		free(vbuf->internal);
-		free(vbuf);
-	}
-	for(vbuf = dpipe->out; vbuf != NULL; vbuf = next) {
-		next = vbuf->next;
-		free(vbuf->internal);
-		free(vbuf);
+	for(i = 0; i < dpipe->nframe; i++) {
+		ga_mem_free(dpipe->buffers[i]->internal, dpipe->buffers[i]->size, dpipe->memflags);
+		free(dpipe->buffers[i]);
 	}
+	if(dpipe->buffers != NULL)
+		free(dpipe->buffers);
 	//
 	free(dpipe);
 	return 0;
 }
 
+/**
+ * Change the frame buffer size of an existing dpipe
+ *
+ * @param dpipe [in] Pointer to the dpipe structure
+ * @param maxframesize [in] The new maximum frame buffer size
+ * @param init [in] Callback to initialize a reallocated buffer, can be NULL
+ * @return 0 on success, or -1 on error
+ *
+ * The pipe is not drained: frames being processed or queued keep their buffers.
+ * Each buffer is reallocated when it is next returned by dpipe_get(),
+ * i.e., when it is owned only by the producer, and then \a init is called.
+ * The pipe must be created by dpipe_create() or dpipe_create_ex().
+ */
+int
+dpipe_resize(dpipe_t *dpipe, int maxframesize, dpipe_init_t init) {
+	if(dpipe == NULL || maxframesize <= 0)
+		return -1;
+	dpipe->initializer = init;
+	if(dpipe->framesize.exchange(maxframesize) != maxframesize) {
+		ga_error("dpipe: '%s' frame buffers resized to %d bytes\n",
+			dpipe->name, maxframesize);
+	}
+	return 0;
+}
+
+/**
+ * Reallocate a frame buffer owned by the caller. This is an internal function.
+ *
+ * @param dpipe [in] The involved pipe
+ * @param vbuf [in] The frame buffer
+ * @param size [in] The new size
+ *
+ * The buffer keeps its old space if the allocation fails.
+ * The space is swapped under io_mutex, see dpipe_numa_bind().
+ */
+static void
+dpipe_buffer_realloc(dpipe_t *dpipe, dpipe_buffer_t *vbuf, int size) {
+	void *ptr, *oldptr;
+	int oldsize;
+	if((ptr = ga_mem_alloc(size, dpipe->memflags)) == NULL) {
+		ga_error("dpipe: '%s' reallocate frame buffer failed (%d bytes).\n",
+			dpipe->name, size);
+		return;
+	}
+	pthread_mutex_lock(&dpipe->io_mutex);
+	oldptr = vbuf->internal;
+	oldsize = vbuf->size;
+	vbuf->internal = ptr;
+	vbuf->offset = 0;
+	vbuf->size = size;
+	vbuf->pointer = ptr;
+	pthread_mutex_unlock(&dpipe->io_mutex);
+	ga_mem_free(oldptr, oldsize, dpipe->memflags);
+	if(dpipe->initializer != NULL)
+		dpipe->initializer(dpipe, vbuf);
+	// let the consumer place the new space on its NUMA node
+	dpipe->numa_bound.store(0);
+	return;
+}
+
 /**
  * Get a free frame buffer from the pipe
  *
@@ -150,16 +626,37 @@ dpipe_destroy(dpipe_t *dpipe) {
  * @return Pointer to the frame buffer structure
  *
  * Note: Data should be stored in vbuf->pointer, with a maximum size
- * of \a maxframesize given when creating the pipe.
+ * of \a maxframesize given when creating (or resizing) the pipe.
  * This function should always success.
  * In case there is no availabe free frame buffer, this function
  * returns the eldest frame buffer in the output pool.
- * 
+ * If all the frame buffers are held by loaders or shared by reference,
+ * it waits until one of them is put back.
  */
 dpipe_buffer_t *
 dpipe_get(dpipe_t *dpipe) {
 	dpipe_buffer_t *vbuf = NULL;
 	//
+	if(dpipe->lockfree != NULL) {
+		int retry = 0;
+		// an empty ring may be transient: a buffer can be in flight
+		while(1) {
+			if((vbuf = dpipe_ring_pop(&dpipe->lockfree->in)) != NULL)
+				break;
+			if((vbuf = dpipe_ring_pop(&dpipe->lockfree->out)) != NULL) {
+				dpipe_counter_drop(dpipe);
+				// the dropped frame may be still referenced by others
+				if((vbuf = dpipe_buffer_release(vbuf)) != NULL)
+					break;
+				continue;
+			}
+			if(++retry >= DPIPE_GET_RETRY)
+				sched_yield();
+		}
+		goto quit_get;
+	}
+	//
+again:
 	pthread_mutex_lock(&dpipe->io_mutex);
 	if(dpipe->in != NULL) {
 		// quick path: has available frame buffers
@@ -168,6 +665,7 @@ dpipe_get(dpipe_t *dpipe) {
 			vbuf->next = NULL;
 			dpipe->in_count--;
 		}
+		pthread_mutex_unlock(&dpipe->io_mutex);
 	} else {
 		// no available buffers: drop the eldest frame buffer from output pool
 		if((vbuf = dpipe->out) != NULL) {
@@ -178,9 +676,25 @@ dpipe_get(dpipe_t *dpipe) {
 			}
 			dpipe->out_count--;
 		}
+		pthread_mutex_unlock(&dpipe->io_mutex);
+		if(vbuf == NULL) {
+			// all the buffers are held by loaders
+			sched_yield();
+			goto again;
+		}
+		dpipe_counter_drop(dpipe);
+		// the dropped frame may be still referenced by others
+		if((vbuf = dpipe_buffer_release(vbuf)) == NULL)
+			goto again;
 	}
-	pthread_mutex_unlock(&dpipe->io_mutex);
 	//
+quit_get:
+	if(vbuf != NULL) {
+		int size = dpipe->framesize.load();
+		vbuf->refcount.store(1);
+		if(vbuf->size != size)
+			dpipe_buffer_realloc(dpipe, vbuf, size);
+	}
 	return vbuf;
 }
 
@@ -189,9 +703,19 @@ dpipe_get(dpipe_t *dpipe) {
  *
  * @param dpipe [in] The involved pipe
  * @param buffer [in] Pointer to the buffer to be released
+ *
+ * If the buffer has been referenced by dpipe_buffer_ref() or dpipe_store_ref(),
+ * it goes back to the pool only when the last holder puts it.
  */
 void
 dpipe_put(dpipe_t *dpipe, dpipe_buffer_t *buffer) {
+	// still referenced?
+	if(dpipe_buffer_release(buffer) == NULL)
+		return;
+	if(dpipe->lockfree != NULL) {
+		dpipe_ring_push(&dpipe->lockfree->in, buffer);
+		return;
+	}
 	pthread_mutex_lock(&dpipe->io_mutex);
 	buffer->next = dpipe->in;
 	dpipe->in = buffer;
@@ -200,6 +724,36 @@ dpipe_put(dpipe_t *dpipe, dpipe_buffer_t *buffer) {
 	return;
 }
 
+/**
+ * Move all the frame buffers to the NUMA node of the calling thread.
+ * This is an internal function.
+ *
+ * @param dpipe [in] The involved pipe
+ *
+ * This is done only once, by the first consumer that loads a frame,
+ * and only if \em frame-pool-numa is enabled.  It is done again after a
+ * frame buffer is reallocated.  The buffers are walked under io_mutex, so
+ * dpipe_buffer_realloc() cannot release the space being bound.
+ */
+static void
+dpipe_numa_bind(dpipe_t *dpipe) {
+	int i, node = -1;
+	if((dpipe->memflags & GA_MEM_NUMA) == 0)
+		return;
+	if(dpipe->numa_bound.load(std::memory_order_relaxed) != 0)
+		return;
+	if(dpipe->numa_bound.exchange(1) != 0)
+		return;
+	pthread_mutex_lock(&dpipe->io_mutex);
+	for(i = 0; i < dpipe->nframe; i++) {
+		node = ga_mem_bind_local(dpipe->buffers[i]->internal, dpipe->buffers[i]->size);
+	}
+	pthread_mutex_unlock(&dpipe->io_mutex);
+	if(node >= 0)
+		ga_error("dpipe: '%s' frame buffers placed on NUMA node %d\n", dpipe->name, node);
+	return;
+}
+
 /**
  * Load a frame from the output pool of the pipe
  *
@@ -217,6 +771,25 @@ dpipe_load(dpipe_t *dpipe, const struct timespec *abstime) {
 	dpipe_buffer_t *vbuf = NULL;
 	int failed = 0;
 	//
+	if(dpipe->lockfree != NULL) {
+		struct dpipe_lockfree_s *lf = dpipe->lockfree;
+		while((vbuf = dpipe_ring_pop(&lf->out)) == NULL && failed == 0) {
+			int stored = lf->stored.load();
+			lf->waiters.fetch_add(1);
+			// re-check after announcing the waiter
+			if((vbuf = dpipe_ring_pop(&lf->out)) == NULL) {
+				if(dpipe_lockfree_wait(dpipe, stored, abstime) < 0)
+					failed = 1;
+			}
+			lf->waiters.fetch_sub(1);
+			if(vbuf != NULL)
+				break;
+		}
+		dpipe_numa_bind(dpipe);
+		dpipe_counter_load(dpipe, vbuf);
+		return vbuf;
+	}
+	//
 	pthread_mutex_lock(&dpipe->io_mutex);
 again:
 	if(dpipe->out != NULL) {
@@ -237,6 +810,8 @@ again:
 	}
 	pthread_mutex_unlock(&dpipe->io_mutex);
 	//
+	dpipe_numa_bind(dpipe);
+	dpipe_counter_load(dpipe, vbuf);
 	return vbuf;
 }
 
@@ -253,6 +828,13 @@ dpipe_buffer_t *
 dpipe_load_nowait(dpipe_t *dpipe) {
 	dpipe_buffer_t *vbuf = NULL;
 	//
+	if(dpipe->lockfree != NULL) {
+		vbuf = dpipe_ring_pop(&dpipe->lockfree->out);
+		dpipe_numa_bind(dpipe);
+		dpipe_counter_load(dpipe, vbuf);
+		return vbuf;
+	}
+	//
 	pthread_mutex_lock(&dpipe->io_mutex);
 	if(dpipe->out != NULL) {
 		vbuf = dpipe->out;
@@ -264,6 +846,8 @@ dpipe_load_nowait(dpipe_t *dpipe) {
 	}
 	pthread_mutex_unlock(&dpipe->io_mutex);
 	//
+	dpipe_numa_bind(dpipe);
+	dpipe_counter_load(dpipe, vbuf);
 	return vbuf;
 }
 
@@ -276,6 +860,19 @@ dpipe_load_nowait(dpipe_t *dpipe) {
  */
 void
 dpipe_store(dpipe_t *dpipe, dpipe_buffer_t *buffer) {
+	long long now = 0;
+	int occupancy;
+	// stamp before the frame becomes visible to the receiver
+	if(dpipe->counter != NULL)
+		now = buffer->stored_us = dpipe_now_us();
+	if(dpipe->lockfree != NULL) {
+		dpipe_ring_t *ring = &dpipe->lockfree->out;
+		dpipe_ring_push(ring, buffer);
+		dpipe_lockfree_wake(dpipe);
+		occupancy = (int) (ring->tail.load(memory_order_relaxed) - ring->head.load(memory_order_relaxed));
+		dpipe_counter_store(dpipe, now, occupancy);
+		return;
+	}
 	pthread_mutex_lock(&dpipe->io_mutex);
 	// put at the end
 	if(dpipe->out_tail != NULL) {
@@ -286,9 +883,156 @@ dpipe_store(dpipe_t *dpipe, dpipe_buffer_t *buffer) {
 	}
 	buffer->next = NULL;
 	dpipe->out_count++;
+	occupancy = dpipe->out_count;
 	//
 	pthread_mutex_unlock(&dpipe->io_mutex);
 	pthread_cond_signal(&dpipe->cond);
+	dpipe_counter_store(dpipe, now, occupancy);
+	return;
+}
+
+
+/**
+ * Store a frame buffer owned by another pipe into the output pool
+ * of a pipe without copying the frame.
+ *
+ * @param dpipe [in] The involved pipe
+ * @param buffer [in] Pointer to the buffer to be shared.
+ * @return 0 on success, or -1 if \a dpipe has no free frame buffer.
+ *
+ * A frame buffer of \a dpipe is used as a reference to \a buffer:
+ * its \a pointer is set to \a buffer->pointer.
+ * The caller still owns \a buffer and has to store or put it as usual.
+ * \a buffer goes back to its own pool after all the holders have put it.
+ * The receivers of \a dpipe must treat the frame as read-only.
+ *
+ * Each frame buffer of \a dpipe holds at most one reference, so the pipe
+ * owning \a buffer needs nframe more frame buffers for each referencing
+ * pipe; otherwise dpipe_get() on it fails when all its frames are held.
+ */
+int
+dpipe_store_ref(dpipe_t *dpipe, dpipe_buffer_t *buffer) {
+	dpipe_buffer_t *vbuf;
+	//
+	if(buffer->source != NULL)
+		buffer = buffer->source;
+	if((vbuf = dpipe_get(dpipe)) == NULL)
+		return -1;
+	dpipe_buffer_ref(buffer);
+	vbuf->source = buffer;
+	vbuf->pointer = buffer->pointer;
+	dpipe_store(dpipe, vbuf);
+	return 0;
+}
+
+/**
+ * Add a reference to a frame buffer.
+ *
+ * @param buffer [in] Pointer to the buffer.
+ *
+ * This is used to hand a loaded frame to more than one consumer.
+ * Each holder must call dpipe_put() once.
+ */
+void
+dpipe_buffer_ref(dpipe_buffer_t *buffer) {
+	buffer->refcount.fetch_add(1);
 	return;
 }
 
+/**
+ * Get a snapshot of the statistics of a pipe.
+ *
+ * @param dpipe [in] The involved pipe
+ * @param stats [out] The statistics
+ * @return 0 on success, or -1 if the pipe does not collect statistics.
+ *
+ * Statistics are collected only if the pipe is created with DPIPE_FLAG_STATS,
+ * or \em dpipe-stats is enabled in the configuration.
+ */
+int
+dpipe_stats(dpipe_t *dpipe, dpipe_stats_t *stats) {
+	struct dpipe_counter_s *c;
+	int i;
+	if(dpipe == NULL || (c = dpipe->counter) == NULL)
+		return -1;
+	bzero(stats, sizeof(dpipe_stats_t));
+	stats->elapsed_us = dpipe_now_us() - c->created_us;
+	stats->stored = c->stored.load(memory_order_relaxed);
+	stats->loaded = c->loaded.load(memory_order_relaxed);
+	stats->dropped = c->dropped.load(memory_order_relaxed);
+	if(stats->elapsed_us > 0) {
+		stats->store_fps = 1000000.0 * stats->stored / stats->elapsed_us;
+		stats->load_fps = 1000000.0 * stats->loaded / stats->elapsed_us;
+	}
+	stats->last_store_us = c->last_store_us.load(memory_order_relaxed);
+	stats->last_load_us = c->last_load_us.load(memory_order_relaxed);
+	if(stats->loaded > 0)
+		stats->wait_avg_us = c->wait_total_us.load(memory_order_relaxed) / stats->loaded;
+	stats->wait_max_us = c->wait_max_us.load(memory_order_relaxed);
+	if(stats->stored > 0)
+		stats->occupancy_avg = 1.0 * c->occupancy_sum.load(memory_order_relaxed) / stats->stored;
+	stats->occupancy_max = c->occupancy_max.load(memory_order_relaxed);
+	for(i = 0; i < DPIPE_STATS_HISTSIZE; i++)
+		stats->wait_hist[i] = c->wait_hist[i].load(memory_order_relaxed);
+	return 0;
+}
+
+/**
+ * Print out the statistics of a pipe.
+ *
+ * @param dpipe [in] The involved pipe
+ *
+ * Throughput is reported both since the pipe was created and
+ * since the previous dump.
+ * If \em dpipe-stats-interval is given in the configuration,
+ * a dump thread calls dpipe_stats_dump_all() every given seconds.
+ */
+void
+dpipe_stats_dump(dpipe_t *dpipe) {
+	struct dpipe_counter_s *c;
+	dpipe_stats_t st;
+	char hist[DPIPE_STATS_HISTSIZE * 12], *ptr = hist;
+	double interval_store_fps = 0.0, interval_load_fps = 0.0;
+	long long now;
+	int i;
+	if(dpipe_stats(dpipe, &st) < 0)
+		return;
+	c = dpipe->counter;
+	for(i = 0; i < DPIPE_STATS_HISTSIZE; i++) {
+		ptr += snprintf(ptr, sizeof(hist) - (ptr - hist), " %llu", st.wait_hist[i]);
+	}
+	pthread_mutex_lock(&c->dump_mutex);
+	now = c->created_us + st.elapsed_us;
+	if(now > c->dump_us) {
+		interval_store_fps = 1000000.0 * (st.stored - c->dump_stored) / (now - c->dump_us);
+		interval_load_fps = 1000000.0 * (st.loaded - c->dump_loaded) / (now - c->dump_us);
+	}
+	c->dump_us = now;
+	c->dump_stored = st.stored;
+	c->dump_loaded = st.loaded;
+	pthread_mutex_unlock(&c->dump_mutex);
+	ga_error("dpipe-stats: '%s' stored=%llu (%.2f/%.2f fps) loaded=%llu (%.2f/%.2f fps) dropped=%llu"
+		" occupancy=%.2f/%d wait=%lld/%lldus hist=[%s ]\n",
+		dpipe->name,
+		st.stored, interval_store_fps, st.store_fps,
+		st.loaded, interval_load_fps, st.load_fps,
+		st.dropped,
+		st.occupancy_avg, st.occupancy_max,
+		st.wait_avg_us, st.wait_max_us,
+		hist);
+	return;
+}
+
+/**
+ * Print out the statistics of all the pipes that collect statistics.
+ */
+void
+dpipe_stats_dump_all() {
+	map<string,dpipe_t*>::iterator mi;
+	pthread_mutex_lock(&dpipemap_mutex);
+	for(mi = dpipemap.begin(); mi != dpipemap.end(); mi++) {
+		dpipe_stats_dump(mi->second);
+	}
+	pthread_mutex_unlock(&dpipemap_mutex);
+	return;
+}
@@ -26,9 +26,20 @@
 
 #include <stdio.h>
 #include <pthread.h>
+#include <atomic>
 
 #include "ga-common.h"
 
+/** dpipe creation flags: use the default linked-list pools */
+#define	DPIPE_FLAG_NONE		0x00
+/** dpipe creation flags: use lock-free ring buffers for the pools */
+#define	DPIPE_FLAG_LOCKFREE	0x01
+/** dpipe creation flags: collect latency and occupancy statistics */
+#define	DPIPE_FLAG_STATS	0x02
+
+/** Number of buckets in the queue-wait histogram */
+#define	DPIPE_STATS_HISTSIZE	20
+
 /**
  * structure for buffering a frame
  */
@@ -36,12 +47,48 @@ typedef struct dpipe_buffer_s {
 	void *pointer;		/**< pointer to a frame buffer. Aligned to 8-byte address: is equivalent to internal + offset */
 	void *internal;		/**< internal pointer to the allocated buffer space. Used with malloc() and free(). */
 	int offset;		/**< data pointer offset from internal */
+	int size;		/**< allocated size of the buffer space */
 	struct dpipe_buffer_s *next;	/**< pointer to the next dpipe frame buffer */
+	// zero-copy sharing
+	struct dpipe_s *owner;		/**< the dpipe that allocates this buffer */
+	std::atomic<int> refcount;	/**< number of holders: the buffer returns to the pool when it drops to zero */
+	struct dpipe_buffer_s *source;	/**< frame buffer referenced by this buffer (see dpipe_store_ref()), or NULL.
+					 * When set, \a pointer is equivalent to \a source->pointer */
+	long long stored_us;		/**< time the frame was stored, in us: used with DPIPE_FLAG_STATS */
 }	dpipe_buffer_t;
 
+/**
+ * Snapshot of dpipe statistics, see dpipe_stats().
+ */
+typedef struct dpipe_stats_s {
+	long long elapsed_us;		/**< time elapsed since the pipe was created */
+	unsigned long long stored;	/**< number of frames stored by producers */
+	unsigned long long loaded;	/**< number of frames loaded by consumers */
+	unsigned long long dropped;	/**< number of stored frames recycled by dpipe_get() before being loaded */
+	double store_fps;		/**< producer throughput */
+	double load_fps;		/**< consumer throughput */
+	long long last_store_us;	/**< time of the last dpipe_store(), in us */
+	long long last_load_us;		/**< time of the last successful load, in us */
+	long long wait_avg_us;		/**< average queue-wait time (store to load) */
+	long long wait_max_us;		/**< maximum queue-wait time */
+	double occupancy_avg;		/**< average number of stored frames, sampled on store */
+	int occupancy_max;		/**< maximum number of stored frames */
+	unsigned long long wait_hist[DPIPE_STATS_HISTSIZE];	/**< queue-wait histogram:
+					 * bucket 0 counts waits below 1us, bucket i counts waits in [2^(i-1), 2^i) us,
+					 * and the last bucket also counts all the longer waits */
+}	dpipe_stats_t;
+
+struct dpipe_lockfree_s;
+struct dpipe_counter_s;
+struct dpipe_s;
+
+/** Callback to initialize a reallocated frame buffer, see dpipe_resize() */
+typedef void (*dpipe_init_t)(struct dpipe_s *dpipe, dpipe_buffer_t *buffer);
+
 typedef struct dpipe_s {
 	int channel_id;		/**< channel id for the dpipe */
 	char *name;		/**< name of the dpipe */
+	int flags;		/**< dpipe creation flags, i.e., DPIPE_FLAG_* */
 	//
 	pthread_mutex_t cond_mutex;	/**< pthread mutex for conditional signaling */
 	pthread_cond_t cond;		/**< pthread condition */
@@ -52,15 +99,35 @@ typedef struct dpipe_s {
 	dpipe_buffer_t *out_tail;	/**< output pool: pointer to the last frame buffer in output pool (occupied frames) */
 	int in_count;			/**< number of unused frame buffers */
 	int out_count;			/**< number of occupied frames */
+	//
+	struct dpipe_lockfree_s *lockfree;	/**< lock-free pools: used only with DPIPE_FLAG_LOCKFREE.
+				 * In this mode, \a in links all the frame buffers (read-only),
+				 * \a out is unused, and \a in_count / \a out_count are not updated. */
+	struct dpipe_counter_s *counter;	/**< statistics: used only with DPIPE_FLAG_STATS */
+	//
+	int nframe;			/**< number of frame buffers allocated */
+	std::atomic<int> framesize;	/**< size of each frame buffer: buffers of other sizes are
+					 * reallocated when they are returned by dpipe_get() */
+	dpipe_init_t initializer;	/**< callback for reallocated frame buffers, see dpipe_resize() */
+	int memflags;			/**< frame buffer allocation flags, i.e., GA_MEM_* */
+	dpipe_buffer_t **buffers;	/**< all the frame buffers, for releasing and NUMA placement */
+	std::atomic<int> numa_bound;	/**< frame buffers have been moved to the consumer's NUMA node */
 }	dpipe_t;
 
 EXPORT dpipe_t *	dpipe_create(int id, const char *name, int nframe, int maxframesize);
+EXPORT dpipe_t *	dpipe_create_ex(int id, const char *name, int nframe, int maxframesize, int flags);
 EXPORT dpipe_t *	dpipe_lookup(const char *name);
 EXPORT int		dpipe_destroy(dpipe_t *dpipe);
+EXPORT int		dpipe_resize(dpipe_t *dpipe, int maxframesize, dpipe_init_t init);
 EXPORT dpipe_buffer_t *	dpipe_get(dpipe_t *dpipe);
 EXPORT void		dpipe_put(dpipe_t *dpipe, dpipe_buffer_t *buffer);
 EXPORT dpipe_buffer_t *	dpipe_load(dpipe_t *dpipe, const struct timespec *abstime);
 EXPORT dpipe_buffer_t *	dpipe_load_nowait(dpipe_t *dpipe);
 EXPORT void		dpipe_store(dpipe_t *dpipe, dpipe_buffer_t *buffer);
+EXPORT int		dpipe_store_ref(dpipe_t *dpipe, dpipe_buffer_t *buffer);
+EXPORT void		dpipe_buffer_ref(dpipe_buffer_t *buffer);
+EXPORT int		dpipe_stats(dpipe_t *dpipe, dpipe_stats_t *stats);
+EXPORT void		dpipe_stats_dump(dpipe_t *dpipe);
+EXPORT void		dpipe_stats_dump_all();
 
 #endif	/* __GA_DPIPE_H__ */
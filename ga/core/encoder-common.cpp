@@ -23,9 +23,15 @@
 
 #include <pthread.h>
 #include <map>
-#include <list>
+#include <atomic>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
 
 #include "vsource.h"
+#include "ga-conf.h"
+#include "ctrl-msg.h"
 #include "encoder-common.h"
 
 using namespace std;
@@ -47,6 +53,13 @@ static ga_module_t *sinkserver = NULL;	/**< Sink server instance */
 static void *vencoder_param = NULL;	/**< Vieo encoder parameter */
 static void *aencoder_param = NULL;	/**< Audio encoder parameter */
 
+// on-demand keyframes
+static atomic<int> idr_pending[VIDEO_SOURCE_CHANNEL_MAX];	/**< a keyframe is requested */
+static long long idr_last[VIDEO_SOURCE_CHANNEL_MAX];	/**< last forced keyframe (us); used by the encoder thread only */
+static atomic<long long> idr_interval(-1);		/**< minimum interval between forced keyframes (us) */
+
+static void encoder_handle_request_idr(ctrlmsg_system_t *msg);
+
 /**
  * Compute the integer presentation timestamp based on elapsed time.
  *
@@ -104,6 +117,7 @@ encoder_register_vencoder(ga_module_t *m, void *param) {
 	}
 	vencoder = m;
 	vencoder_param = param;
+	ctrlsys_set_handler(CTRL_MSGSYS_SUBTYPE_REQUEST_IDR, encoder_handle_request_idr);
 	ga_error("video encoder: %s registered\n", m->name);
 	return 0;
 }
@@ -186,6 +200,77 @@ encoder_get_sinkserver() {
 	return sinkserver;
 }
 
+/**
+ * Forward a client keyframe request to the video encoder. This is an internal function.
+ */
+static void
+encoder_handle_request_idr(ctrlmsg_system_t *msg) {
+	ctrlmsg_system_requestidr_t *msgr = (ctrlmsg_system_requestidr_t*) msg;
+	ga_ioctl_request_idr_t req;
+	int err;
+	if(vencoder == NULL || vencoder->ioctl == NULL)
+		return;
+	req.id = msgr->channel;
+	if((err = vencoder->ioctl(GA_IOCTL_REQUEST_IDR, sizeof(req), &req)) < 0) {
+		ga_error("encoder: keyframe request for channel %d failed, err = %d.\n", req.id, err);
+	}
+	return;
+}
+
+/**
+ * Request a keyframe on a video channel.
+ *
+ * @param channelId [in] The video channel id.
+ * @return 0 on success, or -1 if \a channelId is invalid.
+ *
+ * This is called by the GA_IOCTL_REQUEST_IDR handler of video encoders.
+ * Requests are coalesced until the encoder polls them with encoder_idr_poll().
+ */
+int
+encoder_idr_request(int channelId) {
+	if(channelId < 0 || channelId >= VIDEO_SOURCE_CHANNEL_MAX)
+		return -1;
+	idr_pending[channelId] = 1;
+	return 0;
+}
+
+/**
+ * Check whether a video encoder has to force a keyframe now.
+ *
+ * @param channelId [in] The video channel id.
+ * @return 1 if the next frame has to be a keyframe, or 0 otherwise.
+ *
+ * A video encoder calls this before encoding each frame.
+ * Forced keyframes are at least \em video-idr-min-interval
+ * milliseconds (default 1000) apart, so lossy clients cannot cause a
+ * keyframe storm; requests in between are served when it elapses.
+ */
+int
+encoder_idr_poll(int channelId) {
+	struct timeval tv;
+	long long now, interval;
+	if(channelId < 0 || channelId >= VIDEO_SOURCE_CHANNEL_MAX)
+		return 0;
+	if(idr_pending[channelId] == 0)
+		return 0;
+	if((interval = idr_interval) < 0) {
+		char buf[64];
+		interval = 1000;
+		if(ga_conf_readv("video-idr-min-interval", buf, sizeof(buf)) != NULL
+		&& ga_conf_readint("video-idr-min-interval") >= 0)
+			interval = ga_conf_readint("video-idr-min-interval");
+		interval *= 1000LL;
+		idr_interval = interval;
+	}
+	gettimeofday(&tv, NULL);
+	now = tv.tv_sec * 1000000LL + tv.tv_usec;
+	if(idr_last[channelId] != 0 && now - idr_last[channelId] < interval)
+		return 0;
+	idr_pending[channelId] = 0;
+	idr_last[channelId] = now;
+	return 1;
+}
+
 /**
  * Register an encoder client, and start encoder modules if necessary.
  *
@@ -312,18 +397,36 @@ encoder_send_packet(const char *prefix, int channelId, AVPacket *pkt, int64_t en
 
 // encoder pts to ptv mapping function
 #define	MAX_PTS_QUEUE	8
-static list<encoder_pts_t> pts_queue[MAX_PTS_QUEUE];	// up to 8 queues
+#define	PTS_QUEUE_SIZE	256	/* records per queue, must be a power of two */
+
+/**
+ * A pts to ptv mapping queue.
+ *
+ * Records are appended by encoder_pts_put() and consumed by
+ * encoder_ptv_get(), which can be called from different threads
+ * without locks (single writer and single reader).
+ * Records are kept in ascending pts order.
+ */
+typedef struct pts_ring_s {
+	encoder_pts_t rec[PTS_QUEUE_SIZE];
+	std::atomic<unsigned> head;	/**< Next record to read: owned by the reader */
+	std::atomic<unsigned> tail;	/**< Next record to write: owned by the writer */
+}	pts_ring_t;
+
+static pts_ring_t pts_queue[MAX_PTS_QUEUE];	// up to 8 queues
 
 /**
  * Clear all pts records in a pts queue.
  *
  * @param queueid [in] The id of the pts queue.
+ *
+ * This function must not be called while the queue is being written or read.
  */
 int
 encoder_pts_clear(unsigned queueid) {
 	if(queueid >= MAX_PTS_QUEUE)
 		return -1;
-	pts_queue[queueid].clear();
+	pts_queue[queueid].head = pts_queue[queueid].tail.load();
 	return 0;
 }
 
@@ -334,15 +437,25 @@ encoder_pts_clear(unsigned queueid) {
  * @param pts [in] The pts value.
  * @param ptv [in] The correspond ptv value for the \a pts.
  * @return 0 on success, or -1 on failure.
+ *
+ * The \a pts must be larger than the previous one in the queue.
+ * The record is dropped if the queue is full.
  */
 int
 encoder_pts_put(unsigned queueid, long long pts, struct timeval *ptv) {
-	encoder_pts_t p;
+	pts_ring_t *q;
+	unsigned tail;
 	if(queueid >= MAX_PTS_QUEUE)
 		return -1;
-	p.pts = pts;
-	p.ptv = *ptv;
-	pts_queue[queueid].push_back(p);
+	q = &pts_queue[queueid];
+	tail = q->tail.load(std::memory_order_relaxed);
+	if(tail - q->head.load(std::memory_order_acquire) >= PTS_QUEUE_SIZE) {
+		ga_error("encoder: pts queue #%d full, pts=%lld dropped\n", queueid, pts);
+		return -1;
+	}
+	q->rec[tail & (PTS_QUEUE_SIZE-1)].pts = pts;
+	q->rec[tail & (PTS_QUEUE_SIZE-1)].ptv = *ptv;
+	q->tail.store(tail + 1, std::memory_order_release);
 	return 0;
 }
 
@@ -355,41 +468,62 @@ encoder_pts_put(unsigned queueid, long long pts, struct timeval *ptv) {
  * @param interpolation [in] Use interpolation to get an approximate ptv value.
  * @return The \a ptv pointer if success, or NULL on failure.
  *
+ * The record is found by a binary search, and records older than \a pts
+ * are removed from the queue.
+ *
  * Note that the interpolation feature may be only required for audio packets.
  * The \a interpolation value should be the sample rate of audio frames.
+ * The ptv is then computed backward from the next record,
+ * i.e., (next pts - \a pts) / \a interpolation seconds earlier.
  */
 struct timeval *
 encoder_ptv_get(unsigned queueid, long long pts, struct timeval *ptv, int interpolation) {
+	pts_ring_t *q;
+	unsigned head, tail, lo, hi, mid;
+	encoder_pts_t *rec;
 	if(ptv == NULL)
 		return NULL;
 	if(queueid >= MAX_PTS_QUEUE)
 		return NULL;
-	while(pts_queue[queueid].size() > 0) {
-		if(pts > pts_queue[queueid].front().pts) {
-			pts_queue[queueid].pop_front();
-			continue;
-		}
-		if(pts_queue[queueid].front().pts == pts) {
-			*ptv = pts_queue[queueid].front().ptv;
-			pts_queue[queueid].pop_front();
-			return ptv;
-		}
-		if(interpolation > 0) {
-			long long delta_ts, delta_tv;
-			delta_ts = pts_queue[queueid].front().pts - pts;
-			delta_tv = (long long) (1.0 * delta_ts / interpolation);
-			*ptv = pts_queue[queueid].front().ptv;
-			ptv->tv_sec -= (delta_tv / 1000000LL);
-			delta_tv %= 1000000LL;
-			if(ptv->tv_usec < delta_tv) {
-				ptv->tv_sec--;
-				ptv->tv_usec += 1000000LL;
-			}
-			ptv->tv_usec -= delta_tv;
-			return ptv;
+	q = &pts_queue[queueid];
+	head = q->head.load(std::memory_order_relaxed);
+	tail = q->tail.load(std::memory_order_acquire);
+	// the first record with pts >= the given pts
+	lo = 0;
+	hi = tail - head;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(q->rec[(head + mid) & (PTS_QUEUE_SIZE-1)].pts < pts)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	head += lo;
+	if(head == tail) {
+		q->head.store(head, std::memory_order_release);
+		goto ptv_get_failed;
+	}
+	rec = &q->rec[head & (PTS_QUEUE_SIZE-1)];
+	if(rec->pts == pts) {
+		*ptv = rec->ptv;
+		q->head.store(head + 1, std::memory_order_release);
+		return ptv;
+	}
+	q->head.store(head, std::memory_order_release);
+	if(interpolation > 0) {
+		long long delta_us;
+		delta_us = (rec->pts - pts) * 1000000LL / interpolation;
+		*ptv = rec->ptv;
+		ptv->tv_sec -= (delta_us / 1000000LL);
+		delta_us %= 1000000LL;
+		if(ptv->tv_usec < delta_us) {
+			ptv->tv_sec--;
+			ptv->tv_usec += 1000000LL;
 		}
-		break;
+		ptv->tv_usec -= delta_us;
+		return ptv;
 	}
+ptv_get_failed:
 #if 1
 	ga_error("FIXME: encoder_ptv_get failed: id=%d, pts=%lld\n", queueid, pts);
 #endif
@@ -400,8 +534,29 @@ encoder_ptv_get(unsigned queueid, long long pts, struct timeval *ptv, int interp
 static int pktqueue_initqsize = -1;
 static int pktqueue_initchannels = -1;
 static encoder_packet_queue_t pktqueue[VIDEO_SOURCE_CHANNEL_MAX+1];
-static list<encoder_packet_t> pktlist[VIDEO_SOURCE_CHANNEL_MAX+1];
-static map<qcallback_t,qcallback_t>queue_cb[VIDEO_SOURCE_CHANNEL_MAX+1];
+
+/**
+ * Subscribers of a packet queue.
+ *
+ * The callback list is published as one of two snapshots.
+ * The encoder thread reads the current snapshot without locks or allocation;
+ * writers fill the other snapshot and switch to it, then wait until no one
+ * reads the old snapshot, so a callback is never called after
+ * encoder_pktqueue_unregister_callback() returns.
+ */
+typedef struct pktqueue_notify_s {
+	qcallback_t cb[2][ENCODER_PKTQUEUE_MAX_CALLBACKS];
+	int ncb[2];
+	std::atomic<int> current;	/**< Index of the published snapshot */
+	std::atomic<int> readers[2];	/**< Number of readers of each snapshot */
+	std::atomic<int> efd;		/**< eventfd signaled on append, or 0 */
+}	pktqueue_notify_t;
+
+static pthread_mutex_t queue_cb_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pktqueue_notify_t queue_cb[VIDEO_SOURCE_CHANNEL_MAX+1];
+
+/** Descriptor of the packet with sequence number \a seq. */
+#define	pktqueue_desc(q, seq)	(&(q)->desc[(seq) & (q)->descmask])
 
 /**
  * Initialize an encoder packet queue.
@@ -411,6 +566,9 @@ static map<qcallback_t,qcallback_t>queue_cb[VIDEO_SOURCE_CHANNEL_MAX+1];
  * @return 0 on success, or quit the program on error.
  *
  * This function creates a packet queue of size \a qsize for each channel.
+ * Packet descriptors are kept in a preallocated ring that can hold
+ * \a qsize / ENCODER_PKTQUEUE_MINPKT packets (rounded up to a power of two),
+ * so no memory is allocated when packets are appended or read.
  * This functoin should be called only once.
  * If you have multiple channels, specify the number in the \a channels 
  * parameter.
@@ -418,9 +576,14 @@ static map<qcallback_t,qcallback_t>queue_cb[VIDEO_SOURCE_CHANNEL_MAX+1];
 int
 encoder_pktqueue_init(int channels, int qsize) {
 	int i;
+	unsigned ndesc = 64;
+	while(ndesc < (unsigned) qsize / ENCODER_PKTQUEUE_MINPKT)
+		ndesc <<= 1;
 	for(i = 0; i < channels; i++) {
 		if(pktqueue[i].buf != NULL)
 			free(pktqueue[i].buf);
+		if(pktqueue[i].desc != NULL)
+			free(pktqueue[i].desc);
 		//
 		bzero(&pktqueue[i], sizeof(encoder_packet_queue_t));
 		pthread_mutex_init(&pktqueue[i].mutex, NULL);
@@ -429,18 +592,135 @@ encoder_pktqueue_init(int channels, int qsize) {
 				i, qsize);
 			exit(-1);
 		}
+		if((pktqueue[i].desc = (encoder_packet_t *) malloc(ndesc * sizeof(encoder_packet_t))) == NULL) {
+			ga_error("encoder: initialized packet queue#%d failed (%d descriptors)\n",
+				i, ndesc);
+			exit(-1);
+		}
 		pktqueue[i].bufsize = qsize;
 		pktqueue[i].datasize = 0;
 		pktqueue[i].head = 0;
 		pktqueue[i].tail = 0;
-		pktlist[i].clear();
+		pktqueue[i].descmask = ndesc - 1;
+		pktqueue[i].descfirst = 0;
+		pktqueue[i].descnext = 0;
 	}
 	pktqueue_initqsize = qsize;
 	pktqueue_initchannels = channels;
-	ga_error("encoder: packet queue initialized (%dx%d bytes)\n", channels, qsize);
+	ga_error("encoder: packet queue initialized (%dx%d bytes, %d descriptors)\n",
+		channels, qsize, ndesc);
 	return 0;
 }
 
+/**
+ * Release packets that have been read by all the readers.
+ *
+ * @param q [in] The packet queue, must be locked.
+ * @param upto [in] Release packets before this sequence number.
+ *
+ * Packets are kept if no reader is active, unless \a upto is specified
+ * to free the space.
+ */
+static void
+pktqueue_release(encoder_packet_queue_t *q, unsigned upto) {
+	encoder_packet_t *qp;
+	int i;
+	// the oldest packet that is still required by a reader
+	for(i = 0; i < ENCODER_PKTQUEUE_MAX_READERS; i++) {
+		encoder_packet_reader_t *r = &q->reader[i];
+		if(r->active == 0)
+			continue;
+		if((int) (r->seq - upto) < 0)
+			upto = r->seq;
+		if(r->pinned && (int) (r->pinseq - upto) < 0)
+			upto = r->pinseq;
+	}
+	while(q->descfirst != upto) {
+		qp = pktqueue_desc(q, q->descfirst);
+		q->descfirst++;
+		// borrowed buffer: not in the queue buffer, but may carry the padding
+		if(qp->buf != NULL) {
+			av_buffer_unref(&qp->buf);
+			q->datasize -= qp->size;
+		} else {
+			q->head += qp->size;
+			q->datasize -= qp->size;
+		}
+		q->head += qp->padding;
+		q->datasize -= qp->padding;
+		if(q->head == q->bufsize) {
+			q->head = 0;
+		}
+		if(q->head == q->tail) {
+			q->head = q->tail = 0;
+		}
+	}
+	return;
+}
+
+/**
+ * Request a keyframe for a reader waiting for the next key packet.
+ *
+ * Without the request, the reader would wait for the next periodic keyframe.
+ * Requests are rate-limited by encoder_idr_poll().
+ */
+static void
+pktqueue_waitkey(encoder_packet_queue_t *q, encoder_packet_reader_t *r) {
+	int channelId = q - pktqueue;
+	if(r->waitkey && channelId < video_source_channels())
+		encoder_idr_request(channelId);
+	return;
+}
+
+/**
+ * Move a lagged reader to the next key packet.
+ *
+ * @param q [in] The packet queue, must be locked.
+ * @param r [in] The reader to be resynchronized.
+ *
+ * If no key packet is queued after the reader's current packet,
+ * the reader skips all the queued packets and waits for the next key packet,
+ * which is requested from the video encoder.
+ */
+static void
+pktqueue_resync(encoder_packet_queue_t *q, encoder_packet_reader_t *r) {
+	unsigned seq;
+	for(seq = r->seq + 1; seq != q->descnext; seq++) {
+		if(pktqueue_desc(q, seq)->flags & AV_PKT_FLAG_KEY)
+			break;
+	}
+	r->seq = seq;
+	r->offset = r->limit = 0;
+	r->waitkey = (seq == q->descnext) ? q->haskey : 0;
+	r->resyncs++;
+	pktqueue_waitkey(q, r);
+	return;
+}
+
+/**
+ * Close the eventfd of a packet queue, if it has been created.
+ *
+ * @param channelId [in] The channel id.
+ *
+ * The descriptor is closed after the encoder thread stops signaling it.
+ */
+static void
+pktqueue_close_eventfd(int channelId) {
+#ifdef __linux__
+	pktqueue_notify_t *n = &queue_cb[channelId];
+	int efd;
+	pthread_mutex_lock(&queue_cb_mutex);
+	if((efd = n->efd) > 0) {
+		n->efd = 0;
+		while(n->readers[0] > 0 || n->readers[1] > 0)
+			sched_yield();
+		close(efd);
+	}
+	pthread_mutex_unlock(&queue_cb_mutex);
+#endif
+	return;
+}
+
 /**
  * Empty packets stored in all packet queues.
  */
@@ -459,27 +739,149 @@ encoder_pktqueue_reset() {
  * Empty packets stored in a single packet queue.
  *
  * @param channelId [in] Chennel id.
+ *
+ * Active readers are kept, and they continue with the next appended packet.
+ * The eventfd of the queue is closed, see encoder_pktqueue_eventfd().
  */
 int
 encoder_pktqueue_reset_channel(int channelId) {
-	pthread_mutex_lock(&pktqueue[channelId].mutex);
-	pktlist[channelId].clear();
-	pktqueue[channelId].head = pktqueue[channelId].tail = 0;
-	pktqueue[channelId].datasize = 0;
-	pktqueue[channelId].bufsize = pktqueue_initqsize;
-	pthread_mutex_unlock(&pktqueue[channelId].mutex);
+	encoder_packet_queue_t *q = &pktqueue[channelId];
+	int i;
+	pthread_mutex_lock(&q->mutex);
+	for(i = 0; i < ENCODER_PKTQUEUE_MAX_READERS; i++) {
+		q->reader[i].seq = q->descnext;
+		q->reader[i].offset = q->reader[i].limit = 0;
+		q->reader[i].pinned = 0;
+	}
+	pktqueue_release(q, q->descnext);
+	q->head = q->tail = 0;
+	q->datasize = 0;
+	q->bufsize = pktqueue_initqsize;
+	pthread_mutex_unlock(&q->mutex);
+	pktqueue_close_eventfd(channelId);
 	return 0;
 }
 
 /**
- * Return the occupied size of a packet queue for a given channel.
+ * Open a reader for a packet queue.
+ *
+ * @param channelId [in] The channel id.
+ * @return The reader id, or -1 on error.
+ *
+ * Each reader has its own read cursor, so a slow reader does not
+ * affect the others.
+ * The first reader starts from the oldest queued packet.
+ * Other readers start from the next key packet, which is requested
+ * from the video encoder.
+ */
+int
+encoder_pktqueue_reader_open(int channelId) {
+	encoder_packet_queue_t *q = &pktqueue[channelId];
+	encoder_packet_reader_t *r;
+	int i;
+	pthread_mutex_lock(&q->mutex);
+	for(i = 0; i < ENCODER_PKTQUEUE_MAX_READERS; i++) {
+		if(q->reader[i].active == 0)
+			break;
+	}
+	if(i == ENCODER_PKTQUEUE_MAX_READERS) {
+		pthread_mutex_unlock(&q->mutex);
+		ga_error("encoder: packet queue #%d - too many readers\n", channelId);
+		return -1;
+	}
+	r = &q->reader[i];
+	bzero(r, sizeof(encoder_packet_reader_t));
+	if(q->nreaders == 0) {
+		r->seq = q->descfirst;
+	} else {
+		r->seq = q->descnext;
+		r->waitkey = q->haskey;
+		pktqueue_waitkey(q, r);
+	}
+	r->active = 1;
+	q->nreaders++;
+	pthread_mutex_unlock(&q->mutex);
+	ga_error("encoder: packet queue #%d reader #%d opened\n", channelId, i);
+	return i;
+}
+
+/**
+ * Close a packet queue reader.
+ *
+ * @param channelId [in] The channel id.
+ * @param readerId [in] The reader id.
+ */
+void
+encoder_pktqueue_reader_close(int channelId, int readerId) {
+	encoder_packet_queue_t *q = &pktqueue[channelId];
+	encoder_packet_reader_t *r = &q->reader[readerId];
+	pthread_mutex_lock(&q->mutex);
+	if(r->active) {
+		r->active = 0;
+		q->nreaders--;
+		if(q->nreaders > 0)
+			pktqueue_release(q, q->descnext);
+	}
+	pthread_mutex_unlock(&q->mutex);
+	ga_error("encoder: packet queue #%d reader #%d closed (%u resyncs)\n",
+		channelId, readerId, r->resyncs);
+	return;
+}
+
+/**
+ * Return the size of unread data of a packet queue reader.
  *
  * @param channelId [in] The channel id to be read.
- * @return The occupied size in bytes.
+ * @param readerId [in] The reader id.
+ * @return The size of packets not yet read by the reader in bytes.
+ *
+ * This is also the lag of the reader behind the encoder.
  */
 int
-encoder_pktqueue_size(int channelId) {
-	return pktqueue[channelId].datasize;
+encoder_pktqueue_size(int channelId, int readerId) {
+	encoder_packet_queue_t *q = &pktqueue[channelId];
+	encoder_packet_reader_t *r = &q->reader[readerId];
+	int size = 0;
+	pthread_mutex_lock(&q->mutex);
+	if(r->seq != q->descnext) {
+		size = (int) (q->bytes - pktqueue_desc(q, r->seq)->bytepos - r->offset);
+	}
+	pthread_mutex_unlock(&q->mutex);
+	return size;
+}
+
+/**
+ * Notify subscribers of a packet queue.
+ *
+ * @param channelId [in] The channel id.
+ */
+static void
+pktqueue_notify(int channelId) {
+	pktqueue_notify_t *n = &queue_cb[channelId];
+	int i, idx;
+	// pin the current snapshot
+	do {
+		idx = n->current;
+		n->readers[idx]++;
+		if(idx == n->current)
+			break;
+		n->readers[idx]--;
+	} while(1);
+	for(i = 0; i < n->ncb[idx]; i++) {
+		n->cb[idx][i](channelId);
+	}
+#ifdef __linux__
+	// the eventfd is not closed while a snapshot is pinned
+	int efd;
+	if((efd = n->efd) > 0) {
+		uint64_t one = 1;
+		if(write(efd, &one, sizeof(one)) < 0) {
+			// counter overflow (EAGAIN): the reader is already notified
+		}
+	}
+#endif
+	n->readers[idx]--;
+	return;
 }
 
 /**
@@ -493,29 +895,67 @@ encoder_pktqueue_size(int channelId) {
  *
  * The content of \a pkt is copied into the queue buffer, so it can be released
  * after returing from the function.
+ * If \a pkt is reference counted (\a pkt->buf is set), the queue keeps
+ * a reference to the packet buffer instead of copying the content.
+ * Its size still counts against the queue size.
+ *
+ * The packet is stored once and read by all the readers.
+ * If the queue is full, readers holding the oldest packets are resynchronized
+ * to the next key packet, so the other readers are not affected.
+ * A packet is dropped only if it is larger than the queue.
  */
 int
 encoder_pktqueue_append(int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv) {
 	encoder_packet_queue_t *q = &pktqueue[channelId];
 	encoder_packet_t qp;
-	map<qcallback_t,qcallback_t>::iterator mi;
-	int padding = 0;
+	int i, padding = 0;
+	if(pkt->size > q->bufsize) {
+		ga_error("encoder: packet queue #%d - packet too large, dropped (%d)\n",
+			channelId, pkt->size);
+		return -1;
+	}
 	pthread_mutex_lock(&q->mutex);
 size_check:
 	// size checking
-	if(q->datasize + pkt->size > q->bufsize) {
-		pthread_mutex_unlock(&q->mutex);
-		ga_error("encoder: packet queue #%d full, packet dropped (%d+%d)\n",
-			channelId, q->datasize, pkt->size);
-		return -1;
+	if(q->datasize + pkt->size > q->bufsize
+	|| q->descnext - q->descfirst > q->descmask) {
+		unsigned first = q->descfirst;
+		// free the oldest packet: resync readers that have not read it
+		for(i = 0; i < ENCODER_PKTQUEUE_MAX_READERS; i++) {
+			encoder_packet_reader_t *r = &q->reader[i];
+			if(r->active == 0 || r->seq != first)
+				continue;
+			pktqueue_resync(q, r);
+			ga_error("encoder: packet queue #%d full, reader #%d resynchronized\n",
+				channelId, i);
+		}
+		pktqueue_release(q, first + 1);
+		// the oldest packet is still being read
+		if(q->descfirst == first) {
+			pthread_mutex_unlock(&q->mutex);
+			ga_error("encoder: packet queue #%d full, packet dropped (%d+%d)\n",
+				channelId, q->datasize, pkt->size);
+			return -1;
+		}
+		goto size_check;
+	}
+	// reference counted: borrow the packet buffer
+	if(pkt->buf != NULL) {
+		if((qp.buf = av_buffer_ref(pkt->buf)) == NULL) {
+			pthread_mutex_unlock(&q->mutex);
+			ga_error("encoder: packet queue #%d - reference packet failed\n", channelId);
+			return -1;
+		}
+		qp.data = (char*) pkt->data;
+		goto append_packet;
 	}
 	// end-of-buffer space is not sufficient
 	if(q->bufsize - q->tail < pkt->size) {
-		if(pktlist[channelId].size() == 0) {
+		if(q->descfirst == q->descnext) {
 			q->datasize = q->tail = q->head = 0;
 		} else {
 			padding = q->bufsize - q->tail;
-			pktlist[channelId].back().padding = padding;
+			pktqueue_desc(q, q->descnext - 1)->padding += padding;
 			q->datasize += padding;
 			q->tail = 0;
 		}
@@ -524,6 +964,11 @@ size_check:
 	bcopy(pkt->data, q->buf + q->tail, pkt->size);
 	//
 	qp.data = q->buf + q->tail;
+	qp.buf = NULL;
+	q->tail += pkt->size;
+	if(q->tail == q->bufsize)
+		q->tail = 0;
+append_packet:
 	qp.size = pkt->size;
 	qp.pts_int64 = pkt->pts;
 	if(ptv != NULL) {
@@ -533,50 +978,72 @@ size_check:
 	}
 	//qp.pos = q->tail;
 	qp.padding = 0;
+	qp.flags = pkt->flags;
+	qp.bytepos = q->bytes;
+	if(pkt->flags & AV_PKT_FLAG_KEY)
+		q->haskey = 1;
 	//
-	q->tail += pkt->size;
 	q->datasize += pkt->size;
-	pktlist[channelId].push_back(qp);
-	//
-	if(q->tail == q->bufsize)
-		q->tail = 0;
+	q->bytes += pkt->size;
+	*pktqueue_desc(q, q->descnext) = qp;
+	q->descnext++;
 	//
 	pthread_mutex_unlock(&q->mutex);
 	// notify client
-	for(mi = queue_cb[channelId].begin(); mi != queue_cb[channelId].end(); mi++) {
-		mi->second(channelId);
-	}
+	pktqueue_notify(channelId);
 	//
 	return 0;
 }
 
 /**
- * Read the first packet from the packet queue.
+ * Read the next packet of a reader from the packet queue.
  *
  * @param channelId [in] The channel id.
+ * @param readerId [in] The reader id.
  * @param pkt [out] The pointer to stored a retrieved packet.
  * @return Pointer equal to \a pkt->data, or NULL or error.
  *
- * This funcion ONLY reads the first packet.
- * It DOES NOT remove the packet from the queue.
+ * This funcion ONLY reads the packet.
+ * It DOES NOT move the read cursor of the reader.
+ * The packet is kept in the queue until encoder_pktqueue_pop_front()
+ * is called by the reader.
  */
 char *
-encoder_pktqueue_front(int channelId, encoder_packet_t *pkt) {
+encoder_pktqueue_front(int channelId, int readerId, encoder_packet_t *pkt) {
 	encoder_packet_queue_t *q = &pktqueue[channelId];
+	encoder_packet_reader_t *r = &q->reader[readerId];
+	encoder_packet_t *qp;
 	pthread_mutex_lock(&q->mutex);
-	if(pktlist[channelId].size() == 0) {
+	// resynchronizing: skip packets until a key packet
+	if(r->waitkey) {
+		while(r->seq != q->descnext
+		&& (pktqueue_desc(q, r->seq)->flags & AV_PKT_FLAG_KEY) == 0)
+			r->seq++;
+		if(r->seq != q->descnext)
+			r->waitkey = 0;
+		pktqueue_release(q, q->descnext);
+	}
+	if(r->seq == q->descnext) {
 		pthread_mutex_unlock(&q->mutex);
 		return NULL;
 	}
-	*pkt = pktlist[channelId].front();
+	qp = pktqueue_desc(q, r->seq);
+	*pkt = *qp;
+	pkt->data = qp->data + r->offset;
+	pkt->size = (r->limit > 0 ? r->limit : qp->size) - r->offset;
+	pkt->padding = 0;
+	pkt->buf = NULL;
+	r->pinned = 1;
+	r->pinseq = r->seq;
 	pthread_mutex_unlock(&q->mutex);
 	return pkt->data;
 }
 
 /**
- * Split the first packet in the packet queue into two packets.
+ * Split the next packet of a reader into two packets.
  *
  * @param channelId [in] The channel id.
+ * @param readerId [in] The reader id.
  * @param offset [in] The point to split the packet data.
  *
  * This function is used when you do not have sufficient buffer to handle
@@ -589,74 +1056,106 @@ encoder_pktqueue_front(int channelId, encoder_packet_t *pkt) {
  * When this function returns, the first packet in the queue would hold
  * exact \a N bytes and the rest \a (M-N) bytes would be helded
  * in the second packet.
+ *
+ * The split only affects the given reader.
  */
 void
-encoder_pktqueue_split_packet(int channelId, char *offset) {
+encoder_pktqueue_split_packet(int channelId, int readerId, char *offset) {
 	encoder_packet_queue_t *q = &pktqueue[channelId];
-	encoder_packet_t *pkt, newpkt;
+	encoder_packet_reader_t *r = &q->reader[readerId];
+	encoder_packet_t *qp;
+	unsigned end;
 	pthread_mutex_lock(&q->mutex);
 	// has packet?
-	if(pktlist[channelId].size() == 0)
+	if(r->seq == q->descnext)
 		goto quit_split_packet;
-	pkt = &pktlist[channelId].front();
+	qp = pktqueue_desc(q, r->seq);
+	end = r->limit > 0 ? r->limit : qp->size;
 	// offset must be in the middle
-	if(offset <= pkt->data || offset >= pkt->data + pkt->size)
+	if(offset <= qp->data + r->offset || offset >= qp->data + end)
 		goto quit_split_packet;
-	// split the packet: the new one
-	newpkt = *pkt;
-	newpkt.size = offset - pkt->data;
-	newpkt.padding = 0;
-	//
-	pkt->data = offset;
-	pkt->size -= newpkt.size;
-	//
-	pktlist[channelId].push_front(newpkt);
-	//
-	pthread_mutex_unlock(&q->mutex);
-	return;
+	r->limit = offset - qp->data;
 quit_split_packet:
 	pthread_mutex_unlock(&q->mutex);
 	return;
 }
 
 /**
- * Remove the first packet from the queue.
+ * Remove the next packet of a reader from the queue.
  *
  * @parm channelId [in] The channel id.
+ * @param readerId [in] The reader id.
+ *
+ * The packet is released when all the readers have removed it.
  */
 void
-encoder_pktqueue_pop_front(int channelId) {
+encoder_pktqueue_pop_front(int channelId, int readerId) {
 	encoder_packet_queue_t *q = &pktqueue[channelId];
-	encoder_packet_t qp;
+	encoder_packet_reader_t *r = &q->reader[readerId];
 	pthread_mutex_lock(&q->mutex);
-	if(pktlist[channelId].size() == 0) {
-		pthread_mutex_unlock(&q->mutex);
-		return;
-	}
-	qp = pktlist[channelId].front();
-	pktlist[channelId].pop_front();
-	// update the packet queue
-	q->head += qp.size;
-	q->head += qp.padding;
-	q->datasize -= qp.size;
-	q->datasize -= qp.padding;
-	if(q->head == q->bufsize) {
-		q->head = 0;
+	// resynchronized after front: the packet has been skipped
+	if(r->pinned && r->pinseq != r->seq) {
+		r->pinned = 0;
+		goto quit_pop_front;
 	}
-	if(q->head == q->tail) {
-		q->head = q->tail = 0;
+	r->pinned = 0;
+	if(r->seq == q->descnext)
+		goto quit_pop_front;
+	// split packet: remove only the first part
+	if(r->limit > 0) {
+		r->offset = r->limit;
+		r->limit = 0;
+		goto quit_pop_front;
 	}
-	//
+	r->seq++;
+	r->offset = 0;
+quit_pop_front:
+	pktqueue_release(q, q->descnext);
 	pthread_mutex_unlock(&q->mutex);
 	return;
 }
 
+/**
+ * Publish a new callback list of a packet queue.
+ *
+ * @param channelId [in] The channel id.
+ * @param add [in] The callback function to be added, or NULL.
+ * @param remove [in] The callback function to be removed, or NULL.
+ * @return 0 on success, or -1 if the list is full.
+ *
+ * \a queue_cb_mutex must be locked.
+ */
+static int
+pktqueue_publish_callbacks(int channelId, qcallback_t add, qcallback_t remove) {
+	pktqueue_notify_t *n = &queue_cb[channelId];
+	int i, cur = n->current, next = 1 - cur;
+	// late readers of the previous snapshot
+	while(n->readers[next] > 0)
+		sched_yield();
+	n->ncb[next] = 0;
+	for(i = 0; i < n->ncb[cur]; i++) {
+		if(n->cb[cur][i] == remove || n->cb[cur][i] == add)
+			continue;
+		n->cb[next][n->ncb[next]++] = n->cb[cur][i];
+	}
+	if(add != NULL) {
+		if(n->ncb[next] == ENCODER_PKTQUEUE_MAX_CALLBACKS)
+			return -1;
+		n->cb[next][n->ncb[next]++] = add;
+	}
+	n->current = next;
+	// wait for readers of the old snapshot
+	while(n->readers[cur] > 0)
+		sched_yield();
+	return 0;
+}
+
 /**
  * Register a callback function for a packet queue.
  *
  * @param channelId [in] The channel id.
  * @param cb [in] Pointer to the callback function.
- * @return This function alywas return 0.
+ * @return 0 on success, or -1 if too many callbacks are registered.
  *
  * The callback function \a cb is called when a packet is appended into the
  * queue. The callback function must be in the form of:\n
@@ -664,10 +1163,19 @@ encoder_pktqueue_pop_front(int channelId) {
  *
  * Note that a packet queue can have multiple callback functions, and
  * all of them are called on packet appending.
+ * Callbacks are called from the encoder thread,
+ * and they must not register or unregister callbacks.
  */
 int
 encoder_pktqueue_register_callback(int channelId, qcallback_t cb) {
-	queue_cb[channelId][cb] = cb;
+	int ret;
+	pthread_mutex_lock(&queue_cb_mutex);
+	ret = pktqueue_publish_callbacks(channelId, cb, NULL);
+	pthread_mutex_unlock(&queue_cb_mutex);
+	if(ret < 0) {
+		ga_error("encoder: pktqueue #%d callback register failed - too many callbacks\n", channelId);
+		return -1;
+	}
 	ga_error("encoder: pktqueue #%d callback registered (%p)\n", channelId, cb);
 	return 0;
 }
@@ -678,10 +1186,47 @@ encoder_pktqueue_register_callback(int channelId, qcallback_t cb) {
  * @param channelId [in] The channel id.
  * @param cb [in] The callback function to be removed.
  * @return This functon always returns 0.
+ *
+ * The callback function is not called anymore when this function returns.
  */
 int
 encoder_pktqueue_unregister_callback(int channelId, qcallback_t cb) {
-	queue_cb[channelId].erase(cb);
+	pthread_mutex_lock(&queue_cb_mutex);
+	pktqueue_publish_callbacks(channelId, NULL, cb);
+	pthread_mutex_unlock(&queue_cb_mutex);
 	return 0;
 }
 
+/**
+ * Get an eventfd that is signaled when packets are appended to a queue.
+ *
+ * @param channelId [in] The channel id.
+ * @return The eventfd, or -1 if not supported.
+ *
+ * Sink servers can add the returned descriptor to their poll or epoll loops.
+ * The descriptor is non-blocking and its counter must be read to rearm it.
+ * It is created on the first call and shared by all the callers.
+ * It is closed when the queue is reset, e.g., after the last encoder client
+ * leaves, so sink servers have to get it again after a reset.
+ */
+int
+encoder_pktqueue_eventfd(int channelId) {
+#ifdef __linux__
+	pktqueue_notify_t *n = &queue_cb[channelId];
+	int efd;
+	pthread_mutex_lock(&queue_cb_mutex);
+	if((efd = n->efd) <= 0) {
+		if((efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+			pthread_mutex_unlock(&queue_cb_mutex);
+			ga_error("encoder: pktqueue #%d create eventfd failed\n", channelId);
+			return -1;
+		}
+		n->efd = efd;
+	}
+	pthread_mutex_unlock(&queue_cb_mutex);
+	return efd;
+#else
+	return -1;
+#endif
+}
+
@@ -42,8 +42,41 @@ typedef struct encoder_packet_s {
 	struct timeval pts_tv;	/**< Packet timestamp in \a timeval structure */
 	// internal data structure - do not touch
 	int padding;		/**< Padding area: internal used */
+	AVBufferRef *buf;	/**< Reference to the packet buffer,
+				 * or NULL if \a data is in the queue buffer */
+	int flags;		/**< Packet flags, e.g., AV_PKT_FLAG_KEY */
+	unsigned long long bytepos;	/**< Bytes appended before this packet */
 }	encoder_packet_t;
 
+/** Maximum number of callbacks of a packet queue. */
+#define	ENCODER_PKTQUEUE_MAX_CALLBACKS	16
+
+/** Maximum number of readers of a packet queue. */
+#define	ENCODER_PKTQUEUE_MAX_READERS	16
+
+/*
+ * Read cursor of a packet queue reader.
+ *
+ * Each reader reads all the packets independently.
+ * A packet is released when all the readers have read it.
+ */
+typedef struct encoder_packet_reader_s {
+	int active;		/**< The reader is opened */
+	int waitkey;		/**< Skip packets until a key packet */
+	unsigned seq;		/**< Sequence number of the next packet */
+	unsigned offset;	/**< Bytes of the next packet already read */
+	unsigned limit;		/**< Split point of the next packet, or 0 */
+	int pinned;		/**< The packet returned by front is in use */
+	unsigned pinseq;	/**< Sequence number of the pinned packet */
+	unsigned resyncs;	/**< Number of resynchronizations */
+}	encoder_packet_reader_t;
+
+/**
+ * Expected minimum packet size, used to size the packet descriptor ring.
+ * A queue of \a qsize bytes can hold qsize/ENCODER_PKTQUEUE_MINPKT packets.
+ */
+#define	ENCODER_PKTQUEUE_MINPKT	256
+
 typedef struct encoder_packet_queue_s {
 	pthread_mutex_t mutex;	/**< Per-queue mutex */
 	char *buf;		/**< Pointer to the packet queue buffer */
@@ -51,6 +84,14 @@ typedef struct encoder_packet_queue_s {
 	int datasize;		/**< Size of occupied data size */
 	int head;		/**< Position of queue head */
 	int tail;		/**< Position of queue tail */
+	encoder_packet_t *desc;	/**< Packet descriptor ring */
+	unsigned descmask;	/**< Size of the descriptor ring minus one */
+	unsigned descfirst;	/**< Sequence number of the first packet */
+	unsigned descnext;	/**< Sequence number of the next appended packet */
+	unsigned long long bytes;	/**< Total bytes appended */
+	int haskey;		/**< Key packets have been appended */
+	int nreaders;		/**< Number of active readers */
+	encoder_packet_reader_t reader[ENCODER_PKTQUEUE_MAX_READERS];
 }	encoder_packet_queue_t;
 
 typedef struct encoder_pts_s {
@@ -71,6 +112,9 @@ EXPORT ga_module_t *encoder_get_sinkserver();
 EXPORT int encoder_register_client(void *ctx);
 EXPORT int encoder_unregister_client(void *ctx);
 
+EXPORT int encoder_idr_request(int channelId);
+EXPORT int encoder_idr_poll(int channelId);
+
 EXPORT int encoder_send_packet(const char *prefix, int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv);
 
 // encoder pts to ptv mapping function
@@ -82,12 +126,15 @@ EXPORT struct timeval * encoder_ptv_get(unsigned queueid, long long pts, struct
 EXPORT int encoder_pktqueue_init(int channels, int qsize);
 EXPORT int encoder_pktqueue_reset();
 EXPORT int encoder_pktqueue_reset_channel(int channelId);
-EXPORT int encoder_pktqueue_size(int channelId);
+EXPORT int encoder_pktqueue_reader_open(int channelId);
+EXPORT void encoder_pktqueue_reader_close(int channelId, int readerId);
+EXPORT int encoder_pktqueue_size(int channelId, int readerId);
 EXPORT int encoder_pktqueue_append(int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv);
-EXPORT char * encoder_pktqueue_front(int channelId, encoder_packet_t *pkt);
-EXPORT void encoder_pktqueue_split_packet(int channelId, char *offset);
-EXPORT void encoder_pktqueue_pop_front(int channelId);
+EXPORT char * encoder_pktqueue_front(int channelId, int readerId, encoder_packet_t *pkt);
+EXPORT void encoder_pktqueue_split_packet(int channelId, int readerId, char *offset);
+EXPORT void encoder_pktqueue_pop_front(int channelId, int readerId);
 EXPORT int encoder_pktqueue_register_callback(int channelId, qcallback_t cb);
 EXPORT int encoder_pktqueue_unregister_callback(int channelId, qcallback_t cb);
+EXPORT int encoder_pktqueue_eventfd(int channelId);
 
 #endif
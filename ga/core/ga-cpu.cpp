@@ -0,0 +1,479 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * CPU budgets, thread affinity, and the shared worker pool: the implementation
+ *
+ * Cores in the configured cpu set are handed out as disjoint ranges:
+ * the audio encoder first, and then the conversion and the video
+ * encoder cores of each channel in order. Ranges wrap around and share
+ * cores when the budgets exceed the set.
+ *
+ * The worker pool is shared by all the channels. A caller posts a batch
+ * of jobs, works on its own batch, and returns when all the jobs are
+ * done, so batches from different channels run concurrently and a batch
+ * always completes even if no worker is free. A worker binds itself to
+ * the cores of the batch it takes a job from, and a batch never runs on
+ * more threads than the core budget of its channel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+#ifndef WIN32
+#include <unistd.h>
+#endif
+
+#include "ga-common.h"
+#include "ga-conf.h"
+#include "ga-cpu.h"
+
+static pthread_once_t cpu_once = PTHREAD_ONCE_INIT;
+static int cpu_list[GA_CPU_MAX];
+static int cpu_nlist = 0;
+static int cpu_affinity = 0;
+static int cpu_budget[GA_CPU_STAGES][GA_CPU_CHANNEL_MAX];
+static int cpu_first[GA_CPU_STAGES][GA_CPU_CHANNEL_MAX];
+static const char *cpu_stage_name[GA_CPU_STAGES] = { "convert", "video", "audio" };
+
+/**
+ * Get the number of online processors. This is an internal function.
+ */
+static int
+ga_cpu_online() {
+	int n;
+#ifdef WIN32
+	SYSTEM_INFO si;
+	GetSystemInfo(&si);
+	n = si.dwNumberOfProcessors;
+#else
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	if(n < 1)
+		n = 1;
+	if(n > GA_CPU_MAX)
+		n = GA_CPU_MAX;
+	return n;
+}
+
+/**
+ * Parse a cpu list like "0-3,8,10-11". This is an internal function.
+ *
+ * @return The number of cores in the list.
+ */
+static int
+ga_cpu_parse(const char *s, int *list, int n) {
+	int count = 0;
+	char *endptr;
+	while(*s != '\0' && count < n) {
+		long first, last;
+		while(isspace(*s) || *s == ',')
+			s++;
+		if(*s == '\0')
+			break;
+		first = strtol(s, &endptr, 10);
+		if(endptr == s || first < 0)
+			break;
+		last = first;
+		s = endptr;
+		while(isspace(*s))
+			s++;
+		if(*s == '-') {
+			s++;
+			last = strtol(s, &endptr, 10);
+			if(endptr == s || last < first)
+				break;
+			s = endptr;
+		}
+		while(first <= last && count < n)
+			list[count++] = first++;
+	}
+	return count;
+}
+
+/**
+ * Load the cpu set, the budgets, and the core layout. This is an internal function.
+ */
+static void
+ga_cpu_init() {
+	char buf[1024], key[64];
+	int stage, ch, off;
+	//
+	if(ga_conf_readv("cpu-set", buf, sizeof(buf)) != NULL)
+		cpu_nlist = ga_cpu_parse(buf, cpu_list, GA_CPU_MAX);
+	if(cpu_nlist <= 0) {
+		cpu_nlist = ga_cpu_online();
+		for(off = 0; off < cpu_nlist; off++)
+			cpu_list[off] = off;
+	}
+	cpu_affinity = ga_conf_readbool("cpu-affinity", 0);
+	// cpu-budget-<stage> = n0 [n1 ...]: the last value applies to the rest channels
+	for(stage = 0; stage < GA_CPU_STAGES; stage++) {
+		int vals[GA_CPU_CHANNEL_MAX];
+		int n;
+		snprintf(key, sizeof(key), "cpu-budget-%s", cpu_stage_name[stage]);
+		n = ga_conf_readints(key, vals, GA_CPU_CHANNEL_MAX);
+		for(ch = 0; ch < GA_CPU_CHANNEL_MAX; ch++) {
+			int v = n <= 0 ? 0 : vals[ch < n ? ch : n-1];
+			cpu_budget[stage][ch] = v > 0 ? v : 0;
+		}
+	}
+	// layout: audio (one channel), then convert and video of each channel
+	off = 0;
+	cpu_first[GA_CPU_AUDIO][0] = off;
+	off += cpu_budget[GA_CPU_AUDIO][0];
+	for(ch = 0; ch < GA_CPU_CHANNEL_MAX; ch++) {
+		cpu_first[GA_CPU_CONVERT][ch] = off;
+		off += cpu_budget[GA_CPU_CONVERT][ch];
+		cpu_first[GA_CPU_VIDEO][ch] = off;
+		off += cpu_budget[GA_CPU_VIDEO][ch];
+	}
+	for(ch = 1; ch < GA_CPU_CHANNEL_MAX; ch++)
+		cpu_first[GA_CPU_AUDIO][ch] = cpu_first[GA_CPU_AUDIO][0];
+	//
+	ga_error("cpu: %d cores in the cpu set, affinity %s.\n",
+		cpu_nlist, cpu_affinity ? "enabled" : "disabled");
+	return;
+}
+
+/**
+ * Get the number of cores in the configured cpu set.
+ *
+ * The set is specified by \em cpu-set, or all the online processors.
+ */
+int
+ga_cpu_count() {
+	pthread_once(&cpu_once, ga_cpu_init);
+	return cpu_nlist;
+}
+
+/**
+ * Get the core budget of a pipeline stage of a channel.
+ *
+ * @param stage [in] GA_CPU_CONVERT, GA_CPU_VIDEO, or GA_CPU_AUDIO.
+ * @param channel [in] The channel id.
+ * @return Number of cores, or 0 if the budget is not configured.
+ *
+ * The budgets are specified by \em cpu-budget-convert,
+ * \em cpu-budget-video, and \em cpu-budget-audio.
+ */
+int
+ga_cpu_budget(int stage, int channel) {
+	pthread_once(&cpu_once, ga_cpu_init);
+	if(stage < 0 || stage >= GA_CPU_STAGES
+	|| channel < 0 || channel >= GA_CPU_CHANNEL_MAX)
+		return 0;
+	return cpu_budget[stage][channel];
+}
+
+/**
+ * Restrict the calling thread to a list of cores. This is an internal function.
+ */
+static int
+ga_cpu_setaffinity(const int *cores, int n) {
+	int i;
+#ifdef __linux__
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for(i = 0; i < n; i++) {
+		if(cores[i] < CPU_SETSIZE)
+			CPU_SET(cores[i], &set);
+	}
+	if(sched_setaffinity(0, sizeof(set), &set) != 0)
+		return -1;
+#elif defined WIN32
+	DWORD_PTR mask = 0;
+	for(i = 0; i < n; i++) {
+		if(cores[i] < (int) (8 * sizeof(DWORD_PTR)))
+			mask |= ((DWORD_PTR) 1) << cores[i];
+	}
+	if(mask == 0 || SetThreadAffinityMask(GetCurrentThread(), mask) == 0)
+		return -1;
+#endif
+	return 0;
+}
+
+/**
+ * Bind the calling thread to the cores of a pipeline stage of a channel.
+ *
+ * @param stage [in] GA_CPU_CONVERT, GA_CPU_VIDEO, or GA_CPU_AUDIO.
+ * @param channel [in] The channel id.
+ * @return 0 on success, or -1 on failure.
+ *
+ * Nothing is done unless \em cpu-affinity is enabled.
+ * A stage without a budget is bound to the whole cpu set.
+ * Threads created afterwards by the calling thread inherit the binding.
+ */
+int
+ga_cpu_bind(int stage, int channel) {
+	int cores[GA_CPU_MAX];
+	int i, n, first;
+	pthread_once(&cpu_once, ga_cpu_init);
+	if(cpu_affinity == 0)
+		return 0;
+	if((n = ga_cpu_budget(stage, channel)) <= 0)
+		return ga_cpu_unbind();
+	first = cpu_first[stage][channel];
+	if(first + n > cpu_nlist) {
+		ga_error("cpu: %s channel %d shares cores with other stages (budgets exceed %d cores).\n",
+			cpu_stage_name[stage], channel, cpu_nlist);
+	}
+	if(n > cpu_nlist)
+		n = cpu_nlist;
+	for(i = 0; i < n; i++)
+		cores[i] = cpu_list[(first + i) % cpu_nlist];
+	if(ga_cpu_setaffinity(cores, n) < 0) {
+		ga_error("cpu: bind %s channel %d to %d cores failed.\n",
+			cpu_stage_name[stage], channel, n);
+		return -1;
+	}
+	return 0;
+}
+
+/**
+ * Allow the calling thread to run on the whole cpu set.
+ *
+ * @return 0 on success, or -1 on failure.
+ *
+ * Nothing is done unless \em cpu-affinity is enabled.
+ */
+int
+ga_cpu_unbind() {
+	pthread_once(&cpu_once, ga_cpu_init);
+	if(cpu_affinity == 0)
+		return 0;
+	return ga_cpu_setaffinity(cpu_list, cpu_nlist);
+}
+
+/**
+ * A batch of jobs posted to the shared worker pool
+ */
+typedef struct ga_workbatch_s {
+	ga_workpool_func_t func;
+	void *arg;
+	int stage;		/**< pipeline stage, or -1 if not bound */
+	int channel;
+	int njobs;
+	int next;		/**< index of the next job to be taken */
+	int pending;		/**< number of unfinished jobs */
+	int active;		/**< number of threads running jobs, including the caller */
+	int maxactive;		/**< core budget of the channel, or 0 if not limited */
+	struct ga_workbatch_s *link;	/**< next batch in the queue */
+}	ga_workbatch_t;
+
+static pthread_mutex_t workpool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t workpool_job_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t workpool_done_cond = PTHREAD_COND_INITIALIZER;
+static ga_workbatch_t *workpool_queue = NULL;	/**< batches with jobs not taken */
+static int workpool_target = 0;		/**< number of reserved workers */
+static int workpool_nthreads = 0;	/**< number of running workers */
+
+/**
+ * Take a job from a batch. This is an internal function.
+ *
+ * The pool mutex must be held. A batch is removed from
+ * the queue when its last job is taken.
+ */
+static int
+ga_workpool_take(ga_workbatch_t *b) {
+	int job = b->next++;
+	if(b->next == b->njobs) {
+		ga_workbatch_t **pp;
+		for(pp = &workpool_queue; *pp != NULL; pp = &(*pp)->link) {
+			if(*pp == b) {
+				*pp = b->link;
+				break;
+			}
+		}
+	}
+	return job;
+}
+
+/**
+ * Find the first queued batch that can run one more thread.
+ * This is an internal function.
+ *
+ * The pool mutex must be held.
+ */
+static ga_workbatch_t *
+ga_workpool_next() {
+	ga_workbatch_t *b;
+	for(b = workpool_queue; b != NULL; b = b->link) {
+		if(b->maxactive <= 0 || b->active < b->maxactive)
+			return b;
+	}
+	return NULL;
+}
+
+static void *
+ga_workpool_threadproc(void *arg) {
+	int stage = -1, channel = -1;	// current binding of the worker
+	ga_cpu_unbind();
+	pthread_mutex_lock(&workpool_mutex);
+	while(1) {
+		ga_workbatch_t *b;
+		int job;
+		while(workpool_nthreads <= workpool_target && (b = ga_workpool_next()) == NULL)
+			pthread_cond_wait(&workpool_job_cond, &workpool_mutex);
+		if(workpool_nthreads > workpool_target)
+			break;
+		job = ga_workpool_take(b);
+		b->active++;
+		pthread_mutex_unlock(&workpool_mutex);
+		// rebind only when the job comes from another stage or channel
+		if(b->stage != stage || b->channel != channel) {
+			if(b->stage < 0)
+				ga_cpu_unbind();
+			else
+				ga_cpu_bind(b->stage, b->channel);
+			stage = b->stage;
+			channel = b->channel;
+		}
+		b->func(b->arg, job);
+		pthread_mutex_lock(&workpool_mutex);
+		b->active--;
+		if(--b->pending == 0)
+			pthread_cond_broadcast(&workpool_done_cond);
+		else if(b->next < b->njobs)
+			pthread_cond_broadcast(&workpool_job_cond);
+	}
+	workpool_nthreads--;
+	pthread_mutex_unlock(&workpool_mutex);
+	return NULL;
+}
+
+/**
+ * Reserve workers in the shared worker pool.
+ *
+ * @param nthreads [in] Number of workers to be added to the pool.
+ * @return Number of workers actually added.
+ *
+ * Reservations from all the callers add up, so that batches
+ * posted by different channels can run at the same time.
+ * Reserved workers must be returned by ga_workpool_release().
+ */
+int
+ga_workpool_reserve(int nthreads) {
+	int added = 0;
+	if(nthreads <= 0)
+		return 0;
+	pthread_mutex_lock(&workpool_mutex);
+	while(added < nthreads) {
+		pthread_t t;
+		workpool_target++;
+		if(workpool_nthreads < workpool_target) {
+			if(pthread_create(&t, NULL, ga_workpool_threadproc, NULL) != 0) {
+				workpool_target--;
+				break;
+			}
+			pthread_detach(t);
+			workpool_nthreads++;
+		}
+		added++;
+	}
+	pthread_mutex_unlock(&workpool_mutex);
+	if(added < nthreads) {
+		ga_error("workpool: only %d of %d workers are created.\n", added, nthreads);
+	}
+	return added;
+}
+
+/**
+ * Return workers reserved by ga_workpool_reserve().
+ *
+ * Surplus workers exit after finishing their current jobs.
+ */
+void
+ga_workpool_release(int nthreads) {
+	if(nthreads <= 0)
+		return;
+	pthread_mutex_lock(&workpool_mutex);
+	workpool_target -= nthreads;
+	if(workpool_target < 0)
+		workpool_target = 0;
+	pthread_cond_broadcast(&workpool_job_cond);
+	pthread_mutex_unlock(&workpool_mutex);
+	return;
+}
+
+/**
+ * Run a batch of jobs on the shared worker pool.
+ *
+ * @param stage [in] Pipeline stage of the caller, or -1 if it is not bound.
+ * @param channel [in] The channel id of the caller.
+ * @param njobs [in] Number of jobs. Jobs are indexed from 0 to \a njobs-1.
+ * @param func [in] The job function.
+ * @param arg [in] Argument passed to \a func.
+ *
+ * The caller runs jobs of its own batch as well, and the function
+ * returns when all the jobs are done. Workers running the jobs are bound
+ * like ga_cpu_bind(\a stage, \a channel), and at most as many threads
+ * as the core budget of the stage, including the caller, run the batch.
+ */
+void
+ga_workpool_run(int stage, int channel, int njobs, ga_workpool_func_t func, void *arg) {
+	ga_workbatch_t batch, **pp;
+	int job;
+#ifndef ANDROID
+	int cancelstate;
+#endif
+	if(njobs <= 1) {
+		if(njobs == 1)
+			func(arg, 0);
+		return;
+	}
+	batch.func = func;
+	batch.arg = arg;
+	batch.stage = stage;
+	batch.channel = channel;
+	batch.njobs = njobs;
+	batch.next = 0;
+	batch.pending = njobs;
+	batch.active = 1;
+	batch.maxactive = stage >= 0 ? ga_cpu_budget(stage, channel) : 0;
+	batch.link = NULL;
+#ifndef ANDROID
+	// the workers must not be left with a batch of a cancelled caller
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cancelstate);
+#endif
+	pthread_mutex_lock(&workpool_mutex);
+	for(pp = &workpool_queue; *pp != NULL; pp = &(*pp)->link)
+		;
+	*pp = &batch;
+	pthread_cond_broadcast(&workpool_job_cond);
+	while(batch.next < batch.njobs) {
+		job = ga_workpool_take(&batch);
+		pthread_mutex_unlock(&workpool_mutex);
+		func(arg, job);
+		pthread_mutex_lock(&workpool_mutex);
+		batch.pending--;
+	}
+	while(batch.pending > 0)
+		pthread_cond_wait(&workpool_done_cond, &workpool_mutex);
+	pthread_mutex_unlock(&workpool_mutex);
+#ifndef ANDROID
+	pthread_setcancelstate(cancelstate, NULL);
+#endif
+	return;
+}
@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __GA_CPU_H__
+#define __GA_CPU_H__
+
+/**
+ * @file
+ * CPU budgets, thread affinity, and the shared worker pool: header
+ */
+
+#include "ga-common.h"
+
+/** Maximum number of cores in the cpu set */
+#define	GA_CPU_MAX		256
+/** Maximum number of channels that can have their own budgets */
+#define	GA_CPU_CHANNEL_MAX	8
+
+/** Pipeline stage: colorspace conversion */
+#define	GA_CPU_CONVERT		0
+/** Pipeline stage: video encoding */
+#define	GA_CPU_VIDEO		1
+/** Pipeline stage: audio encoding */
+#define	GA_CPU_AUDIO		2
+/** Number of pipeline stages */
+#define	GA_CPU_STAGES		3
+
+/** A job of the shared worker pool: \a job is the job index in its batch */
+typedef void (*ga_workpool_func_t)(void *arg, int job);
+
+EXPORT int	ga_cpu_count();
+EXPORT int	ga_cpu_budget(int stage, int channel);
+EXPORT int	ga_cpu_bind(int stage, int channel);
+EXPORT int	ga_cpu_unbind();
+EXPORT int	ga_workpool_reserve(int nthreads);
+EXPORT void	ga_workpool_release(int nthreads);
+EXPORT void	ga_workpool_run(int stage, int channel, int njobs, ga_workpool_func_t func, void *arg);
+
+#endif /* __GA_CPU_H__ */
@@ -0,0 +1,211 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * Frame buffer memory allocator: the implementation
+ *
+ * Frame buffers are large and long-lived, so they are allocated
+ * cache-line aligned by default, or mapped page by page when
+ * huge pages, page locking, prefaulting, or NUMA placement is requested.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef WIN32
+#include <malloc.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#endif
+#if defined __linux__ && !defined ANDROID
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#endif
+
+#include "ga-common.h"
+#include "ga-conf.h"
+#include "ga-memory.h"
+
+/** Flags that require page-granularity mapped memory */
+#define	GA_MEM_MAPPED	(GA_MEM_PAGE|GA_MEM_HUGEPAGE|GA_MEM_LOCK|GA_MEM_PREFAULT|GA_MEM_NUMA)
+
+/**
+ * Read frame buffer allocation flags from the configuration.
+ *
+ * @return GA_MEM_* flags.
+ *
+ * The parameters are \em frame-pool-hugepage, \em frame-pool-mlock,
+ * \em frame-pool-prefault, and \em frame-pool-numa.
+ */
+int
+ga_mem_conf_flags() {
+	int flags = GA_MEM_DEFAULT;
+	if(ga_conf_readbool("frame-pool-hugepage", 0) != 0)
+		flags |= GA_MEM_HUGEPAGE;
+	if(ga_conf_readbool("frame-pool-mlock", 0) != 0)
+		flags |= GA_MEM_LOCK;
+	if(ga_conf_readbool("frame-pool-prefault", 0) != 0)
+		flags |= GA_MEM_PREFAULT;
+	if(ga_conf_readbool("frame-pool-numa", 0) != 0)
+		flags |= GA_MEM_NUMA;
+	return flags;
+}
+
+/**
+ * Get the allocation granularity for given flags. This is an internal function.
+ */
+static size_t
+ga_mem_granularity(int flags) {
+	static size_t pagesize = 0;
+	if(flags & GA_MEM_HUGEPAGE)
+		return GA_MEM_HUGEPAGE_SIZE;
+	if(pagesize == 0) {
+#ifdef WIN32
+		SYSTEM_INFO si;
+		GetSystemInfo(&si);
+		pagesize = si.dwPageSize;
+#else
+		pagesize = sysconf(_SC_PAGESIZE);
+#endif
+	}
+	return pagesize;
+}
+
+/**
+ * Allocate a frame buffer.
+ *
+ * @param size [in] Requested memory space.
+ * @param flags [in] GA_MEM_* flags.
+ * @return Pointer to the allocated buffer, or NULL on failure.
+ *
+ * The returned pointer is at least GA_MEM_ALIGNMENT-byte aligned.
+ * Options that are not supported by the system are ignored.
+ * The buffer must be released by ga_mem_free() with the same \a size and \a flags.
+ */
+void *
+ga_mem_alloc(size_t size, int flags) {
+	void *ptr = NULL;
+	size_t len, gran, off;
+	//
+	if((flags & GA_MEM_MAPPED) == 0) {
+#ifdef WIN32
+		ptr = _aligned_malloc(size, GA_MEM_ALIGNMENT);
+#else
+		if(posix_memalign(&ptr, GA_MEM_ALIGNMENT, size) != 0)
+			ptr = NULL;
+#endif
+		return ptr;
+	}
+	//
+	gran = ga_mem_granularity(flags);
+	len = (size + gran - 1) / gran * gran;
+#ifdef WIN32
+	if((ptr = VirtualAlloc(NULL, len, MEM_RESERVE|MEM_COMMIT, PAGE_READWRITE)) == NULL)
+		return NULL;
+	if((flags & GA_MEM_LOCK) && VirtualLock(ptr, len) == 0)
+		ga_error("memory: lock %lu bytes failed.\n", (unsigned long) len);
+#else
+	ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if(flags & GA_MEM_HUGEPAGE)
+		ptr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+#endif
+	if(ptr == MAP_FAILED) {
+		if((ptr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		// no reserved huge pages: fall back to transparent huge pages
+		if(flags & GA_MEM_HUGEPAGE)
+			madvise(ptr, len, MADV_HUGEPAGE);
+#endif
+	}
+	// placement must be decided before the pages are touched
+	if(flags & GA_MEM_NUMA)
+		ga_mem_bind_local(ptr, len);
+	if((flags & GA_MEM_LOCK) && mlock(ptr, len) != 0)
+		ga_error("memory: lock %lu bytes failed (RLIMIT_MEMLOCK?).\n", (unsigned long) len);
+#endif
+	if(flags & GA_MEM_PREFAULT) {
+		for(off = 0; off < len; off += ga_mem_granularity(flags & ~GA_MEM_HUGEPAGE)) {
+			((volatile char*) ptr)[off] = 0;
+		}
+	}
+	return ptr;
+}
+
+/**
+ * Release a frame buffer allocated by ga_mem_alloc().
+ *
+ * @param ptr [in] Pointer to the buffer.
+ * @param size [in] The \a size passed to ga_mem_alloc().
+ * @param flags [in] The \a flags passed to ga_mem_alloc().
+ */
+void
+ga_mem_free(void *ptr, size_t size, int flags) {
+	size_t len, gran;
+	if(ptr == NULL)
+		return;
+	if((flags & GA_MEM_MAPPED) == 0) {
+#ifdef WIN32
+		_aligned_free(ptr);
+#else
+		free(ptr);
+#endif
+		return;
+	}
+	gran = ga_mem_granularity(flags);
+	len = (size + gran - 1) / gran * gran;
+#ifdef WIN32
+	if(flags & GA_MEM_LOCK)
+		VirtualUnlock(ptr, len);
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+	munmap(ptr, len);
+#endif
+	return;
+}
+
+/**
+ * Move the pages of a mapped buffer to the NUMA node of the calling thread.
+ *
+ * @param ptr [in] Pointer to a page-aligned buffer.
+ * @param size [in] Size of the buffer.
+ * @return The NUMA node id, or -1 if not supported or on failure.
+ *
+ * Pages not yet touched are allocated on the node when first used.
+ */
+int
+ga_mem_bind_local(void *ptr, size_t size) {
+#if defined __linux__ && !defined ANDROID && defined SYS_getcpu && defined SYS_mbind
+	unsigned cpu, node;
+	unsigned long nodemask;
+	if(syscall(SYS_getcpu, &cpu, &node, NULL) != 0)
+		return -1;
+	if(node >= sizeof(nodemask) * 8)
+		return -1;
+	nodemask = 1UL << node;
+	if(syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, &nodemask,
+			sizeof(nodemask) * 8, MPOL_MF_MOVE) != 0)
+		return -1;
+	return (int) node;
+#else
+	return -1;
+#endif
+}
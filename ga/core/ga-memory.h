@@ -0,0 +1,54 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __GA_MEMORY_H__
+#define __GA_MEMORY_H__
+
+/**
+ * @file
+ * Frame buffer memory allocator: header
+ */
+
+#include <stddef.h>
+
+#include "ga-common.h"
+
+/** Minimum alignment of allocated frame buffers: a cache line */
+#define	GA_MEM_ALIGNMENT	64
+/** Huge page size assumed for GA_MEM_HUGEPAGE allocations */
+#define	GA_MEM_HUGEPAGE_SIZE	(2*1024*1024)
+
+/** Allocation flags: cache-line aligned heap memory */
+#define	GA_MEM_DEFAULT		0x00
+/** Allocation flags: page-aligned, mapped memory */
+#define	GA_MEM_PAGE		0x01
+/** Allocation flags: backed by huge pages (MAP_HUGETLB, or transparent huge pages). Implies GA_MEM_PAGE */
+#define	GA_MEM_HUGEPAGE		0x02
+/** Allocation flags: lock the pages in memory (mlock). Implies GA_MEM_PAGE */
+#define	GA_MEM_LOCK		0x04
+/** Allocation flags: touch all the pages on allocation. Implies GA_MEM_PAGE */
+#define	GA_MEM_PREFAULT		0x08
+/** Allocation flags: place the pages on the NUMA node of the consuming thread. Implies GA_MEM_PAGE */
+#define	GA_MEM_NUMA		0x10
+
+EXPORT int	ga_mem_conf_flags();
+EXPORT void *	ga_mem_alloc(size_t size, int flags);
+EXPORT void	ga_mem_free(void *ptr, size_t size, int flags);
+EXPORT int	ga_mem_bind_local(void *ptr, size_t size);
+
+#endif /* __GA_MEMORY_H__ */
@@ -52,6 +52,7 @@ enum ga_module_types {
 enum ga_ioctl_commands {
 	GA_IOCTL_NULL = 0,		/**< Not used */
 	GA_IOCTL_RECONFIGURE,		/**< Reconfiguration */
+	GA_IOCTL_REQUEST_IDR,		/**< Request a keyframe (or an intra refresh) for loss recovery */
 	GA_IOCTL_GETSPS = 0x100,	/**< Get SPS: for H.264 and H.265 */
 	GA_IOCTL_GETPPS,		/**< Get PPS: for H.264 and H.265 */
 	GA_IOCTL_GETVPS,		/**< Get VPS: for H.265 */
@@ -97,6 +98,13 @@ typedef struct ga_ioctl_reconfigure_s {
 	int height;		/**< Height */
 }	ga_ioctl_reconfigure_t;
 
+/**
+ * Parameter for ioctl()'s keyframe request command.
+ */
+typedef struct ga_ioctl_request_idr_s {
+	int id;			/**< Video channel id */
+}	ga_ioctl_request_idr_t;
+
 #ifdef __cplusplus
 extern "C" {
 #endif
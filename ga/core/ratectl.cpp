@@ -0,0 +1,452 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * Server-side rate adaptation driven by client network reports: the implementation
+ *
+ * A policy updates a running target bitrate with each report. The controller
+ * clamps the target, ignores changes smaller than the hysteresis,
+ * applies decreases at once and increases no more often than the
+ * hold time, and lowers the framerate when the bitrate cannot give
+ * each frame enough bits per pixel.
+ *
+ * With several clients, reports are accumulated per client, and once per
+ * decision period the encoder follows the client with the lowest target,
+ * with the controller clock on the wall clock. A recorded trace has one
+ * client, and its clock is the sum of the report durations, so it
+ * replays to the same decisions.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <strings.h>
+#endif
+
+#include "ga-common.h"
+#include "ga-conf.h"
+#include "ratectl.h"
+
+/** Loss rate above which AIMD decreases the bitrate */
+#define	RATECTL_AIMD_LOSS	0.02
+/** AIMD multiplicative decrease factor */
+#define	RATECTL_AIMD_BETA	0.7
+/** AIMD additive increase per second, relative to the maximum bitrate */
+#define	RATECTL_AIMD_ALPHA	0.05
+/** GCC loss-based controller: decrease above, increase below */
+#define	RATECTL_GCC_LOSS_HIGH	0.10
+#define	RATECTL_GCC_LOSS_LOW	0.02
+/** GCC: never target above this share of the measured capacity */
+#define	RATECTL_GCC_CAPACITY	0.85
+/** A received rate below this share of the bitrate means the scene does not need more bits */
+#define	RATECTL_APP_LIMITED	0.5
+/** A client is forgotten after this many periods without reports */
+#define	RATECTL_CLIENT_EXPIRE	10
+
+/**
+ * AIMD: additive increase without loss, multiplicative decrease on loss.
+ */
+static double
+ratectl_aimd(ratectl_t *rc, const ratectl_report_t *r) {
+	if(r->lossrate > RATECTL_AIMD_LOSS)
+		return rc->targetKbps * RATECTL_AIMD_BETA;
+	return rc->targetKbps + rc->maxKbps * RATECTL_AIMD_ALPHA * r->duration;
+}
+
+/**
+ * GCC-like: the loss-based controller of Google congestion control,
+ * bounded by the measured capacity in place of the delay-based estimate.
+ */
+static double
+ratectl_gcc(ratectl_t *rc, const ratectl_report_t *r) {
+	double target = rc->targetKbps;
+	if(r->lossrate > RATECTL_GCC_LOSS_HIGH)
+		target *= 1.0 - 0.5 * r->lossrate;
+	else if(r->lossrate < RATECTL_GCC_LOSS_LOW)
+		target *= 1.05;
+	if(r->capacityKbps > 0 && target > r->capacityKbps * RATECTL_GCC_CAPACITY)
+		target = r->capacityKbps * RATECTL_GCC_CAPACITY;
+	return target;
+}
+
+static ratectl_policy_t ratectl_builtin[] = {
+	{ "aimd", ratectl_aimd },
+	{ "gcc", ratectl_gcc }
+};
+
+static const ratectl_policy_t *ratectl_policies[RATECTL_POLICY_MAX] = {
+	&ratectl_builtin[0],
+	&ratectl_builtin[1]
+};
+
+/**
+ * Register a rate control policy.
+ *
+ * @param policy [in] The policy. It must remain valid while in use.
+ * @return 0 on success, or -1 if there are too many policies.
+ *
+ * A policy with the name of a registered one replaces it.
+ */
+int
+ratectl_register_policy(const ratectl_policy_t *policy) {
+	int i;
+	for(i = 0; i < RATECTL_POLICY_MAX; i++) {
+		if(ratectl_policies[i] == NULL
+		|| strcasecmp(ratectl_policies[i]->name, policy->name) == 0) {
+			ratectl_policies[i] = policy;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+/**
+ * Find a rate control policy by name.
+ *
+ * @return The policy, or NULL if not found.
+ */
+const ratectl_policy_t *
+ratectl_find_policy(const char *name) {
+	int i;
+	for(i = 0; i < RATECTL_POLICY_MAX && ratectl_policies[i] != NULL; i++) {
+		if(strcasecmp(ratectl_policies[i]->name, name) == 0)
+			return ratectl_policies[i];
+	}
+	return NULL;
+}
+
+/**
+ * Initialize a rate controller from the configuration.
+ *
+ * @param rc [out] The controller.
+ * @param id [in] The video channel id.
+ * @param width [in] Encoded frame width.
+ * @param height [in] Encoded frame height.
+ * @return 0 on success, or -1 if rate adaptation is disabled or misconfigured.
+ *
+ * The policy is \em ratectl (aimd or gcc). The start bitrate is
+ * video-specific[b]. Other parameters are \em ratectl-min-kbps,
+ * \em ratectl-max-kbps, \em ratectl-min-fps, \em ratectl-min-bpp,
+ * \em ratectl-hysteresis (in percent), \em ratectl-hold-ms, and
+ * \em ratectl-period-ms.
+ */
+int
+ratectl_init(ratectl_t *rc, int id, int width, int height) {
+	char name[64];
+	double v;
+	int start;
+	//
+	bzero(rc, sizeof(ratectl_t));
+	if(ga_conf_readv("ratectl", name, sizeof(name)) == NULL
+	|| strcasecmp(name, "none") == 0)
+		return -1;
+	if((rc->policy = ratectl_find_policy(name)) == NULL) {
+		ga_error("ratectl: unknown policy '%s'.\n", name);
+		return -1;
+	}
+	rc->id = id;
+	rc->width = width;
+	rc->height = height;
+	//
+	if((start = ga_conf_mapreadint("video-specific", "b") / 1000) <= 0)
+		start = 3000;
+	if((rc->maxKbps = ga_conf_readint("ratectl-max-kbps")) <= 0)
+		rc->maxKbps = start;
+	if((rc->minKbps = ga_conf_readint("ratectl-min-kbps")) <= 0)
+		rc->minKbps = rc->maxKbps / 10 > 100 ? rc->maxKbps / 10 : 100;
+	if(rc->minKbps > rc->maxKbps)
+		rc->minKbps = rc->maxKbps;
+	rc->bitrateKbps = start < rc->minKbps ? rc->minKbps : (start > rc->maxKbps ? rc->maxKbps : start);
+	rc->targetKbps = rc->bitrateKbps;
+	//
+	if((rc->maxfps = ga_conf_readint("video-fps")) <= 0)
+		rc->maxfps = 24;
+	if((rc->minfps = ga_conf_readint("ratectl-min-fps")) <= 0 || rc->minfps > rc->maxfps)
+		rc->minfps = rc->maxfps;
+	rc->fps = rc->maxfps;
+	if((rc->minbpp = ga_conf_readdouble("ratectl-min-bpp")) <= 0)
+		rc->minbpp = 0.05;
+	if((v = ga_conf_readdouble("ratectl-hysteresis")) <= 0)
+		v = 10;
+	rc->hysteresis = v / 100.0;
+	if((v = ga_conf_readint("ratectl-hold-ms")) <= 0)
+		v = 2000;
+	rc->holdus = (long long) v * 1000LL;
+	if((v = ga_conf_readint("ratectl-period-ms")) <= 0)
+		v = 1000;
+	rc->periodus = (long long) v * 1000LL;
+	//
+	ga_error("ratectl: channel %d policy=%s; bitrate=%d (%d-%d) Kbps; fps=%d-%d; min-bpp=%.3f; hysteresis=%.0f%%; hold=%lldms; period=%lldms\n",
+		id, rc->policy->name, rc->bitrateKbps, rc->minKbps, rc->maxKbps,
+		rc->minfps, rc->maxfps, rc->minbpp, rc->hysteresis * 100,
+		rc->holdus / 1000, rc->periodus / 1000);
+	return 0;
+}
+
+/**
+ * Convert a network report to controller units. This is an internal function.
+ */
+static void
+ratectl_report(const ctrlmsg_system_netreport_t *msg, ratectl_report_t *r) {
+	r->duration = msg->duration / 1000000.0;
+	r->lossrate = msg->pktcount > 0 ? 1.0 * msg->pktloss / msg->pktcount : 0.0;
+	r->recvKbps = msg->bytecount * 8.0 / 1000.0 / r->duration;
+	r->capacityKbps = msg->capacity / 1000.0;
+	r->fps = msg->framecount / r->duration;
+	return;
+}
+
+/**
+ * Apply a policy target at the controller time. This is an internal function.
+ *
+ * @param rc [in] The controller.
+ * @param target [in] The target returned by the policy.
+ * @param r [in] The report the target is computed from.
+ * @param reconf [out] See ratectl_update().
+ * @return 1 if \a reconf has to be applied, or 0 otherwise.
+ */
+static int
+ratectl_decide(ratectl_t *rc, double target, const ratectl_report_t *r, ga_ioctl_reconfigure_t *reconf) {
+	int bitrate, fps;
+	// a static scene does not fill the current rate, so an increase could not be probed
+	if(target > rc->targetKbps && r->recvKbps < rc->bitrateKbps * RATECTL_APP_LIMITED)
+		target = rc->targetKbps;
+	if(target < rc->minKbps)
+		target = rc->minKbps;
+	if(target > rc->maxKbps)
+		target = rc->maxKbps;
+	rc->targetKbps = target;
+	// hysteresis: decrease at once, increase after the hold time
+	bitrate = rc->bitrateKbps;
+	if(target < rc->bitrateKbps * (1.0 - rc->hysteresis)
+	|| (target < rc->bitrateKbps && target == rc->minKbps)) {
+		bitrate = (int) target;
+	} else if((target > rc->bitrateKbps * (1.0 + rc->hysteresis)
+		|| (target > rc->bitrateKbps && target == rc->maxKbps))
+	&& rc->now - rc->lastincrease >= rc->holdus) {
+		bitrate = (int) target;
+		rc->lastincrease = rc->now;
+	}
+	// keep enough bits per pixel in each frame: trade framerate for quality
+	fps = rc->fps;
+	if(rc->minfps < rc->maxfps && rc->width > 0 && rc->height > 0) {
+		int want = (int) (bitrate * 1000.0 / (rc->width * rc->height * rc->minbpp));
+		if(want < rc->minfps)
+			want = rc->minfps;
+		if(want > rc->maxfps)
+			want = rc->maxfps;
+		if(want < rc->fps)
+			fps = want;
+		else if(want > rc->fps && bitrate > rc->bitrateKbps)
+			fps = want;
+	}
+	//
+	if(bitrate == rc->bitrateKbps && fps == rc->fps)
+		return 0;
+	if(bitrate != rc->bitrateKbps)
+		reconf->bitrateKbps = bitrate;
+	if(fps != rc->fps) {
+		reconf->framerate_n = fps;
+		reconf->framerate_d = 1;
+	}
+	rc->bitrateKbps = bitrate;
+	rc->fps = fps;
+	return 1;
+}
+
+/**
+ * Feed a network report to a rate controller.
+ *
+ * @param rc [in] The controller.
+ * @param msg [in] The report, in host byte order.
+ * @param reconf [out] The reconfiguration to be applied to the video
+ *	source (framerate) and the video encoder (bitrate and framerate).
+ *	Unchanged fields are zero.
+ * @return 1 if \a reconf has to be applied, or 0 otherwise.
+ *
+ * Reports are assumed to come from a single client, and the controller
+ * clock advances by their durations. This is used to replay a trace.
+ */
+int
+ratectl_update(ratectl_t *rc, const ctrlmsg_system_netreport_t *msg, ga_ioctl_reconfigure_t *reconf) {
+	ratectl_report_t r;
+	//
+	bzero(reconf, sizeof(ga_ioctl_reconfigure_t));
+	reconf->id = rc->id;
+	if(msg->duration == 0)
+		return 0;
+	ratectl_report(msg, &r);
+	rc->now += msg->duration;
+	rc->nreports++;
+	return ratectl_decide(rc, rc->policy->update(rc, &r), &r, reconf);
+}
+
+/**
+ * Find or allocate the state of a client. This is an internal function.
+ *
+ * Clients silent for RATECTL_CLIENT_EXPIRE periods are forgotten;
+ * if all the slots are taken, the least recently seen client is replaced.
+ */
+static ratectl_client_t *
+ratectl_client(ratectl_t *rc, unsigned long long id, long long nowus) {
+	ratectl_client_t *c, *slot = NULL;
+	int i;
+	for(i = 0; i < RATECTL_CLIENT_MAX; i++) {
+		c = &rc->client[i];
+		if(c->inuse && c->id == id)
+			return c;
+		if(c->inuse && nowus - c->lastseen > RATECTL_CLIENT_EXPIRE * rc->periodus)
+			c->inuse = 0;
+		if(c->inuse == 0) {
+			if(slot == NULL || slot->inuse)
+				slot = c;
+		} else if(slot == NULL || (slot->inuse && c->lastseen < slot->lastseen)) {
+			slot = c;
+		}
+	}
+	bzero(slot, sizeof(ratectl_client_t));
+	slot->inuse = 1;
+	slot->id = id;
+	return slot;
+}
+
+/**
+ * Feed a network report of a client to a rate controller.
+ *
+ * @param rc [in] The controller.
+ * @param client [in] Identity of the client, e.g., its address and port.
+ * @param nowus [in] Wall-clock time, in microseconds.
+ * @param msg [in] The report, in host byte order.
+ * @param reconf [out] See ratectl_update().
+ * @return 1 if \a reconf has to be applied, or 0 otherwise.
+ *
+ * Reports are accumulated per client. Once per \em ratectl-period-ms,
+ * the policy is run on the accumulated report of each client, and the
+ * lowest target drives the shared encoder, so the worst client decides.
+ */
+int
+ratectl_update_client(ratectl_t *rc, unsigned long long client, long long nowus,
+		const ctrlmsg_system_netreport_t *msg, ga_ioctl_reconfigure_t *reconf) {
+	ratectl_client_t *c;
+	ratectl_report_t r, worst;
+	double target = 0, t;
+	int i, n = 0;
+	//
+	bzero(reconf, sizeof(ga_ioctl_reconfigure_t));
+	reconf->id = rc->id;
+	if(msg->duration == 0)
+		return 0;
+	c = ratectl_client(rc, client, nowus);
+	c->lastseen = nowus;
+	c->sum.duration += msg->duration;
+	c->sum.framecount += msg->framecount;
+	c->sum.pktcount += msg->pktcount;
+	c->sum.pktloss += msg->pktloss;
+	c->sum.bytecount += msg->bytecount;
+	if(msg->capacity > 0 && (c->sum.capacity == 0 || msg->capacity < c->sum.capacity))
+		c->sum.capacity = msg->capacity;
+	rc->nreports++;
+	if(rc->periodstart == 0)
+		rc->periodstart = nowus;
+	if(nowus - rc->periodstart < rc->periodus)
+		return 0;
+	rc->periodstart = nowus;
+	rc->now = nowus;
+	// the worst client of the period
+	for(i = 0; i < RATECTL_CLIENT_MAX; i++) {
+		c = &rc->client[i];
+		if(c->inuse == 0 || c->sum.duration == 0)
+			continue;
+		ratectl_report(&c->sum, &r);
+		t = rc->policy->update(rc, &r);
+		if(n++ == 0 || t < target) {
+			target = t;
+			worst = r;
+		}
+		bzero(&c->sum, sizeof(c->sum));
+	}
+	if(n == 0)
+		return 0;
+	return ratectl_decide(rc, target, &worst, reconf);
+}
+
+/**
+ * Append a network report to a trace file.
+ *
+ * @return 0 on success, or -1 on failure.
+ *
+ * Each line holds duration (us), frame count, packet count,
+ * packet loss, byte count, and capacity (bps).
+ */
+int
+ratectl_record(FILE *fp, const ctrlmsg_system_netreport_t *msg) {
+	if(fprintf(fp, "%u %u %u %u %u %u\n",
+		msg->duration, msg->framecount, msg->pktcount,
+		msg->pktloss, msg->bytecount, msg->capacity) < 0)
+		return -1;
+	fflush(fp);
+	return 0;
+}
+
+/**
+ * Replay a recorded trace through a rate controller.
+ *
+ * @param rc [in] An initialized controller.
+ * @param trace [in] The trace written by ratectl_record(). Empty lines
+ *	and lines starting with '#' are ignored.
+ * @param out [in] Decisions are written here, one line per report.
+ * @return Number of reports replayed.
+ */
+int
+ratectl_replay(ratectl_t *rc, FILE *trace, FILE *out) {
+	char line[256];
+	int n = 0;
+	fprintf(out, "# time(s) loss(%%) recv(Kbps) capacity(Kbps) target(Kbps) bitrate(Kbps) fps reconfigured\n");
+	while(fgets(line, sizeof(line), trace) != NULL) {
+		ctrlmsg_system_netreport_t msg;
+		ga_ioctl_reconfigure_t reconf;
+		unsigned int v[6];
+		int changed;
+		if(line[0] == '#' || line[0] == '\n' || line[0] == '\r')
+			continue;
+		// fields of the packed message cannot be scanned into directly
+		if(sscanf(line, "%u %u %u %u %u %u",
+			&v[0], &v[1], &v[2], &v[3], &v[4], &v[5]) != 6) {
+			ga_error("ratectl: bad trace line: %s", line);
+			continue;
+		}
+		bzero(&msg, sizeof(msg));
+		msg.duration = v[0];
+		msg.framecount = v[1];
+		msg.pktcount = v[2];
+		msg.pktloss = v[3];
+		msg.bytecount = v[4];
+		msg.capacity = v[5];
+		changed = ratectl_update(rc, &msg, &reconf);
+		fprintf(out, "%.3f %.2f %.1f %.1f %.1f %d %d %d\n",
+			rc->now / 1000000.0,
+			msg.pktcount > 0 ? 100.0 * msg.pktloss / msg.pktcount : 0.0,
+			msg.duration > 0 ? msg.bytecount * 8000.0 / msg.duration : 0.0,
+			msg.capacity / 1000.0,
+			rc->targetKbps, rc->bitrateKbps, rc->fps, changed);
+		n++;
+	}
+	return n;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * Server-side rate adaptation driven by client network reports: header
+ */
+
+#ifndef __RATECTL_H__
+#define __RATECTL_H__
+
+#include <stdio.h>
+
+#include "ga-common.h"
+#include "ga-module.h"
+#include "ctrl-msg.h"
+
+/** Maximum number of registered rate control policies */
+#define	RATECTL_POLICY_MAX	8
+/** Maximum number of clients tracked by a rate controller */
+#define	RATECTL_CLIENT_MAX	16
+
+/**
+ * A network report in controller units
+ */
+typedef struct ratectl_report_s {
+	double duration;	/**< report period, in seconds */
+	double lossrate;	/**< packet loss rate, 0-1 */
+	double recvKbps;	/**< received rate, in Kbps */
+	double capacityKbps;	/**< measured capacity, in Kbps; 0 if unknown */
+	double fps;		/**< received frames per second */
+}	ratectl_report_t;
+
+/**
+ * Reports of a client in the current decision period
+ */
+typedef struct ratectl_client_s {
+	int inuse;
+	unsigned long long id;	/**< client identity, e.g., its address and port */
+	long long lastseen;	/**< wall-clock time of the last report, in microseconds */
+	ctrlmsg_system_netreport_t sum;	/**< reports accumulated in the period */
+}	ratectl_client_t;
+
+struct ratectl_s;
+
+/**
+ * A rate control policy. \a update returns the new target bitrate
+ * (in Kbps) from the current one (targetKbps) and a report; the
+ * controller clamps it, applies hysteresis, and decides the framerate.
+ */
+typedef struct ratectl_policy_s {
+	const char *name;
+	double (*update)(struct ratectl_s *rc, const ratectl_report_t *report);
+}	ratectl_policy_t;
+
+/**
+ * Rate controller state of a video channel
+ */
+typedef struct ratectl_s {
+	const ratectl_policy_t *policy;
+	int id;			/**< video channel id */
+	// limits
+	int minKbps, maxKbps;
+	int minfps, maxfps;
+	int width, height;
+	double minbpp;		/**< minimum bits per pixel per frame before the framerate is lowered */
+	double hysteresis;	/**< minimum relative change to be applied */
+	long long holdus;	/**< minimum interval between two increases */
+	long long periodus;	/**< interval between two decisions driven by client reports */
+	// state
+	int bitrateKbps;	/**< applied bitrate */
+	int fps;		/**< applied framerate */
+	double targetKbps;	/**< running target, updated by the policy */
+	long long now;		/**< controller time, in microseconds: wall clock for
+				  ratectl_update_client(), sum of report durations for a replay */
+	long long lastincrease;	/**< controller time of the last increase */
+	long long periodstart;	/**< wall-clock start of the current decision period */
+	unsigned int nreports;
+	ratectl_client_t client[RATECTL_CLIENT_MAX];
+}	ratectl_t;
+
+EXPORT int	ratectl_register_policy(const ratectl_policy_t *policy);
+EXPORT const ratectl_policy_t * ratectl_find_policy(const char *name);
+EXPORT int	ratectl_init(ratectl_t *rc, int id, int width, int height);
+EXPORT int	ratectl_update(ratectl_t *rc, const ctrlmsg_system_netreport_t *msg, ga_ioctl_reconfigure_t *reconf);
+EXPORT int	ratectl_update_client(ratectl_t *rc, unsigned long long client, long long nowus,
+			const ctrlmsg_system_netreport_t *msg, ga_ioctl_reconfigure_t *reconf);
+EXPORT int	ratectl_record(FILE *fp, const ctrlmsg_system_netreport_t *msg);
+EXPORT int	ratectl_replay(ratectl_t *rc, FILE *trace, FILE *out);
+
+#endif /* __RATECTL_H__ */
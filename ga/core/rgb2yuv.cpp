@@ -0,0 +1,659 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * Same-size BGRA/RGBA to YUV420P conversion kernels: the implementation
+ *
+ * The conversion uses BT.601 limited-range coefficients (the swscale default)
+ * in 8-bit fixed point. Chroma is the average of each 2x2 block.
+ * Results may differ from swscale by one level,
+ * but all the kernels produce identical results.
+ *
+ * Kernels convert a pair of rows at a time. SIMD kernels handle
+ * the leftmost multiple of 16 (SSE2, NEON) or 32 (AVX2) pixels,
+ * and the scalar kernel handles the rest.
+ *
+ * Row pairs are independent, so a frame can be split into bands
+ * of even height and converted in parallel with identical results.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <strings.h>
+#endif
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define	RGB2YUV_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#endif
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define	RGB2YUV_NEON
+#include <arm_neon.h>
+#endif
+
+#ifdef __GNUC__
+#define	RGB2YUV_TARGET(isa)	__attribute__((target(isa)))
+#else
+#define	RGB2YUV_TARGET(isa)
+#endif
+
+#include "ga-common.h"
+#include "ga-cpu.h"
+#include "rgb2yuv.h"
+
+/** Convert a pair of source rows: \a src1 and \a y1 are NULL for the last odd row */
+typedef void (*rgb2yuv_row_t)(const unsigned char *src0, const unsigned char *src1,
+		unsigned char *y0, unsigned char *y1, unsigned char *u, unsigned char *v,
+		int width, int order);
+
+/** Conversion kernel description */
+typedef struct rgb2yuv_kernel_s {
+	const char *name;	/**< kernel name used in the configuration */
+	rgb2yuv_row_t row;	/**< row-pair conversion function */
+	int (*supported)();	/**< return non-zero if the running CPU supports the kernel */
+}	rgb2yuv_kernel_t;
+
+static rgb2yuv_kernel_t *kernel = NULL;
+
+#define	RGB2YUV_Y(r, g, b)	((( 66*(r) + 129*(g) +  25*(b) + 128) >> 8) + 16)
+#define	RGB2YUV_U(r, g, b)	(((-38*(r) -  74*(g) + 112*(b) + 128) >> 8) + 128)
+#define	RGB2YUV_V(r, g, b)	(((112*(r) -  94*(g) -  18*(b) + 128) >> 8) + 128)
+
+/**
+ * Scalar kernel: converts any width, starting from an even column.
+ */
+static void
+rgb2yuv_row_c(const unsigned char *src0, const unsigned char *src1,
+		unsigned char *y0, unsigned char *y1, unsigned char *u, unsigned char *v,
+		int width, int order) {
+	int x, ir = 2, ib = 0;
+	if(order == RGB2YUV_ORDER_RGBA) {
+		ir = 0;
+		ib = 2;
+	}
+	for(x = 0; x < width; x += 2) {
+		const unsigned char *p;
+		int i, n = 0, r = 0, g = 0, b = 0;
+		for(i = x; i < x + 2 && i < width; i++) {
+			p = src0 + (i<<2);
+			y0[i] = RGB2YUV_Y(p[ir], p[1], p[ib]);
+			r += p[ir]; g += p[1]; b += p[ib]; n++;
+			if(src1 == NULL)
+				continue;
+			p = src1 + (i<<2);
+			y1[i] = RGB2YUV_Y(p[ir], p[1], p[ib]);
+			r += p[ir]; g += p[1]; b += p[ib]; n++;
+		}
+		r = (r + (n>>1)) / n;
+		g = (g + (n>>1)) / n;
+		b = (b + (n>>1)) / n;
+		u[x>>1] = RGB2YUV_U(r, g, b);
+		v[x>>1] = RGB2YUV_V(r, g, b);
+	}
+	return;
+}
+
+static int
+rgb2yuv_supported_c() {
+	return 1;
+}
+
+#ifdef RGB2YUV_X86
+/**
+ * Dot products of 4 pixels with per-byte coefficients (c0, c1, c2, 0).
+ */
+RGB2YUV_TARGET("sse2")
+static inline __m128i
+rgb2yuv_dot4_sse2(__m128i px, __m128i coef) {
+	__m128i zero = _mm_setzero_si128();
+	__m128 lo = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpacklo_epi8(px, zero), coef));
+	__m128 hi = _mm_castsi128_ps(_mm_madd_epi16(_mm_unpackhi_epi8(px, zero), coef));
+	return _mm_add_epi32(
+		_mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2,0,2,0))),
+		_mm_castps_si128(_mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3,1,3,1))));
+}
+
+/**
+ * Scale and offset 4 dot products: (dot + 128) >> 8 + offset.
+ */
+RGB2YUV_TARGET("sse2")
+static inline __m128i
+rgb2yuv_scale4_sse2(__m128i dot, int offset) {
+	return _mm_add_epi32(
+		_mm_srai_epi32(_mm_add_epi32(dot, _mm_set1_epi32(128)), 8),
+		_mm_set1_epi32(offset));
+}
+
+/**
+ * Convert 16 pixels of a row to Y.
+ */
+RGB2YUV_TARGET("sse2")
+static inline void
+rgb2yuv_y16_sse2(const unsigned char *src, unsigned char *dst, __m128i coef) {
+	__m128i d0 = rgb2yuv_scale4_sse2(rgb2yuv_dot4_sse2(_mm_loadu_si128((const __m128i*) src), coef), 16);
+	__m128i d1 = rgb2yuv_scale4_sse2(rgb2yuv_dot4_sse2(_mm_loadu_si128((const __m128i*) (src+16)), coef), 16);
+	__m128i d2 = rgb2yuv_scale4_sse2(rgb2yuv_dot4_sse2(_mm_loadu_si128((const __m128i*) (src+32)), coef), 16);
+	__m128i d3 = rgb2yuv_scale4_sse2(rgb2yuv_dot4_sse2(_mm_loadu_si128((const __m128i*) (src+48)), coef), 16);
+	_mm_storeu_si128((__m128i*) dst,
+		_mm_packus_epi16(_mm_packs_epi32(d0, d1), _mm_packs_epi32(d2, d3)));
+	return;
+}
+
+/**
+ * Sum 2x2 blocks of 4 pixels of two rows, and round the sums to averages.
+ */
+RGB2YUV_TARGET("sse2")
+static inline __m128i
+rgb2yuv_sum4_sse2(__m128i p, __m128i q) {
+	__m128i zero = _mm_setzero_si128();
+	__m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(p, zero), _mm_unpacklo_epi8(q, zero));
+	__m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(p, zero), _mm_unpackhi_epi8(q, zero));
+	__m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+	return _mm_srli_epi16(_mm_add_epi16(sum, _mm_set1_epi16(2)), 2);
+}
+
+/**
+ * Average 8 pixels of two rows into 4 subsampled pixels.
+ * The rounding is the same as the scalar kernel.
+ */
+RGB2YUV_TARGET("sse2")
+static inline __m128i
+rgb2yuv_avg8_sse2(const unsigned char *src0, const unsigned char *src1) {
+	return _mm_packus_epi16(
+		rgb2yuv_sum4_sse2(
+			_mm_loadu_si128((const __m128i*) src0),
+			_mm_loadu_si128((const __m128i*) src1)),
+		rgb2yuv_sum4_sse2(
+			_mm_loadu_si128((const __m128i*) (src0+16)),
+			_mm_loadu_si128((const __m128i*) (src1+16))));
+}
+
+RGB2YUV_TARGET("sse2")
+static void
+rgb2yuv_row_sse2(const unsigned char *src0, const unsigned char *src1,
+		unsigned char *y0, unsigned char *y1, unsigned char *u, unsigned char *v,
+		int width, int order) {
+	int x = 0;
+	__m128i cy, cu, cv;
+	if(order == RGB2YUV_ORDER_RGBA) {
+		cy = _mm_setr_epi16(66, 129, 25, 0, 66, 129, 25, 0);
+		cu = _mm_setr_epi16(-38, -74, 112, 0, -38, -74, 112, 0);
+		cv = _mm_setr_epi16(112, -94, -18, 0, 112, -94, -18, 0);
+	} else {
+		cy = _mm_setr_epi16(25, 129, 66, 0, 25, 129, 66, 0);
+		cu = _mm_setr_epi16(112, -74, -38, 0, 112, -74, -38, 0);
+		cv = _mm_setr_epi16(-18, -94, 112, 0, -18, -94, 112, 0);
+	}
+	if(src1 != NULL) {
+		for(x = 0; x + 16 <= width; x += 16) {
+			const unsigned char *s0 = src0 + (x<<2);
+			const unsigned char *s1 = src1 + (x<<2);
+			__m128i c0, c1, d0, d1;
+			rgb2yuv_y16_sse2(s0, y0 + x, cy);
+			rgb2yuv_y16_sse2(s1, y1 + x, cy);
+			c0 = rgb2yuv_avg8_sse2(s0, s1);
+			c1 = rgb2yuv_avg8_sse2(s0 + 32, s1 + 32);
+			d0 = rgb2yuv_scale4_sse2(rgb2yuv_dot4_sse2(c0, cu), 128);
+			d1 = rgb2yuv_scale4_sse2(rgb2yuv_dot4_sse2(c1, cu), 128);
+			d0 = _mm_packs_epi32(d0, d1);
+			_mm_storel_epi64((__m128i*) (u + (x>>1)), _mm_packus_epi16(d0, d0));
+			d0 = rgb2yuv_scale4_sse2(rgb2yuv_dot4_sse2(c0, cv), 128);
+			d1 = rgb2yuv_scale4_sse2(rgb2yuv_dot4_sse2(c1, cv), 128);
+			d0 = _mm_packs_epi32(d0, d1);
+			_mm_storel_epi64((__m128i*) (v + (x>>1)), _mm_packus_epi16(d0, d0));
+		}
+	}
+	if(x < width) {
+		rgb2yuv_row_c(src0 + (x<<2), src1 ? src1 + (x<<2) : NULL,
+			y0 + x, y1 ? y1 + x : NULL, u + (x>>1), v + (x>>1),
+			width - x, order);
+	}
+	return;
+}
+
+/**
+ * Dot products of 8 pixels with per-byte coefficients (c0, c1, c2, 0).
+ */
+RGB2YUV_TARGET("avx2")
+static inline __m256i
+rgb2yuv_dot8_avx2(__m256i px, __m256i coef) {
+	__m256i zero = _mm256_setzero_si256();
+	// within each 128-bit lane: pixels (0,1) and (2,3)
+	return _mm256_hadd_epi32(
+		_mm256_madd_epi16(_mm256_unpacklo_epi8(px, zero), coef),
+		_mm256_madd_epi16(_mm256_unpackhi_epi8(px, zero), coef));
+}
+
+RGB2YUV_TARGET("avx2")
+static inline __m256i
+rgb2yuv_scale8_avx2(__m256i dot, int offset) {
+	return _mm256_add_epi32(
+		_mm256_srai_epi32(_mm256_add_epi32(dot, _mm256_set1_epi32(128)), 8),
+		_mm256_set1_epi32(offset));
+}
+
+/**
+ * Pack 16 values in two registers into ordered 16-bit integers.
+ */
+RGB2YUV_TARGET("avx2")
+static inline __m256i
+rgb2yuv_pack16_avx2(__m256i d0, __m256i d1) {
+	return _mm256_permute4x64_epi64(_mm256_packs_epi32(d0, d1), _MM_SHUFFLE(3,1,2,0));
+}
+
+/**
+ * Convert 32 pixels of a row to Y.
+ */
+RGB2YUV_TARGET("avx2")
+static inline void
+rgb2yuv_y32_avx2(const unsigned char *src, unsigned char *dst, __m256i coef) {
+	__m256i d0 = rgb2yuv_scale8_avx2(rgb2yuv_dot8_avx2(_mm256_loadu_si256((const __m256i*) src), coef), 16);
+	__m256i d1 = rgb2yuv_scale8_avx2(rgb2yuv_dot8_avx2(_mm256_loadu_si256((const __m256i*) (src+32)), coef), 16);
+	__m256i d2 = rgb2yuv_scale8_avx2(rgb2yuv_dot8_avx2(_mm256_loadu_si256((const __m256i*) (src+64)), coef), 16);
+	__m256i d3 = rgb2yuv_scale8_avx2(rgb2yuv_dot8_avx2(_mm256_loadu_si256((const __m256i*) (src+96)), coef), 16);
+	__m256i y = _mm256_packus_epi16(rgb2yuv_pack16_avx2(d0, d1), rgb2yuv_pack16_avx2(d2, d3));
+	_mm256_storeu_si256((__m256i*) dst, _mm256_permute4x64_epi64(y, _MM_SHUFFLE(3,1,2,0)));
+	return;
+}
+
+/**
+ * Sum 2x2 blocks of 8 pixels of two rows, and round the sums to averages.
+ */
+RGB2YUV_TARGET("avx2")
+static inline __m256i
+rgb2yuv_sum8_avx2(__m256i p, __m256i q) {
+	__m256i zero = _mm256_setzero_si256();
+	__m256i lo = _mm256_add_epi16(_mm256_unpacklo_epi8(p, zero), _mm256_unpacklo_epi8(q, zero));
+	__m256i hi = _mm256_add_epi16(_mm256_unpackhi_epi8(p, zero), _mm256_unpackhi_epi8(q, zero));
+	__m256i sum = _mm256_add_epi16(_mm256_unpacklo_epi64(lo, hi), _mm256_unpackhi_epi64(lo, hi));
+	return _mm256_srli_epi16(_mm256_add_epi16(sum, _mm256_set1_epi16(2)), 2);
+}
+
+/**
+ * Average 16 pixels of two rows into 8 subsampled pixels.
+ * The rounding is the same as the scalar kernel.
+ */
+RGB2YUV_TARGET("avx2")
+static inline __m256i
+rgb2yuv_avg16_avx2(const unsigned char *src0, const unsigned char *src1) {
+	__m256i c = _mm256_packus_epi16(
+		rgb2yuv_sum8_avx2(
+			_mm256_loadu_si256((const __m256i*) src0),
+			_mm256_loadu_si256((const __m256i*) src1)),
+		rgb2yuv_sum8_avx2(
+			_mm256_loadu_si256((const __m256i*) (src0+32)),
+			_mm256_loadu_si256((const __m256i*) (src1+32))));
+	// lanes hold subsampled pixels (0,1,4,5) and (2,3,6,7)
+	return _mm256_permutevar8x32_epi32(c, _mm256_setr_epi32(0, 1, 4, 5, 2, 3, 6, 7));
+}
+
+/**
+ * Convert 16 subsampled pixels to U or V.
+ */
+RGB2YUV_TARGET("avx2")
+static inline void
+rgb2yuv_uv16_avx2(__m256i c0, __m256i c1, unsigned char *dst, __m256i coef) {
+	__m256i d = rgb2yuv_pack16_avx2(
+			rgb2yuv_scale8_avx2(rgb2yuv_dot8_avx2(c0, coef), 128),
+			rgb2yuv_scale8_avx2(rgb2yuv_dot8_avx2(c1, coef), 128));
+	d = _mm256_permute4x64_epi64(_mm256_packus_epi16(d, d), _MM_SHUFFLE(0,0,2,0));
+	_mm_storeu_si128((__m128i*) dst, _mm256_castsi256_si128(d));
+	return;
+}
+
+RGB2YUV_TARGET("avx2")
+static void
+rgb2yuv_row_avx2(const unsigned char *src0, const unsigned char *src1,
+		unsigned char *y0, unsigned char *y1, unsigned char *u, unsigned char *v,
+		int width, int order) {
+	int x = 0;
+	__m256i cy, cu, cv;
+	if(order == RGB2YUV_ORDER_RGBA) {
+		cy = _mm256_setr_epi16(66, 129, 25, 0, 66, 129, 25, 0, 66, 129, 25, 0, 66, 129, 25, 0);
+		cu = _mm256_setr_epi16(-38, -74, 112, 0, -38, -74, 112, 0, -38, -74, 112, 0, -38, -74, 112, 0);
+		cv = _mm256_setr_epi16(112, -94, -18, 0, 112, -94, -18, 0, 112, -94, -18, 0, 112, -94, -18, 0);
+	} else {
+		cy = _mm256_setr_epi16(25, 129, 66, 0, 25, 129, 66, 0, 25, 129, 66, 0, 25, 129, 66, 0);
+		cu = _mm256_setr_epi16(112, -74, -38, 0, 112, -74, -38, 0, 112, -74, -38, 0, 112, -74, -38, 0);
+		cv = _mm256_setr_epi16(-18, -94, 112, 0, -18, -94, 112, 0, -18, -94, 112, 0, -18, -94, 112, 0);
+	}
+	if(src1 != NULL) {
+		for(x = 0; x + 32 <= width; x += 32) {
+			const unsigned char *s0 = src0 + (x<<2);
+			const unsigned char *s1 = src1 + (x<<2);
+			__m256i c0, c1;
+			rgb2yuv_y32_avx2(s0, y0 + x, cy);
+			rgb2yuv_y32_avx2(s1, y1 + x, cy);
+			c0 = rgb2yuv_avg16_avx2(s0, s1);
+			c1 = rgb2yuv_avg16_avx2(s0 + 64, s1 + 64);
+			rgb2yuv_uv16_avx2(c0, c1, u + (x>>1), cu);
+			rgb2yuv_uv16_avx2(c0, c1, v + (x>>1), cv);
+		}
+		_mm256_zeroupper();
+	}
+	if(x < width) {
+		rgb2yuv_row_sse2(src0 + (x<<2), src1 ? src1 + (x<<2) : NULL,
+			y0 + x, y1 ? y1 + x : NULL, u + (x>>1), v + (x>>1),
+			width - x, order);
+	}
+	return;
+}
+
+static int
+rgb2yuv_supported_sse2() {
+#if defined(__x86_64__) || defined(_M_X64)
+	return 1;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 1);
+	return (info[3] & (1<<26)) != 0;
+#elif defined(__GNUC__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse2");
+#else
+	return 0;
+#endif
+}
+
+static int
+rgb2yuv_supported_avx2() {
+#if defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if(info[0] < 7)
+		return 0;
+	__cpuid(info, 1);
+	// AVX and OSXSAVE, and the OS saves the YMM registers
+	if((info[2] & (1<<27)) == 0 || (info[2] & (1<<28)) == 0)
+		return 0;
+	if((_xgetbv(0) & 0x06) != 0x06)
+		return 0;
+	__cpuidex(info, 7, 0);
+	return (info[1] & (1<<5)) != 0;
+#elif defined(__GNUC__)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#else
+	return 0;
+#endif
+}
+#endif	/* RGB2YUV_X86 */
+
+#ifdef RGB2YUV_NEON
+static void
+rgb2yuv_row_neon(const unsigned char *src0, const unsigned char *src1,
+		unsigned char *y0, unsigned char *y1, unsigned char *u, unsigned char *v,
+		int width, int order) {
+	int x = 0;
+	int ir = 2, ib = 0;
+	if(order == RGB2YUV_ORDER_RGBA) {
+		ir = 0;
+		ib = 2;
+	}
+	if(src1 != NULL) {
+		for(x = 0; x + 16 <= width; x += 16) {
+			uint8x16x4_t p[2];
+			uint16x8_t s[3];
+			int16x8_t r, g, b, d;
+			int i;
+			p[0] = vld4q_u8(src0 + (x<<2));
+			p[1] = vld4q_u8(src1 + (x<<2));
+			for(i = 0; i < 2; i++) {
+				uint8x16_t R = p[i].val[ir], G = p[i].val[1], B = p[i].val[ib];
+				uint16x8_t lo, hi;
+				lo = vmull_u8(vget_low_u8(R), vdup_n_u8(66));
+				lo = vmlal_u8(lo, vget_low_u8(G), vdup_n_u8(129));
+				lo = vmlal_u8(lo, vget_low_u8(B), vdup_n_u8(25));
+				hi = vmull_u8(vget_high_u8(R), vdup_n_u8(66));
+				hi = vmlal_u8(hi, vget_high_u8(G), vdup_n_u8(129));
+				hi = vmlal_u8(hi, vget_high_u8(B), vdup_n_u8(25));
+				vst1q_u8((i == 0 ? y0 : y1) + x, vaddq_u8(
+					vcombine_u8(vrshrn_n_u16(lo, 8), vrshrn_n_u16(hi, 8)),
+					vdupq_n_u8(16)));
+			}
+			// 2x2 average
+			s[0] = vpadalq_u8(vpaddlq_u8(p[0].val[ir]), p[1].val[ir]);
+			s[1] = vpadalq_u8(vpaddlq_u8(p[0].val[1]), p[1].val[1]);
+			s[2] = vpadalq_u8(vpaddlq_u8(p[0].val[ib]), p[1].val[ib]);
+			r = vreinterpretq_s16_u16(vrshrq_n_u16(s[0], 2));
+			g = vreinterpretq_s16_u16(vrshrq_n_u16(s[1], 2));
+			b = vreinterpretq_s16_u16(vrshrq_n_u16(s[2], 2));
+			d = vmulq_n_s16(b, 112);
+			d = vmlsq_n_s16(d, g, 74);
+			d = vmlsq_n_s16(d, r, 38);
+			d = vaddq_s16(vrshrq_n_s16(d, 8), vdupq_n_s16(128));
+			vst1_u8(u + (x>>1), vqmovun_s16(d));
+			d = vmulq_n_s16(r, 112);
+			d = vmlsq_n_s16(d, g, 94);
+			d = vmlsq_n_s16(d, b, 18);
+			d = vaddq_s16(vrshrq_n_s16(d, 8), vdupq_n_s16(128));
+			vst1_u8(v + (x>>1), vqmovun_s16(d));
+		}
+	}
+	if(x < width) {
+		rgb2yuv_row_c(src0 + (x<<2), src1 ? src1 + (x<<2) : NULL,
+			y0 + x, y1 ? y1 + x : NULL, u + (x>>1), v + (x>>1),
+			width - x, order);
+	}
+	return;
+}
+
+static int
+rgb2yuv_supported_neon() {
+	return 1;
+}
+#endif	/* RGB2YUV_NEON */
+
+/** Available kernels, in the order of preference */
+static rgb2yuv_kernel_t kernels[] = {
+#ifdef RGB2YUV_X86
+	{ "avx2", rgb2yuv_row_avx2, rgb2yuv_supported_avx2 },
+	{ "sse2", rgb2yuv_row_sse2, rgb2yuv_supported_sse2 },
+#endif
+#ifdef RGB2YUV_NEON
+	{ "neon", rgb2yuv_row_neon, rgb2yuv_supported_neon },
+#endif
+	{ "c", rgb2yuv_row_c, rgb2yuv_supported_c },
+	{ NULL, NULL, NULL }
+};
+
+/**
+ * Select the conversion kernel.
+ *
+ * @param name [in] Kernel name: \em auto (or NULL), \em avx2, \em sse2,
+ *	\em neon, \em c, or \em swscale.
+ * @return The name of the selected kernel, or NULL if conversions
+ *	should be done by swscale.
+ *
+ * If the requested kernel is not available on the running CPU,
+ * the best available kernel is selected.
+ */
+const char *
+rgb2yuv_init(const char *name) {
+	rgb2yuv_kernel_t *k;
+	//
+	kernel = NULL;
+	if(name != NULL && strcasecmp(name, "swscale") == 0)
+		return NULL;
+	if(name != NULL && strcasecmp(name, "auto") != 0) {
+		for(k = kernels; k->name != NULL; k++) {
+			if(strcasecmp(name, k->name) == 0 && k->supported())
+				return (kernel = k)->name;
+		}
+		ga_error("rgb2yuv: kernel '%s' is not available, use the default.\n", name);
+	}
+	for(k = kernels; k->name != NULL; k++) {
+		if(k->supported())
+			return (kernel = k)->name;
+	}
+	return NULL;
+}
+
+/**
+ * Convert rows [\a y0, \a y1) of a frame. This is an internal function.
+ * \a y0 must be even.
+ */
+static void
+rgb2yuv_convert_rows(int order, const unsigned char *src, int srcstride,
+		int width, int height, int y0, int y1,
+		unsigned char **dst, const int *dststride) {
+	int y;
+	for(y = y0; y < y1; y += 2) {
+		int last = (y + 1 >= height);
+		kernel->row(src + y * srcstride,
+			last ? NULL : src + (y+1) * srcstride,
+			dst[0] + y * dststride[0],
+			last ? NULL : dst[0] + (y+1) * dststride[0],
+			dst[1] + (y>>1) * dststride[1],
+			dst[2] + (y>>1) * dststride[2],
+			width, order);
+	}
+	return;
+}
+
+/**
+ * Convert a BGRA or RGBA frame to a YUV420P frame of the same size.
+ *
+ * @param order [in] Source byte order: RGB2YUV_ORDER_BGRA or RGB2YUV_ORDER_RGBA.
+ * @param src [in] Pointer to the source frame.
+ * @param srcstride [in] Source stride in bytes.
+ * @param width [in] Frame width.
+ * @param height [in] Frame height.
+ * @param dst [in] Pointers to the Y, U, and V planes.
+ * @param dststride [in] Strides of the Y, U, and V planes.
+ * @return 0 on success, or -1 if no kernel is selected.
+ */
+int
+rgb2yuv_convert(int order, const unsigned char *src, int srcstride,
+		int width, int height, unsigned char **dst, const int *dststride) {
+	if(kernel == NULL)
+		return -1;
+	rgb2yuv_convert_rows(order, src, srcstride, width, height, 0, height, dst, dststride);
+	return 0;
+}
+
+/**
+ * Band-parallel conversion handle: a share of the process-wide worker pool
+ */
+struct rgb2yuv_pool_s {
+	int nthreads;		/**< number of bands: reserved workers + the caller */
+	int channel;		/**< channel whose conversion cores run the bands, or -1 */
+};
+
+/** A frame being converted in parallel */
+typedef struct rgb2yuv_frame_s {
+	int order;
+	const unsigned char *src;
+	int srcstride;
+	int width, height;
+	unsigned char **dst;
+	const int *dststride;
+	int bandheight;
+}	rgb2yuv_frame_t;
+
+/**
+ * Convert one band of a frame. This is an internal function.
+ */
+static void
+rgb2yuv_pool_band(void *arg, int band) {
+	rgb2yuv_frame_t *f = (rgb2yuv_frame_t*) arg;
+	int y0 = band * f->bandheight;
+	int y1 = y0 + f->bandheight;
+	if(y1 > f->height)
+		y1 = f->height;
+	if(y0 < y1) {
+		rgb2yuv_convert_rows(f->order, f->src, f->srcstride,
+			f->width, f->height, y0, y1, f->dst, f->dststride);
+	}
+	return;
+}
+
+/**
+ * Create a handle for band-parallel conversions.
+ *
+ * @param nthreads [in] Number of bands per frame, including the caller.
+ * @param channel [in] The channel id, or -1 if the workers are not bound.
+ * @return Pointer to the handle, or NULL if \a nthreads is less than 2 or on failure.
+ *
+ * \a nthreads - 1 workers are reserved in the shared worker pool,
+ * so handles of different channels convert frames concurrently.
+ * Bands of a frame run on the GA_CPU_CONVERT cores of \a channel.
+ */
+rgb2yuv_pool_t *
+rgb2yuv_pool_create(int nthreads, int channel) {
+	rgb2yuv_pool_t *pool;
+	if(nthreads < 2)
+		return NULL;
+	if((pool = (rgb2yuv_pool_t*) calloc(1, sizeof(rgb2yuv_pool_t))) == NULL)
+		return NULL;
+	pool->nthreads = 1 + ga_workpool_reserve(nthreads - 1);
+	pool->channel = channel;
+	return pool;
+}
+
+/**
+ * Release a handle and return its workers to the shared worker pool.
+ */
+void
+rgb2yuv_pool_destroy(rgb2yuv_pool_t *pool) {
+	if(pool == NULL)
+		return;
+	ga_workpool_release(pool->nthreads - 1);
+	free(pool);
+	return;
+}
+
+/**
+ * Convert a frame like rgb2yuv_convert(), with bands converted in parallel.
+ *
+ * @param pool [in] The conversion handle. If it is NULL, the frame is converted serially.
+ * @return 0 on success, or -1 if no kernel is selected.
+ *
+ * The caller converts bands as well, and the function returns
+ * when all the bands are done. The output is identical to rgb2yuv_convert().
+ */
+int
+rgb2yuv_convert_parallel(rgb2yuv_pool_t *pool, int order,
+		const unsigned char *src, int srcstride,
+		int width, int height, unsigned char **dst, const int *dststride) {
+	rgb2yuv_frame_t f;
+	int bandpairs;
+	if(kernel == NULL)
+		return -1;
+	if(pool == NULL || pool->nthreads < 2 || height < 2 * pool->nthreads)
+		return rgb2yuv_convert(order, src, srcstride, width, height, dst, dststride);
+	f.order = order;
+	f.src = src;
+	f.srcstride = srcstride;
+	f.width = width;
+	f.height = height;
+	f.dst = dst;
+	f.dststride = dststride;
+	// bands start at even rows
+	bandpairs = ((height + 1) / 2 + pool->nthreads - 1) / pool->nthreads;
+	f.bandheight = bandpairs * 2;
+	ga_workpool_run(pool->channel >= 0 ? GA_CPU_CONVERT : -1, pool->channel,
+		pool->nthreads, rgb2yuv_pool_band, &f);
+	return 0;
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#ifndef __RGB2YUV_H__
+#define __RGB2YUV_H__
+
+/**
+ * @file
+ * Same-size BGRA/RGBA to YUV420P conversion kernels: header
+ */
+
+/** Source byte order: B, G, R, A */
+#define	RGB2YUV_ORDER_BGRA	0
+/** Source byte order: R, G, B, A */
+#define	RGB2YUV_ORDER_RGBA	1
+
+#include "ga-common.h"
+
+typedef struct rgb2yuv_pool_s rgb2yuv_pool_t;
+
+EXPORT const char *	rgb2yuv_init(const char *kernel);
+EXPORT int		rgb2yuv_convert(int order, const unsigned char *src, int srcstride,
+			int width, int height, unsigned char **dst, const int *dststride);
+EXPORT rgb2yuv_pool_t *	rgb2yuv_pool_create(int nthreads, int channel);
+EXPORT void		rgb2yuv_pool_destroy(rgb2yuv_pool_t *pool);
+EXPORT int		rgb2yuv_convert_parallel(rgb2yuv_pool_t *pool, int order,
+			const unsigned char *src, int srcstride,
+			int width, int height, unsigned char **dst, const int *dststride);
+
+#endif
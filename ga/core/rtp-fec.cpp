@@ -0,0 +1,353 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * XOR parity forward error correction for RTP packets: the implementation
+ *
+ * The encoder works on packetized buffers: packets each prefixed with its
+ * length in 4 bytes (big-endian), as produced by dynamic packet buffers,
+ * and it produces parity packets in the same format.  The decoder keeps
+ * a window of recent media packets and rebuilds a lost packet from a
+ * parity packet and the other packets of its group.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <strings.h>
+#endif
+
+#include "ga-common.h"
+#include "rtp-fec.h"
+
+static inline unsigned short
+fec_rb16(const unsigned char *p) {
+	return (p[0] << 8) | p[1];
+}
+
+static inline unsigned int
+fec_rb32(const unsigned char *p) {
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void
+fec_wb16(unsigned char *p, unsigned short v) {
+	p[0] = v >> 8;
+	p[1] = v & 0x0ff;
+}
+
+static inline void
+fec_wb32(unsigned char *p, unsigned int v) {
+	p[0] = v >> 24;
+	p[1] = (v >> 16) & 0x0ff;
+	p[2] = (v >> 8) & 0x0ff;
+	p[3] = v & 0x0ff;
+}
+
+static inline void
+fec_xor(unsigned char *dst, const unsigned char *src, int len) {
+	int i;
+	for(i = 0; i < len; i++)
+		dst[i] ^= src[i];
+}
+
+/**
+ * Initialize a parity packet generator.
+ *
+ * @param enc [in] The generator.
+ * @param blocksize [in] Media packets per block, up to RTP_FEC_MAX_BLOCK.
+ * @param ratio [in] Parity packets per media packet, in (0, 1].
+ * @return 0 on success, or -1 on invalid parameters.
+ */
+int
+rtp_fec_encoder_init(rtp_fec_encoder_t *enc, int blocksize, double ratio) {
+	if(blocksize < 1 || ratio <= 0.0)
+		return -1;
+	bzero(enc, sizeof(rtp_fec_encoder_t));
+	enc->blocksize = blocksize > RTP_FEC_MAX_BLOCK ? RTP_FEC_MAX_BLOCK : blocksize;
+	enc->ratio = ratio > 1.0 ? 1.0 : ratio;
+	enc->seq = rand() & 0x0ffff;
+	return 0;
+}
+
+/**
+ * Release the output buffer of a parity packet generator.
+ */
+void
+rtp_fec_encoder_deinit(rtp_fec_encoder_t *enc) {
+	if(enc->buf != NULL)
+		free(enc->buf);
+	enc->buf = NULL;
+	enc->bufsize = 0;
+	return;
+}
+
+/* append the parity packets of a block to the output buffer */
+static int
+rtp_fec_protect(rtp_fec_encoder_t *enc, const unsigned char **pkt, const int *len, int n, int outlen) {
+	int p, i, j, k, maxpl, pl, need;
+	unsigned short lenxor, hdrxor;
+	unsigned char *q;
+	//
+	// ratio <= 1, so p <= n
+	enc->credit += n * enc->ratio;
+	p = (int) enc->credit;
+	enc->credit -= p;
+	if(p == 0) {
+		enc->packets += n;
+		return outlen;
+	}
+	for(maxpl = 0, i = 0; i < n; i++) {
+		if(len[i] - RTP_FEC_RTP_HEADER > maxpl)
+			maxpl = len[i] - RTP_FEC_RTP_HEADER;
+	}
+	need = outlen + p * (4 + RTP_FEC_RTP_HEADER + RTP_FEC_HEADER + maxpl);
+	if(need > enc->bufsize) {
+		unsigned char *buf;
+		if((buf = (unsigned char*) realloc(enc->buf, need * 2)) == NULL)
+			return -1;
+		enc->buf = buf;
+		enc->bufsize = need * 2;
+	}
+	for(j = 0; j < p; j++) {
+		for(pl = 0, k = j; k < n; k += p) {
+			if(len[k] - RTP_FEC_RTP_HEADER > pl)
+				pl = len[k] - RTP_FEC_RTP_HEADER;
+		}
+		q = enc->buf + outlen;
+		fec_wb32(q, RTP_FEC_RTP_HEADER + RTP_FEC_HEADER + pl);
+		q += 4;
+		// RTP header: timestamp of the block
+		q[0] = 0x80;
+		q[1] = RTP_FEC_PAYLOAD_TYPE;
+		fec_wb16(q+2, enc->seq++);
+		bcopy(pkt[0]+4, q+4, 4);
+		fec_wb32(q+8, RTP_FEC_SSRC(fec_rb32(pkt[0]+8)));
+		// FEC header and payload
+		q += RTP_FEC_RTP_HEADER;
+		fec_wb16(q, fec_rb16(pkt[0]+2));
+		q[2] = n;
+		q[3] = j;
+		q[4] = p;
+		q[5] = 0;
+		lenxor = hdrxor = 0;
+		bzero(q + RTP_FEC_HEADER, pl);
+		for(k = j; k < n; k += p) {
+			lenxor ^= len[k] - RTP_FEC_RTP_HEADER;
+			hdrxor ^= fec_rb16(pkt[k]);
+			fec_xor(q + RTP_FEC_HEADER, pkt[k] + RTP_FEC_RTP_HEADER, len[k] - RTP_FEC_RTP_HEADER);
+		}
+		fec_wb16(q+6, lenxor);
+		fec_wb16(q+8, hdrxor);
+		outlen += 4 + RTP_FEC_RTP_HEADER + RTP_FEC_HEADER + pl;
+		enc->parity++;
+	}
+	enc->packets += n;
+	return outlen;
+}
+
+/**
+ * Generate parity packets for a packetized buffer.
+ *
+ * RTCP packets, and packets that are too small or too large, are not
+ * protected.  A block ends when it is full, or at a change of timestamp,
+ * SSRC, or a gap in sequence numbers.
+ *
+ * @param enc [in] The generator.
+ * @param buf [in] Length-prefixed RTP packets.
+ * @param buflen [in] Size of \a buf.
+ * @param out [out] Length-prefixed parity packets, valid until the next call.
+ * @return Size of \a out, or -1 on memory allocation failure.
+ */
+int
+rtp_fec_encode(rtp_fec_encoder_t *enc, const unsigned char *buf, int buflen, unsigned char **out) {
+	const unsigned char *pkt[RTP_FEC_MAX_BLOCK];
+	int len[RTP_FEC_MAX_BLOCK];
+	const unsigned char *p;
+	int i, pktlen, n = 0, outlen = 0;
+	//
+	i = 0;
+	while(i + 4 <= buflen) {
+		pktlen = fec_rb32(&buf[i]);
+		p = &buf[i+4];
+		i += (4+pktlen);
+		if(i > buflen)
+			break;
+		if(pktlen < RTP_FEC_RTP_HEADER || pktlen > RTP_FEC_MAX_PACKET
+		|| (p[0] & 0xc0) != 0x80
+		|| (p[1] >= 200 && p[1] <= 204)		/* RTCP */
+		|| (p[1] & 0x7f) == RTP_FEC_PAYLOAD_TYPE)
+			continue;
+		if(n > 0 && (n == enc->blocksize
+		|| bcmp(p+4, pkt[0]+4, 8) != 0		/* timestamp and SSRC */
+		|| fec_rb16(p+2) != (unsigned short) (fec_rb16(pkt[0]+2) + n))) {
+			if((outlen = rtp_fec_protect(enc, pkt, len, n, outlen)) < 0)
+				return -1;
+			n = 0;
+		}
+		pkt[n] = p;
+		len[n] = pktlen;
+		n++;
+	}
+	if(n > 0 && (outlen = rtp_fec_protect(enc, pkt, len, n, outlen)) < 0)
+		return -1;
+	*out = enc->buf;
+	return outlen;
+}
+
+/**
+ * Create a packet recovery state.
+ */
+rtp_fec_decoder_t *
+rtp_fec_decoder_create() {
+	return (rtp_fec_decoder_t*) calloc(1, sizeof(rtp_fec_decoder_t));
+}
+
+/**
+ * Release a packet recovery state.
+ */
+void
+rtp_fec_decoder_destroy(rtp_fec_decoder_t *dec) {
+	if(dec != NULL)
+		free(dec);
+	return;
+}
+
+/**
+ * Forget all the kept media packets, e.g., on a change of SSRC.
+ */
+void
+rtp_fec_decoder_reset(rtp_fec_decoder_t *dec) {
+	int i;
+	for(i = 0; i < RTP_FEC_WINDOW; i++)
+		dec->slot[i].len = 0;
+	return;
+}
+
+/**
+ * Keep a received media packet.
+ */
+void
+rtp_fec_decoder_add(rtp_fec_decoder_t *dec, const unsigned char *pkt, int len) {
+	rtp_fec_slot_t *slot;
+	unsigned short seq;
+	if(len < RTP_FEC_RTP_HEADER || len > RTP_FEC_MAX_PACKET)
+		return;
+	seq = fec_rb16(pkt+2);
+	slot = &dec->slot[seq & (RTP_FEC_WINDOW-1)];
+	bcopy(pkt, slot->data, len);
+	slot->seq = seq;
+	slot->len = len;
+	slot->recovered = 0;
+	return;
+}
+
+/**
+ * Look up a kept (received or recovered) media packet.
+ *
+ * @param dec [in] The recovery state.
+ * @param seq [in] Sequence number of the packet.
+ * @param len [out] Length of the packet.
+ * @param recovered [out] If the packet is rebuilt from a parity packet.
+ * @return The packet, or NULL if it is not available.
+ */
+const unsigned char *
+rtp_fec_decoder_get(rtp_fec_decoder_t *dec, unsigned short seq, int *len, int *recovered) {
+	rtp_fec_slot_t *slot = &dec->slot[seq & (RTP_FEC_WINDOW-1)];
+	if(slot->len == 0 || slot->seq != seq)
+		return NULL;
+	if(len != NULL)
+		*len = slot->len;
+	if(recovered != NULL)
+		*recovered = slot->recovered;
+	return slot->data;
+}
+
+/**
+ * Recover a lost media packet with a parity packet.
+ * The recovered packet is kept, see rtp_fec_decoder_get().
+ *
+ * @param dec [in] The recovery state.
+ * @param pkt [in] The parity packet.
+ * @param len [in] Length of the parity packet.
+ * @param seq [out] Sequence number of the recovered packet.
+ * @return 1 if a packet is recovered, 0 if no packet of the group is lost,
+ *	or -1 if more than one packet of the group is lost or the parity
+ *	packet is malformed.
+ */
+int
+rtp_fec_decoder_recover(rtp_fec_decoder_t *dec, const unsigned char *pkt, int len, unsigned short *seq) {
+	const unsigned char *hdr = pkt + RTP_FEC_RTP_HEADER;
+	const unsigned char *data;
+	rtp_fec_slot_t *slot;
+	unsigned short base, lenxor, hdrxor, lost = 0;
+	int count, index, stride, pl, k, dlen, missing = 0;
+	//
+	if(!rtp_fec_is_parity(pkt, len))
+		return -1;
+	dec->parity++;
+	base = fec_rb16(hdr);
+	count = hdr[2];
+	index = hdr[3];
+	stride = hdr[4];
+	lenxor = fec_rb16(hdr+6);
+	hdrxor = fec_rb16(hdr+8);
+	pl = len - RTP_FEC_RTP_HEADER - RTP_FEC_HEADER;
+	if(count < 1 || count > RTP_FEC_MAX_BLOCK || stride < 1 || index >= stride)
+		return -1;
+	for(k = index; k < count; k += stride) {
+		unsigned short s = base + k;
+		if((data = rtp_fec_decoder_get(dec, s, &dlen, NULL)) == NULL) {
+			lost = s;
+			if(++missing > 1) {
+				dec->unrecoverable++;
+				return -1;
+			}
+			continue;
+		}
+		lenxor ^= dlen - RTP_FEC_RTP_HEADER;
+		hdrxor ^= fec_rb16(data);
+	}
+	if(missing == 0)
+		return 0;
+	if(lenxor > pl || RTP_FEC_RTP_HEADER + lenxor > RTP_FEC_MAX_PACKET)
+		return -1;
+	// the group spans less than the window: the slot is not in the group
+	slot = &dec->slot[lost & (RTP_FEC_WINDOW-1)];
+	fec_wb16(slot->data, hdrxor);
+	fec_wb16(slot->data+2, lost);
+	bcopy(pkt+4, slot->data+4, 4);
+	fec_wb32(slot->data+8, RTP_FEC_SSRC(fec_rb32(pkt+8)));
+	bcopy(hdr + RTP_FEC_HEADER, slot->data + RTP_FEC_RTP_HEADER, lenxor);
+	for(k = index; k < count; k += stride) {
+		unsigned short s = base + k;
+		if(s == lost || (data = rtp_fec_decoder_get(dec, s, &dlen, NULL)) == NULL)
+			continue;
+		dlen -= RTP_FEC_RTP_HEADER;
+		fec_xor(slot->data + RTP_FEC_RTP_HEADER, data + RTP_FEC_RTP_HEADER,
+			dlen < lenxor ? dlen : lenxor);
+	}
+	slot->seq = lost;
+	slot->len = RTP_FEC_RTP_HEADER + lenxor;
+	slot->recovered = 1;
+	dec->recovered++;
+	*seq = lost;
+	return 1;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * XOR parity forward error correction for RTP packets: header
+ *
+ * Media packets are protected in blocks of up to a configured number of
+ * packets that share the same timestamp.  A block of n packets gets p parity
+ * packets, the integer part of n * ratio plus the fraction carried over from
+ * the previous blocks, so the stream gets the configured ratio even if
+ * frames are small, and a block may get none.  Parity packet j is the XOR of
+ * packets j, j+p, j+2p, ... of the block, so a parity packet recovers one
+ * lost packet of its group, and a block recovers a burst of up to p
+ * consecutive losses.
+ *
+ * A parity packet is an RTP packet with payload type RTP_FEC_PAYLOAD_TYPE,
+ * the timestamp of the block, and a sequence number and an SSRC of its own
+ * (RTP_FEC_SSRC of the block), so receivers counting packets per SSRC do
+ * not see gaps in the media sequence numbers.
+ * The RTP header is followed by the FEC header (in network byte order):
+ *
+ *	base sequence number (16) | count (8) | index (8) | stride (8) |
+ *	reserved (8) | length XOR (16) | header XOR (16)
+ *
+ * and the XOR of the protected payloads, padded with zeros.  The payload
+ * of a packet is what follows its 12-byte RTP header, the length XOR is
+ * the XOR of the payload lengths, and the header XOR is the XOR of the
+ * first two bytes (version, flags, marker and payload type).  Receivers
+ * that do not know the payload type simply drop the parity packets.
+ */
+
+#ifndef __RTP_FEC_H__
+#define __RTP_FEC_H__
+
+#include "ga-common.h"
+
+/** RTP payload type of parity packets */
+#define	RTP_FEC_PAYLOAD_TYPE	127
+/** SSRC of parity packets from the SSRC of media packets, and vice versa */
+#define	RTP_FEC_SSRC(ssrc)	((ssrc) ^ 0x01)
+/** Size of the RTP header of protected and parity packets */
+#define	RTP_FEC_RTP_HEADER	12
+/** Size of the FEC header */
+#define	RTP_FEC_HEADER		10
+/** Largest media packet that is protected */
+#define	RTP_FEC_MAX_PACKET	2048
+/** Largest block, in media packets */
+#define	RTP_FEC_MAX_BLOCK	64
+/** Number of media packets kept by a decoder: must be a power of 2 */
+#define	RTP_FEC_WINDOW		512
+
+/**
+ * Parity packet generator of a stream
+ */
+typedef struct rtp_fec_encoder_s {
+	int blocksize;		/**< media packets per block */
+	double ratio;		/**< parity packets per media packet */
+	double credit;		/**< fraction of a parity packet carried to the next block */
+	unsigned short seq;	/**< sequence number of the next parity packet */
+	unsigned char *buf;	/**< output buffer */
+	int bufsize;
+	unsigned long long packets;	/**< protected media packets */
+	unsigned long long parity;	/**< generated parity packets */
+}	rtp_fec_encoder_t;
+
+/**
+ * A media packet kept by a decoder
+ */
+typedef struct rtp_fec_slot_s {
+	int len;		/**< packet length, or 0 if the slot is empty */
+	int recovered;		/**< rebuilt from a parity packet */
+	unsigned short seq;	/**< sequence number */
+	unsigned char data[RTP_FEC_MAX_PACKET];
+}	rtp_fec_slot_t;
+
+/**
+ * Packet recovery state of a stream
+ */
+typedef struct rtp_fec_decoder_s {
+	rtp_fec_slot_t slot[RTP_FEC_WINDOW];	/**< recent media packets, indexed by sequence number */
+	unsigned long long parity;	/**< received parity packets */
+	unsigned long long recovered;	/**< recovered media packets */
+	unsigned long long unrecoverable;	/**< parity groups with more than one loss */
+}	rtp_fec_decoder_t;
+
+/**
+ * Check if an RTP packet is a parity packet.
+ */
+static inline int rtp_fec_is_parity(const unsigned char *pkt, int len) {
+	return len >= RTP_FEC_RTP_HEADER + RTP_FEC_HEADER
+		&& (pkt[0] & 0xc0) == 0x80
+		&& (pkt[1] & 0x7f) == RTP_FEC_PAYLOAD_TYPE;
+}
+
+EXPORT int	rtp_fec_encoder_init(rtp_fec_encoder_t *enc, int blocksize, double ratio);
+EXPORT void	rtp_fec_encoder_deinit(rtp_fec_encoder_t *enc);
+EXPORT int	rtp_fec_encode(rtp_fec_encoder_t *enc, const unsigned char *buf, int buflen, unsigned char **out);
+EXPORT rtp_fec_decoder_t * rtp_fec_decoder_create();
+EXPORT void	rtp_fec_decoder_destroy(rtp_fec_decoder_t *dec);
+EXPORT void	rtp_fec_decoder_reset(rtp_fec_decoder_t *dec);
+EXPORT void	rtp_fec_decoder_add(rtp_fec_decoder_t *dec, const unsigned char *pkt, int len);
+EXPORT const unsigned char * rtp_fec_decoder_get(rtp_fec_decoder_t *dec, unsigned short seq, int *len, int *recovered);
+EXPORT int	rtp_fec_decoder_recover(rtp_fec_decoder_t *dec, const unsigned char *pkt, int len, unsigned short *seq);
+
+#endif /* __RTP_FEC_H__ */
@@ -38,9 +38,12 @@
 #include "ga-crc.h"
 
 /**< Video buffer allocation alignment: should be 2^n */
-#define	VSOURCE_ALIGNMENT	16
+#define	VSOURCE_ALIGNMENT	64
 /**< Video buffer allocation alignment mask: should be \em VSOURCE_ALIGNMENT-1 */
-#define	VSOURCE_ALIGNMENT_MASK	0x0f
+#define	VSOURCE_ALIGNMENT_MASK	0x3f
+
+/** Return the larger value of \a x and \a y */
+#define	max(x, y)	((x) > (y) ? (x) : (y))
 
 // embed colorcode feature
 #define	COLORCODE_MAX_DIGIT	10	/**< Maximum number of embedded color code digits */
@@ -58,6 +61,43 @@ static int gChannels;		/**< Total number of video channels */
 static vsource_t gVsource[VIDEO_SOURCE_CHANNEL_MAX];	/**< Video source */
 static dpipe_t *gPipe[VIDEO_SOURCE_CHANNEL_MAX];	/**< Video pipeline */
 
+/**
+ * Get the frame data size of the pipe buffers of a video source.
+ * This is an internal function.
+ *
+ * A buffer stores either a captured frame at the current resolution
+ * or a converted frame at the output resolution.
+ */
+static int
+vsource_pool_size(vsource_t *vs) {
+	return max(vs->curr_height * vs->curr_stride, vs->out_height * vs->out_stride);
+}
+
+/**
+ * Initialize a video frame with a given data size. This is an internal function.
+ */
+static vsource_frame_t *
+vsource_frame_setup(vsource_t *vs, vsource_frame_t *frame, int imgbufsize) {
+	int i;
+	int stride = max(vs->curr_stride, vs->out_stride);
+	//
+	bzero(frame, sizeof(vsource_frame_t));
+	//
+	for(i = 0; i < VIDEO_SOURCE_MAX_STRIDE; i++) {
+		frame->linesize[i] = stride;
+	}
+	frame->maxstride = stride;
+	frame->dirtycount = -1;
+	frame->tilecount = -1;
+	frame->imgbufsize = imgbufsize;
+	frame->imgbuf = ((unsigned char *) frame) + sizeof(vsource_frame_t);
+	frame->imgbuf += ga_alignment(frame->imgbuf, VSOURCE_ALIGNMENT);
+	//ga_error("XXX: frame=%p, imgbuf=%p, sizeof(vframe)=%d, bzero(%d)\n",
+	//	frame, frame->imgbuf, sizeof(vsource_frame_t), frame->imgbufsize);
+	bzero(frame->imgbuf, frame->imgbufsize);
+	return frame;
+}
+
 /**
  * Initialize a video frame
  *
@@ -67,16 +107,13 @@ static dpipe_t *gPipe[VIDEO_SOURCE_CHANNEL_MAX];	/**< Video pipeline */
  *
  * Note that video frame data is stored right after a video frame structure.
  * So the size of allocated video frame structure must be at least:
- * \em sizeof(vsource_frame_t)
- * + \em video-source-max-stride * \em video-source-max-height
- * + \em VSOURCE_ALIGNMENT.
+ * \em sizeof(vsource_frame_t) + video_source_mem_size().
  *
- * \a imgbufsize will be set to \em video-source-max-stride * \em video-source-max-height,
+ * \a imgbufsize will be set to the larger one of the current and the output frame size,
  * and \a imgbuf is pointed to an aligned memory address.
  */
 vsource_frame_t *
 vsource_frame_init(int channel, vsource_frame_t *frame) {
-	int i;
 	vsource_t *vs;
 	//
 	if(channel < 0 || channel >= VIDEO_SOURCE_CHANNEL_MAX)
@@ -86,19 +123,23 @@ vsource_frame_init(int channel, vsource_frame_t *frame) {
 	if(vs->max_width == 0)
 		return NULL;
 	//
-	bzero(frame, sizeof(vsource_frame_t));
-	//
-	for(i = 0; i < VIDEO_SOURCE_MAX_STRIDE; i++) {
-		frame->linesize[i] = vs->max_stride;
-	}
-	frame->maxstride = vs->max_stride;
-	frame->imgbufsize = vs->max_height * vs->max_stride;
-	frame->imgbuf = ((unsigned char *) frame) + sizeof(vsource_frame_t);
-	frame->imgbuf += ga_alignment(frame->imgbuf, VSOURCE_ALIGNMENT);
-	//ga_error("XXX: frame=%p, imgbuf=%p, sizeof(vframe)=%d, bzero(%d)\n",
-	//	frame, frame->imgbuf, sizeof(vsource_frame_t), frame->imgbufsize);
-	bzero(frame->imgbuf, frame->imgbufsize);
-	return frame;
+	return vsource_frame_setup(vs, frame, vsource_pool_size(vs));
+}
+
+/**
+ * Initialize a video frame reallocated by dpipe_resize(). This is an internal function.
+ *
+ * The frame data size is derived from the buffer, which may have been
+ * reallocated before the video source is resized again.
+ */
+static void
+vsource_frame_reinit(dpipe_t *dpipe, dpipe_buffer_t *buffer) {
+	vsource_t *vs = video_source(dpipe->channel_id);
+	if(vs == NULL)
+		return;
+	vsource_frame_setup(vs, (vsource_frame_t*) buffer->pointer,
+		buffer->size - sizeof(vsource_frame_t) - VSOURCE_ALIGNMENT);
+	return;
 }
 
 /**
@@ -129,6 +170,17 @@ vsource_dup_frame(vsource_frame_t *src, vsource_frame_t *dst) {
 	dst->realheight = src->realheight;
 	dst->realstride = src->realstride;
 	dst->realsize = src->realsize;
+	dst->dirtycount = src->dirtycount;
+	for(j = 0; j < src->dirtycount; j++) {
+		dst->dirty[j] = src->dirty[j];
+	}
+	dst->tilecount = src->tilecount;
+	if(src->tilecount >= 0) {
+		dst->tilecols = src->tilecols;
+		dst->tilerows = src->tilerows;
+		dst->tilebase = src->tilebase;
+		bcopy(src->tilemap, dst->tilemap, (src->tilecols * src->tilerows + 7) / 8);
+	}
 	bcopy(src->imgbuf, dst->imgbuf, src->realstride * src->realheight/*dst->imgbufsize*/);
 	return;
 }
@@ -670,19 +722,70 @@ video_source_out_stride(int channel) {
 }
 
 /**
-  * Return the maximum memory size to store a frame (including size for alignment)
+  * Return the memory size to store a frame (including size for alignment)
   *
   * @param channel [in] The channel id
   * @return The size in bytes, or 0 if the given \a channel is not initialized
+  *
+  * The size follows the current and the output resolution,
+  * and it changes when the video source is resized, see video_source_resize().
   */
 int
 video_source_mem_size(int channel) {
 	vsource_t *vs = video_source(channel);
-	return vs == NULL ? 0 : (vs->max_height * vs->max_stride + VSOURCE_ALIGNMENT);
+	return vs == NULL ? 0 : (vsource_pool_size(vs) + VSOURCE_ALIGNMENT);
 }
 
-/** Return the larger value of \a x and \a y */
-#define	max(x, y)	((x) > (y) ? (x) : (y))
+/**
+ * Change the current resolution of a video source.
+ *
+ * @param channel [in] The channel id
+ * @param curr_width [in] The new video width.
+ * @param curr_height [in] The new video height.
+ * @param curr_stride [in] The new video stride.
+ * @return 0 on success, or -1 on error.
+ *
+ * This function should be called by the producer before it gets a frame
+ * of the new resolution from the pipe. All the pipes of the video source
+ * (see video_source_add_pipename()) are resized, and their frame buffers
+ * are reallocated one by one when they are free. The server is not restarted.
+ *
+ * The new resolution cannot exceed the maximum resolution,
+ * and the output resolution is not changed.
+ */
+int
+video_source_resize(int channel, int curr_width, int curr_height, int curr_stride) {
+	vsource_t *vs = video_source(channel);
+	pipename_t *p;
+	int size;
+	//
+	if(vs == NULL || curr_width <= 0 || curr_height <= 0 || curr_stride <= 0)
+		return -1;
+	if(curr_width > vs->max_width
+	|| curr_height > vs->max_height
+	|| curr_stride > vs->max_stride) {
+		ga_error("video source: resolution %dx%d exceeds max-resolution %dx%d\n",
+			curr_width, curr_height, vs->max_width, vs->max_height);
+		return -1;
+	}
+	if(curr_width == vs->curr_width
+	&& curr_height == vs->curr_height
+	&& curr_stride == vs->curr_stride)
+		return 0;
+	vs->curr_width  = curr_width;
+	vs->curr_height = curr_height;
+	vs->curr_stride = curr_stride;
+	size = sizeof(vsource_frame_t) + video_source_mem_size(channel);
+	for(p = vs->pipename; p != NULL; p = p->next) {
+		dpipe_t *pipe;
+		if((pipe = dpipe_lookup(p->name)) == NULL)
+			continue;
+		dpipe_resize(pipe, size, vsource_frame_reinit);
+	}
+	ga_error("video source: channel %d resized to %dx%d (stride=%d)\n",
+		channel, curr_width, curr_height, curr_stride);
+	return 0;
+}
 
 /**
  * The generic function to setup video sources.
@@ -746,9 +849,12 @@ video_source_setup_ex(vsource_config_t *config, int nConfig) {
 			vs->out_height  = vs->curr_height;
 			vs->out_stride  = vs->curr_stride;
 		}
-		// create pipe
-		gPipe[idx] = dpipe_create(idx, pipename, VIDEO_SOURCE_POOLSIZE,
-				sizeof(vsource_frame_t) + vs->max_height * vs->max_stride + VSOURCE_ALIGNMENT);
+		// create pipe: the other channels keep references to the frames
+		// of channel 0 (see dpipe_store_ref()), so channel 0 needs a pool
+		// for each channel to always have a free frame
+		gPipe[idx] = dpipe_create(idx, pipename,
+				idx == 0 ? VIDEO_SOURCE_POOLSIZE * nConfig : VIDEO_SOURCE_POOLSIZE,
+				sizeof(vsource_frame_t) + vsource_pool_size(vs) + VSOURCE_ALIGNMENT);
 		if(gPipe[idx] == NULL) {
 			ga_error("video source: init pipeline failed.\n");
 			return -1;
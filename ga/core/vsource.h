@@ -46,6 +46,12 @@
 #define	VIDEO_SOURCE_PIPEFORMAT		"video-%d"
 /** Define the default video source pipe pool size (frames in the pipe) */
 #define	VIDEO_SOURCE_POOLSIZE		8
+/** Define the maximum number of dirty rectangles carried by a video frame */
+#define	VIDEO_SOURCE_MAX_DIRTY		16
+/** Define the size of a tile in the changed-tile map: a macroblock */
+#define	VIDEO_SOURCE_TILE_SIZE		16
+/** Define the maximum number of tiles in the changed-tile map (4096x2304) */
+#define	VIDEO_SOURCE_MAX_TILES		((4096/VIDEO_SOURCE_TILE_SIZE)*(2304/VIDEO_SOURCE_TILE_SIZE))
 
 /**
  * Data structure to store a video frame in RGBA or YUV420 format.
@@ -66,6 +72,19 @@ typedef struct vsource_frame_s {
 	int realstride;		/**< stride for RGBA and BGRA video frame */
 	int realsize;		/**< Total size of the video frame data */
 	struct timeval timestamp;	/**< Captured timestamp */
+	int dirtycount;		/**< Number of rectangles in \a dirty:
+				 * 0 if the frame is the same as the previous one,
+				 * or -1 if unknown (the whole frame may change) */
+	struct gaRect dirty[VIDEO_SOURCE_MAX_DIRTY];	/**< Changed regions
+				 * since the previous frame of the channel */
+	int tilecount;		/**< Number of changed tiles in \a tilemap,
+				 * or -1 if the map is not available */
+	int tilecols;		/**< Number of tile columns in \a tilemap */
+	int tilerows;		/**< Number of tile rows in \a tilemap */
+	long long tilebase;	/**< \a imgpts of the frame that
+				 * \a tilemap is compared against */
+	unsigned char tilemap[VIDEO_SOURCE_MAX_TILES/8];	/**< Changed tiles,
+				 * one bit per tile in row-major order */
 	// internal data - should not change after initialized
 	int maxstride;		/**< */
 	int imgbufsize;		/**< Allocated video frame buffer size */
@@ -80,6 +99,11 @@ typedef struct vsource_frame_s {
 				 * XXX: NOT USED NOW. */
 }	vsource_frame_t;
 
+/** Test whether tile \a i of a video frame has changed */
+#define	vsource_tile_changed(frame, i)	(((frame)->tilemap[(i)>>3] >> ((i)&7)) & 1)
+/** Mark tile \a i of a video frame as changed */
+#define	vsource_tile_set(frame, i)	((frame)->tilemap[(i)>>3] |= (1<<((i)&7)))
+
 /**
  * Data structure to setup a video configuration.
  */
@@ -145,6 +169,7 @@ EXPORT int video_source_out_width(int channel);
 EXPORT int video_source_out_height(int channel);
 EXPORT int video_source_out_stride(int channel);
 EXPORT int video_source_mem_size(int channel);
+EXPORT int video_source_resize(int channel, int curr_width, int curr_height, int curr_stride);
 
 EXPORT int video_source_setup_ex(vsource_config_t *config, int nConfig);
 EXPORT int video_source_setup(int curr_width, int curr_height, int curr_stride);
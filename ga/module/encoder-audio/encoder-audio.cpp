@@ -28,6 +28,7 @@
 
 #include "ga-common.h"
 #include "ga-conf.h"
+#include "ga-cpu.h"
 #include "ga-avcodec.h"
 #include "ga-module.h"
 
@@ -249,6 +250,7 @@ aencoder_threadproc(void *arg) {
 	//
 	bzero(snd_in, sizeof(*snd_in));
 	av_frame_unref(snd_in);
+	ga_cpu_bind(GA_CPU_AUDIO, 0);
 	// start encoding
 	ga_error("audio encoding started: tid=%ld channels=%d, frames=%d (%d/%d bytes), chunk_size=%ld (%d bytes), delay=%d\n",
 		ga_gettid(),
@@ -25,6 +25,7 @@
 #include "ga-common.h"
 #include "ga-avcodec.h"
 #include "ga-conf.h"
+#include "ga-cpu.h"
 #include "ga-module.h"
 
 #include "dpipe.h"
@@ -118,10 +119,13 @@ vencoder_init(void *arg) {
 		}
 		ga_error("video encoder: video source #%d from '%s' (%dx%d).\n",
 			iid, pipe->name, outputW, outputH);
+		// codec threads inherit the cores of the opening thread
+		ga_cpu_bind(GA_CPU_VIDEO, iid);
 		vencoder[iid] = ga_avcodec_vencoder_init(NULL,
 				rtspconf->video_encoder_codec,
 				outputW, outputH,
 				rtspconf->video_fps, rtspconf->vso);
+		ga_cpu_unbind();
 		if(vencoder[iid] == NULL)
 			goto init_failed;
 #ifdef STANDALONE_SDP
@@ -228,8 +232,6 @@ vencoder_threadproc(void *arg) {
 	AVFrame *pic_in = NULL;
 	unsigned char *pic_in_buf = NULL;
 	int pic_in_size;
-	unsigned char *nalbuf = NULL, *nalbuf_a = NULL;
-	int nalbuf_size = 0, nalign = 0;
 	long long basePts = -1LL, newpts = 0LL, pts = -1LL, ptsSync = 0LL;
 	pthread_mutex_t condMutex = PTHREAD_MUTEX_INITIALIZER;
 	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
@@ -245,19 +247,13 @@ vencoder_threadproc(void *arg) {
 	// init variables
 	iid = pipe->channel_id;
 	encoder = vencoder[iid];
+	ga_cpu_bind(GA_CPU_VIDEO, iid);
 	//
 	outputW = video_source_out_width(iid);
 	outputH = video_source_out_height(iid);
 	//
 	encoder_pts_clear(iid);
 	//
-	nalbuf_size = 100000+12 * outputW * outputH;
-	if(ga_malloc(nalbuf_size, (void**) &nalbuf, &nalign) < 0) {
-		ga_error("video encoder: buffer allocation failed, terminated.\n");
-		goto video_quit;
-	}
-	nalbuf_a = nalbuf + nalign;
-	//
 	if((pic_in = av_frame_alloc()) == NULL) {
 		ga_error("video encoder: picture allocation failed, terminated.\n");
 		goto video_quit;
@@ -274,10 +270,10 @@ vencoder_threadproc(void *arg) {
 			AV_PIX_FMT_YUV420P, outputW, outputH);
 	//ga_error("video encoder: linesize = %d|%d|%d\n", pic_in->linesize[0], pic_in->linesize[1], pic_in->linesize[2]);
 	// start encoding
-	ga_error("video encoding started: tid=%ld %dx%d@%dfps, nalbuf_size=%d, pic_in_size=%d.\n",
+	ga_error("video encoding started: tid=%ld %dx%d@%dfps, pic_in_size=%d.\n",
 		ga_gettid(),
 		outputW, outputH, rtspconf->video_fps,
-		nalbuf_size, pic_in_size);
+		pic_in_size);
 	//
 	while(vencoder_started != 0 && encoder_running() > 0) {
 		// Reconfigure encoder (if required)
@@ -327,9 +323,13 @@ vencoder_threadproc(void *arg) {
 		// encode
 		encoder_pts_put(iid, pts, &tv);
 		pic_in->pts = pts;
+		// keyframe requested by a client?
+		pic_in->pict_type = encoder_idr_poll(iid) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+		// let the encoder allocate a reference counted packet,
+		// so that sink servers can keep it without copying
 		av_init_packet(&pkt);
-		pkt.data = nalbuf_a;
-		pkt.size = nalbuf_size;
+		pkt.data = NULL;
+		pkt.size = 0;
 		if(avcodec_encode_video2(encoder, &pkt, pic_in, &got_packet) < 0) {
 			ga_error("video encoder: encode failed, terminated.\n");
 			goto video_quit;
@@ -365,6 +365,7 @@ vencoder_threadproc(void *arg) {
 			if(encoder_send_packet("video-encoder",
 				iid/*rtspconf->video_id*/, &pkt,
 				pkt.pts, &tv) < 0) {
+				av_packet_unref(&pkt);
 				goto video_quit;
 			}
 			// free unused side-data
@@ -375,6 +376,7 @@ vencoder_threadproc(void *arg) {
 				av_freep(&pkt.side_data);
 				pkt.side_data_elems = 0;
 			}
+			av_packet_unref(&pkt);
 			//
 			if(video_written == 0) {
 				video_written = 1;
@@ -390,7 +392,6 @@ video_quit:
 	//
 	if(pic_in_buf)	av_free(pic_in_buf);
 	if(pic_in)	av_free(pic_in);
-	if(nalbuf)	free(nalbuf);
 	//
 	ga_error("video encoder: thread terminated (tid=%ld).\n", ga_gettid());
 	//
@@ -579,6 +580,14 @@ vencoder_ioctl(int command, int argsize, void *arg) {
 		bcopy(arg, &vencoder_reconf[((ga_ioctl_reconfigure_t *) arg)->id], sizeof(ga_ioctl_reconfigure_t));
 		pthread_mutex_unlock(&vencoder_reconf_mutex[((ga_ioctl_reconfigure_t *) arg)->id]);
 		return ret; // 0
+	case GA_IOCTL_REQUEST_IDR:
+		if(argsize != sizeof(ga_ioctl_request_idr_t))
+			return GA_IOCTL_ERR_INVALID_ARGUMENT;
+		if(((ga_ioctl_request_idr_t*) arg)->id < 0
+		|| ((ga_ioctl_request_idr_t*) arg)->id >= video_source_channels())
+			return GA_IOCTL_ERR_BADID;
+		encoder_idr_request(((ga_ioctl_request_idr_t*) arg)->id);
+		return ret; // 0
 	case GA_IOCTL_GETSPS:
 	case GA_IOCTL_GETPPS:
 	case GA_IOCTL_GETVPS:
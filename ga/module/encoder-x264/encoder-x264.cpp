@@ -17,6 +17,7 @@
  */
 
 #include <stdio.h>
+#include <atomic>
 
 #include "vsource.h"
 #include "rtspconf.h"
@@ -25,6 +26,7 @@
 #include "ga-common.h"
 #include "ga-avcodec.h"
 #include "ga-conf.h"
+#include "ga-cpu.h"
 #include "ga-module.h"
 
 #include "dpipe.h"
@@ -41,11 +43,19 @@ static struct RTSPConf *rtspconf = NULL;
 
 static int vencoder_initialized = 0;
 static int vencoder_started = 0;
+static int vencoder_tilehints = 0;	/* use the changed-tile maps of frames */
+static int vencoder_slicestream = 0;	/* send slices as soon as they are encoded */
 static pthread_t vencoder_tid[VIDEO_SOURCE_CHANNEL_MAX];
 static pthread_mutex_t vencoder_reconf_mutex[VIDEO_SOURCE_CHANNEL_MAX];
 static ga_ioctl_reconfigure_t vencoder_reconf[VIDEO_SOURCE_CHANNEL_MAX];
 //// encoders for encoding
 static x264_t* vencoder[VIDEO_SOURCE_CHANNEL_MAX];
+static int vencoder_intrarefresh[VIDEO_SOURCE_CHANNEL_MAX];	/* recover with intra refresh instead of IDR */
+#ifdef X264_MBINFO_CONSTANT
+/* mb_info maps of the frames x264 holds: one per delayed frame, plus the input */
+static uint8_t *vencoder_mbinfo[VIDEO_SOURCE_CHANNEL_MAX];
+static int vencoder_mbinfo_slots[VIDEO_SOURCE_CHANNEL_MAX];
+#endif
 
 // specific data for h.264
 static char *_sps[VIDEO_SOURCE_CHANNEL_MAX];
@@ -53,6 +63,35 @@ static int _spslen[VIDEO_SOURCE_CHANNEL_MAX];
 static char *_pps[VIDEO_SOURCE_CHANNEL_MAX];
 static int _ppslen[VIDEO_SOURCE_CHANNEL_MAX];
 
+// slice streaming: slices are sent from the x264 nalu_process callback
+#define	SLICE_MAX_PENDING	64	/* out-of-order slices of a frame */
+#define	SLICE_MAX_DELAY		256	/* frames in x264 lookahead */
+
+/* identifies the input frame of a nal: passed to nalu_process as opaque */
+typedef struct vencoder_slicetag_s {
+	int iid;
+	int64_t pts;
+}	vencoder_slicetag_t;
+
+typedef struct vencoder_slice_s {
+	pthread_mutex_t mutex;		/* serializes nal delivery */
+	AVBufferPool *pool;		/* output buffers for x264_nal_encode */
+	AVBufferRef *ref;		/* output buffer of the current call */
+	unsigned char *buf;
+	int bufsize;
+	std::atomic<int> bufused;
+	int nextmb;			/* first macroblock of the next slice */
+	int npending;
+	x264_nal_t *pending[SLICE_MAX_PENDING];	/* slices encoded out of order */
+	struct timeval ptv;		/* presentation time of the frame */
+	int hasptv;
+	int keysent;			/* the first nal of a keyframe is sent */
+	int error;
+	vencoder_slicetag_t tag[SLICE_MAX_DELAY];
+}	vencoder_slice_t;
+
+static vencoder_slice_t vencoder_slice[VIDEO_SOURCE_CHANNEL_MAX];
+
 //#define	SAVEENC	"save.264"
 #ifdef SAVEENC
 static FILE *fsaveenc = NULL;
@@ -68,12 +107,26 @@ vencoder_deinit(void *arg) {
 	}
 #endif
 	for(iid = 0; iid < video_source_channels(); iid++) {
+		if(vencoder_slice[iid].pool != NULL) {
+			av_buffer_unref(&vencoder_slice[iid].ref);
+			// buffers still held by the packet queue are released later
+			av_buffer_pool_uninit(&vencoder_slice[iid].pool);
+			vencoder_slice[iid].buf = NULL;
+			pthread_mutex_destroy(&vencoder_slice[iid].mutex);
+		}
 		if(_sps[iid] != NULL)
 			free(_sps[iid]);
 		if(_pps[iid] != NULL)
 			free(_pps[iid]);
 		if(vencoder[iid] != NULL)
 			x264_encoder_close(vencoder[iid]);
+#ifdef X264_MBINFO_CONSTANT
+		// x264 keeps the maps of queued frames until it is closed
+		if(vencoder_mbinfo[iid] != NULL)
+			free(vencoder_mbinfo[iid]);
+		vencoder_mbinfo[iid] = NULL;
+		vencoder_mbinfo_slots[iid] = 0;
+#endif
 		pthread_mutex_destroy(&vencoder_reconf_mutex[iid]);
 		vencoder[iid] = NULL;
 	}
@@ -94,6 +147,106 @@ ga_x264_param_parse_bit(x264_param_t *params, const char *name, const char *bitv
 	return x264_param_parse(params, name, kbit);
 }
 
+static int x264_save_sps_pps(int iid, x264_t *encoder);
+
+/* send a nal produced by nalu_process: vencoder_slice[iid].mutex must be locked */
+static void
+vencoder_send_nal(int iid, int64_t pts, x264_nal_t *nal) {
+	vencoder_slice_t *vs = &vencoder_slice[iid];
+	AVPacket pkt;
+	//
+	if(vs->error)
+		return;
+	// all nals of a frame share the same presentation time
+	if(vs->hasptv == 0) {
+		gettimeofday(&vs->ptv, NULL);
+		vs->hasptv = 1;
+	}
+	av_init_packet(&pkt);
+	pkt.pts = pts;
+	pkt.stream_index = 0;
+	pkt.size = nal->i_payload;
+	pkt.data = nal->p_payload;
+	pkt.buf = vs->ref;
+	// readers resynchronize at key packets: flag only the first nal of
+	// a keyframe, the SPS, or the top slice if headers are not repeated
+	if(vs->keysent == 0
+	&& (nal->i_type == NAL_SPS
+	|| (nal->i_type == NAL_SLICE_IDR && nal->i_first_mb == 0))) {
+		pkt.flags |= AV_PKT_FLAG_KEY;
+		vs->keysent = 1;
+	}
+	if(encoder_send_packet("video-encoder", iid, &pkt, pkt.pts, &vs->ptv) < 0) {
+		vs->error = 1;
+		return;
+	}
+#ifdef SAVEENC
+	if(fsaveenc != NULL)
+		fwrite(pkt.data, sizeof(char), pkt.size, fsaveenc);
+#endif
+	return;
+}
+
+/* send pending slices that follow the sent ones: mutex must be locked */
+static void
+vencoder_send_pending(int iid, int64_t pts, int force) {
+	vencoder_slice_t *vs = &vencoder_slice[iid];
+	int i, found;
+	do {
+		found = -1;
+		for(i = 0; i < vs->npending; i++) {
+			if(vs->pending[i]->i_first_mb == vs->nextmb) {
+				found = i;
+				break;
+			}
+			// forced: send the remaining slices in macroblock order
+			if(force && (found < 0 || vs->pending[i]->i_first_mb < vs->pending[found]->i_first_mb))
+				found = i;
+		}
+		if(found < 0)
+			break;
+		vencoder_send_nal(iid, pts, vs->pending[found]);
+		vs->nextmb = vs->pending[found]->i_last_mb + 1;
+		vs->pending[found] = vs->pending[--vs->npending];
+	} while(vs->npending > 0);
+	return;
+}
+
+/**
+ * x264 nalu_process callback: deliver each nal as soon as it is encoded.
+ *
+ * With sliced threads, this is called from x264 threads and slices may
+ * complete out of order, so slices are delivered in macroblock order.
+ */
+static void
+vencoder_nalu_process(x264_t *h, x264_nal_t *nal, void *opaque) {
+	vencoder_slicetag_t *tag = (vencoder_slicetag_t*) opaque;
+	vencoder_slice_t *vs = &vencoder_slice[tag->iid];
+	int need = nal->i_payload * 3 / 2 + 5 + 64;
+	int offset = vs->bufused.fetch_add(need);
+	//
+	if(offset + need > vs->bufsize) {
+		ga_error("video encoder: slice buffer full, nal dropped (%d bytes).\n", nal->i_payload);
+		return;
+	}
+	x264_nal_encode(h, vs->buf + offset, nal);
+	//
+	pthread_mutex_lock(&vs->mutex);
+	if(nal->i_type != NAL_SLICE && nal->i_type != NAL_SLICE_IDR) {
+		vencoder_send_nal(tag->iid, tag->pts, nal);
+	} else if(nal->i_first_mb == vs->nextmb) {
+		vencoder_send_nal(tag->iid, tag->pts, nal);
+		vs->nextmb = nal->i_last_mb + 1;
+		vencoder_send_pending(tag->iid, tag->pts, 0);
+	} else if(vs->npending < SLICE_MAX_PENDING) {
+		vs->pending[vs->npending++] = nal;
+	} else {
+		ga_error("video encoder: too many pending slices, nal dropped.\n");
+	}
+	pthread_mutex_unlock(&vs->mutex);
+	return;
+}
+
 static int
 vencoder_init(void *arg) {
 	int iid;
@@ -110,6 +263,15 @@ vencoder_init(void *arg) {
 	if(vencoder_initialized != 0)
 		return 0;
 	//
+	vencoder_tilehints = ga_conf_readbool("video-tile-hints", 0);
+	vencoder_slicestream = ga_conf_readbool("video-slice-streaming", 0);
+#ifndef X264_MBINFO_CONSTANT
+	if(vencoder_tilehints != 0) {
+		ga_error("video encoder: tile hints are not supported by this x264.\n");
+		vencoder_tilehints = 0;
+	}
+#endif
+	//
 	for(iid = 0; iid < video_source_channels(); iid++) {
 		char pipename[64];
 		int outputW, outputH;
@@ -184,6 +346,8 @@ vencoder_init(void *arg) {
 			x264_param_parse(&params, "fps", tmpbuf);
 		if(ga_conf_mapreadv("video-specific", "threads", tmpbuf, sizeof(tmpbuf)) != NULL)
 			x264_param_parse(&params, "threads", tmpbuf);
+		else if(ga_cpu_budget(GA_CPU_VIDEO, iid) > 0)
+			params.i_threads = ga_cpu_budget(GA_CPU_VIDEO, iid);
 		if(ga_conf_mapreadv("video-specific", "slices", tmpbuf, sizeof(tmpbuf)) != NULL)
 			x264_param_parse(&params, "slices", tmpbuf);
 		//
@@ -208,10 +372,40 @@ vencoder_init(void *arg) {
 				name = strtok_r(NULL, ":", &saveptr);
 			}
 		}
-		//
+#ifdef X264_MBINFO_CONSTANT
+		// unchanged macroblocks are hinted by frame tile maps
+		if(vencoder_tilehints != 0)
+			params.analyse.b_mb_info = 1;
+#endif
+		// slice streaming: nalu_process does not work with frame threads
+		if(vencoder_slicestream != 0) {
+			x264_t *hdr;
+			if(params.i_threads != 1)
+				params.b_sliced_threads = 1;
+			if(params.i_slice_count == 0
+			&& params.i_slice_max_size == 0
+			&& params.i_slice_max_mbs == 0)
+				params.i_slice_max_size = 1200;
+			// x264_encoder_headers cannot be used with nalu_process,
+			// get sps and pps from an encoder without the callback
+			if((hdr = x264_encoder_open(&params)) == NULL)
+				goto init_failed;
+			x264_save_sps_pps(iid, hdr);
+			x264_encoder_close(hdr);
+			//
+			vencoder_slice[iid].bufsize = outputW * outputH * 4;
+			if((vencoder_slice[iid].pool = av_buffer_pool_init(vencoder_slice[iid].bufsize, NULL)) == NULL)
+				goto init_failed;
+			pthread_mutex_init(&vencoder_slice[iid].mutex, NULL);
+			params.nalu_process = vencoder_nalu_process;
+		}
+		// x264 worker threads inherit the cores of the opening thread
+		ga_cpu_bind(GA_CPU_VIDEO, iid);
 		vencoder[iid] = x264_encoder_open(&params);
+		ga_cpu_unbind();
 		if(vencoder[iid] == NULL)
 			goto init_failed;
+		vencoder_intrarefresh[iid] = params.b_intra_refresh;
 		ga_error("video encoder: opened! bitrate=%dKbps; me_method=%d; me_range=%d; refs=%d; g=%d; intra-refresh=%d; width=%d; height=%d; crop=%d,%d,%d,%d; threads=%d; slices=%d; repeat-hdr=%d; annexb=%d\n",
 			params.rc.i_bitrate,
 			params.analyse.i_me_method, params.analyse.i_me_range,
@@ -223,6 +417,11 @@ vencoder_init(void *arg) {
 			params.crop_rect.i_right, params.crop_rect.i_bottom,
 			params.i_threads, params.i_slice_count,
 			params.b_repeat_headers, params.b_annexb);
+		if(vencoder_slicestream != 0) {
+			ga_error("video encoder: slice streaming enabled; sliced-threads=%d; slice-max-size=%d; slice-max-mbs=%d\n",
+				params.b_sliced_threads,
+				params.i_slice_max_size, params.i_slice_max_mbs);
+		}
 	}
 #ifdef SAVEENC
 	fsaveenc = fopen(SAVEENC, "wb");
@@ -304,10 +503,15 @@ vencoder_threadproc(void *arg) {
 	pthread_mutex_t condMutex = PTHREAD_MUTEX_INITIALIZER;
 	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
 	//
-	unsigned char *pktbuf = NULL;
-	int pktbufsize = 0, pktbufmax = 0;
 	int video_written = 0;
 	int64_t x264_pts = 0;
+	long long lastimgpts = -1LL;	/* imgpts of the last encoded frame */
+	int idleframes = 0;
+	int forceidr;
+	int mbinfosize = 0, mbinfoslot = 0;
+	AVBufferPool *pktpool = NULL;	/* packet buffers borrowed by the packet queue */
+	AVBufferRef *pktref = NULL;
+	int pktbufmax;
 	//
 	if(pipe == NULL) {
 		ga_error("video encoder: invalid pipeline specified (%s).\n", pipename);
@@ -318,11 +522,27 @@ vencoder_threadproc(void *arg) {
 	// init variables
 	iid = pipe->channel_id;
 	encoder = vencoder[iid];
+	ga_cpu_bind(GA_CPU_VIDEO, iid);
 	//
 	outputW = video_source_out_width(iid);
 	outputH = video_source_out_height(iid);
+#ifdef X264_MBINFO_CONSTANT
+	// tile hints: x264 reads a map until its frame is encoded, so a map
+	// is reused only after all the frames delayed in x264 are out
+	if(vencoder_tilehints != 0) {
+		mbinfosize = ((outputW + VIDEO_SOURCE_TILE_SIZE - 1) / VIDEO_SOURCE_TILE_SIZE)
+			* ((outputH + VIDEO_SOURCE_TILE_SIZE - 1) / VIDEO_SOURCE_TILE_SIZE);
+		if(vencoder_mbinfo[iid] == NULL) {
+			vencoder_mbinfo_slots[iid] = x264_encoder_maximum_delayed_frames(encoder) + 1;
+			vencoder_mbinfo[iid] = (uint8_t*) malloc(mbinfosize * vencoder_mbinfo_slots[iid]);
+		}
+		if(vencoder_mbinfo[iid] == NULL)
+			ga_error("video encoder: no memory for tile hints, disabled.\n");
+	}
+#endif
 	pktbufmax = outputW * outputH * 2;
-	if((pktbuf = (unsigned char*) malloc(pktbufmax)) == NULL) {
+	if(vencoder_slicestream == 0
+	&& (pktpool = av_buffer_pool_init(pktbufmax, NULL)) == NULL) {
 		ga_error("video encoder: allocate memory failed.\n");
 		goto video_quit;
 	}
@@ -335,6 +555,7 @@ vencoder_threadproc(void *arg) {
 		x264_picture_t pic_in, pic_out = {0};
 		x264_nal_t *nal;
 		int i, size, nnal;
+		int tilehints;
 		struct timeval tv;
 		struct timespec to;
 		gettimeofday(&tv, NULL);
@@ -357,8 +578,30 @@ vencoder_threadproc(void *arg) {
 		} else {
 			newpts = ptsSync + frame->imgpts - basePts;
 		}
+		// the tile map is usable only if it is relative to the last encoded frame
+		tilehints = vencoder_tilehints != 0
+			&& frame->tilecount >= 0
+			&& frame->tilebase == lastimgpts
+			&& frame->tilecols == (outputW + VIDEO_SOURCE_TILE_SIZE - 1) / VIDEO_SOURCE_TILE_SIZE
+			&& frame->tilerows == (outputH + VIDEO_SOURCE_TILE_SIZE - 1) / VIDEO_SOURCE_TILE_SIZE;
+		// keyframe requested by a client?
+		forceidr = encoder_idr_poll(iid);
+		// unchanged frame: skip it, but still encode one per second
+		if(forceidr == 0 && tilehints && frame->tilecount == 0 && ++idleframes < rtspconf->video_fps) {
+			lastimgpts = frame->imgpts;
+			dpipe_put(pipe, data);
+			continue;
+		}
+		idleframes = 0;
 		//
 		x264_picture_init(&pic_in);
+		if(forceidr != 0) {
+			// intra refresh recovers without the bitrate spike of an IDR
+			if(vencoder_intrarefresh[iid] != 0)
+				x264_encoder_intra_refresh(encoder);
+			else
+				pic_in.i_type = X264_TYPE_IDR;
+		}
 		//
 		pic_in.img.i_csp = X264_CSP_I420;
 		pic_in.img.i_plane = 3;
@@ -367,15 +610,50 @@ vencoder_threadproc(void *arg) {
 		pic_in.img.i_stride[2] = frame->linesize[2];
 		pic_in.img.plane[0] = frame->imgbuf;
 		pic_in.img.plane[1] = pic_in.img.plane[0] + outputW*outputH;
-		pic_in.img.plane[2] = pic_in.img.plane[1] + ((outputW * outputH) >> 2);
+		pic_in.img.plane[2] = pic_in.img.plane[1] + frame->linesize[1] * ((outputH+1)>>1);
 		// pts must be monotonically increasing
 		if(newpts > pts) {
 			pts = newpts;
 		} else {
 			pts++;
 		}
+#ifdef X264_MBINFO_CONSTANT
+		if(tilehints && vencoder_mbinfo[iid] != NULL) {
+			uint8_t *mbinfo = vencoder_mbinfo[iid] + mbinfosize * mbinfoslot;
+			for(i = 0; i < mbinfosize; i++) {
+				mbinfo[i] = vsource_tile_changed(frame, i) ? 0 : X264_MBINFO_CONSTANT;
+			}
+			mbinfoslot = (mbinfoslot + 1) % vencoder_mbinfo_slots[iid];
+			pic_in.prop.mb_info = mbinfo;
+			pic_in.prop.mb_info_free = NULL;
+		}
+#endif
+		lastimgpts = frame->imgpts;
 		//pic_in.i_pts = pts;
+		// skipped frames (here or at the source) leave gaps in the capture sequence
+		if(frame->imgpts - basePts > x264_pts)
+			x264_pts = frame->imgpts - basePts;
 		pic_in.i_pts = x264_pts++;
+		if(vencoder_slicestream != 0) {
+			vencoder_slice_t *vs = &vencoder_slice[iid];
+			vencoder_slicetag_t *tag = &vs->tag[pic_in.i_pts % SLICE_MAX_DELAY];
+			tag->iid = iid;
+			tag->pts = pic_in.i_pts;
+			pic_in.opaque = tag;
+			// nals are encoded into a reference counted buffer,
+			// so that the packet queue keeps them without copying
+			if((vs->ref = av_buffer_pool_get(vs->pool)) == NULL) {
+				ga_error("video encoder: allocate slice buffer failed.\n");
+				dpipe_put(pipe, data);
+				break;
+			}
+			vs->buf = vs->ref->data;
+			vs->bufused = 0;
+			vs->nextmb = 0;
+			vs->npending = 0;
+			vs->hasptv = 0;
+			vs->keysent = 0;
+		}
 		// encode
 		if((size = x264_encoder_encode(encoder, &nal, &nnal, &pic_in, &pic_out)) < 0) {
 			ga_error("video encoder: encode failed, err = %d\n", size);
@@ -383,25 +661,49 @@ vencoder_threadproc(void *arg) {
 			break;
 		}
 		dpipe_put(pipe, data);
+		// slice streaming: nals have been sent by vencoder_nalu_process
+		if(vencoder_slicestream != 0) {
+			vencoder_slice_t *vs = &vencoder_slice[iid];
+			pthread_mutex_lock(&vs->mutex);
+			vencoder_send_pending(iid, pic_out.i_pts, 1);
+			pthread_mutex_unlock(&vs->mutex);
+			// sent nals hold their own references
+			av_buffer_unref(&vs->ref);
+			vs->buf = NULL;
+			if(vs->error)
+				goto video_quit;
+			if(size > 0 && video_written == 0) {
+				video_written = 1;
+				ga_error("first video frame written (pts=%lld)\n", pic_out.i_pts);
+			}
+			continue;
+		}
 		// encode
 		if(size > 0) {
 			AVPacket pkt;
+			unsigned char *pktbuf = nal[0].p_payload;
+			// x264 outputs the payloads of all nals back to back into
+			// its own buffer, which is valid until the next
+			// x264_encoder_encode call. Copy them once into a reference
+			// counted buffer, so that the packet queue can keep it.
+			// A packet larger than the pool buffers is copied by the queue.
+			if(size <= pktbufmax) {
+				if((pktref = av_buffer_pool_get(pktpool)) == NULL) {
+					ga_error("video encoder: allocate packet buffer failed.\n");
+					goto video_quit;
+				}
+				bcopy(nal[0].p_payload, pktref->data, size);
+				pktbuf = pktref->data;
+			}
 #if 1
 			av_init_packet(&pkt);
 			pkt.pts = pic_in.i_pts;
 			pkt.stream_index = 0;
-			// concatenate nals
-			pktbufsize = 0;
-			for(i = 0; i < nnal; i++) {
-				if(pktbufsize + nal[i].i_payload > pktbufmax) {
-					ga_error("video encoder: nal dropped (%d < %d).\n", i+1, nnal);
-					break;
-				}
-				bcopy(nal[i].p_payload, pktbuf + pktbufsize, nal[i].i_payload);
-				pktbufsize += nal[i].i_payload;
-			}
-			pkt.size = pktbufsize;
+			pkt.size = size;
 			pkt.data = pktbuf;
+			pkt.buf = pktref;
+			if(pic_out.b_keyframe)
+				pkt.flags |= AV_PKT_FLAG_KEY;
 #if 0			// XXX: dump naltype
 			do {
 				int codelen;
@@ -442,7 +744,10 @@ vencoder_threadproc(void *arg) {
 				pkt.pts = pic_in.i_pts;
 				pkt.stream_index = 0;
 				pkt.size = nal[i].i_payload;
-				pkt.data = ptr;
+				pkt.data = pktbuf + (ptr - nal[0].p_payload);
+				pkt.buf = pktref;
+				if(pic_out.b_keyframe)
+					pkt.flags |= AV_PKT_FLAG_KEY;
 				if(encoder_send_packet("video-encoder",
 					iid/*rtspconf->video_id*/, &pkt, pkt.pts, NULL) < 0) {
 					goto video_quit;
@@ -452,22 +757,16 @@ vencoder_threadproc(void *arg) {
 					fwrite(pkt.data, sizeof(char), pkt.size, fsaveenc);
 #endif
 			}
-			// handling video frame data
-			pktbufsize = 0;
-			for(; i < nnal; i++) {
-				if(pktbufsize + nal[i].i_payload > pktbufmax) {
-					ga_error("video encoder: nal dropped (%d < %d).\n", i+1, nnal);
-					break;
-				}
-				bcopy(nal[i].p_payload, pktbuf + pktbufsize, nal[i].i_payload);
-				pktbufsize += nal[i].i_payload;
-			}
-			if(pktbufsize > 0) {
+			// handling video frame data: the rest of the nals
+			if(i < nnal) {
 				av_init_packet(&pkt);
 				pkt.pts = pic_in.i_pts;
 				pkt.stream_index = 0;
-				pkt.size = pktbufsize;
-				pkt.data = pktbuf;
+				pkt.size = nal[0].p_payload + size - nal[i].p_payload;
+				pkt.data = pktbuf + (nal[i].p_payload - nal[0].p_payload);
+				pkt.buf = pktref;
+				if(pic_out.b_keyframe)
+					pkt.flags |= AV_PKT_FLAG_KEY;
 				if(encoder_send_packet("video-encoder",
 					iid/*rtspconf->video_id*/, &pkt, pkt.pts, NULL) < 0) {
 					goto video_quit;
@@ -478,6 +777,8 @@ vencoder_threadproc(void *arg) {
 #endif
 			}
 #endif
+			// sent packets hold their own references
+			av_buffer_unref(&pktref);
 			// free unused side-data
 			if(pkt.side_data_elems > 0) {
 				int i;
@@ -498,10 +799,13 @@ video_quit:
 	if(pipe) {
 		pipe = NULL;
 	}
-	if(pktbuf != NULL) {
-		free(pktbuf);
+	if(pktref != NULL) {
+		av_buffer_unref(&pktref);
+	}
+	if(pktpool != NULL) {
+		// buffers still held by the packet queue are released later
+		av_buffer_pool_uninit(&pktpool);
 	}
-	pktbuf = NULL;
 	//
 	ga_error("video encoder: thread terminated (tid=%ld).\n", ga_gettid());
 	//
@@ -574,16 +878,21 @@ x264_reconfigure(ga_ioctl_reconfigure_t *reconf) {
 
 static int
 x264_get_sps_pps(int iid) {
-	x264_nal_t *p_nal;
-	int ret = 0;
-	int i, i_nal;
 	// alread obtained?
 	if(_sps[iid] != NULL)
 		return 0;
 	//
 	if(vencoder_initialized == 0)
 		return GA_IOCTL_ERR_NOTINITIALIZED;
-	if(x264_encoder_headers(vencoder[iid], &p_nal, &i_nal) < 0)
+	return x264_save_sps_pps(iid, vencoder[iid]);
+}
+
+static int
+x264_save_sps_pps(int iid, x264_t *encoder) {
+	x264_nal_t *p_nal;
+	int ret = 0;
+	int i, i_nal;
+	if(x264_encoder_headers(encoder, &p_nal, &i_nal) < 0)
 		return GA_IOCTL_ERR_NOTFOUND;
 	for(i = 0; i < i_nal; i++) {
 		if(p_nal[i].i_type == NAL_SPS) {
@@ -629,6 +938,14 @@ vencoder_ioctl(int command, int argsize, void *arg) {
 			return GA_IOCTL_ERR_INVALID_ARGUMENT;
 		x264_reconfigure((ga_ioctl_reconfigure_t*) arg);
 		break;
+	case GA_IOCTL_REQUEST_IDR:
+		if(argsize != sizeof(ga_ioctl_request_idr_t))
+			return GA_IOCTL_ERR_INVALID_ARGUMENT;
+		if(((ga_ioctl_request_idr_t*) arg)->id < 0
+		|| ((ga_ioctl_request_idr_t*) arg)->id >= video_source_channels())
+			return GA_IOCTL_ERR_BADID;
+		encoder_idr_request(((ga_ioctl_request_idr_t*) arg)->id);
+		break;
 	case GA_IOCTL_GETSPS:
 		if(argsize != sizeof(ga_ioctl_buffer_t))
 			return GA_IOCTL_ERR_INVALID_ARGUMENT;
@@ -19,6 +19,7 @@
 #include <stdio.h>
 #include <pthread.h>
 #include <map>
+#include <vector>
 
 #include "vsource.h"
 #include "vconverter.h"
@@ -27,11 +28,13 @@
 
 #include "ga-common.h"
 #include "ga-conf.h"
+#include "ga-cpu.h"
 #include "ga-avcodec.h"
 
 #include "dpipe.h"
 #include "dpipe.h"
 #include "filter-rgb2yuv.h"
+#include "rgb2yuv.h"
 
 #define	POOLSIZE		8
 #define	ENABLE_EMBED_COLORCODE	1
@@ -41,6 +44,8 @@ using namespace std;
 static int filter_initialized = 0;
 static int filter_started = 0;
 static pthread_t filter_tid[VIDEO_SOURCE_CHANNEL_MAX];
+static rgb2yuv_pool_t *filter_pool[VIDEO_SOURCE_CHANNEL_MAX];
+static int filter_tiles = 0;
 static FILE *savefp = NULL;
 
 /* filter_RGB2YUV_init: arg is two pointers to pipeline format string */
@@ -56,6 +61,9 @@ filter_RGB2YUV_init(void *arg) {
 	dpipe_t *srcpipe[VIDEO_SOURCE_CHANNEL_MAX];
 	dpipe_t *dstpipe[VIDEO_SOURCE_CHANNEL_MAX];
 	char savefile[128];
+	char kernel[64];
+	const char *selected;
+	int nthreads;
 	//
 	if(filter_initialized != 0)
 		return 0;
@@ -63,9 +71,30 @@ filter_RGB2YUV_init(void *arg) {
 	if(ga_conf_readv("save-yuv-image", savefile, sizeof(savefile)) != NULL) {
 		savefp = ga_save_init(savefile);
 	}
+	// same-size conversion kernel
+	if(ga_conf_readv("filter-rgb2yuv-kernel", kernel, sizeof(kernel)) == NULL)
+		strcpy(kernel, "auto");
+	if((selected = rgb2yuv_init(kernel)) != NULL) {
+		ga_error("RGB2YUV filter: use '%s' kernel for same-size conversions.\n", selected);
+	} else {
+		ga_error("RGB2YUV filter: use swscale for all conversions.\n");
+	}
+	// band-parallel conversion threads per channel, unless cpu-budget-convert is set
+	if((nthreads = ga_conf_readint("filter-rgb2yuv-threads")) < 1)
+		nthreads = 1;
+	// convert only changed tiles
+	filter_tiles = (selected != NULL && ga_conf_readbool("filter-rgb2yuv-tiles", 0) != 0);
 #ifdef ENABLE_EMBED_COLORCODE
-	vsource_embed_colorcode_init(0/*RGBmode*/);
+	// color codes change the output frames without changing the source
+	if(vsource_embed_colorcode_init(0/*RGBmode*/) == 0 && filter_tiles != 0) {
+		ga_error("RGB2YUV filter: changed-tile conversion disabled by embed-colorcode.\n");
+		filter_tiles = 0;
+	}
 #endif
+	if(filter_tiles != 0) {
+		ga_error("RGB2YUV filter: convert changed %dx%d tiles only.\n",
+			VIDEO_SOURCE_TILE_SIZE, VIDEO_SOURCE_TILE_SIZE);
+	}
 	//
 	bzero(dstpipe, sizeof(dstpipe));
 	//
@@ -135,6 +164,16 @@ filter_RGB2YUV_init(void *arg) {
 			}
 		}
 		video_source_add_pipename(iid, dstpipename);
+		//
+		if(selected != NULL) {
+			int n = ga_cpu_budget(GA_CPU_CONVERT, iid);
+			if(n <= 0)
+				n = nthreads;
+			if(n > 1) {
+				filter_pool[iid] = rgb2yuv_pool_create(n, iid);
+				ga_error("RGB2YUV filter: %d conversion threads for %s.\n", n, dstpipename);
+			}
+		}
 	}
 	//
 	filter_initialized = 1;
@@ -145,6 +184,8 @@ init_failed:
 		if(dstpipe[iid] != NULL)
 			dpipe_destroy(dstpipe[iid]);
 		dstpipe[iid] = NULL;
+		rgb2yuv_pool_destroy(filter_pool[iid]);
+		filter_pool[iid] = NULL;
 	}
 #if 0
 	if(pipe) {
@@ -156,6 +197,11 @@ init_failed:
 
 static int
 filter_RGB2YUV_deinit(void *arg) {
+	int iid;
+	for(iid = 0; iid < VIDEO_SOURCE_CHANNEL_MAX; iid++) {
+		rgb2yuv_pool_destroy(filter_pool[iid]);
+		filter_pool[iid] = NULL;
+	}
 	if(savefp != NULL) {
 		ga_save_close(savefp);
 		savefp = NULL;
@@ -163,6 +209,119 @@ filter_RGB2YUV_deinit(void *arg) {
 	return 0;
 }
 
+/* filter_tile_changed: compare a tile of two same-size RGBA/BGRA frames */
+
+static int
+filter_tile_changed(vsource_frame_t *prev, vsource_frame_t *curr, int x, int y) {
+	int j, width, height, offset;
+	width = curr->realwidth - x;
+	height = curr->realheight - y;
+	if(width > VIDEO_SOURCE_TILE_SIZE)
+		width = VIDEO_SOURCE_TILE_SIZE;
+	if(height > VIDEO_SOURCE_TILE_SIZE)
+		height = VIDEO_SOURCE_TILE_SIZE;
+	offset = curr->realstride * y + (x<<2);
+	for(j = 0; j < height; j++, offset += curr->realstride) {
+		if(memcmp(prev->imgbuf + offset, curr->imgbuf + offset, width<<2) != 0)
+			return 1;
+	}
+	return 0;
+}
+
+/* filter_convert_tiles: convert a same-size RGBA/BGRA frame tile by tile */
+/*	changed tiles are found by comparing with the previous source frame, */
+/*	and recorded in the tile map of the output frame. */
+/*	each output frame keeps the tiles it has missed since it was written, */
+/*	and only those tiles are converted. */
+
+static int
+filter_convert_tiles(rgb2yuv_pool_t *pool, int order,
+		vsource_frame_t *prev, vsource_frame_t *src, vsource_frame_t *dst,
+		unsigned char **dstplane, map<vsource_frame_t*, vector<unsigned char> > &stale) {
+	const int T = VIDEO_SOURCE_TILE_SIZE;
+	int cols = (src->realwidth + T - 1) / T;
+	int rows = (src->realheight + T - 1) / T;
+	int ntiles = cols * rows, nbytes = (ntiles + 7) / 8;
+	int i, r, c, c0, count = 0;
+	map<vsource_frame_t*, vector<unsigned char> >::iterator mi;
+	unsigned char *todo;
+	//
+	if(ntiles > VIDEO_SOURCE_MAX_TILES)
+		return -1;
+	// changed tiles
+	bzero(dst->tilemap, nbytes);
+	if(prev == NULL
+	|| prev->pixelformat != src->pixelformat
+	|| prev->realwidth != src->realwidth
+	|| prev->realheight != src->realheight
+	|| prev->realstride != src->realstride) {
+		for(i = 0; i < ntiles; i++)
+			vsource_tile_set(dst, i);
+		count = ntiles;
+	} else {
+		for(r = 0, i = 0; r < rows; r++) {
+			for(c = 0; c < cols; c++, i++) {
+				if(filter_tile_changed(prev, src, c*T, r*T) == 0)
+					continue;
+				vsource_tile_set(dst, i);
+				count++;
+			}
+		}
+	}
+	dst->tilecols = cols;
+	dst->tilerows = rows;
+	dst->tilecount = count;
+	dst->tilebase = prev ? prev->imgpts : -1LL;
+	// tiles out of date in each output frame: a new frame is out of date
+	if(stale.find(dst) == stale.end())
+		stale[dst].assign(nbytes, 0xff);
+	for(mi = stale.begin(); mi != stale.end(); mi++) {
+		if((int) mi->second.size() != nbytes) {
+			mi->second.assign(nbytes, 0xff);
+			continue;
+		}
+		for(i = 0; i < nbytes; i++)
+			mi->second[i] |= dst->tilemap[i];
+	}
+	todo = &stale[dst][0];
+	for(i = 0, count = 0; i < ntiles; i++)
+		count += (todo[i>>3] >> (i&7)) & 1;
+	// convert: the whole frame, or runs of out-of-date tiles in each row
+	if(count == ntiles) {
+		rgb2yuv_convert_parallel(pool, order, src->imgbuf, src->realstride,
+			src->realwidth, src->realheight, dstplane, dst->linesize);
+	} else for(r = 0; count > 0 && r < rows; r++) {
+		int y = r * T;
+		int height = src->realheight - y < T ? src->realheight - y : T;
+		for(c = 0; c < cols; ) {
+			int x, width;
+			const unsigned char *s;
+			unsigned char *d[4];
+			i = r * cols + c;
+			if(((todo[i>>3] >> (i&7)) & 1) == 0) {
+				c++;
+				continue;
+			}
+			for(c0 = c; c < cols; c++) {
+				i = r * cols + c;
+				if(((todo[i>>3] >> (i&7)) & 1) == 0)
+					break;
+			}
+			x = c0 * T;
+			width = (c * T < src->realwidth ? c * T : src->realwidth) - x;
+			s = src->imgbuf + src->realstride * y + (x<<2);
+			d[0] = dstplane[0] + dst->linesize[0] * y + x;
+			d[1] = dstplane[1] + dst->linesize[1] * (y>>1) + (x>>1);
+			d[2] = dstplane[2] + dst->linesize[2] * (y>>1) + (x>>1);
+			d[3] = NULL;
+			rgb2yuv_convert(order, s, src->realstride, width, height, d, dst->linesize);
+			count -= c - c0;
+		}
+	}
+	bzero(todo, nbytes);
+	return 0;
+}
+
 /* filter_RGB2YUV_threadproc: arg is two pointers to pipeline name */
 /*	1st ptr: source pipeline */
 /*	2nd ptr: destination pipeline */
@@ -176,6 +335,8 @@ filter_RGB2YUV_threadproc(void *arg) {
 	dpipe_t *dstpipe = dpipe_lookup(filterpipe[1]);
 	dpipe_buffer_t *srcdata = NULL;
 	dpipe_buffer_t *dstdata = NULL;
+	dpipe_buffer_t *prevdata = NULL;	/* previous source frame, for changed tiles */
+	map<vsource_frame_t*, vector<unsigned char> > stale;
 	vsource_frame_t *srcframe = NULL;
 	vsource_frame_t *dstframe = NULL;
 	// image info
@@ -202,6 +363,7 @@ filter_RGB2YUV_threadproc(void *arg) {
 #endif
 	//
 	iid = dstpipe->channel_id;
+	ga_cpu_bind(GA_CPU_CONVERT, iid);
 	outputW = video_source_out_width(iid);
 	outputH = video_source_out_height(iid);
 	//
@@ -221,6 +383,30 @@ filter_RGB2YUV_threadproc(void *arg) {
 			goto filter_quit;
 		}
 		srcframe = (vsource_frame_t*) srcdata->pointer;
+		// same-size YUV420P (converted by the source): pass it on by reference
+		if(srcframe->pixelformat == AV_PIX_FMT_YUV420P
+		&& srcframe->realwidth == outputW
+		&& srcframe->realheight == outputH
+		&& srcframe->linesize[0] == outputW
+		&& srcframe->linesize[1] == ((outputW+1)>>1)
+		&& srcframe->linesize[2] == ((outputW+1)>>1)) {
+#ifdef ENABLE_EMBED_COLORCODE
+			vsource_embed_colorcode_inc(srcframe);
+#endif
+			if(iid == 0 && savefp != NULL) {
+				src[0] = srcframe->imgbuf;
+				src[1] = src[0] + outputH*outputW;
+				src[2] = src[1] + srcframe->linesize[1]*((outputH+1)>>1);
+				ga_save_yuv420p(savefp, outputW, outputH, src, srcframe->linesize);
+			}
+			dpipe_store_ref(dstpipe, srcdata);
+			dpipe_put(srcpipe, srcdata);
+			if(prevdata != NULL) {
+				dpipe_put(srcpipe, prevdata);
+				prevdata = NULL;
+			}
+			continue;
+		}
 		//
 		dstdata = dpipe_get(dstpipe);
 		dstframe = (vsource_frame_t*) dstdata->pointer;
@@ -231,7 +417,50 @@ filter_RGB2YUV_threadproc(void *arg) {
 		dstframe->realwidth = outputW;
 		dstframe->realheight = outputH;
 		dstframe->realstride = outputW;
-		dstframe->realsize = outputW * outputH * 3 / 2;
+		dstframe->realsize = outputW * outputH + 2 * ((outputW+1)>>1) * ((outputH+1)>>1);
+		// changed regions are kept only if the frame is not scaled
+		dstframe->dirtycount = -1;
+		if(srcframe->realwidth == outputW && srcframe->realheight == outputH) {
+			int i;
+			dstframe->dirtycount = srcframe->dirtycount;
+			for(i = 0; i < srcframe->dirtycount; i++) {
+				dstframe->dirty[i] = srcframe->dirty[i];
+			}
+		}
+		dstframe->tilecount = -1;
+		//
+		dst[0] = dstframe->imgbuf;
+		dst[1] = dstframe->imgbuf + outputH*outputW;
+		dst[2] = dst[1] + ((outputW+1)>>1) * ((outputH+1)>>1);
+		dst[3] = NULL;
+		dstframe->linesize[0] = dststride[0] = outputW;
+		dstframe->linesize[1] = dststride[1] = (outputW+1)>>1;
+		dstframe->linesize[2] = dststride[2] = (outputW+1)>>1;
+		dstframe->linesize[3] = dststride[3] = 0;
+		// same-size RGBA or BGRA: no scaling required
+		if(srcframe->realwidth == outputW
+		&& srcframe->realheight == outputH
+		&& (srcframe->pixelformat == AV_PIX_FMT_RGBA
+		 || srcframe->pixelformat == AV_PIX_FMT_BGRA)) {
+			int order = srcframe->pixelformat == AV_PIX_FMT_RGBA ?
+				RGB2YUV_ORDER_RGBA : RGB2YUV_ORDER_BGRA;
+			if(filter_tiles != 0
+			&& filter_convert_tiles(filter_pool[iid], order,
+				prevdata ? (vsource_frame_t*) prevdata->pointer : NULL,
+				srcframe, dstframe, dst, stale) == 0) {
+				// keep the source frame to compare with the next one
+				if(prevdata != NULL)
+					dpipe_put(srcpipe, prevdata);
+				prevdata = srcdata;
+				srcdata = NULL;
+				goto converted;
+			}
+			if(rgb2yuv_convert_parallel(filter_pool[iid], order,
+				srcframe->imgbuf, srcframe->realstride,
+				outputW, outputH, dst, dstframe->linesize) == 0) {
+				goto converted;
+			}
+		}
 		// scale image: RGBA, BGRA, or YUV
 		swsctx = lookup_frame_converter(
 				srcframe->realwidth,
@@ -263,8 +492,8 @@ filter_RGB2YUV_threadproc(void *arg) {
 			srcstride[1] = 0;
 		} else if(srcframe->pixelformat == AV_PIX_FMT_YUV420P) {
 			src[0] = srcframe->imgbuf;
-			src[1] = src[0] + ((srcframe->realwidth * srcframe->realheight));
-			src[2] = src[1] + ((srcframe->realwidth * srcframe->realheight)>>2);
+			src[1] = src[0] + srcframe->linesize[0] * srcframe->realheight;
+			src[2] = src[1] + srcframe->linesize[1] * ((srcframe->realheight+1)>>1);
 			src[3] = NULL;
 			srcstride[0] = srcframe->linesize[0];
 			srcstride[1] = srcframe->linesize[1];
@@ -275,18 +504,10 @@ filter_RGB2YUV_threadproc(void *arg) {
 			exit(-1);
 		}
 		//
-		dst[0] = dstframe->imgbuf;
-		dst[1] = dstframe->imgbuf + outputH*outputW;
-		dst[2] = dstframe->imgbuf + outputH*outputW + (outputH*outputW>>2);
-		dst[3] = NULL;
-		dstframe->linesize[0] = dststride[0] = outputW;
-		dstframe->linesize[1] = dststride[1] = outputW>>1;
-		dstframe->linesize[2] = dststride[2] = outputW>>1;
-		dstframe->linesize[3] = dststride[3] = 0;
-		//
 		sws_scale(swsctx,
 			src, srcstride, 0, srcframe->realheight,
 			dst, dstframe->linesize);
+converted:
 		// embed first, and then save
 #ifdef ENABLE_EMBED_COLORCODE
 		vsource_embed_colorcode_inc(dstframe);
@@ -296,12 +517,17 @@ filter_RGB2YUV_threadproc(void *arg) {
 			ga_save_yuv420p(savefp, outputW, outputH, dst, dstframe->linesize);
 		}
 		//
-		dpipe_put(srcpipe, srcdata);
+		if(srcdata != NULL)
+			dpipe_put(srcpipe, srcdata);
 		dpipe_store(dstpipe, dstdata);
 		//
 	}
 	//
 filter_quit:
+	if(prevdata) {
+		dpipe_put(srcpipe, prevdata);
+		prevdata = NULL;
+	}
 	if(srcpipe) {
 		srcpipe = NULL;
 	}
@@ -0,0 +1,168 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * Batched RTP/UDP sends for the ffmpeg-rtsp-server: the implementation.
+ *
+ * The RTP packets of a frame are sent with sendmmsg(), and runs of
+ * same-sized packets are merged into UDP GSO messages, so a keyframe of
+ * hundreds of packets costs a few system calls instead of one each.
+ */
+
+#include "rtpbatch.h"
+
+#ifdef RTP_BATCH_SEND
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/udp.h>
+#ifndef UDP_SEGMENT
+#define	UDP_SEGMENT	103	/* linux >= 4.18 */
+#endif
+#ifndef SOL_UDP
+#define	SOL_UDP		17
+#endif
+
+#include "ga-common.h"
+
+static int rtp_batch = 1;	// send with sendmmsg
+static int rtp_gso = 1;		// merge same-sized packets with UDP GSO
+
+/**
+ * Configure batched RTP/UDP sends.
+ *
+ * @param batch [in] Send the packets of a buffer with sendmmsg().
+ * @param gso [in] Also merge runs of same-sized packets with UDP GSO;
+ *	it is disabled automatically if the kernel rejects it.
+ */
+void
+rtp_batch_config(int batch, int gso) {
+	rtp_batch = batch;
+	rtp_gso = batch && gso;
+	ga_error("RTP: batched UDP sends %s, GSO %s\n",
+		rtp_batch ? "enabled" : "disabled",
+		rtp_gso ? "enabled" : "disabled");
+	return;
+}
+
+int
+rtp_batch_enabled() {
+	return rtp_batch;
+}
+
+/**
+ * Send the packets in a dynamic packet buffer with as few system calls as
+ * possible.  A run of packets of the same size, optionally ended by a
+ * shorter one, goes in a single GSO message that the kernel (or the NIC)
+ * splits into datagrams; other packets are one message each.
+ *
+ * @param s [in] The UDP socket.
+ * @param sin [in] The destination.
+ * @param buf [in] Packets in the format of rtp_write_bindata().
+ * @param buflen [in] Size of \a buf.
+ * @return \a buflen: packets that cannot be sent are dropped, as with sendto().
+ */
+int
+rtp_batch_send(int s, struct sockaddr_in *sin, uint8_t *buf, int buflen) {
+	struct iovec iov[RTP_BATCH_MAX];
+	struct mmsghdr msg[RTP_BATCH_MAX];
+	int msgiov[RTP_BATCH_MAX];	// first iov of each message
+	union {
+		char buf[CMSG_SPACE(sizeof(uint16_t))];
+		struct cmsghdr align;
+	} ctrl[RTP_BATCH_MAX];
+	struct cmsghdr *cm;
+	int i, pktlen, niov, nmsg, first, sent, r, gso;
+	//
+	i = 0;
+	while(i < buflen) {
+		// collect packets
+		for(niov = 0; niov < RTP_BATCH_MAX && i + 4 <= buflen; ) {
+			pktlen  = (buf[i+0] << 24);
+			pktlen += (buf[i+1] << 16);
+			pktlen += (buf[i+2] << 8);
+			pktlen += (buf[i+3]);
+			if(i + 4 + pktlen > buflen) {
+				i = buflen;
+				break;
+			}
+			if(pktlen > 0) {
+				iov[niov].iov_base = &buf[i+4];
+				iov[niov].iov_len = pktlen;
+				niov++;
+			}
+			i += (4+pktlen);
+		}
+		if(i + 4 > buflen)
+			i = buflen;
+		first = 0;
+regroup:
+		gso = rtp_gso;
+		bzero(msg, sizeof(msg));
+		for(nmsg = 0; first < niov; nmsg++) {
+			int j = first+1;
+			size_t seglen = iov[first].iov_len, total = seglen;
+			if(gso) {
+				while(j < niov && j - first < RTP_GSO_SEGMENTS
+				&& total + iov[j].iov_len <= RTP_GSO_BYTES
+				&& iov[j].iov_len <= seglen) {
+					total += iov[j++].iov_len;
+					if(iov[j-1].iov_len < seglen)
+						break;
+				}
+			}
+			msg[nmsg].msg_hdr.msg_name = sin;
+			msg[nmsg].msg_hdr.msg_namelen = sizeof(struct sockaddr_in);
+			msg[nmsg].msg_hdr.msg_iov = &iov[first];
+			msg[nmsg].msg_hdr.msg_iovlen = j - first;
+			if(j - first > 1) {
+				msg[nmsg].msg_hdr.msg_control = ctrl[nmsg].buf;
+				msg[nmsg].msg_hdr.msg_controllen = sizeof(ctrl[nmsg].buf);
+				cm = CMSG_FIRSTHDR(&msg[nmsg].msg_hdr);
+				cm->cmsg_level = SOL_UDP;
+				cm->cmsg_type = UDP_SEGMENT;
+				cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+				*((uint16_t*) CMSG_DATA(cm)) = seglen;
+			}
+			msgiov[nmsg] = first;
+			first = j;
+		}
+		for(sent = 0; sent < nmsg; ) {
+			if((r = sendmmsg(s, &msg[sent], nmsg - sent, 0)) >= 0) {
+				sent += r;
+				continue;
+			}
+			if(errno == EINTR)
+				continue;
+			if(gso && msg[sent].msg_hdr.msg_controllen > 0
+			&& (errno == EIO || errno == EINVAL
+			 || errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+				ga_error("RTP: UDP GSO disabled: %s\n", strerror(errno));
+				rtp_gso = 0;
+				first = msgiov[sent];
+				goto regroup;
+			}
+			// e.g., EAGAIN: drop the rest, as with sendto()
+			break;
+		}
+	}
+	return buflen;
+}
+#endif
@@ -0,0 +1,41 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * Batched RTP/UDP sends for the ffmpeg-rtsp-server: interfaces.
+ */
+
+#ifndef __RTP_BATCH_H__
+#define	__RTP_BATCH_H__
+
+#ifdef __linux__
+#include <stdint.h>
+#include <netinet/in.h>
+
+#define	RTP_BATCH_SEND		// send RTP/UDP packets with sendmmsg and UDP GSO
+#define	RTP_BATCH_MAX		64	// max packets per sendmmsg call
+#define	RTP_GSO_SEGMENTS	64	// max segments per UDP GSO message
+#define	RTP_GSO_BYTES		65000	// max payload per UDP GSO message
+
+void rtp_batch_config(int batch, int gso);
+int rtp_batch_enabled();
+int rtp_batch_send(int s, struct sockaddr_in *sin, uint8_t *buf, int buflen);
+#endif
+
+#endif	/* __RTP_BATCH_H__ */
@@ -0,0 +1,429 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * RTP pacer for the ffmpeg-rtsp-server: the implementation.
+ *
+ * RTP/UDP packets of a paced client are queued per stream and released by a
+ * single timer thread that serves all the clients.  Each client has a token
+ * bucket filled at a multiple of the target video bitrate, up to a maximum
+ * burst, so a keyframe is spread over several milliseconds instead of
+ * overrunning the buffers of the routers and the client at once.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#endif
+
+#include "ga-common.h"
+#include "ga-conf.h"
+#include "vsource.h"
+#include "encoder-common.h"
+
+#include "rtspserver.h"
+#include "rtppacer.h"
+
+#include <map>
+using namespace std;
+
+#define	RTP_PACER_TICK		1000	// timer interval in microseconds
+#define	RTP_PACER_DEFAULT_KBPS	3000	// if video-specific[b] is not set
+
+struct RTPPacerQueue {
+	uint8_t *buf;		// packets in the format of rtp_write_bindata()
+	int head;
+	int tail;
+	int size;
+};
+
+struct RTPPacer {
+	RTSPContext *ctx;
+	pthread_mutex_t mutex;
+	struct RTPPacerQueue q[RTSP_CHANNEL_MAX];
+	double tokens;		// bytes that can be sent now
+	rtp_pacer_stats_t stats;
+};
+
+static int pacer_enabled = 0;
+static double pacer_multiple = 1.5;	// rate = multiple * target bitrate
+static int pacer_burst = 16384;		// bucket size in bytes
+static int pacer_maxdelay = 500;	// queue limit in milliseconds
+static int pacer_stats_interval = 0;	// report interval in seconds
+static volatile int pacer_kbps = RTP_PACER_DEFAULT_KBPS;
+
+static pthread_mutex_t pacer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pacer_cond = PTHREAD_COND_INITIALIZER;
+static map<RTSPContext*, struct RTPPacer*> pacers;
+static pthread_t pacer_tid;
+static int pacer_running = 0;
+static int pacer_idle = 0;
+
+/* pacing rate in bytes per second */
+static double
+rtp_pacer_rate() {
+	return pacer_multiple * pacer_kbps * 1000.0 / 8;
+}
+
+/**
+ * Load the pacer configuration.
+ *
+ * @return 0 on success.
+ */
+int
+rtp_pacer_config() {
+	int v;
+	double m;
+	//
+	if((pacer_enabled = ga_conf_readbool("ffmpeg-server-pacer", 0)) == 0)
+		return 0;
+	if((m = ga_conf_readdouble("ffmpeg-server-pacer-multiple")) > 0) {
+		if(m < 1.0) {
+			ga_error("pacer: multiple %.2f is too small, use 1.0\n", m);
+			m = 1.0;
+		}
+		pacer_multiple = m;
+	}
+	if((v = ga_conf_readint("ffmpeg-server-pacer-burst")) > 0)
+		pacer_burst = v * 1024;
+	if((v = ga_conf_readint("ffmpeg-server-pacer-max-delay")) > 0)
+		pacer_maxdelay = v;
+	if((v = ga_conf_readint("ffmpeg-server-pacer-stats")) > 0)
+		pacer_stats_interval = v;
+	if((v = ga_conf_mapreadint("video-specific", "b") / 1000) > 0)
+		pacer_kbps = v;
+	ga_error("pacer: enabled, %.2fx of %dKbps, burst=%dKB, max-delay=%dms\n",
+		pacer_multiple, pacer_kbps, pacer_burst / 1024, pacer_maxdelay);
+	return 0;
+}
+
+int
+rtp_pacer_enabled() {
+	return pacer_enabled;
+}
+
+/**
+ * Update the target bitrate, e.g., after a rate adaptation.
+ *
+ * @param kbps [in] The target video bitrate in Kbps.
+ */
+void
+rtp_pacer_set_target(int kbps) {
+	if(kbps <= 0 || kbps == pacer_kbps)
+		return;
+	pacer_kbps = kbps;
+	if(pacer_enabled) {
+		ga_error("pacer: target bitrate set to %dKbps (rate %.0fKbps)\n",
+			kbps, rtp_pacer_rate() * 8 / 1000);
+	}
+	return;
+}
+
+/* length of the queued packet at ptr, including the 4-byte prefix */
+static int
+rtp_pacer_pktlen(const uint8_t *ptr) {
+	return 4 + ((ptr[0] << 24) | (ptr[1] << 16) | (ptr[2] << 8) | ptr[3]);
+}
+
+/* RTP timestamp of the queued packet at ptr: packets of a frame share it */
+static uint32_t
+rtp_pacer_timestamp(const uint8_t *ptr) {
+	if(rtp_pacer_pktlen(ptr) < 4 + 8)
+		return 0;
+	return (ptr[8] << 24) | (ptr[9] << 16) | (ptr[10] << 8) | ptr[11];
+}
+
+/**
+ * Queue packets of a client for pacing.
+ *
+ * @param ctx [in] The client.
+ * @param streamid [in] The stream id.
+ * @param buf [in] Packets in the format of rtp_write_bindata().
+ * @param buflen [in] Size of \a buf.
+ * @return \a buflen, or -1 on error.
+ *
+ * If the queue of the stream would hold more than ffmpeg-server-pacer-max-delay
+ * worth of packets, the oldest frames of the stream are dropped as a whole to
+ * make room, and a keyframe is requested if the stream is video.  The
+ * incoming packets are always queued, so a keyframe larger than the limit
+ * is still delivered.
+ */
+int
+rtp_pacer_enqueue(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen) {
+	struct RTPPacer *p = ctx->pacer;
+	struct RTPPacerQueue *q;
+	int limit, pending, pktlen, dropped = 0;
+	uint32_t ts;
+	//
+	if(p == NULL || streamid < 0 || streamid >= RTSP_CHANNEL_MAX)
+		return -1;
+	if(buf == NULL || buflen <= 0)
+		return 0;
+	q = &p->q[streamid];
+	if((limit = (int) (rtp_pacer_rate() * pacer_maxdelay / 1000)) < pacer_burst)
+		limit = pacer_burst;
+	//
+	pthread_mutex_lock(&p->mutex);
+	// drop frames from the head: late packets are less useful than new ones
+	while(q->tail - q->head + buflen > limit && q->head + 4 <= q->tail) {
+		ts = rtp_pacer_timestamp(q->buf + q->head);
+		do {
+			pktlen = rtp_pacer_pktlen(q->buf + q->head);
+			q->head += pktlen;
+			p->stats.queued -= pktlen;
+			p->stats.dropped++;
+		} while(q->head + 4 <= q->tail && rtp_pacer_timestamp(q->buf + q->head) == ts);
+		dropped = 1;
+	}
+	if(q->head >= q->tail)
+		q->head = q->tail = 0;
+	// compact, then grow if necessary
+	pending = q->tail - q->head;
+	if(q->head > 0 && q->tail + buflen > q->size) {
+		bcopy(q->buf + q->head, q->buf, pending);
+		q->head = 0;
+		q->tail = pending;
+	}
+	if(q->tail + buflen > q->size) {
+		int newsize = q->size > 0 ? q->size : 65536;
+		uint8_t *newbuf;
+		while(newsize < pending + buflen)
+			newsize <<= 1;
+		if((newbuf = (uint8_t*) realloc(q->buf, newsize)) == NULL) {
+			pthread_mutex_unlock(&p->mutex);
+			ga_error("pacer: cannot allocate queue (%d bytes)\n", newsize);
+			return -1;
+		}
+		q->buf = newbuf;
+		q->size = newsize;
+	}
+	bcopy(buf, q->buf + q->tail, buflen);
+	q->tail += buflen;
+	p->stats.queued += buflen;
+	if(p->stats.queued > p->stats.maxqueued)
+		p->stats.maxqueued = p->stats.queued;
+	pthread_mutex_unlock(&p->mutex);
+	// the decoder has lost a frame: recover with the next keyframe
+	if(dropped && streamid < video_source_channels())
+		encoder_idr_request(streamid);
+	// wake up the timer thread
+	pthread_mutex_lock(&pacer_mutex);
+	if(pacer_idle)
+		pthread_cond_signal(&pacer_cond);
+	pthread_mutex_unlock(&pacer_mutex);
+	return buflen;
+}
+
+/* refill the bucket and send what it allows; returns bytes left in the queue */
+static int
+rtp_pacer_run(struct RTPPacer *p, double refill) {
+	struct RTPPacerQueue *q;
+	int s, len, pktlen, queued;
+	//
+	pthread_mutex_lock(&p->mutex);
+	if((p->tokens += refill) > pacer_burst)
+		p->tokens = pacer_burst;
+	// from the last stream (audio): small and latency sensitive
+	for(s = RTSP_CHANNEL_MAX-1; s >= 0 && p->tokens > 0; s--) {
+		q = &p->q[s];
+		len = 0;
+		while(q->head + len + 4 <= q->tail && p->tokens > 0) {
+			pktlen = rtp_pacer_pktlen(q->buf + q->head + len);
+			len += pktlen;
+			p->tokens -= pktlen - 4;
+			p->stats.packets++;
+			p->stats.bytes += pktlen - 4;
+		}
+		if(len == 0)
+			continue;
+		rtp_write_bindata(p->ctx, s, q->buf + q->head, len);
+		q->head += len;
+		if(q->head == q->tail)
+			q->head = q->tail = 0;
+		p->stats.queued -= len;
+	}
+	queued = p->stats.queued;
+	pthread_mutex_unlock(&p->mutex);
+	return queued;
+}
+
+static void
+rtp_pacer_report(struct RTPPacer *p) {
+	double rate = rtp_pacer_rate();
+	pthread_mutex_lock(&p->mutex);
+	ga_error("pacer: %s:%d: %llu pkts, %lluKB sent, %u dropped, queue %dKB (max %dKB, %.1fms)\n",
+		inet_ntoa(p->ctx->client.sin_addr), ntohs(p->ctx->client.sin_port),
+		p->stats.packets, p->stats.bytes / 1024, p->stats.dropped,
+		p->stats.queued / 1024, p->stats.maxqueued / 1024,
+		rate > 0 ? 1000.0 * p->stats.maxqueued / rate : 0.0);
+	p->stats.maxqueued = p->stats.queued;
+	pthread_mutex_unlock(&p->mutex);
+	return;
+}
+
+static void *
+rtp_pacer_main(void *arg) {
+	struct timeval last, now, lastreport;
+	map<RTSPContext*, struct RTPPacer*>::iterator mi;
+	double refill;
+	int queued;
+	//
+	ga_error("pacer: started (tid %ld).\n", ga_gettid());
+	gettimeofday(&last, NULL);
+	lastreport = last;
+	pthread_mutex_lock(&pacer_mutex);
+	while(pacer_running) {
+		gettimeofday(&now, NULL);
+		refill = rtp_pacer_rate() * tvdiff_us(&now, &last) / 1000000.0;
+		last = now;
+		queued = 0;
+		for(mi = pacers.begin(); mi != pacers.end(); mi++) {
+			queued += rtp_pacer_run(mi->second, refill);
+		}
+		if(pacer_stats_interval > 0
+		&& tvdiff_us(&now, &lastreport) >= pacer_stats_interval * 1000000LL) {
+			for(mi = pacers.begin(); mi != pacers.end(); mi++)
+				rtp_pacer_report(mi->second);
+			lastreport = now;
+		}
+		if(queued == 0) {
+			// nothing to pace: wait for packets (buckets are full by then)
+			pacer_idle = 1;
+			pthread_cond_wait(&pacer_cond, &pacer_mutex);
+			pacer_idle = 0;
+			continue;
+		}
+		pthread_mutex_unlock(&pacer_mutex);
+		ga_usleep(RTP_PACER_TICK, &now);
+		pthread_mutex_lock(&pacer_mutex);
+	}
+	pthread_mutex_unlock(&pacer_mutex);
+	ga_error("pacer: terminated.\n");
+	return NULL;
+}
+
+/**
+ * Start the timer thread, if pacing is enabled.
+ *
+ * @return 0 on success, or -1 on error.
+ */
+int
+rtp_pacer_start() {
+	if(pacer_enabled == 0 || pacer_running)
+		return 0;
+	pacer_running = 1;
+	if(pthread_create(&pacer_tid, NULL, rtp_pacer_main, NULL) != 0) {
+		pacer_running = 0;
+		ga_error("pacer: cannot create timer thread.\n");
+		return -1;
+	}
+	return 0;
+}
+
+void
+rtp_pacer_stop() {
+	if(pacer_running == 0)
+		return;
+	pthread_mutex_lock(&pacer_mutex);
+	pacer_running = 0;
+	pthread_cond_signal(&pacer_cond);
+	pthread_mutex_unlock(&pacer_mutex);
+	pthread_join(pacer_tid, NULL);
+	return;
+}
+
+/**
+ * Start pacing a client.
+ *
+ * @param ctx [in] The client.
+ * @return 0 on success (or if pacing is disabled), or -1 on error.
+ */
+int
+rtp_pacer_attach(RTSPContext *ctx) {
+	struct RTPPacer *p;
+	//
+	if(pacer_running == 0 || ctx->pacer != NULL)
+		return 0;
+	if((p = (struct RTPPacer*) calloc(1, sizeof(struct RTPPacer))) == NULL) {
+		ga_error("pacer: cannot allocate client context.\n");
+		return -1;
+	}
+	p->ctx = ctx;
+	p->tokens = pacer_burst;
+	pthread_mutex_init(&p->mutex, NULL);
+	pthread_mutex_lock(&pacer_mutex);
+	pacers[ctx] = p;
+	ctx->pacer = p;
+	pthread_mutex_unlock(&pacer_mutex);
+	return 0;
+}
+
+/**
+ * Stop pacing a client; queued packets are discarded.
+ * The client must no longer be fed by rtp_pacer_enqueue().
+ *
+ * @param ctx [in] The client.
+ */
+void
+rtp_pacer_detach(RTSPContext *ctx) {
+	struct RTPPacer *p;
+	int s;
+	//
+	if((p = ctx->pacer) == NULL)
+		return;
+	pthread_mutex_lock(&pacer_mutex);
+	pacers.erase(ctx);
+	ctx->pacer = NULL;
+	pthread_mutex_unlock(&pacer_mutex);
+	for(s = 0; s < RTSP_CHANNEL_MAX; s++) {
+		if(p->q[s].buf != NULL)
+			free(p->q[s].buf);
+	}
+	pthread_mutex_destroy(&p->mutex);
+	free(p);
+	return;
+}
+
+/**
+ * Get the pacing statistics of a client.
+ *
+ * @param ctx [in] The client.
+ * @param stats [out] The statistics.
+ * @return 0 on success, or -1 if the client is not paced.
+ */
+int
+rtp_pacer_stats(RTSPContext *ctx, rtp_pacer_stats_t *stats) {
+	struct RTPPacer *p;
+	pthread_mutex_lock(&pacer_mutex);
+	if((p = ctx->pacer) == NULL) {
+		pthread_mutex_unlock(&pacer_mutex);
+		return -1;
+	}
+	pthread_mutex_lock(&p->mutex);
+	bcopy(&p->stats, stats, sizeof(*stats));
+	pthread_mutex_unlock(&p->mutex);
+	pthread_mutex_unlock(&pacer_mutex);
+	return 0;
+}
@@ -0,0 +1,50 @@
+/*
+ * Copyright (c) 2013-2015 Chun-Ying Huang
+ *
+ * This file is part of GamingAnywhere (GA).
+ *
+ * GA is free software; you can redistribute it and/or modify it
+ * under the terms of the 3-clause BSD License as published by the
+ * Free Software Foundation: http://directory.fsf.org/wiki/License:BSD_3Clause
+ *
+ * GA is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.
+ *
+ * You should have received a copy of the 3-clause BSD License along with GA;
+ * if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/**
+ * @file
+ * RTP pacer for the ffmpeg-rtsp-server: interfaces.
+ */
+
+#ifndef __RTP_PACER_H__
+#define	__RTP_PACER_H__
+
+#include <stdint.h>
+
+struct RTSPContext;
+
+/** Pacing statistics of a client */
+typedef struct rtp_pacer_stats_s {
+	unsigned long long packets;	/**< Packets sent */
+	unsigned long long bytes;	/**< Bytes sent */
+	unsigned int dropped;		/**< Packets dropped on queue overflow */
+	int queued;			/**< Bytes in the queue */
+	int maxqueued;			/**< Max bytes in the queue since the last report */
+}	rtp_pacer_stats_t;
+
+int rtp_pacer_config();
+int rtp_pacer_enabled();
+int rtp_pacer_start();
+void rtp_pacer_stop();
+void rtp_pacer_set_target(int kbps);
+int rtp_pacer_attach(struct RTSPContext *ctx);
+void rtp_pacer_detach(struct RTSPContext *ctx);
+int rtp_pacer_enqueue(struct RTSPContext *ctx, int streamid, uint8_t *buf, int buflen);
+int rtp_pacer_stats(struct RTSPContext *ctx, rtp_pacer_stats_t *stats);
+
+#endif	/* __RTP_PACER_H__ */
@@ -42,9 +42,16 @@
 #include "asource.h"
 #include "encoder-common.h"
 #include "rtspconf.h"
+#include "rtp-fec.h"
 
 #include "rtspserver.h"
 
+#ifdef RTSP_EVENT_LOOP
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #define	RTSP_STREAM_FORMAT	"streamid=%d"
 #define	RTSP_STREAM_FORMAT_MAXLEN	64
 
@@ -68,11 +75,76 @@ rtsp_cleanup(RTSPContext *rtsp, int retcode) {
 	return;
 }
 
+#ifdef RTSP_EVENT_LOOP
+static int rtsp_loop_pollout(RTSPContext *ctx, int enable);
+
 static int
-rtsp_write(RTSPContext *ctx, const void *buf, size_t count) {
+rtsp_wbuffer_append(RTSPContext *ctx, const char *buf, size_t count) {
+	int pending = ctx->wbuftail - ctx->wbufhead;
+	// compact, then grow if necessary
+	if(ctx->wbufhead > 0 && ctx->wbuftail + count > (size_t) ctx->wbufsize) {
+		bcopy(ctx->wbuffer + ctx->wbufhead, ctx->wbuffer, pending);
+		ctx->wbufhead = 0;
+		ctx->wbuftail = pending;
+	}
+	if(ctx->wbuftail + count > (size_t) ctx->wbufsize) {
+		int newsize = ctx->wbufsize > 0 ? ctx->wbufsize : 65536;
+		char *newbuf;
+		while((size_t) newsize < pending + count)
+			newsize <<= 1;
+		if((newbuf = (char*) realloc(ctx->wbuffer, newsize)) == NULL) {
+			ga_error("RTSP: cannot allocate output buffer (%d bytes)\n", newsize);
+			return -1;
+		}
+		ctx->wbuffer = newbuf;
+		ctx->wbufsize = newsize;
+	}
+	bcopy(buf, ctx->wbuffer + ctx->wbuftail, count);
+	ctx->wbuftail += count;
+	return count;
+}
+
+/* write to a non-blocking connection: the caller holds rtsp_writer_mutex */
+static int
+rtsp_write_queued(RTSPContext *ctx, const void *buf, size_t count) {
+	ssize_t wlen = 0;
+	// keep the order: write directly only if nothing is pending
+	if(ctx->wbuftail == ctx->wbufhead) {
+		if((wlen = send(ctx->fd, buf, count, MSG_NOSIGNAL)) < 0) {
+			if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+				return -1;
+			wlen = 0;
+		}
+		if((size_t) wlen == count)
+			return count;
+	}
+	if(rtsp_wbuffer_append(ctx, ((const char*) buf) + wlen, count - wlen) < 0)
+		return -1;
+	if(ctx->wpolled == 0) {
+		rtsp_loop_pollout(ctx, 1);
+	}
+	return count;
+}
+#endif
+
+static int
+rtsp_write_internal(RTSPContext *ctx, const void *buf, size_t count) {
+#ifdef RTSP_EVENT_LOOP
+	if(ctx->loop != NULL)
+		return rtsp_write_queued(ctx, buf, count);
+#endif
 	return write(ctx->fd, buf, count);
 }
 
+static int
+rtsp_write(RTSPContext *ctx, const void *buf, size_t count) {
+	int wlen;
+	pthread_mutex_lock(&ctx->rtsp_writer_mutex);
+	wlen = rtsp_write_internal(ctx, buf, count);
+	pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
+	return wlen;
+}
+
 static int
 rtsp_printf(RTSPContext *ctx, const char *fmt, ...) {
 	va_list ap;
@@ -112,11 +184,23 @@ rtsp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen) {
 		header[2] = pktlen>>8;
 		header[3] = pktlen & 0x0ff;
 		pthread_mutex_lock(&ctx->rtsp_writer_mutex);
-		if(rtsp_write(ctx, header, 4) != 4) {
+#ifdef RTSP_EVENT_LOOP
+		// the client does not keep up: drop rather than block the encoder
+		if(ctx->loop != NULL
+		&& ctx->wbuftail - ctx->wbufhead + 4 + pktlen > RTSP_WBUF_MAX) {
+			if(ctx->wdropped++ == 0)
+				ga_error("RTSP: output buffer full, dropping packets (fd=%d)\n", ctx->fd);
+			pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
+			i += (4+pktlen);
+			continue;
+		}
+#endif
+		if(rtsp_write_internal(ctx, header, 4) != 4) {
 			pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
 			return i;
 		}
-		if(rtsp_write(ctx, &buf[i+4], pktlen) != pktlen) {
+		if(rtsp_write_internal(ctx, &buf[i+4], pktlen) != pktlen) {
+			pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
 			return i;
 		}
 		pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
@@ -208,6 +292,10 @@ rtp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen) {
 		return buflen;
 	bcopy(&ctx->client, &sin, sizeof(sin));
 	sin.sin_port = ctx->rtpPeerPort[streamid*2];
+#ifdef RTP_BATCH_SEND
+	if(rtp_batch_enabled())
+		return rtp_batch_send(ctx->rtpSocket[streamid*2], &sin, buf, buflen);
+#endif
 	// XXX: buffer is the reuslt from avio_open_dyn_buf.
 	// Multiple RTP packets can be placed in a single buffer.
 	// Format == 4-bytes (big-endian) packet size + packet-data
@@ -233,6 +321,78 @@ rtp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen) {
 	}
 	return i;
 }
+
+static inline unsigned int
+rtp_rb32(const uint8_t *p) {
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline void
+rtp_wb32(uint8_t *p, unsigned int v) {
+	p[0] = v >> 24;
+	p[1] = (v >> 16) & 0x0ff;
+	p[2] = (v >> 8) & 0x0ff;
+	p[3] = v & 0x0ff;
+}
+
+/**
+ * Rewrite packets from the shared RTP packetizer in place for a client:
+ * SSRC, sequence number and timestamp of RTP and parity packets, and SSRC,
+ * timestamp and counters of RTCP sender reports.
+ * The buffer has the same format as the input of rtp_write_bindata().
+ * A buffer can be rewritten for clients one after another: prev is the
+ * client it was last rewritten for, or NULL if it is from the packetizer.
+ */
+int
+rtp_rewrite_bindata(RTSPContext *ctx, RTSPContext *prev, int streamid, uint8_t *buf, int buflen) {
+	int i, pktlen;
+	uint8_t *p;
+	unsigned short seq, seqdelta;
+	unsigned int tsdelta;
+	//
+	seqdelta = ctx->rtpSeqDelta[streamid];
+	tsdelta = ctx->rtpTsDelta[streamid];
+	if(prev != NULL) {
+		seqdelta -= prev->rtpSeqDelta[streamid];
+		tsdelta -= prev->rtpTsDelta[streamid];
+	}
+	i = 0;
+	while(i + 4 <= buflen) {
+		pktlen = rtp_rb32(&buf[i]);
+		p = &buf[i+4];
+		i += (4+pktlen);
+		if(pktlen < 8 || i > buflen)
+			continue;
+		// RTCP: only sender reports carry stream-dependent fields
+		if(p[1] >= RTCP_SR && p[1] <= RTCP_APP) {
+			rtp_wb32(p+4, ctx->rtpSsrc[streamid]);
+			if(p[1] == RTCP_SR && pktlen >= 28) {
+				rtp_wb32(p+16, rtp_rb32(p+16) + tsdelta);
+				rtp_wb32(p+20, ctx->rtpPacketCount[streamid]);
+				rtp_wb32(p+24, ctx->rtpOctetCount[streamid]);
+			}
+			continue;
+		}
+		if(pktlen < 12)
+			continue;
+		seq = ((p[2] << 8) | p[3]) + seqdelta;
+		p[2] = seq >> 8;
+		p[3] = seq & 0x0ff;
+		rtp_wb32(p+4, rtp_rb32(p+4) + tsdelta);
+		// parity packets: rewrite the protected sequence numbers, too
+		if(rtp_fec_is_parity(p, pktlen)) {
+			rtp_wb32(p+8, RTP_FEC_SSRC(ctx->rtpSsrc[streamid]));
+			seq = ((p[12] << 8) | p[13]) + seqdelta;
+			p[12] = seq >> 8;
+			p[13] = seq & 0x0ff;
+			continue;
+		}
+		rtp_wb32(p+8, ctx->rtpSsrc[streamid]);
+		ctx->rtpPacketCount[streamid]++;
+		ctx->rtpOctetCount[streamid] += pktlen - 12;
+	}
+	return buflen;
+}
 #endif
 
 static int
@@ -318,18 +478,25 @@ readmore:
 	return -1;
 }
 
+static int
+rtsp_rbuffer_init(RTSPContext *ctx) {
+	if(ctx->rbuffer != NULL)
+		return 0;
+	ctx->rbufsize = 65536;
+	if((ctx->rbuffer = (char*) malloc(ctx->rbufsize)) == NULL) {
+		ctx->rbufsize = 0;
+		return -1;
+	}
+	ctx->rbufhead = 0;
+	ctx->rbuftail = 0;
+	return 0;
+}
+
 static int
 rtsp_getnext(RTSPContext *ctx, char *buf, size_t count) {
 	// initialize if necessary
-	if(ctx->rbuffer == NULL) {
-		ctx->rbufsize = 65536;
-		if((ctx->rbuffer = (char*) malloc(ctx->rbufsize)) == NULL) {
-			ctx->rbufsize = 0;
-			return -1;
-		}
-		ctx->rbufhead = 0;
-		ctx->rbuftail = 0;
-	}
+	if(rtsp_rbuffer_init(ctx) < 0)
+		return -1;
 	// buffer is empty, force read
 	if(ctx->rbuftail == ctx->rbufhead) {
 		if(rtsp_read_internal(ctx) < 0)
@@ -734,6 +901,65 @@ rtp_new_av_stream(RTSPContext *ctx, struct sockaddr_in *sin, int streamid, enum
 	return 0;
 }
 
+#ifdef HOLE_PUNCHING
+/*
+ * Shared RTP packetization: a context without a client packetizes each
+ * encoded packet of a stream once, and the result is rewritten for and
+ * sent to every client (see rtp_rewrite_bindata).  The per-client muxers
+ * use the same codec parameters and packet size, so the payloads are the
+ * same; only the header fields differ.
+ */
+static pthread_mutex_t rtpshared_mutex = PTHREAD_MUTEX_INITIALIZER;
+static RTSPContext *rtpshared[RTSP_CHANNEL_MAX];
+
+static int
+rtp_shared_open(int streamid, enum AVCodecID codecid) {
+	RTSPContext *shared;
+	//
+	pthread_mutex_lock(&rtpshared_mutex);
+	if(rtpshared[streamid] != NULL) {
+		pthread_mutex_unlock(&rtpshared_mutex);
+		return 0;
+	}
+	if((shared = (RTSPContext*) malloc(sizeof(RTSPContext))) == NULL) {
+		pthread_mutex_unlock(&rtpshared_mutex);
+		return -1;
+	}
+	bzero(shared, sizeof(RTSPContext));
+	if(per_client_init(shared) < 0) {
+		pthread_mutex_unlock(&rtpshared_mutex);
+		free(shared);
+		return -1;
+	}
+	// no RTP ports are needed
+	shared->lower_transport[streamid] = RTSP_LOWER_TRANSPORT_TCP;
+	if(rtp_new_av_stream(shared, NULL, streamid, codecid) < 0) {
+		pthread_mutex_unlock(&rtpshared_mutex);
+		per_client_deinit(shared);
+		free(shared);
+		return -1;
+	}
+	// publish only when ready: encoder threads read it without the lock
+	__atomic_store_n(&rtpshared[streamid], shared, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&rtpshared_mutex);
+	ga_error("RTP: shared packetizer created for stream %d\n", streamid);
+	return 0;
+}
+
+/**
+ * Get the shared RTP packetizer of a stream.
+ *
+ * @param streamid [in] The stream (channel) id.
+ * @return The packetizing context, or NULL if it is not available.
+ */
+RTSPContext *
+rtp_shared_context(int streamid) {
+	if(streamid < 0 || streamid >= RTSP_CHANNEL_MAX)
+		return NULL;
+	return __atomic_load_n(&rtpshared[streamid], __ATOMIC_ACQUIRE);
+}
+#endif
+
 static void
 rtsp_cmd_setup(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
 	int i;
@@ -750,6 +976,7 @@ rtsp_cmd_setup(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
 	int streamid;
 	int rtp_port, rtcp_port;
 	enum RTSPStatusCode errcode;
+	enum AVCodecID codecid;
 	//
 	av_url_split(NULL, 0, NULL, 0, NULL, 0, NULL, path, sizeof(path), url);
 	for(i = 0; i < VIDEO_SOURCE_CHANNEL_MAX+1; i++) {
@@ -823,13 +1050,25 @@ rtsp_cmd_setup(RTSPContext *ctx, const char *url, RTSPMessageHeader *h) {
 	}
 	//
 	ctx->lower_transport[streamid] = th->lower_transport;
-	if(rtp_new_av_stream(ctx, &destaddr, streamid,
-			streamid == video_source_channels()/*rtspconf->audio_id*/ ?
-				rtspconf->audio_encoder_codec->id : rtspconf->video_encoder_codec->id) < 0) {
+	codecid = streamid == video_source_channels()/*rtspconf->audio_id*/ ?
+			rtspconf->audio_encoder_codec->id : rtspconf->video_encoder_codec->id;
+	if(rtp_new_av_stream(ctx, &destaddr, streamid, codecid) < 0) {
 		ga_error("Create AV stream %d failed.\n", streamid);
 		errcode = RTSP_STATUS_TRANSPORT;
 		goto error_setup;
 	}
+#ifdef HOLE_PUNCHING
+	// header fields for the shared packetizer output
+	ctx->rtpSsrc[streamid] = (((unsigned int) rand()) << 16) ^ rand();
+	ctx->rtpTsDelta[streamid] = (((unsigned int) rand()) << 16) ^ rand();
+	ctx->rtpSeqDelta[streamid] = rand() & 0x0ffff;
+	ctx->rtpPacketCount[streamid] = 0;
+	ctx->rtpOctetCount[streamid] = 0;
+	if(rtp_shared_open(streamid, codecid) < 0) {
+		ga_error("RTP: cannot create shared packetizer for stream %d, packetize per client\n",
+			streamid);
+	}
+#endif
 	//
 	ctx->state = SERVER_STATE_READY;
 	rtsp_reply_header(ctx, RTSP_STATUS_OK);
@@ -1032,50 +1271,205 @@ get_word(char *buf, int buf_size, const char **pp) {
 	*pp = p;
 }
 
-void*
-rtspserver(void *arg) {
+#ifdef HOLE_PUNCHING
+static void
+rtp_check_peer(RTSPContext *ctx, int i, struct sockaddr_in *xsin) {
+	if(ctx->rtpPortChecked[i] != 0)
+		return;
+	// XXX: port should not flip-flop, so check only once
+	if(xsin->sin_addr.s_addr != ctx->client.sin_addr.s_addr) {
+		ga_error("RTP: client address mismatched? %u.%u.%u.%u != %u.%u.%u.%u\n",
+			NIPQUAD(ctx->client.sin_addr.s_addr),
+			NIPQUAD(xsin->sin_addr.s_addr));
+		return;
+	}
+	if(xsin->sin_port != ctx->rtpPeerPort[i]) {
+		ga_error("RTP: client port reconfigured: %u -> %u\n",
+			(unsigned int) ntohs(ctx->rtpPeerPort[i]),
+			(unsigned int) ntohs(xsin->sin_port));
+		ctx->rtpPeerPort[i] = xsin->sin_port;
+	} else {
+		ga_error("RTP: client is not under an NAT, port %d confirmed\n",
+			(int) ntohs(ctx->rtpPeerPort[i]));
+	}
+	ctx->rtpPortChecked[i] = 1;
+	return;
+}
+#endif
+
+static int
 #ifdef WIN32
-	SOCKET s = *((SOCKET*) arg);
-	int sinlen = sizeof(struct sockaddr_in);
+rtsp_client_open(RTSPContext *ctx, SOCKET s) {
 #else
-	int s = *((int*) arg);
-	socklen_t sinlen = sizeof(struct sockaddr_in);
+rtsp_client_open(RTSPContext *ctx, int s) {
 #endif
-	const char *p;
-	char buf[8192];
-	char cmd[32], url[1024], protocol[32];
-	int rlen;
 	struct sockaddr_in sin;
-	RTSPContext ctx;
-	RTSPMessageHeader header1, *header = &header1;
-	//int thread_ret;
-	// image info
-	//int iwidth = video_source_maxwidth(0);
-	//int iheight = video_source_maxheight(0);
+#ifdef WIN32
+	int sinlen = sizeof(sin);
+#else
+	socklen_t sinlen = sizeof(sin);
+#endif
 	//
 	rtspconf = rtspconf_global();
-	sinlen = sizeof(sin);
 	getpeername(s, (struct sockaddr*) &sin, &sinlen);
 	//
-	bzero(&ctx, sizeof(ctx));
-	if(per_client_init(&ctx) < 0) {
+	bzero(ctx, sizeof(*ctx));
+	if(per_client_init(ctx) < 0) {
 		ga_error("server initialization failed.\n");
-		return NULL;
+		return -1;
 	}
-	bcopy(&sin, &ctx.client, sizeof(ctx.client));
-	ctx.state = SERVER_STATE_IDLE;
+	bcopy(&sin, &ctx->client, sizeof(ctx->client));
+	ctx->state = SERVER_STATE_IDLE;
 	// XXX: hasVideo is used to sync audio/video
 	// This value is increased by 1 for each captured frame until it is gerater than zero
 	// when this value is greater than zero, audio encoding then starts ...
-	//ctx.hasVideo = -(rtspconf->video_fps>>1);	// for slow encoders?
-	ctx.hasVideo = 0;	// with 'zerolatency'
-	pthread_mutex_init(&ctx.rtsp_writer_mutex, NULL);
+	//ctx->hasVideo = -(rtspconf->video_fps>>1);	// for slow encoders?
+	ctx->hasVideo = 0;	// with 'zerolatency'
+	pthread_mutex_init(&ctx->rtsp_writer_mutex, NULL);
 	//
 	ga_error("[tid %ld] client connected from %s:%d\n",
 		ga_gettid(),
 		inet_ntoa(sin.sin_addr), htons(sin.sin_port));
 	//
-	ctx.fd = s;
+	ctx->fd = s;
+	return 0;
+}
+
+static void
+rtsp_client_close(RTSPContext *ctx) {
+	ctx->state = SERVER_STATE_TEARDOWN;
+	// 2014-05-20: support only share-encoder model
+	// unregister first, so that no packet is being sent on a closed fd
+	ff_server_unregister_client(ctx);
+	//
+	close(ctx->fd);
+	per_client_deinit(ctx);
+	pthread_mutex_destroy(&ctx->rtsp_writer_mutex);
+	return;
+}
+
+/**
+ * Handle a request (or an interleaved binary packet) from a client.
+ * Blocks until the whole request is read; event loops call it only when
+ * rtsp_request_ready() says the request is in the read buffer.
+ *
+ * @return 0 on success, or -1 if the connection has to be closed.
+ */
+static int
+rtsp_handle_request(RTSPContext *ctx, char *buf, size_t bufsize) {
+	const char *p;
+	char cmd[32], url[1024], protocol[32];
+	int rlen;
+	RTSPMessageHeader header1, *header = &header1;
+	// read commands
+	if((rlen = rtsp_getnext(ctx, buf, bufsize)) < 0) {
+		return -1;
+	}
+	// Interleaved binary data?
+	if(buf[0] == '$') {
+		handle_rtcp(ctx, buf, rlen);
+		return 0;
+	}
+	// REQUEST line
+	ga_error("%s", buf);
+	p = buf;
+	get_word(cmd, sizeof(cmd), &p);
+	get_word(url, sizeof(url), &p);
+	get_word(protocol, sizeof(protocol), &p);
+	// check protocol
+	if(strcmp(protocol, "RTSP/1.0") != 0) {
+		rtsp_reply_error(ctx, RTSP_STATUS_VERSION);
+		return -1;
+	}
+	// read headers
+	bzero(header, sizeof(*header));
+	do {
+		int myseq = -1;
+		char mysession[sizeof(header->session_id)] = "";
+		if((rlen = rtsp_getnext(ctx, buf, bufsize)) < 0)
+			return -1;
+		if(buf[0]=='\n' || (buf[0]=='\r' && buf[1]=='\n'))
+			break;
+#if 0
+		ga_error("HEADER: %s", buf);
+#endif
+		// Special handling to CSeq & Session header
+		// ff_rtsp_parse_line cannot handle CSeq & Session properly on Windows
+		// any more?
+		if(strncasecmp("CSeq: ", buf, 6) == 0) {
+			myseq = strtol(buf+6, NULL, 10);
+		}
+		if(strncasecmp("Session: ", buf, 9) == 0) {
+			strcpy(mysession, buf+9);
+		}
+		//
+		ff_rtsp_parse_line(header, buf, NULL, NULL);
+		//
+		if(myseq > 0 && header->seq <= 0) {
+			ga_error("WARNING: CSeq fixes applied (%d->%d).\n",
+				header->seq, myseq);
+			header->seq = myseq;
+		}
+		if(mysession[0] != '\0' && header->session_id[0]=='\0') {
+			unsigned i;
+			for(i = 0; i < sizeof(header->session_id)-1; i++) {
+				if(mysession[i] == '\0'
+				|| isspace(mysession[i])
+				|| mysession[i] == ';')
+					break;
+				header->session_id[i] = mysession[i];
+			}
+			header->session_id[i+1] = '\0';
+			ga_error("WARNING: Session fixes applied (%s)\n",
+				header->session_id);
+		}
+	} while(1);
+	// special handle to session_id
+	if(header->session_id != NULL) {
+		char *p = header->session_id;
+		while(*p != '\0') {
+			if(*p == '\r' || *p == '\n') {
+				*p = '\0';
+				break;
+			}
+			p++;
+		}
+	}
+	// handle commands
+	ctx->seq = header->seq;
+	if (!strcmp(cmd, "DESCRIBE"))
+		rtsp_cmd_describe(ctx, url);
+	else if (!strcmp(cmd, "OPTIONS"))
+		rtsp_cmd_options(ctx, url);
+	else if (!strcmp(cmd, "SETUP"))
+		rtsp_cmd_setup(ctx, url, header);
+	else if (!strcmp(cmd, "PLAY"))
+		rtsp_cmd_play(ctx, url, header);
+	else if (!strcmp(cmd, "PAUSE"))
+		rtsp_cmd_pause(ctx, url, header);
+	else if (!strcmp(cmd, "TEARDOWN"))
+		rtsp_cmd_teardown(ctx, url, header, 1);
+	else
+		rtsp_reply_error(ctx, RTSP_STATUS_METHOD);
+	return 0;
+}
+
+void*
+rtspserver(void *arg) {
+#ifdef WIN32
+	SOCKET s = *((SOCKET*) arg);
+#else
+	int s = *((int*) arg);
+#endif
+	char buf[8192];
+	RTSPContext ctx;
+	//int thread_ret;
+	// image info
+	//int iwidth = video_source_maxwidth(0);
+	//int iheight = video_source_maxheight(0);
+	//
+	if(rtsp_client_open(&ctx, s) < 0)
+		return NULL;
 	//
 	do {
 		int i, fdmax, active;
@@ -1113,136 +1507,393 @@ rtspserver(void *arg) {
 				continue;
 			recvfrom(ctx.rtpSocket[i], buf, sizeof(buf), 0,
 				(struct sockaddr*) &xsin, &xsinlen);
-			if(ctx.rtpPortChecked[i] != 0)
-				continue;
-			// XXX: port should not flip-flop, so check only once
-			if(xsin.sin_addr.s_addr != ctx.client.sin_addr.s_addr) {
-				ga_error("RTP: client address mismatched? %u.%u.%u.%u != %u.%u.%u.%u\n",
-					NIPQUAD(ctx.client.sin_addr.s_addr),
-					NIPQUAD(xsin.sin_addr.s_addr));
-				continue;
-			}
-			if(xsin.sin_port != ctx.rtpPeerPort[i]) {
-				ga_error("RTP: client port reconfigured: %u -> %u\n",
-					(unsigned int) ntohs(ctx.rtpPeerPort[i]),
-					(unsigned int) ntohs(xsin.sin_port));
-				ctx.rtpPeerPort[i] = xsin.sin_port;
-			} else {
-				ga_error("RTP: client is not under an NAT, port %d confirmed\n",
-					(int) ntohs(ctx.rtpPeerPort[i]));
-			}
-			ctx.rtpPortChecked[i] = 1;
+			rtp_check_peer(&ctx, i, &xsin);
 		}
 		// is RTSP connection?
 		if(FD_ISSET(ctx.fd, &rfds) == 0)
 			continue;
 #endif
-		// read commands
-		if((rlen = rtsp_getnext(&ctx, buf, sizeof(buf))) < 0) {
+		if(rtsp_handle_request(&ctx, buf, sizeof(buf)) < 0)
 			goto quit;
+		if(ctx.state == SERVER_STATE_TEARDOWN) {
+			break;
+		}
+	} while(1);
+quit:
+	rtsp_client_close(&ctx);
+	//ga_error("RTSP client thread terminated (%d/%d clients left).\n",
+	//	video_source_client_count(), audio_source_client_count());
+	ga_error("RTSP client thread terminated.\n");
+	//
+	return NULL;
+}
+
+#ifdef RTSP_EVENT_LOOP
+/*
+ * Event loops: each loop serves a share of the clients with one epoll
+ * instance, instead of one thread and one select() per client.  The RTSP
+ * connection and the RTP/RTCP sockets are non-blocking.  Encoder threads
+ * still packetize and send RTP directly; RTSP/TCP output that cannot be
+ * written at once is queued and flushed by the loop on EPOLLOUT.
+ */
+
+#define	RTSP_LOOP_EVENTS	256
+
+struct RTSPLoop {
+	int epfd;
+	int wakefd;		// eventfd for stopping the loop
+	volatile int running;
+	int clients;		// updated with atomic builtins
+	pthread_t tid;
+};
+
+static struct RTSPLoop rtsploop[RTSP_LOOP_MAX];
+static int rtsploops = 0;
+
+static int
+rtsp_loop_pollout(RTSPContext *ctx, int enable) {
+	struct epoll_event ev;
+	bzero(&ev, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP | (enable ? EPOLLOUT : 0);
+	ev.data.ptr = &ctx->evtag[0];
+	if(epoll_ctl(ctx->loop->epfd, EPOLL_CTL_MOD, ctx->fd, &ev) < 0) {
+		ga_error("RTSP: epoll_ctl(fd=%d) failed: %s\n", ctx->fd, strerror(errno));
+		return -1;
+	}
+	ctx->wpolled = enable;
+	return 0;
+}
+
+static int
+rtsp_set_nonblock(int fd) {
+	int flags;
+	if((flags = fcntl(fd, F_GETFL, 0)) < 0)
+		return -1;
+	return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/* poll the RTP/RTCP sockets opened by SETUP requests */
+static void
+rtsp_loop_watch_rtp(RTSPContext *ctx) {
+#ifdef HOLE_PUNCHING
+	int i;
+	struct epoll_event ev;
+	for(i = 0; i < 2*ctx->streamCount; i++) {
+		if(ctx->rtpSocket[i] <= 0 || ctx->rtpPolled[i] != 0)
+			continue;
+		// the sockets stay blocking: encoder threads send on them
+		bzero(&ev, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = &ctx->evtag[1+i];
+		if(epoll_ctl(ctx->loop->epfd, EPOLL_CTL_ADD, ctx->rtpSocket[i], &ev) < 0) {
+			ga_error("RTP: epoll_ctl(fd=%d) failed: %s\n",
+				ctx->rtpSocket[i], strerror(errno));
+			continue;
 		}
-		// Interleaved binary data?
-		if(buf[0] == '$') {
-			handle_rtcp(&ctx, buf, rlen);
+		ctx->rtpPolled[i] = 1;
+	}
+#endif
+	return;
+}
+
+/* is a whole request (or interleaved packet) in the read buffer? */
+static int
+rtsp_request_ready(RTSPContext *ctx) {
+	int i, linestart, linelen;
+	if(ctx->rbuftail == ctx->rbufhead)
+		return 0;
+	if(ctx->rbuffer[ctx->rbufhead] == '$') {
+		int reqlength;
+		if(ctx->rbuftail - ctx->rbufhead < 4)
+			return 0;
+		reqlength = (unsigned char) ctx->rbuffer[ctx->rbufhead+2];
+		reqlength <<= 8;
+		reqlength += (unsigned char) ctx->rbuffer[ctx->rbufhead+3];
+		return 4+reqlength <= ctx->rbuftail - ctx->rbufhead;
+	}
+	// request line, headers, and an empty line
+	linestart = ctx->rbufhead;
+	for(i = ctx->rbufhead; i < ctx->rbuftail; i++) {
+		if(ctx->rbuffer[i] != '\n')
 			continue;
+		linelen = i - linestart + 1;
+		if(linestart > ctx->rbufhead
+		&& (linelen == 1 || (linelen == 2 && ctx->rbuffer[linestart] == '\r')))
+			return 1;
+		linestart = i+1;
+	}
+	return 0;
+}
+
+/* read what is available, and handle the complete requests */
+static int
+rtsp_loop_read(RTSPContext *ctx, char *buf, size_t bufsize) {
+	int rlen;
+	if(rtsp_rbuffer_init(ctx) < 0)
+		return -1;
+	do {
+		if(ctx->rbufhead > 0) {
+			bcopy(ctx->rbuffer + ctx->rbufhead, ctx->rbuffer, ctx->rbuftail - ctx->rbufhead);
+			ctx->rbuftail -= ctx->rbufhead;
+			ctx->rbufhead = 0;
 		}
-		// REQUEST line
-		ga_error("%s", buf);
-		p = buf;
-		get_word(cmd, sizeof(cmd), &p);
-		get_word(url, sizeof(url), &p);
-		get_word(protocol, sizeof(protocol), &p);
-		// check protocol
-		if(strcmp(protocol, "RTSP/1.0") != 0) {
-			rtsp_reply_error(&ctx, RTSP_STATUS_VERSION);
-			goto quit;
+		if(ctx->rbuftail == ctx->rbufsize) {
+			ga_error("Buffer full: Extremely long request encountered?\n");
+			return -1;
 		}
-		// read headers
-		bzero(header, sizeof(*header));
-		do {
-			int myseq = -1;
-			char mysession[sizeof(header->session_id)] = "";
-			if((rlen = rtsp_getnext(&ctx, buf, sizeof(buf))) < 0)
-				goto quit;
-			if(buf[0]=='\n' || (buf[0]=='\r' && buf[1]=='\n'))
+		if((rlen = read(ctx->fd, ctx->rbuffer + ctx->rbuftail,
+				ctx->rbufsize - ctx->rbuftail)) == 0) {
+			return -1;
+		}
+		if(rlen < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
 				break;
-#if 0
-			ga_error("HEADER: %s", buf);
-#endif
-			// Special handling to CSeq & Session header
-			// ff_rtsp_parse_line cannot handle CSeq & Session properly on Windows
-			// any more?
-			if(strncasecmp("CSeq: ", buf, 6) == 0) {
-				myseq = strtol(buf+6, NULL, 10);
-			}
-			if(strncasecmp("Session: ", buf, 9) == 0) {
-				strcpy(mysession, buf+9);
-			}
-			//
-			ff_rtsp_parse_line(header, buf, NULL, NULL);
-			//
-			if(myseq > 0 && header->seq <= 0) {
-				ga_error("WARNING: CSeq fixes applied (%d->%d).\n",
-					header->seq, myseq);
-				header->seq = myseq;
-			}
-			if(mysession[0] != '\0' && header->session_id[0]=='\0') {
-				unsigned i;
-				for(i = 0; i < sizeof(header->session_id)-1; i++) {
-					if(mysession[i] == '\0'
-					|| isspace(mysession[i])
-					|| mysession[i] == ';')
-						break;
-					header->session_id[i] = mysession[i];
-				}
-				header->session_id[i+1] = '\0';
-				ga_error("WARNING: Session fixes applied (%s)\n",
-					header->session_id);
-			}
-		} while(1);
-		// special handle to session_id
-		if(header->session_id != NULL) {
-			char *p = header->session_id;
-			while(*p != '\0') {
-				if(*p == '\r' || *p == '\n') {
-					*p = '\0';
-					break;
-				}
-				p++;
-			}
+			return -1;
 		}
-		// handle commands
-		ctx.seq = header->seq;
-		if (!strcmp(cmd, "DESCRIBE"))
-			rtsp_cmd_describe(&ctx, url);
-		else if (!strcmp(cmd, "OPTIONS"))
-			rtsp_cmd_options(&ctx, url);
-		else if (!strcmp(cmd, "SETUP"))
-			rtsp_cmd_setup(&ctx, url, header);
-		else if (!strcmp(cmd, "PLAY"))
-			rtsp_cmd_play(&ctx, url, header);
-		else if (!strcmp(cmd, "PAUSE"))
-			rtsp_cmd_pause(&ctx, url, header);
-		else if (!strcmp(cmd, "TEARDOWN"))
-			rtsp_cmd_teardown(&ctx, url, header, 1);
-		else
-			rtsp_reply_error(&ctx, RTSP_STATUS_METHOD);
-		if(ctx.state == SERVER_STATE_TEARDOWN) {
+		ctx->rbuftail += rlen;
+		while(rtsp_request_ready(ctx) > 0) {
+			if(rtsp_handle_request(ctx, buf, bufsize) < 0)
+				return -1;
+			if(ctx->state == SERVER_STATE_TEARDOWN)
+				return -1;
+			rtsp_loop_watch_rtp(ctx);
+		}
+	} while(1);
+	return 0;
+}
+
+/* write the pending output */
+static int
+rtsp_loop_flush(RTSPContext *ctx) {
+	int ret = 0;
+	ssize_t wlen;
+	pthread_mutex_lock(&ctx->rtsp_writer_mutex);
+	while(ctx->wbufhead < ctx->wbuftail) {
+		if((wlen = send(ctx->fd, ctx->wbuffer + ctx->wbufhead,
+				ctx->wbuftail - ctx->wbufhead, MSG_NOSIGNAL)) < 0) {
+			if(errno == EINTR)
+				continue;
+			if(errno != EAGAIN && errno != EWOULDBLOCK)
+				ret = -1;
 			break;
 		}
+		ctx->wbufhead += wlen;
+	}
+	if(ctx->wbufhead == ctx->wbuftail) {
+		ctx->wbufhead = ctx->wbuftail = 0;
+		if(ctx->wdropped > 0) {
+			ga_error("RTSP: %d packets dropped (fd=%d)\n", ctx->wdropped, ctx->fd);
+			ctx->wdropped = 0;
+		}
+		if(ctx->wpolled != 0)
+			rtsp_loop_pollout(ctx, 0);
+	}
+	pthread_mutex_unlock(&ctx->rtsp_writer_mutex);
+	return ret;
+}
+
+#ifdef HOLE_PUNCHING
+static void
+rtsp_loop_recv_rtp(RTSPContext *ctx, int i, char *buf, size_t bufsize) {
+	struct sockaddr_in xsin;
+	socklen_t xsinlen;
+	do {
+		xsinlen = sizeof(xsin);
+		if(recvfrom(ctx->rtpSocket[i], buf, bufsize, MSG_DONTWAIT,
+				(struct sockaddr*) &xsin, &xsinlen) < 0) {
+			if(errno == EINTR)
+				continue;
+			break;
+		}
+		rtp_check_peer(ctx, i, &xsin);
 	} while(1);
-quit:
-	ctx.state = SERVER_STATE_TEARDOWN;
-	//
-	close(ctx.fd);
-	// 2014-05-20: support only share-encoder model
-	ff_server_unregister_client(&ctx);
-	//
-	per_client_deinit(&ctx);
-	//ga_error("RTSP client thread terminated (%d/%d clients left).\n",
-	//	video_source_client_count(), audio_source_client_count());
-	ga_error("RTSP client thread terminated.\n");
+	return;
+}
+#endif
+
+static void
+rtsp_loop_close(RTSPContext *ctx) {
+	struct RTSPLoop *loop = ctx->loop;
+	// closing the descriptors also removes them from the epoll set
+	rtsp_client_close(ctx);
+	if(ctx->wbuffer != NULL)
+		free(ctx->wbuffer);
+	free(ctx);
+	ga_error("RTSP client closed (%d clients left in the loop).\n",
+		__sync_sub_and_fetch(&loop->clients, 1));
+	return;
+}
+
+static void *
+rtsp_loop_main(void *arg) {
+	struct RTSPLoop *loop = (struct RTSPLoop*) arg;
+	struct epoll_event ev[RTSP_LOOP_EVENTS];
+	RTSPContext *closing[RTSP_LOOP_EVENTS];
+	char buf[8192];
+	int i, n, nclosing;
 	//
+	ga_error("RTSP event loop started (tid %ld).\n", ga_gettid());
+	while(loop->running) {
+		if((n = epoll_wait(loop->epfd, ev, RTSP_LOOP_EVENTS, -1)) < 0) {
+			if(errno == EINTR)
+				continue;
+			ga_error("epoll_wait() failed: %s\n", strerror(errno));
+			break;
+		}
+		nclosing = 0;
+		for(i = 0; i < n; i++) {
+			struct RTSPEventTag *tag = (struct RTSPEventTag*) ev[i].data.ptr;
+			RTSPContext *ctx;
+			if(tag == NULL)		// woken up for stopping
+				continue;
+			ctx = tag->ctx;
+			if(ctx->closing)
+				continue;
+#ifdef HOLE_PUNCHING
+			if(tag->index >= 0) {
+				rtsp_loop_recv_rtp(ctx, tag->index, buf, sizeof(buf));
+				continue;
+			}
+#endif
+			if((ev[i].events & EPOLLOUT) && rtsp_loop_flush(ctx) < 0)
+				ctx->closing = 1;
+			if(ctx->closing == 0
+			&& (ev[i].events & (EPOLLIN|EPOLLRDHUP|EPOLLHUP|EPOLLERR))
+			&& rtsp_loop_read(ctx, buf, sizeof(buf)) < 0)
+				ctx->closing = 1;
+			if(ctx->closing)
+				closing[nclosing++] = ctx;
+		}
+		// release after the batch: later events may refer to the same client
+		for(i = 0; i < nclosing; i++) {
+			rtsp_loop_close(closing[i]);
+		}
+	}
+	ga_error("RTSP event loop terminated (tid %ld).\n", ga_gettid());
 	return NULL;
 }
 
+/**
+ * Start event loops for serving RTSP clients.
+ *
+ * @param nloops [in] Number of loops (threads).
+ * @return 0 on success, or -1 on error.
+ */
+int
+rtspserver_loop_start(int nloops) {
+	int i;
+	struct epoll_event ev;
+	if(nloops > RTSP_LOOP_MAX)
+		nloops = RTSP_LOOP_MAX;
+	for(i = 0; i < nloops; i++) {
+		struct RTSPLoop *loop = &rtsploop[i];
+		bzero(loop, sizeof(*loop));
+		if((loop->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+			ga_error("RTSP: epoll_create1 failed: %s\n", strerror(errno));
+			goto failed;
+		}
+		if((loop->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+			ga_error("RTSP: eventfd failed: %s\n", strerror(errno));
+			close(loop->epfd);
+			goto failed;
+		}
+		bzero(&ev, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &ev);
+		loop->running = 1;
+		if(pthread_create(&loop->tid, NULL, rtsp_loop_main, loop) != 0) {
+			ga_error("RTSP: cannot create event loop thread.\n");
+			close(loop->wakefd);
+			close(loop->epfd);
+			goto failed;
+		}
+		rtsploops = i+1;
+	}
+	return 0;
+failed:
+	rtspserver_loop_stop();
+	return -1;
+}
+
+/**
+ * Stop the event loops.
+ * Clients still connected are left open, as with per-client threads.
+ */
+void
+rtspserver_loop_stop() {
+	int i;
+	uint64_t one = 1;
+	for(i = 0; i < rtsploops; i++) {
+		rtsploop[i].running = 0;
+		if(write(rtsploop[i].wakefd, &one, sizeof(one)) < 0) {
+			ga_error("RTSP: cannot wake up event loop #%d\n", i);
+		}
+	}
+	for(i = 0; i < rtsploops; i++) {
+		pthread_join(rtsploop[i].tid, NULL);
+		close(rtsploop[i].wakefd);
+		close(rtsploop[i].epfd);
+	}
+	rtsploops = 0;
+	return;
+}
+
+/**
+ * Serve an accepted connection with the least loaded event loop.
+ *
+ * @param s [in] The connected socket.
+ * @return 0 on success, or -1 on error (the socket is not closed).
+ */
+int
+rtspserver_attach(int s) {
+	int i;
+	struct RTSPLoop *loop;
+	struct epoll_event ev;
+	RTSPContext *ctx;
+	//
+	if(rtsploops <= 0)
+		return -1;
+	loop = &rtsploop[0];
+	for(i = 1; i < rtsploops; i++) {
+		if(rtsploop[i].clients < loop->clients)
+			loop = &rtsploop[i];
+	}
+	if((ctx = (RTSPContext*) malloc(sizeof(RTSPContext))) == NULL) {
+		ga_error("RTSP: cannot allocate client context.\n");
+		return -1;
+	}
+	if(rtsp_client_open(ctx, s) < 0) {
+		free(ctx);
+		return -1;
+	}
+	if(rtsp_set_nonblock(s) < 0) {
+		ga_error("RTSP: cannot set non-blocking mode (fd=%d).\n", s);
+		goto failed;
+	}
+	ctx->loop = loop;
+	ctx->evtag[0].ctx = ctx;
+	ctx->evtag[0].index = -1;
+	for(i = 0; i < RTSP_CHANNEL_MAXx2; i++) {
+		ctx->evtag[1+i].ctx = ctx;
+		ctx->evtag[1+i].index = i;
+	}
+	// the loop owns the client once it is added
+	bzero(&ev, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.ptr = &ctx->evtag[0];
+	if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, s, &ev) < 0) {
+		ga_error("RTSP: epoll_ctl(fd=%d) failed: %s\n", s, strerror(errno));
+		goto failed;
+	}
+	__sync_add_and_fetch(&loop->clients, 1);
+	return 0;
+failed:
+	per_client_deinit(ctx);
+	pthread_mutex_destroy(&ctx->rtsp_writer_mutex);
+	free(ctx);
+	return -1;
+}
+#endif	/* RTSP_EVENT_LOOP */
@@ -25,6 +25,7 @@
 #include "ga-common.h"
 #include "ga-avcodec.h"
 #include "server-ffmpeg.h"
+#include "rtpbatch.h"
 
 // acquired from ffmpeg source code
 #ifdef __cplusplus
@@ -42,6 +43,12 @@ int ffio_open_dyn_packet_buf(AVIOContext **, int);
 #define	RTSP_CHANNEL_MAX	8	// must be at least VIDEO_SOURCE_CHANNEL_MAX+1
 #define	RTSP_CHANNEL_MAXx2	16	// must be RTSP_CHANNEL_MAX * 2
 
+#ifdef __linux__
+#define	RTSP_EVENT_LOOP		// serve clients with epoll event loops
+#define	RTSP_LOOP_MAX		16	// max number of event loops
+#define	RTSP_WBUF_MAX		8388608	// max pending RTSP/TCP output per client
+#endif
+
 enum RTSPServerState {
 	SERVER_STATE_IDLE = 0,
 	SERVER_STATE_READY,
@@ -50,6 +57,18 @@ enum RTSPServerState {
 	SERVER_STATE_TEARDOWN
 };
 
+struct RTPPacer;
+
+#ifdef RTSP_EVENT_LOOP
+struct RTSPLoop;
+
+// attached to each descriptor polled by an event loop
+struct RTSPEventTag {
+	struct RTSPContext *ctx;
+	int index;		// -1 for the RTSP connection, or the rtpSocket index
+};
+#endif
+
 struct RTSPContext {
 #ifdef WIN32
 	SOCKET fd;
@@ -90,6 +109,7 @@ struct RTSPContext {
 	int mtu;
 	URLContext *rtp[RTSP_CHANNEL_MAX];	// RTP over UDP
 	pthread_mutex_t rtsp_writer_mutex;	// RTP over RTSP/TCP
+	struct RTPPacer *pacer;			// RTP/UDP pacing, or NULL
 #ifdef HOLE_PUNCHING
 	int streamCount;
 #ifdef WIN32
@@ -100,6 +120,26 @@ struct RTSPContext {
 	unsigned short rtpLocalPort[RTSP_CHANNEL_MAXx2];
 	unsigned short rtpPeerPort[RTSP_CHANNEL_MAXx2];
 	char rtpPortChecked[RTSP_CHANNEL_MAXx2];
+	// header fields for packets from the shared RTP packetizer
+	unsigned int rtpSsrc[RTSP_CHANNEL_MAX];
+	unsigned int rtpTsDelta[RTSP_CHANNEL_MAX];
+	unsigned short rtpSeqDelta[RTSP_CHANNEL_MAX];
+	unsigned int rtpPacketCount[RTSP_CHANNEL_MAX];
+	unsigned int rtpOctetCount[RTSP_CHANNEL_MAX];
+#endif
+#ifdef RTSP_EVENT_LOOP
+	// event loop
+	struct RTSPLoop *loop;	// serving loop, or NULL for a per-client thread
+	struct RTSPEventTag evtag[1+RTSP_CHANNEL_MAXx2];
+	char rtpPolled[RTSP_CHANNEL_MAXx2];
+	// pending output, written when the connection is writable again
+	char *wbuffer;
+	int wbufhead;
+	int wbuftail;
+	int wbufsize;
+	int wpolled;		// waiting for EPOLLOUT
+	int wdropped;		// RTP packets dropped since the last flush
+	int closing;
 #endif
 };
 
@@ -109,6 +149,13 @@ void* rtspserver(void *arg);
 #ifdef HOLE_PUNCHING
 int rtp_open_ports(RTSPContext *ctx, int streamid);
 int rtp_write_bindata(RTSPContext *ctx, int streamid, uint8_t *buf, int buflen);
+RTSPContext *rtp_shared_context(int streamid);
+int rtp_rewrite_bindata(RTSPContext *ctx, RTSPContext *prev, int streamid, uint8_t *buf, int buflen);
+#endif
+#ifdef RTSP_EVENT_LOOP
+int rtspserver_loop_start(int nloops);
+void rtspserver_loop_stop();
+int rtspserver_attach(int s);
 #endif
 
 #endif
@@ -30,12 +30,16 @@
 #endif	/* ! WIN32 */
 
 #include "ga-common.h"
+#include "ga-conf.h"
 #include "ga-module.h"
 #include "encoder-common.h"
+#include "vsource.h"
 #include "rtspconf.h"
+#include "rtp-fec.h"
 
 #include "server-ffmpeg.h"
 #include "rtspserver.h"
+#include "rtppacer.h"
 
 #include <map>
 using namespace std;
@@ -47,6 +51,10 @@ static int server_socket = -1;			/**< The server socket */
 #endif
 static pthread_t server_tid;
 static int server_started = 0;
+static int server_loops = 0;			/**< Number of event loops, or 0 for thread-per-client */
+static int server_shared_rtp = 1;		/**< Packetize once for all the clients */
+static int server_fec = 0;			/**< Protect RTP/UDP video packets with XOR parity */
+static rtp_fec_encoder_t server_fec_encoder[VIDEO_SOURCE_CHANNEL_MAX];
 static pthread_rwlock_t cclock = PTHREAD_RWLOCK_INITIALIZER;
 static map<void *, void *> client_context;
 
@@ -55,6 +63,7 @@ ff_server_register_client(void *ccontext) {
 	if(encoder_register_client(ccontext) < 0)
 		return -1;
 	//
+	rtp_pacer_attach((RTSPContext*) ccontext);
 	pthread_rwlock_wrlock(&cclock);
 	client_context[ccontext] = ccontext;
 	pthread_rwlock_unlock(&cclock);
@@ -69,6 +78,8 @@ ff_server_unregister_client(void *ccontext) {
 	pthread_rwlock_wrlock(&cclock);
 	client_context.erase(ccontext);
 	pthread_rwlock_unlock(&cclock);
+	// no more packets: senders hold cclock
+	rtp_pacer_detach((RTSPContext*) ccontext);
 	return 0;
 }
 
@@ -104,6 +115,15 @@ ff_server_main(void *arg) {
 			}
 		} while(0);
 		//
+#ifdef RTSP_EVENT_LOOP
+		if(server_loops > 0) {
+			if(rtspserver_attach(cs) < 0) {
+				close(cs);
+				ga_error("ffmpeg-server: cannot serve the client.\n");
+			}
+			continue;
+		}
+#endif
 		pthread_cancel_init();
 		if(pthread_create(&thread, NULL, rtspserver, &cs) != 0) {
 			close(cs);
@@ -148,13 +168,61 @@ ff_server_init(void *arg) {
 		perror("listen");
 		return -1;
 	}
+	server_shared_rtp = ga_conf_readbool("ffmpeg-server-shared-rtp", 1);
+	// XOR parity for RTP/UDP video packets
+	if((server_fec = ga_conf_readbool("ffmpeg-server-fec", 0)) != 0) {
+		int i, block = ga_conf_readint("ffmpeg-server-fec-block");
+		double ratio = ga_conf_readdouble("ffmpeg-server-fec-ratio");
+		if(block <= 0)
+			block = 20;
+		if(ratio <= 0.0)
+			ratio = 0.1;
+		for(i = 0; i < VIDEO_SOURCE_CHANNEL_MAX; i++)
+			rtp_fec_encoder_init(&server_fec_encoder[i], block, ratio);
+		ga_error("ffmpeg-server: FEC enabled, block=%d packets, ratio=%.2f.\n",
+			server_fec_encoder[0].blocksize, server_fec_encoder[0].ratio);
+	}
+	rtp_pacer_config();
+#ifdef RTP_BATCH_SEND
+	rtp_batch_config(ga_conf_readbool("ffmpeg-server-udp-batch", 1),
+			ga_conf_readbool("ffmpeg-server-udp-gso", 1));
+#endif
+	// serve clients with event loops (default: 1), or a thread per client (0)
+#ifdef RTSP_EVENT_LOOP
+	do {
+		char buf[64];
+		if(ga_conf_readv("ffmpeg-server-loops", buf, sizeof(buf)) == NULL) {
+			server_loops = 1;
+		} else if((server_loops = ga_conf_readint("ffmpeg-server-loops")) < 0) {
+			server_loops = 0;
+		} else if(server_loops > RTSP_LOOP_MAX) {
+			server_loops = RTSP_LOOP_MAX;
+		}
+		ga_error("ffmpeg-server: %d event loop(s)%s.\n", server_loops,
+			server_loops == 0 ? ", thread-per-client" : "");
+	} while(0);
+#endif
 	return 0;
 }
 
 static int
 ff_server_start(void *arg) {
+#ifdef RTSP_EVENT_LOOP
+	if(server_loops > 0 && rtspserver_loop_start(server_loops) < 0) {
+		ga_error("start ffmpeg-server event loops failed.\n");
+		return -1;
+	}
+#endif
+	if(rtp_pacer_start() < 0) {
+		ga_error("start ffmpeg-server pacer failed, packets are not paced.\n");
+	}
 	if(pthread_create(&server_tid, NULL, ff_server_main, NULL) != 0) {
 		ga_error("start ffmpeg-server failed.\n");
+#ifdef RTSP_EVENT_LOOP
+		if(server_loops > 0)
+			rtspserver_loop_stop();
+#endif
+		rtp_pacer_stop();
 		return -1;
 	}
 	return 0;
@@ -167,6 +235,11 @@ ff_server_stop(void *arg) {
 	pthread_cancel(server_tid);
 	ga_error("wait for ffmpeg-server termination ...\n");
 	pthread_join(server_tid, &x);
+#ifdef RTSP_EVENT_LOOP
+	if(server_loops > 0)
+		rtspserver_loop_stop();
+#endif
+	rtp_pacer_stop();
 	return 0;
 }
 
@@ -179,25 +252,24 @@ ff_server_deinit(void *arg) {
 	if(server_socket >= 0)		{ close(server_socket); }
 	server_socket = -1;
 #endif
+	if(server_fec != 0) {
+		int i;
+		for(i = 0; i < VIDEO_SOURCE_CHANNEL_MAX; i++)
+			rtp_fec_encoder_deinit(&server_fec_encoder[i]);
+		server_fec = 0;
+	}
 	return 0;
 }
 
+#ifdef HOLE_PUNCHING
+/* packetize a packet with the RTP muxer of a context */
 static int
-ff_server_send_packet_1(const char *prefix, void *ctx, int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv) {
-	int iolen;
-	uint8_t *iobuf;
-	RTSPContext *rtsp = (RTSPContext*) ctx;
-	//
-	if(rtsp->fmtctx[channelId] == NULL) {
-		// not initialized - disabled?
-		return 0;
-	}
+ff_server_packetize(const char *prefix, RTSPContext *rtsp, int channelId, AVPacket *pkt, int64_t encoderPts, uint8_t **iobuf) {
 	if(encoderPts != (int64_t) AV_NOPTS_VALUE) {
 		pkt->pts = av_rescale_q(encoderPts,
 				rtsp->encoder[channelId]->time_base,
 				rtsp->stream[channelId]->time_base);
 	}
-#ifdef HOLE_PUNCHING
 	if(ffio_open_dyn_packet_buf(&rtsp->fmtctx[channelId]->pb, rtsp->mtu) < 0) {
 		ga_error("%s: buffer allocation failed.\n", prefix);
 		return -1;
@@ -206,22 +278,73 @@ ff_server_send_packet_1(const char *prefix, void *ctx, int channelId, AVPacket *
 		ga_error("%s: write failed.\n", prefix);
 		return -1;
 	}
-	iolen = avio_close_dyn_buf(rtsp->fmtctx[channelId]->pb, &iobuf);
+	return avio_close_dyn_buf(rtsp->fmtctx[channelId]->pb, iobuf);
+}
+
+static int
+ff_server_write(const char *prefix, RTSPContext *rtsp, int channelId, uint8_t *iobuf, int iolen) {
 	if(rtsp->lower_transport[channelId] == RTSP_LOWER_TRANSPORT_TCP) {
 		if(rtsp_write_bindata(rtsp, channelId, iobuf, iolen) < 0) {
-			av_free(iobuf);
 			ga_error("%s: RTSP write failed.\n", prefix);
 			return -1;
 		}
+	} else if(rtsp->pacer != NULL) {
+		if(rtp_pacer_enqueue(rtsp, channelId, iobuf, iolen) < 0) {
+			ga_error("%s: RTP pacing failed.\n", prefix);
+			return -1;
+		}
 	} else {
 		if(rtp_write_bindata(rtsp, channelId, iobuf, iolen) < 0) {
-			av_free(iobuf);
 			ga_error("%s: RTP write failed.\n", prefix);
 			return -1;
 		}
 	}
+	return 0;
+}
+
+/* generate parity packets for a packetized video buffer */
+static int
+ff_server_fec(int channelId, uint8_t *iobuf, int iolen, uint8_t **fecbuf) {
+	int feclen;
+	if(server_fec == 0 || channelId >= video_source_channels())
+		return 0;
+	if((feclen = rtp_fec_encode(&server_fec_encoder[channelId], iobuf, iolen, fecbuf)) < 0) {
+		ga_error("ffmpeg-server: FEC buffer allocation failed.\n");
+		return 0;
+	}
+	return feclen;
+}
+#endif
+
+static int
+ff_server_send_packet_1(const char *prefix, void *ctx, int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv) {
+	RTSPContext *rtsp = (RTSPContext*) ctx;
+#ifdef HOLE_PUNCHING
+	int iolen, feclen, ret;
+	uint8_t *iobuf, *fecbuf;
+#endif
+	//
+	if(rtsp->fmtctx[channelId] == NULL) {
+		// not initialized - disabled?
+		return 0;
+	}
+#ifdef HOLE_PUNCHING
+	if((iolen = ff_server_packetize(prefix, rtsp, channelId, pkt, encoderPts, &iobuf)) < 0)
+		return -1;
+	ret = ff_server_write(prefix, rtsp, channelId, iobuf, iolen);
+	// parity is useless over TCP
+	if(ret == 0 && rtsp->lower_transport[channelId] != RTSP_LOWER_TRANSPORT_TCP
+	&& (feclen = ff_server_fec(channelId, iobuf, iolen, &fecbuf)) > 0) {
+		ret = ff_server_write(prefix, rtsp, channelId, fecbuf, feclen);
+	}
 	av_free(iobuf);
+	return ret;
 #else
+	if(encoderPts != (int64_t) AV_NOPTS_VALUE) {
+		pkt->pts = av_rescale_q(encoderPts,
+				rtsp->encoder[channelId]->time_base,
+				rtsp->stream[channelId]->time_base);
+	}
 	if(rtsp->lower_transport[channelId] == RTSP_LOWER_TRANSPORT_TCP) {
 		//if(avio_open_dyn_buf(&rtsp->fmtctx[channelId]->pb) < 0)
 		if(ffio_open_dyn_packet_buf(&rtsp->fmtctx[channelId]->pb, rtsp->mtu) < 0) {
@@ -248,10 +371,53 @@ ff_server_send_packet_1(const char *prefix, void *ctx, int channelId, AVPacket *
 	return 0;
 }
 
+#ifdef HOLE_PUNCHING
+/* packetize once with the shared packetizer, and rewrite for each client */
+static int
+ff_server_send_packet_shared(const char *prefix, RTSPContext *shared, int channelId, AVPacket *pkt, int64_t encoderPts) {
+	map<void*, void*>::iterator mi;
+	int iolen, feclen;
+	uint8_t *iobuf, *fecbuf;
+	RTSPContext *rtsp, *prev = NULL, *fecprev = NULL;
+	//
+	if((iolen = ff_server_packetize(prefix, shared, channelId, pkt, encoderPts, &iobuf)) < 0)
+		return -1;
+	// parity is generated once, too: rtp_rewrite_bindata() rewrites parity packets
+	feclen = ff_server_fec(channelId, iobuf, iolen, &fecbuf);
+	// the buffers are rewritten in place: sends do not keep references to them
+	for(mi = client_context.begin(); mi != client_context.end(); mi++) {
+		rtsp = (RTSPContext*) mi->second;
+		if(rtsp->fmtctx[channelId] == NULL)
+			continue;
+		rtp_rewrite_bindata(rtsp, prev, channelId, iobuf, iolen);
+		ff_server_write(prefix, rtsp, channelId, iobuf, iolen);
+		prev = rtsp;
+		if(feclen > 0 && rtsp->lower_transport[channelId] != RTSP_LOWER_TRANSPORT_TCP) {
+			rtp_rewrite_bindata(rtsp, fecprev, channelId, fecbuf, feclen);
+			ff_server_write(prefix, rtsp, channelId, fecbuf, feclen);
+			fecprev = rtsp;
+		}
+	}
+	av_free(iobuf);
+	return 0;
+}
+#endif
+
 static int
 ff_server_send_packet(const char *prefix, int channelId, AVPacket *pkt, int64_t encoderPts, struct timeval *ptv) {
 	map<void*, void*>::iterator mi;
+#ifdef HOLE_PUNCHING
+	RTSPContext *shared;
+#endif
 	pthread_rwlock_rdlock(&cclock);
+#ifdef HOLE_PUNCHING
+	if(server_shared_rtp && client_context.size() > 0
+	&& (shared = rtp_shared_context(channelId)) != NULL) {
+		ff_server_send_packet_shared(prefix, shared, channelId, pkt, encoderPts);
+		pthread_rwlock_unlock(&cclock);
+		return 0;
+	}
+#endif
 	for(mi = client_context.begin(); mi != client_context.end(); mi++) {
 		ff_server_send_packet_1(prefix, mi->second, channelId, pkt, encoderPts, ptv);
 	}
@@ -259,6 +425,24 @@ ff_server_send_packet(const char *prefix, int channelId, AVPacket *pkt, int64_t
 	return 0;
 }
 
+static int
+ff_server_ioctl(int command, int argsize, void *arg) {
+	ga_ioctl_reconfigure_t *reconf = (ga_ioctl_reconfigure_t*) arg;
+	//
+	switch(command) {
+	case GA_IOCTL_RECONFIGURE:
+		// follow the encoder bitrate for pacing
+		if(argsize != sizeof(ga_ioctl_reconfigure_t))
+			return GA_IOCTL_ERR_INVALID_ARGUMENT;
+		if(reconf->id == 0)
+			rtp_pacer_set_target(reconf->bitrateKbps);
+		break;
+	default:
+		return GA_IOCTL_ERR_NOTSUPPORTED;
+	}
+	return 0;
+}
+
 ga_module_t *
 module_load() {
 	static ga_module_t m;
@@ -271,6 +455,7 @@ module_load() {
 	m.stop = ff_server_stop;
 	m.deinit = ff_server_deinit;
 	m.send_packet = ff_server_send_packet;
+	m.ioctl = ff_server_ioctl;
 	//
 	encoder_register_sinkserver(&m);
 	//
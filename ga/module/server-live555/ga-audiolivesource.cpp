@@ -16,12 +16,14 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <list>
+
 #include "ga-common.h"
 #include "encoder-common.h"
 #include "ga-audiolivesource.h"
 #include "ga-liveserver.h"
 
-static GAAudioLiveSource *aLiveSource = NULL;
+static std::list<GAAudioLiveSource*> aLiveSource;
 static void signalNewAudioFrameData(int channelId);
 
 EventTriggerId GAAudioLiveSource::eventTriggerId = 0;
@@ -35,6 +37,9 @@ GAAudioLiveSource * GAAudioLiveSource
 GAAudioLiveSource
 ::GAAudioLiveSource(UsageEnvironment& env, int cid)
 		: FramedSource(env) {
+	// each source reads the packet queue with its own cursor
+	this->channelId = cid;
+	this->readerId = encoder_pktqueue_reader_open(cid);
 	//
 	if (referenceCount == 0) {
 		// Any global initialization of the device would be done here:
@@ -43,8 +48,7 @@ GAAudioLiveSource
 	}
 	++referenceCount;
 	// Any instance-specific initialization of the device would be done here:
-	this->channelId = cid;
-	aLiveSource = this;
+	aLiveSource.push_back(this);
 	if (eventTriggerId == 0) {
 		eventTriggerId = envir().taskScheduler().createEventTrigger(deliverFrame0);
 		encoder_pktqueue_register_callback(cid, signalNewAudioFrameData);
@@ -54,7 +58,9 @@ GAAudioLiveSource
 GAAudioLiveSource
 ::~GAAudioLiveSource() {
 	// Any instance-specific 'destruction' (i.e., resetting) of the device would be done here:
-	aLiveSource = NULL;
+	aLiveSource.remove(this);
+	if (this->readerId >= 0)
+		encoder_pktqueue_reader_close(this->channelId, this->readerId);
 	--referenceCount;
 	if (referenceCount == 0) {
 		// Any global 'destruction' (i.e., resetting) of the device would be done here:
@@ -67,19 +73,25 @@ GAAudioLiveSource
 
 void GAAudioLiveSource
 ::deliverFrame0(void* clientData) {
-	((GAAudioLiveSource*) clientData)->deliverFrame();
+	// clientData is the list of audio sources
+	std::list<GAAudioLiveSource*> *sources = (std::list<GAAudioLiveSource*>*) clientData;
+	std::list<GAAudioLiveSource*>::iterator li;
+	for(li = sources->begin(); li != sources->end(); ) {
+		GAAudioLiveSource *source = *li++;
+		source->deliverFrame();
+	}
 }
 
 void GAAudioLiveSource
 ::doGetNextFrame() {
 	// This function is called (by our 'downstream' object) when it asks for new data.
 	// Note: If, for some reason, the source device stops being readable (e.g., it gets closed), then you do the following:
-	if (0 /* the source stops being readable */ /*%%% TO BE WRITTEN %%%*/) {
+	if (this->readerId < 0 /* the source stops being readable */) {
 		handleClosure(NULL);
 		return;
 	}
 	// If a new frame of data is immediately available to be delivered, then do this now:
-	if (encoder_pktqueue_size(this->channelId) > 0) {
+	if (encoder_pktqueue_size(this->channelId, this->readerId) > 0) {
 		deliverFrame();
 	}
 	// No new data is immediately available to be delivered.  We don't do anything more here.
@@ -111,12 +123,13 @@ void GAAudioLiveSource
 	// Note the code below.
 
 	if (!isCurrentlyAwaitingData()) return; // we're not ready for the data yet
+	if (readerId < 0) return;
 
 	encoder_packet_t pkt;
 	u_int8_t* newFrameDataStart = NULL; //%%% TO BE WRITTEN %%%
 	unsigned newFrameSize = 0; //%%% TO BE WRITTEN %%%
 
-	newFrameDataStart = (u_int8_t*) encoder_pktqueue_front(this->channelId, &pkt);
+	newFrameDataStart = (u_int8_t*) encoder_pktqueue_front(this->channelId, this->readerId, &pkt);
 	if(newFrameDataStart == NULL)
 		return;
 	newFrameSize = pkt.size;
@@ -133,7 +146,7 @@ void GAAudioLiveSource
 	// If the device is *not* a 'live source' (e.g., it comes instead from a file or buffer), then set "fDurationInMicroseconds" here.
 	memmove(fTo, newFrameDataStart, fFrameSize);
 
-	encoder_pktqueue_pop_front(channelId);
+	encoder_pktqueue_pop_front(channelId, readerId);
 
 	// After delivering the data, inform the reader that it is now available:
 	FramedSource::afterGetting(this);
@@ -142,10 +155,10 @@ void GAAudioLiveSource
 static void
 signalNewAudioFrameData(int channelId) {
 	TaskScheduler* ourScheduler = (TaskScheduler*) liveserver_taskscheduler(); //%%% TO BE WRITTEN %%%
-	GAAudioLiveSource* ourDevice = aLiveSource; //%%% TO BE WRITTEN %%%
+	std::list<GAAudioLiveSource*> *ourDevices = &aLiveSource; //%%% TO BE WRITTEN %%%
 
 	if (ourScheduler != NULL) { // sanity check
-		ourScheduler->triggerEvent(GAAudioLiveSource::eventTriggerId, ourDevice);
+		ourScheduler->triggerEvent(GAAudioLiveSource::eventTriggerId, ourDevices);
 	}
 }
 
@@ -31,6 +31,7 @@ protected:
 private:
 	static unsigned referenceCount;
 	int channelId;
+	int readerId;
 	//
 	static void deliverFrame0(void* clientData);
 	void doGetNextFrame();
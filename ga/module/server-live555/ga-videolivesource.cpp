@@ -16,6 +16,8 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <list>
+
 #include "ga-common.h"
 #include "vsource.h"
 #include "encoder-common.h"
@@ -24,7 +26,7 @@
 #include "ga-videolivesource.h"
 #include "ga-liveserver.h"
 
-static GAVideoLiveSource *vLiveSource[VIDEO_SOURCE_CHANNEL_MAX];
+static std::list<GAVideoLiveSource*> vLiveSource[VIDEO_SOURCE_CHANNEL_MAX];
 static EventTriggerId eventTriggerId[VIDEO_SOURCE_CHANNEL_MAX];
 static void signalNewVideoFrameData(int channelId);
 
@@ -41,6 +43,10 @@ GAVideoLiveSource * GAVideoLiveSource
 GAVideoLiveSource
 ::GAVideoLiveSource(UsageEnvironment& env, int cid)
 		: FramedSource(env) {
+	// each source reads the packet queue with its own cursor,
+	// so it has to be opened before the encoders are started
+	this->channelId = cid;
+	this->readerId = encoder_pktqueue_reader_open(cid);
 	//
 	if (referenceCount == 0) {
 		// Any global initialization of the device would be done here:
@@ -52,8 +58,7 @@ GAVideoLiveSource
 	}
 	++referenceCount;
 	// Any instance-specific initialization of the device would be done here:
-	this->channelId = cid;
-	vLiveSource[cid] = this;
+	vLiveSource[cid].push_back(this);
 	if (eventTriggerId[cid] == 0) {
 		eventTriggerId[cid] = envir().taskScheduler().createEventTrigger(deliverFrame0);
 		encoder_pktqueue_register_callback(this->channelId, signalNewVideoFrameData);
@@ -63,35 +68,45 @@ GAVideoLiveSource
 GAVideoLiveSource
 ::~GAVideoLiveSource() {
 	// Any instance-specific 'destruction' (i.e., resetting) of the device would be done here:
-	vLiveSource[this->channelId] = NULL;
+	vLiveSource[this->channelId].remove(this);
+	if (this->readerId >= 0)
+		encoder_pktqueue_reader_close(this->channelId, this->readerId);
+	if (vLiveSource[this->channelId].empty()) {
+		encoder_pktqueue_unregister_callback(this->channelId, signalNewVideoFrameData);
+		// Reclaim our 'event trigger'
+		envir().taskScheduler().deleteEventTrigger(eventTriggerId[this->channelId]);
+		eventTriggerId[this->channelId] = 0;
+	}
 	--referenceCount;
 	if (referenceCount == 0) {
 		// Any global 'destruction' (i.e., resetting) of the device would be done here:
 		live_server_unregister_client(this);
 		remove_startcode = 0;
 		m = NULL;
-		encoder_pktqueue_unregister_callback(this->channelId, signalNewVideoFrameData);
-		// Reclaim our 'event trigger'
-		envir().taskScheduler().deleteEventTrigger(eventTriggerId[this->channelId]);
-		eventTriggerId[this->channelId] = 0;
 	}
 }
 
 void GAVideoLiveSource
 ::deliverFrame0(void* clientData) {
-	((GAVideoLiveSource*) clientData)->deliverFrame();
+	// clientData is the list of sources of a channel
+	std::list<GAVideoLiveSource*> *sources = (std::list<GAVideoLiveSource*>*) clientData;
+	std::list<GAVideoLiveSource*>::iterator li;
+	for(li = sources->begin(); li != sources->end(); ) {
+		GAVideoLiveSource *source = *li++;
+		source->deliverFrame();
+	}
 }
 
 void GAVideoLiveSource
 ::doGetNextFrame() {
 	// This function is called (by our 'downstream' object) when it asks for new data.
 	// Note: If, for some reason, the source device stops being readable (e.g., it gets closed), then you do the following:
-	if (0 /* the source stops being readable */ /*%%% TO BE WRITTEN %%%*/) {
+	if (this->readerId < 0 /* the source stops being readable */) {
 		handleClosure(NULL);
 		return;
 	}
 	// If a new frame of data is immediately available to be delivered, then do this now:
-	if (encoder_pktqueue_size(this->channelId) > 0) {
+	if (encoder_pktqueue_size(this->channelId, this->readerId) > 0) {
 		deliverFrame();
 	}
 	// No new data is immediately available to be delivered.  We don't do anything more here.
@@ -123,12 +138,13 @@ void GAVideoLiveSource
 	// Note the code below.
 
 	if (!isCurrentlyAwaitingData()) return; // we're not ready for the data yet
+	if (readerId < 0) return;
 
 	encoder_packet_t pkt;
 	u_int8_t* newFrameDataStart = NULL; //%%% TO BE WRITTEN %%%
 	unsigned newFrameSize = 0; //%%% TO BE WRITTEN %%%
 
-	newFrameDataStart = (u_int8_t*) encoder_pktqueue_front(this->channelId, &pkt);
+	newFrameDataStart = (u_int8_t*) encoder_pktqueue_front(this->channelId, this->readerId, &pkt);
 	if(newFrameDataStart == NULL)
 		return;
 	newFrameSize = pkt.size;
@@ -154,7 +170,7 @@ void GAVideoLiveSource
 		fNumTruncatedBytes = newFrameSize - fMaxSize;
 		ga_error("video encoder: packet truncated (%d > %d).\n", newFrameSize, fMaxSize);
 #else		// for regular H264Framer
-		encoder_pktqueue_split_packet(this->channelId, (char*) newFrameDataStart + fMaxSize);
+		encoder_pktqueue_split_packet(this->channelId, this->readerId, (char*) newFrameDataStart + fMaxSize);
 #endif
 	} else {
 		fFrameSize = newFrameSize;
@@ -164,7 +180,7 @@ void GAVideoLiveSource
 	// If the device is *not* a 'live source' (e.g., it comes instead from a file or buffer), then set "fDurationInMicroseconds" here.
 	memmove(fTo, newFrameDataStart, fFrameSize);
 
-	encoder_pktqueue_pop_front(channelId);
+	encoder_pktqueue_pop_front(channelId, readerId);
 
 	// After delivering the data, inform the reader that it is now available:
 	FramedSource::afterGetting(this);
@@ -173,10 +189,10 @@ void GAVideoLiveSource
 static void
 signalNewVideoFrameData(int channelId) {
 	TaskScheduler* ourScheduler = (TaskScheduler*) liveserver_taskscheduler(); //%%% TO BE WRITTEN %%%
-	GAVideoLiveSource* ourDevice = vLiveSource[channelId]; //%%% TO BE WRITTEN %%%
+	std::list<GAVideoLiveSource*> *ourDevices = &vLiveSource[channelId]; //%%% TO BE WRITTEN %%%
 
 	if (ourScheduler != NULL) { // sanity check
-		ourScheduler->triggerEvent(eventTriggerId[channelId], ourDevice);
+		ourScheduler->triggerEvent(eventTriggerId[channelId], ourDevices);
 	}
 }
 
@@ -34,6 +34,7 @@ private:
 	static int remove_startcode;
 	static ga_module_t *m;
 	int channelId;
+	int readerId;
 	//
 	static void deliverFrame0(void* clientData);
 	void doGetNextFrame();
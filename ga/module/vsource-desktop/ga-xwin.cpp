@@ -37,6 +37,13 @@ static XImage *image = NULL;
 static XShmSegmentInfo __xshminfo;
 static bool __xshmattached = false;
 
+#ifdef HAVE_XDAMAGE
+static Damage damage = None;
+static XserverRegion damageregion = None;
+static int damageEventBase = 0;
+static int damagefull = 0;
+#endif
+
 int
 ga_xwin_init(const char *displayname, gaImage *gaimg) {
 	int ignore = 0;
@@ -111,6 +118,16 @@ xcap_init_error:
 void
 //ga_xwin_deinit(Display *display, XImage *image) {
 ga_xwin_deinit() {
+#ifdef HAVE_XDAMAGE
+	if(damage != None) {
+		XDamageDestroy(display, damage);
+		damage = None;
+	}
+	if(damageregion != None) {
+		XFixesDestroyRegion(display, damageregion);
+		damageregion = None;
+	}
+#endif
 	//
 	if(__xshmattached) {
 		XShmDetach(display, &__xshminfo);
@@ -174,3 +191,157 @@ ga_xwin_capture(char *buf, int buflen, struct gaRect *rect) {
 	return;
 }
 
+/**
+ * Grab the screen into the shared memory image without copying it out.
+ *
+ * @param stride [out] Bytes per line of the returned image.
+ * @param rect [in] The region to grab, or NULL for the full screen.
+ * @return Pointer to the top-left pixel of the (cropped) image.
+ *
+ * The image stays valid until the next capture call.
+ */
+const unsigned char *
+ga_xwin_capture_shm(int *stride, struct gaRect *rect) {
+	if(XShmGetImage(display, rootWindow, image, 0, 0, XAllPlanes()) == 0) {
+		ga_error("FATAL: XShmGetImage failed.\n");
+		exit(-1);
+	}
+	return ga_xwin_image(stride, rect);
+}
+
+/**
+ * Get the last grabbed image in the shared memory segment.
+ *
+ * @param stride [out] Bytes per line of the returned image.
+ * @param rect [in] The captured region, or NULL for the full screen.
+ * @return Pointer to the top-left pixel of the (cropped) image.
+ */
+const unsigned char *
+ga_xwin_image(int *stride, struct gaRect *rect) {
+	const unsigned char *src = (const unsigned char *) image->data;
+	if(rect != NULL) {
+		src += image->bytes_per_line * rect->top;
+		src += RGBA_SIZE * rect->left;
+	}
+	*stride = image->bytes_per_line;
+	return src;
+}
+
+#ifdef HAVE_XDAMAGE
+/**
+ * Start tracking damaged regions of the root window.
+ *
+ * @return 0 on success, or -1 if XDamage is not supported.
+ *
+ * Once enabled, use ga_xwin_capture_damage() to capture frames.
+ */
+int
+ga_xwin_damage_init() {
+	int major = 1, minor = 1, ignore;
+	if(XDamageQueryExtension(display, &damageEventBase, &ignore) == False
+	|| XDamageQueryVersion(display, &major, &minor) == 0) {
+		ga_error("XDamage extension not supported.\n");
+		return -1;
+	}
+	if(XFixesQueryExtension(display, &ignore, &ignore) == False) {
+		ga_error("XFixes extension not supported.\n");
+		return -1;
+	}
+	damage = XDamageCreate(display, rootWindow, XDamageReportNonEmpty);
+	damageregion = XFixesCreateRegion(display, NULL, 0);
+	damagefull = 1;
+	ga_error("XDamage extension version %d.%d\n", major, minor);
+	return 0;
+}
+
+/**
+ * Add a rectangle to a dirty list. This is an internal function.
+ *
+ * If the list is full, all the rectangles are merged into the bounding box.
+ */
+static void
+ga_xwin_dirty_add(struct gaRect *dirty, int *count, int maxdirty,
+		int left, int top, int right, int bottom) {
+	int i;
+	if(*count >= maxdirty) {
+		for(i = 0; i < *count; i++) {
+			if(dirty[i].left < left)	left = dirty[i].left;
+			if(dirty[i].top < top)		top = dirty[i].top;
+			if(dirty[i].right > right)	right = dirty[i].right;
+			if(dirty[i].bottom > bottom)	bottom = dirty[i].bottom;
+		}
+		*count = 0;
+	}
+	ga_fillrect(&dirty[(*count)++], left, top, right, bottom);
+	return;
+}
+
+/**
+ * Update the damaged part of the shared memory image.
+ *
+ * @param rect [in] The captured region, or NULL for the full screen.
+ * @param dirty [out] Changed regions, relative to \a rect.
+ * @param maxdirty [in] Capacity of \a dirty.
+ * @return Number of regions in \a dirty, or 0 if nothing has changed.
+ *
+ * Only the rows covered by the damage are grabbed.
+ * The first call after ga_xwin_damage_init() reports the whole region.
+ * Read the image with ga_xwin_image().
+ */
+int
+ga_xwin_capture_damage(struct gaRect *rect, struct gaRect *dirty, int maxdirty) {
+	XRectangle *rects;
+	XEvent ev;
+	char *data;
+	int i, n = 0, count = 0;
+	int x0, y0, x1, y1, top, bottom;
+	//
+	x0 = rect ? rect->left : 0;
+	y0 = rect ? rect->top : 0;
+	x1 = rect ? rect->right : width - 1;
+	y1 = rect ? rect->bottom : height - 1;
+	top = y1 + 1;
+	bottom = y0 - 1;
+	// notifications are not needed: the damage is fetched below
+	while(XCheckTypedEvent(display, damageEventBase + XDamageNotify, &ev))
+		;
+	XDamageSubtract(display, damage, None, damageregion);
+	if(damagefull != 0) {
+		ga_xwin_dirty_add(dirty, &count, maxdirty, 0, 0, x1 - x0, y1 - y0);
+		top = y0;
+		bottom = y1;
+		damagefull = 0;
+	} else if((rects = XFixesFetchRegion(display, damageregion, &n)) != NULL) {
+		for(i = 0; i < n; i++) {
+			int l = rects[i].x, t = rects[i].y;
+			int r = l + rects[i].width - 1, b = t + rects[i].height - 1;
+			if(l < x0)	l = x0;
+			if(t < y0)	t = y0;
+			if(r > x1)	r = x1;
+			if(b > y1)	b = y1;
+			if(l > r || t > b)
+				continue;
+			ga_xwin_dirty_add(dirty, &count, maxdirty, l - x0, t - y0, r - x0, b - y0);
+			if(t < top)	top = t;
+			if(b > bottom)	bottom = b;
+		}
+		XFree(rects);
+	}
+	if(count == 0)
+		return 0;
+	// grab the damaged rows: full-width, so the stride is unchanged
+	data = image->data;
+	n = image->height;
+	image->data += image->bytes_per_line * top;
+	image->height = bottom - top + 1;
+	i = XShmGetImage(display, rootWindow, image, 0, top, XAllPlanes());
+	image->data = data;
+	image->height = n;
+	if(i == 0) {
+		ga_error("FATAL: XShmGetImage failed.\n");
+		exit(-1);
+	}
+	return count;
+}
+#endif	/* HAVE_XDAMAGE */
+
@@ -22,6 +22,9 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/extensions/XShm.h>
+#ifdef HAVE_XDAMAGE
+#include <X11/extensions/Xdamage.h>
+#endif
 
 #include "ga-common.h"
 
@@ -34,6 +37,12 @@ int	ga_xwin_init(const char *displayname, gaImage *gaimg);
 void	ga_xwin_deinit();
 void	ga_xwin_imageinfo(XImage *image);
 void	ga_xwin_capture(char *buf, int buflen, struct gaRect *rect);
+const unsigned char *	ga_xwin_capture_shm(int *stride, struct gaRect *rect);
+const unsigned char *	ga_xwin_image(int *stride, struct gaRect *rect);
+#ifdef HAVE_XDAMAGE
+int	ga_xwin_damage_init();
+int	ga_xwin_capture_damage(struct gaRect *rect, struct gaRect *dirty, int maxdirty);
+#endif
 #ifdef __cplusplus
 }
 #endif
@@ -47,9 +47,18 @@
 #include "ga-androidvideo.h"
 #else
 #include "ga-xwin.h"
+#define	FUSED_CONVERT	1	/* capture and convert to YUV420P in one pass */
+#ifdef HAVE_XDAMAGE
+#define	DAMAGE_CAPTURE	1	/* capture only the changed regions */
+#endif
 #endif
 
 #include "ga-avcodec.h"
+#include "ga-conf.h"
+#ifdef FUSED_CONVERT
+#include "ga-cpu.h"
+#include "rgb2yuv.h"
+#endif
 
 #include "vsource-desktop.h"
 
@@ -73,6 +82,24 @@ static int vsource_framerate_n = -1;
 static int vsource_framerate_d = -1;
 static int vsource_reconfigured = 0;
 
+#ifdef FUSED_CONVERT
+/* convert the captured image to YUV420P directly, without a BGRA copy */
+static int vsource_fused = 0;
+static rgb2yuv_pool_t *vsource_pool = NULL;
+#endif
+
+#ifdef DAMAGE_CAPTURE
+/* regions that have to be written to a frame buffer at its next capture */
+typedef struct vsource_damage_s {
+	int full;
+	int count;
+	struct gaRect rect[VIDEO_SOURCE_MAX_DIRTY];
+}	vsource_damage_t;
+
+static int vsource_damage = 0;
+static map<vsource_frame_t*, vsource_damage_t> vsource_pending;
+#endif
+
 /* video source has to send images to video-# pipes */
 /* the format is defined in VIDEO_SOURCE_PIPEFORMAT */
 
@@ -142,6 +169,19 @@ vsource_init(void *arg) {
 	screenwidth = image->width;
 	screenheight = image->height;
 
+#ifdef DAMAGE_CAPTURE
+	vsource_damage = 0;
+	vsource_pending.clear();
+	if(ga_conf_readbool("vsource-damage", 0) != 0) {
+		if(ga_xwin_damage_init() == 0) {
+			vsource_damage = 1;
+			ga_error("video source: damage-aware capture enabled.\n");
+		} else {
+			ga_error("video source: damage-aware capture disabled.\n");
+		}
+	}
+#endif
+
 #ifdef SOURCES
 	do {
 		int i;
@@ -166,10 +206,191 @@ vsource_init(void *arg) {
 	}
 #endif
 	//
+#ifdef FUSED_CONVERT
+	vsource_fused = 0;
+	if(ga_conf_readbool("vsource-fused-convert", 0) != 0) {
+		char kernel[64];
+		const char *selected;
+		int i, nthreads;
+		// the filter passes a converted frame on only if it is not scaled
+		for(i = 0; i < video_source_channels(); i++) {
+			if(video_source_out_width(i) != video_source_curr_width(i)
+			|| video_source_out_height(i) != video_source_curr_height(i))
+				break;
+		}
+		if(ga_conf_readv("filter-rgb2yuv-kernel", kernel, sizeof(kernel)) == NULL)
+			strcpy(kernel, "auto");
+		if(i < video_source_channels()) {
+			ga_error("video source: output resolution differs, fused convert disabled.\n");
+		} else if((selected = rgb2yuv_init(kernel)) == NULL) {
+			ga_error("video source: no conversion kernel, fused convert disabled.\n");
+		} else {
+			if((nthreads = ga_cpu_budget(GA_CPU_CONVERT, 0)) <= 0)
+				nthreads = ga_conf_readint("filter-rgb2yuv-threads");
+			if(nthreads > 1)
+				vsource_pool = rgb2yuv_pool_create(nthreads, 0);
+			vsource_fused = 1;
+			ga_error("video source: fused convert to YUV420P ('%s' kernel, %d thread(s)).\n",
+				selected, vsource_pool ? nthreads : 1);
+		}
+	}
+#endif
 	vsource_initialized = 1;
 	return 0;
 }
 
+#ifdef DAMAGE_CAPTURE
+/*
+ * vsource_damage_add: add a region to a damage list,
+ * merging them into the bounding box if the list is full.
+ */
+static void
+vsource_damage_add(vsource_damage_t *d, struct gaRect *r) {
+	int i, left, top, right, bottom;
+	if(d->full != 0)
+		return;
+	if(d->count < VIDEO_SOURCE_MAX_DIRTY) {
+		d->rect[d->count++] = *r;
+		return;
+	}
+	left = r->left;
+	top = r->top;
+	right = r->right;
+	bottom = r->bottom;
+	for(i = 0; i < d->count; i++) {
+		if(d->rect[i].left < left)	left = d->rect[i].left;
+		if(d->rect[i].top < top)	top = d->rect[i].top;
+		if(d->rect[i].right > right)	right = d->rect[i].right;
+		if(d->rect[i].bottom > bottom)	bottom = d->rect[i].bottom;
+	}
+	ga_fillrect(&d->rect[0], left, top, right, bottom);
+	d->count = 1;
+	return;
+}
+
+/*
+ * vsource_damage_take: record the latest changes for all the frame buffers,
+ * and take the regions that are out of date in \a frame.
+ * A frame buffer that has never been captured has to be written in full.
+ */
+static void
+vsource_damage_take(vsource_frame_t *frame, struct gaRect *dirty, int ndirty, vsource_damage_t *todo) {
+	map<vsource_frame_t*, vsource_damage_t>::iterator mi;
+	int i;
+	if((mi = vsource_pending.find(frame)) == vsource_pending.end()) {
+		vsource_damage_t d;
+		bzero(&d, sizeof(d));
+		d.full = 1;
+		vsource_pending[frame] = d;
+	}
+	for(mi = vsource_pending.begin(); mi != vsource_pending.end(); mi++) {
+		for(i = 0; i < ndirty; i++) {
+			vsource_damage_add(&mi->second, &dirty[i]);
+		}
+	}
+	mi = vsource_pending.find(frame);
+	*todo = mi->second;
+	bzero(&mi->second, sizeof(vsource_damage_t));
+	return;
+}
+
+/*
+ * vsource_capture_damage: copy the out-of-date regions of a BGRA frame
+ * from the shared memory image.
+ */
+static void
+vsource_capture_damage(vsource_frame_t *frame, struct gaRect *dirty, int ndirty) {
+	vsource_damage_t todo;
+	const unsigned char *src;
+	int i, j, srcstride;
+	//
+	vsource_damage_take(frame, dirty, ndirty, &todo);
+	if(todo.full != 0) {
+		todo.count = 1;
+		ga_fillrect(&todo.rect[0], 0, 0, frame->realwidth - 1, frame->realheight - 1);
+	}
+	src = ga_xwin_image(&srcstride, prect);
+	for(i = 0; i < todo.count; i++) {
+		struct gaRect *r = &todo.rect[i];
+		const unsigned char *s = src + srcstride * r->top + RGBA_SIZE * r->left;
+		unsigned char *d = frame->imgbuf + frame->realstride * r->top + RGBA_SIZE * r->left;
+		for(j = 0; j < r->height; j++) {
+			bcopy(s, d, r->linesize);
+			s += srcstride;
+			d += frame->realstride;
+		}
+	}
+	return;
+}
+#endif
+
+#ifdef FUSED_CONVERT
+/*
+ * vsource_capture_yuv: grab the screen and convert it into a YUV420P frame.
+ * The planes are laid out the same as the output of filter-rgb2yuv,
+ * so that the filter can pass the frame on without copying.
+ */
+static void
+vsource_capture_yuv(vsource_frame_t *frame, struct gaRect *dirty, int ndirty) {
+	const unsigned char *src;
+	unsigned char *dst[4];
+	int srcstride, width, height, cwidth, cheight;
+#ifdef DAMAGE_CAPTURE
+	vsource_damage_t todo;
+	int i;
+#endif
+	//
+	width = prect ? prect->width : screenwidth;
+	height = prect ? prect->height : screenheight;
+	// chroma planes cover the last column and row of odd sizes
+	cwidth = (width + 1) >> 1;
+	cheight = (height + 1) >> 1;
+	frame->pixelformat = AV_PIX_FMT_YUV420P;
+	frame->realwidth = width;
+	frame->realheight = height;
+	frame->realstride = width;
+	frame->realsize = width * height + 2 * cwidth * cheight;
+	frame->linesize[0] = width;
+	frame->linesize[1] = cwidth;
+	frame->linesize[2] = cwidth;
+	frame->linesize[3] = 0;
+	dst[0] = frame->imgbuf;
+	dst[1] = dst[0] + width*height;
+	dst[2] = dst[1] + cwidth*cheight;
+	dst[3] = NULL;
+	//
+#ifdef DAMAGE_CAPTURE
+	if(vsource_damage != 0) {
+		vsource_damage_take(frame, dirty, ndirty, &todo);
+		src = ga_xwin_image(&srcstride, prect);
+		for(i = 0; todo.full == 0 && i < todo.count; i++) {
+			// chroma is subsampled: align the region to 2x2 blocks
+			struct gaRect *r = &todo.rect[i];
+			int left = r->left & ~1, top = r->top & ~1;
+			int right = (r->right + 2) & ~1, bottom = (r->bottom + 2) & ~1;
+			const unsigned char *s;
+			unsigned char *d[4];
+			if(right > width)	right = width;
+			if(bottom > height)	bottom = height;
+			s = src + srcstride * top + RGBA_SIZE * left;
+			d[0] = dst[0] + width * top + left;
+			d[1] = dst[1] + cwidth * (top>>1) + (left>>1);
+			d[2] = dst[2] + cwidth * (top>>1) + (left>>1);
+			d[3] = NULL;
+			rgb2yuv_convert(RGB2YUV_ORDER_BGRA, s, srcstride,
+				right - left, bottom - top, d, frame->linesize);
+		}
+		if(todo.full == 0)
+			return;
+	} else
+#endif
+	src = ga_xwin_capture_shm(&srcstride, prect);
+	rgb2yuv_convert_parallel(vsource_pool, RGB2YUV_ORDER_BGRA,
+		src, srcstride, width, height, dst, frame->linesize);
+	return;
+}
+#endif
+
 /*
  * vsource_threadproc accepts no arguments
  */
@@ -178,6 +399,11 @@ vsource_threadproc(void *arg) {
 	int i;
 	int token;
 	int frame_interval;
+	int ndirty = -1;
+	struct gaRect dirty[VIDEO_SOURCE_MAX_DIRTY];
+#ifdef DAMAGE_CAPTURE
+	int idleframes = 0;
+#endif
 	struct timeval tv;
 	dpipe_buffer_t *data;
 	vsource_frame_t *frame;
@@ -202,6 +428,11 @@ vsource_threadproc(void *arg) {
 			exit(-1);
 		}
 	}
+#ifdef FUSED_CONVERT
+	// the capture thread converts frames itself
+	if(vsource_fused)
+		ga_cpu_bind(GA_CPU_CONVERT, 0);
+#endif
 	//
 	ga_error("video source thread started: tid=%ld\n", ga_gettid());
 	gettimeofday(&initialTv, NULL);
@@ -236,9 +467,27 @@ vsource_threadproc(void *arg) {
 			continue;
 		}
 		token -= frame_interval;
+#ifdef DAMAGE_CAPTURE
+		// skip unchanged frames, but still deliver one per second
+		if(vsource_damage != 0) {
+			ndirty = ga_xwin_capture_damage(prect, dirty, VIDEO_SOURCE_MAX_DIRTY);
+			if(ndirty == 0 && ++idleframes < 1000000 / frame_interval)
+				continue;
+			idleframes = 0;
+		}
+#endif
 		// copy image 
-		data = dpipe_get(pipe[0]);
+		if((data = dpipe_get(pipe[0])) == NULL) {
+			ga_error("video source: no free frame buffer, frame skipped.\n");
+			continue;
+		}
 		frame = (vsource_frame_t*) data->pointer;
+#ifdef FUSED_CONVERT
+		if(vsource_fused != 0) {
+			vsource_capture_yuv(frame, dirty, ndirty);
+			goto captured;
+		}
+#endif
 #ifdef __APPLE__
 		frame->pixelformat = AV_PIX_FMT_RGBA;
 #else
@@ -273,12 +522,25 @@ vsource_threadproc(void *arg) {
 #elif defined ANDROID
 		ga_androidvideo_capture((char*) frame->imgbuf, frame->imgbufsize);
 #else // X11
-		ga_xwin_capture((char*) frame->imgbuf, frame->imgbufsize, prect);
+#ifdef DAMAGE_CAPTURE
+		if(vsource_damage != 0)
+			vsource_capture_damage(frame, dirty, ndirty);
+		else
+#endif
+			ga_xwin_capture((char*) frame->imgbuf, frame->imgbufsize, prect);
 #endif
 		// draw cursor
 #ifdef WIN32
 		ga_win32_draw_system_cursor(frame);
 #endif
+#ifdef FUSED_CONVERT
+captured:
+#endif
+		// changed regions since the previous frame
+		frame->dirtycount = ndirty;
+		for(i = 0; i < ndirty; i++) {
+			frame->dirty[i] = dirty[i];
+		}
 		//gImgPts++;
 		frame->imgpts = tvdiff_us(&captureTv, &initialTv)/frame_interval;
 		frame->timestamp = captureTv;
@@ -286,16 +548,9 @@ vsource_threadproc(void *arg) {
 #ifdef ENABLE_EMBED_COLORCODE
 		vsource_embed_colorcode_inc(frame);
 #endif
-		// duplicate from channel 0 to other channels
+		// share channel 0 frame with other channels: no copy
 		for(i = 1; i < SOURCES; i++) {
-			dpipe_buffer_t *dupdata;
-			vsource_frame_t *dupframe;
-			dupdata = dpipe_get(pipe[i]);
-			dupframe = (vsource_frame_t*) dupdata->pointer;
-			//
-			vsource_dup_frame(frame, dupframe);
-			//
-			dpipe_store(pipe[i], dupdata);
+			dpipe_store_ref(pipe[i], data);
 		}
 		dpipe_store(pipe[0], data);
 		// reconfigured?
@@ -333,6 +588,17 @@ vsource_deinit(void *arg) {
 #else
 	//ga_xwin_deinit(display, image);
 	ga_xwin_deinit();
+#endif
+#ifdef FUSED_CONVERT
+	if(vsource_pool != NULL) {
+		rgb2yuv_pool_destroy(vsource_pool);
+		vsource_pool = NULL;
+	}
+	vsource_fused = 0;
+#endif
+#ifdef DAMAGE_CAPTURE
+	vsource_damage = 0;
+	vsource_pending.clear();
 #endif
 	vsource_initialized = 0;
 	return 0;
@@ -196,17 +196,9 @@ D3D9_screen_capture(IDirect3DDevice9 * pDevice) {
 		gettimeofday(&frame->timestamp, NULL);
 	} while(0);
 
-	// duplicate from channel 0 to other channels
+	// share channel 0 frame with other channels: no copy
 	for(i = 1; i < SOURCES; i++) {
-		int j;
-		dpipe_buffer_t *dupdata;
-		vsource_frame_t *dupframe;
-		dupdata = dpipe_get(g_pipe[i]);
-		dupframe = (vsource_frame_t*) dupdata->pointer;
-		//
-		vsource_dup_frame(frame, dupframe);
-		//
-		dpipe_store(g_pipe[i], dupdata);
+		dpipe_store_ref(g_pipe[i], data);
 	}
 	dpipe_store(g_pipe[0], data);
 	
@@ -735,17 +727,9 @@ hook_DXGISwapChainPresent(
 			gettimeofday(&frame->timestamp, NULL);
 		} while(0);
 	
-		// duplicate from channel 0 to other channels
+		// share channel 0 frame with other channels: no copy
 		for(i = 1; i < SOURCES; i++) {
-			int j;
-			dpipe_buffer_t *dupdata;
-			vsource_frame_t *dupframe;
-			dupdata = dpipe_get(g_pipe[i]);
-			dupframe = (vsource_frame_t*) dupdata->pointer;
-			//
-			vsource_dup_frame(frame, dupframe);
-			//
-			dpipe_store(g_pipe[i], dupdata);
+			dpipe_store_ref(g_pipe[i], data);
 		}
 		dpipe_store(g_pipe[0], data);
 		
@@ -817,17 +801,9 @@ hook_DXGISwapChainPresent(
 			gettimeofday(&frame->timestamp, NULL);
 		} while(0);
 	
-		// duplicate from channel 0 to other channels
+		// share channel 0 frame with other channels: no copy
 		for(i = 1; i < SOURCES; i++) {
-			int j;
-			dpipe_buffer_t *dupdata;
-			vsource_frame_t *dupframe;
-			dupdata = dpipe_get(g_pipe[i]);
-			dupframe = (vsource_frame_t*) dupdata->pointer;
-			//
-			vsource_dup_frame(frame, dupframe);
-			//
-			dpipe_store(g_pipe[i], dupdata);
+			dpipe_store_ref(g_pipe[i], data);
 		}
 		dpipe_store(g_pipe[0], data);
 
@@ -152,21 +152,40 @@ ga_hook_capture_prepared(int width, int height, int check_resolution) {
 }
 
 void
-ga_hook_capture_dupframe(vsource_frame_t *frame) {
+ga_hook_capture_dupframe(dpipe_buffer_t *data) {
 	int i;
+	// share the frame with other channels: no copy
 	for(i = 1; i < SOURCES; i++) {
-		dpipe_buffer_t *dupdata;
-		vsource_frame_t *dupframe;
-		dupdata = dpipe_get(g_pipe[i]);
-		dupframe = (vsource_frame_t*) dupdata->pointer;
-		//
-		vsource_dup_frame(frame, dupframe);
-		//
-		dpipe_store(g_pipe[i], dupdata);
+		dpipe_store_ref(g_pipe[i], data);
 	}
 	return;
 }
 
+/**
+ * Resize the frame pools of all the video sources.
+ *
+ * This must be called before capturing a frame of a new resolution,
+ * because frame pools are sized for the current resolution.
+ * It does nothing if the resolution is not changed.
+ * The game resolution follows, so that ga_hook_capture_prepared()
+ * accepts frames of the new size.
+ */
+int
+ga_hook_capture_resize(int width, int height, int stride) {
+	int i;
+	for(i = 0; i < SOURCES; i++) {
+		if(video_source_resize(i, width, height, stride) < 0)
+			return -1;
+	}
+	if(width == game_width && height == game_height)
+		return 0;
+	ga_error("game resolution changed: %dx%d -> %dx%d\n",
+		game_width, game_height, width, height);
+	game_width = width;
+	game_height = height;
+	return 0;
+}
+
 #ifdef	WIN32
 #define	BACKSLASHDIR(fwd, back)	back
 #else
@@ -193,7 +193,7 @@ hook_glFlush() {
 		frame->timestamp = captureTv;
 	} while(0);
 	// duplicate from channel 0 to other channels
-	ga_hook_capture_dupframe(frame);
+	ga_hook_capture_dupframe(data);
 	dpipe_store(g_pipe[0], data);
 	//
 	return;
@@ -866,6 +866,9 @@ hook_SDL_capture_screen(const char *caller) {
 	//
 	if (enable_server_rate_control && ga_hook_video_rate_control() < 0)
 		return;
+	// the surface may be changed after the video source is initialized
+	if(ga_hook_capture_resize(dupsurface->w, dupsurface->h, dupsurface->pitch) < 0)
+		return;
 	// copy screen
 	do {
 		data = dpipe_get(g_pipe[0]);
@@ -881,7 +884,7 @@ hook_SDL_capture_screen(const char *caller) {
 		frame->timestamp = captureTv;
 	} while(0);
 	// duplicate from channel 0 to other channels
-	ga_hook_capture_dupframe(frame);
+	ga_hook_capture_dupframe(data);
 	dpipe_store(g_pipe[0], data);
 	return;
 }
@@ -952,6 +955,7 @@ hook_SDL_GL_SwapBuffers() {
 	static struct timeval initialTv, captureTv;
 	static int frameLinesize;
 	static unsigned char *frameBuf;
+	static int frameBufSize;
 	static int sb_initialized = 0;
 	//
 	GLint vp[4];
@@ -979,7 +983,8 @@ hook_SDL_GL_SwapBuffers() {
 		frame_interval = 1000000/video_fps; // in the unif of us
 		frame_interval++;
 		gettimeofday(&initialTv, NULL);
-		frameBuf = (unsigned char*) malloc(encoder_width * encoder_height * 4);
+		frameBufSize = encoder_width * encoder_height * 4;
+		frameBuf = (unsigned char*) malloc(frameBufSize);
 		if(frameBuf == NULL) {
 			ga_error("allocate frame failed.\n");
 			return;
@@ -992,6 +997,18 @@ hook_SDL_GL_SwapBuffers() {
 	
 	if (enable_server_rate_control && ga_hook_video_rate_control() < 0)
 		return;
+	// the viewport may be changed after the video source is initialized
+	if(ga_hook_capture_resize(vp_width, vp_height, vp_width<<2) < 0)
+		return;
+	if(vp_width * vp_height * 4 > frameBufSize) {
+		unsigned char *newbuf;
+		if((newbuf = (unsigned char*) realloc(frameBuf, vp_width * vp_height * 4)) == NULL) {
+			ga_error("allocate frame failed.\n");
+			return;
+		}
+		frameBuf = newbuf;
+		frameBufSize = vp_width * vp_height * 4;
+	}
 
 	// copy screen
 	do {
@@ -1023,7 +1040,7 @@ hook_SDL_GL_SwapBuffers() {
 	} while(0);
 
 	// duplicate from channel 0 to other channels
-	ga_hook_capture_dupframe(frame);
+	ga_hook_capture_dupframe(data);
 	dpipe_store(g_pipe[0], data);
 	
 	return;
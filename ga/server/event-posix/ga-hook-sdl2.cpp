@@ -430,6 +430,9 @@ hook_SDL2_capture_screen(const char *caller, SDL_Renderer *renderer) {
 	//
 	if (enable_server_rate_control && ga_hook_video_rate_control() < 0)
 		return;
+	// the window may be changed after the video source is initialized
+	if(ga_hook_capture_resize(curr_width, curr_height, curr_width * 4) < 0)
+		return;
 	// copy screen
 	do {
 		data = dpipe_get(g_pipe[0]);
@@ -448,7 +451,7 @@ hook_SDL2_capture_screen(const char *caller, SDL_Renderer *renderer) {
 		frame->timestamp = captureTv;
 	} while(0);
 	// duplicate from channel 0 to other channels
-	ga_hook_capture_dupframe(frame);
+	ga_hook_capture_dupframe(data);
 	dpipe_store(g_pipe[0], data);
 	return;
 }
@@ -577,7 +580,7 @@ GL_capture() {
 	} while(0);
 
 	// duplicate from channel 0 to other channels
-	ga_hook_capture_dupframe(frame);
+	ga_hook_capture_dupframe(data);
 	dpipe_store(g_pipe[0], data);
 	
 	return;
@@ -28,6 +28,8 @@
 #include "rtspconf.h"
 #include "controller.h"
 #include "encoder-common.h"
+#include "vsource.h"
+#include "ratectl.h"
 
 #define	TEST_RECONFIGURE
 
@@ -48,6 +50,11 @@ static struct gaRect rect;
 
 static ga_module_t *m_vsource, *m_filter, *m_vencoder, *m_asource, *m_aencoder, *m_ctrl, *m_server;
 
+// rate adaptation driven by client net-reports
+static ratectl_t ratectl;
+static int ratectl_enabled = 0;
+static FILE *ratectl_trace = NULL;
+
 int
 load_modules() {
 	if((m_vsource = ga_load_module("mod/vsource-desktop", "vsource_")) == NULL)
@@ -191,9 +198,37 @@ test_reconfig(void *) {
 }
 #endif
 
+/**
+ * Apply a rate controller decision to the video source and the video encoder.
+ */
+static void
+ratectl_apply(ga_ioctl_reconfigure_t *reconf) {
+	int err;
+	if(reconf->framerate_n > 0 && m_vsource->ioctl) {
+		err = m_vsource->ioctl(GA_IOCTL_RECONFIGURE, sizeof(*reconf), reconf);
+		if(err < 0) {
+			ga_error("ratectl: reconfigure vsource failed, err = %d.\n", err);
+		}
+	}
+	if(m_vencoder->ioctl) {
+		err = m_vencoder->ioctl(GA_IOCTL_RECONFIGURE, sizeof(*reconf), reconf);
+		if(err < 0) {
+			ga_error("ratectl: reconfigure encoder failed, err = %d.\n", err);
+		}
+	}
+	// e.g., for pacing
+	if(m_server != NULL && m_server->ioctl) {
+		m_server->ioctl(GA_IOCTL_RECONFIGURE, sizeof(*reconf), reconf);
+	}
+	ga_error("ratectl: bitrate=%dKbps (target %.0fKbps); framerate=%d.\n",
+		ratectl.bitrateKbps, ratectl.targetKbps, ratectl.fps);
+	return;
+}
+
 void
 handle_netreport(ctrlmsg_system_t *msg) {
 	ctrlmsg_system_netreport_t *msgn = (ctrlmsg_system_netreport_t*) msg;
+	ga_ioctl_reconfigure_t reconf;
 	ga_error("net-report: capacity=%.3f Kbps; loss-rate=%.2f%% (%u/%u); overhead=%.2f [%u KB received in %.3fs (%.2fKB/s)]\n",
 		msgn->capacity / 1024.0,
 		100.0 * msgn->pktloss / msgn->pktcount,
@@ -202,12 +237,54 @@ handle_netreport(ctrlmsg_system_t *msg) {
 		msgn->bytecount / 1024,
 		msgn->duration / 1000000.0,
 		msgn->bytecount / 1024.0 / (msgn->duration / 1000000.0));
+	if(ratectl_trace != NULL)
+		ratectl_record(ratectl_trace, msgn);
+	if(ratectl_enabled) {
+		struct sockaddr_in sin;
+		struct timeval tv;
+		// one state per client: the worst one drives the shared encoder
+		ctrl_server_get_peer(&sin);
+		gettimeofday(&tv, NULL);
+		if(ratectl_update_client(&ratectl,
+			(((unsigned long long) ntohl(sin.sin_addr.s_addr)) << 16) | ntohs(sin.sin_port),
+			tv.tv_sec * 1000000LL + tv.tv_usec, msgn, &reconf) > 0)
+			ratectl_apply(&reconf);
+	}
 	return;
 }
 
+/**
+ * Replay a recorded net-report trace through the configured rate
+ * controller and print its decisions, without starting the server.
+ */
+static int
+ratectl_simulate(const char *tracefile) {
+	int res[2] = { 1280, 720 };
+	int n;
+	FILE *fp;
+	if(ga_conf_readints("output-resolution", res, 2) != 2
+	&& ga_conf_readints("max-resolution", res, 2) != 2) {
+		res[0] = 1280;
+		res[1] = 720;
+	}
+	if(ratectl_init(&ratectl, 0, res[0], res[1]) < 0) {
+		fprintf(stderr, "rate adaptation is not configured (ratectl).\n");
+		return -1;
+	}
+	if((fp = fopen(tracefile, "rt")) == NULL) {
+		fprintf(stderr, "cannot open trace %s.\n", tracefile);
+		return -1;
+	}
+	n = ratectl_replay(&ratectl, fp, stdout);
+	fclose(fp);
+	fprintf(stderr, "%d net-reports replayed.\n", n);
+	return 0;
+}
+
 int
 main(int argc, char *argv[]) {
 	int notRunning = 0;
+	char tracefile[1024];
 #ifdef WIN32
 	if(CoInitializeEx(NULL, COINIT_MULTITHREADED) < 0) {
 		fprintf(stderr, "cannot initialize COM.\n");
@@ -216,11 +293,15 @@ main(int argc, char *argv[]) {
 #endif
 	//
 	if(argc < 2) {
-		fprintf(stderr, "usage: %s config-file\n", argv[0]);
+		fprintf(stderr, "usage: %s config-file [netreport-trace]\n", argv[0]);
 		return -1;
 	}
 	//
 	if(ga_init(argv[1], NULL) < 0)	{ return -1; }
+	// simulation: replay a recorded trace
+	if(argc > 2) {
+		return ratectl_simulate(argv[2]) < 0 ? -1 : 0;
+	}
 	//
 	ga_openlog();
 	//
@@ -243,11 +324,20 @@ main(int argc, char *argv[]) {
 	if(init_modules() < 0)	 	{ return -1; }
 	if(run_modules() < 0)	 	{ return -1; }
 	// enable handler to monitored network status
+	if(ratectl_init(&ratectl, 0, video_source_out_width(0), video_source_out_height(0)) == 0)
+		ratectl_enabled = 1;
+	if(ga_conf_readv("ratectl-record", tracefile, sizeof(tracefile)) != NULL) {
+		if((ratectl_trace = fopen(tracefile, "at")) == NULL)
+			ga_error("ratectl: cannot record net-reports to %s.\n", tracefile);
+	}
 	ctrlsys_set_handler(CTRL_MSGSYS_SUBTYPE_NETREPORT, handle_netreport);
 	//
 #ifdef TEST_RECONFIGURE
-	pthread_t t;
-	pthread_create(&t, NULL, test_reconfig, NULL);
+	// the test would fight with the rate controller
+	if(ratectl_enabled == 0) {
+		pthread_t t;
+		pthread_create(&t, NULL, test_reconfig, NULL);
+	}
 #endif
 	//rtspserver_main(NULL);
 	//liveserver_main(NULL);